@@ -2044,6 +2044,23 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.logits_file = value;
         }
     ).set_examples({LLAMA_EXAMPLE_PERPLEXITY}));
+    add_opt(common_arg(
+        {"--kl-divergence-top-k"}, "N",
+        string_format("save only the N most likely tokens of each position to --kl-divergence-base, computed in the graph (default: %d, 0 = full vocabulary)", params.kl_divergence_top_k),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.kl_divergence_top_k = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_PERPLEXITY}));
+    add_opt(common_arg(
+        {"--fused-logprobs"},
+        string_format("compute the log-likelihood of the tokens in the graph instead of copying all logits from the backend (default: %s)", params.fused_logprobs ? "true" : "false"),
+        [](common_params & params) {
+            params.fused_logprobs = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_PERPLEXITY}));
     add_opt(common_arg(
         {"--ppl-stride"}, "N",
         string_format("stride for perplexity calculation (default: %d)", params.ppl_stride),
@@ -2065,6 +2082,25 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"-kvb", "--kv-block-size"}, "N",
+        string_format("KV cache block size in cells, the cache slots of the sequences are allocated in blocks\n"
+                      "of N cells and do not need to be contiguous (default: %d, 0 = disabled)", params.kv_block_size),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(common_arg(
+        {"--swa-full"},
+        string_format("use full-size KV cache buffers for the sliding-window layers, by default they only keep\n"
+                      "the window of each sequence, which disables context shift (default: %s)", params.swa_full ? "true" : "false"),
+        [](common_params & params) {
+            params.swa_full = true;
+        }
+    ).set_env("LLAMA_ARG_SWA_FULL"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -2138,6 +2174,15 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.use_mmap = false;
         }
     ).set_env("LLAMA_ARG_NO_MMAP"));
+    add_opt(common_arg(
+        {"--expert-resident"}, "N",
+        "page the experts of MoE models from the memory mapped model file on demand, prefetching them from the\n"
+        "router outputs and keeping the N most frequently selected experts of each layer locked in memory\n"
+        "(requires mmap, default: 0 = disabled)",
+        [](common_params & params, int value) {
+            params.n_expert_resident = value;
+        }
+    ).set_env("LLAMA_ARG_EXPERT_RESIDENT"));
     add_opt(common_arg(
         {"--numa"}, "TYPE",
         "attempt optimizations that help on some NUMA systems\n"
@@ -2303,6 +2348,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.check_tensors = true;
         }
     ));
+    add_opt(common_arg(
+        {"--repack-cache"}, "FNAME",
+        "path to a cache file for the weights repacked by the CPU backend; written on the first load and used\n"
+        "instead of repacking on later loads with the same model and CPU features (default: none)",
+        [](common_params & params, const std::string & value) {
+            params.repack_cache = value;
+        }
+    ).set_env("LLAMA_ARG_REPACK_CACHE"));
     add_opt(common_arg(
         {"--override-kv"}, "KEY=TYPE:VALUE",
         "advanced option to override model metadata by key. may be specified multiple times.\n"
@@ -2447,6 +2500,42 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.chunk_separator = value;
         }
     ).set_examples({LLAMA_EXAMPLE_RETRIEVAL}));
+    add_opt(common_arg(
+        {"--index-file"}, "FNAME",
+        "embedding index to query, created if it does not exist and extended with the chunks of context files it does not contain yet",
+        [](common_params & params, const std::string & value) {
+            params.index_file = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_RETRIEVAL}));
+    add_opt(common_arg(
+        {"--index-type"}, "TYPE",
+        string_format("type of the vectors of a new embedding index (f32, f16 or q8_0, default: %s)", ggml_type_name(params.index_type)),
+        [](common_params & params, const std::string & value) {
+            if (value == "f32") {
+                params.index_type = GGML_TYPE_F32;
+            } else if (value == "f16") {
+                params.index_type = GGML_TYPE_F16;
+            } else if (value == "q8_0") {
+                params.index_type = GGML_TYPE_Q8_0;
+            } else {
+                throw std::invalid_argument("invalid value");
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_RETRIEVAL}));
+    add_opt(common_arg(
+        {"--index-lists"}, "N",
+        string_format("number of IVF lists of a new embedding index, 0 for exhaustive search (default: %d)", params.index_n_list),
+        [](common_params & params, int value) {
+            params.index_n_list = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_RETRIEVAL}));
+    add_opt(common_arg(
+        {"--index-probe"}, "N",
+        string_format("number of IVF lists scanned per query (default: %d)", params.index_n_probe),
+        [](common_params & params, int value) {
+            params.index_n_probe = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_RETRIEVAL}));
     add_opt(common_arg(
         {"--junk"}, "N",
         string_format("number of times to repeat the junk text (default: %d)", params.n_junk),
@@ -2650,6 +2739,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_threads_http = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_HTTP"));
+    add_opt(common_arg(
+        {"--http-epoll"},
+        string_format("serve the HTTP connections from an epoll event loop instead of a thread per connection, the HTTP threads only run the request handlers (Linux only, default: %s)", params.http_epoll ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.http_epoll = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_HTTP_EPOLL"));
     add_opt(common_arg(
         {"--cache-reuse"}, "N",
         string_format("min chunk size to attempt reusing from the cache via KV shifting (default: %d)", params.n_cache_reuse),
@@ -2657,6 +2753,70 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--prefix-cache"}, "N",
+        string_format("max number of tokens kept in the KV cache for prompts evicted from the slots; any slot can reuse\n"
+                      "the longest cached prefix of its prompt from another slot or from this cache (default: %d, 0 = disabled)", params.n_prefix_cache),
+        [](common_params & params, int value) {
+            params.n_prefix_cache = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE"));
+    add_opt(common_arg(
+        {"--kv-tier-host"}, "N",
+        string_format("max MiB of host memory for the KV of prompts evicted from the slots or from the prefix cache;\n"
+                      "a later prompt that matches one of them restores it instead of processing it again (default: %d, 0 = disabled)", params.kv_tier_host),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.kv_tier_host = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_TIER_HOST"));
+    add_opt(common_arg(
+        {"--kv-tier-disk"}, "N",
+        string_format("max MiB of disk space for the KV moved out of the host memory tier (default: %d)", params.kv_tier_disk),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.kv_tier_disk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_TIER_DISK"));
+    add_opt(common_arg(
+        {"--kv-tier-path"}, "PATH",
+        "directory of the disk tier of the KV, the files are deleted when the server exits (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.kv_tier_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.kv_tier_path.empty() && params.kv_tier_path[params.kv_tier_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.kv_tier_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_TIER_PATH"));
+    add_opt(common_arg(
+        {"--sched-budget"}, "N",
+        string_format("max number of tokens decoded per iteration; longer prompts are processed in chunks interleaved\n"
+                      "with the generation of the other slots (default: %d, 0 = batch size)", params.n_sched_budget),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_sched_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SCHED_BUDGET"));
+    add_opt(common_arg(
+        {"--sched-policy"}, "{decode-first,fair,priority}",
+        "how the token budget left by the generating slots is shared between the prompts:\n"
+        "- decode-first: in arrival order (default)\n"
+        "- fair: evenly, shortest remaining prompt first\n"
+        "- priority: by request priority, then in arrival order",
+        [](common_params & params, const std::string & value) {
+            /**/ if (value == "decode-first") { params.sched_policy = COMMON_SCHED_POLICY_DECODE_FIRST; }
+            else if (value == "fair")         { params.sched_policy = COMMON_SCHED_POLICY_FAIR; }
+            else if (value == "priority")     { params.sched_policy = COMMON_SCHED_POLICY_PRIORITY; }
+            else { throw std::invalid_argument("invalid value"); }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SCHED_POLICY"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -3050,6 +3210,26 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.vocoder.use_guide_tokens = true;
         }
     ).set_examples({LLAMA_EXAMPLE_TTS, LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--tts-chunk"}, "N",
+        string_format("vocode the audio codes in chunks of N codes while they are generated and stream the audio to the output file (default: %d, 0 = vocode after generation)", params.vocoder.n_chunk),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.vocoder.n_chunk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_TTS}));
+    add_opt(common_arg(
+        {"--tts-chunk-ctx"}, "N",
+        string_format("audio codes of context decoded on each side of a streamed chunk (default: %d)", params.vocoder.n_chunk_ctx),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.vocoder.n_chunk_ctx = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_TTS}));
     add_opt(common_arg(
         {"--tts-speaker-file"}, "FNAME",
         "speaker file path for audio generation",
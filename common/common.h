@@ -209,6 +209,16 @@ struct common_params_vocoder {
     std::string speaker_file = ""; // speaker file path                                      // NOLINT
 
     bool use_guide_tokens = false; // enable guide tokens to improve TTS accuracy            // NOLINT
+
+    int32_t n_chunk     = 0; // audio codes per streamed vocoder chunk (0 = vocode after generation)
+    int32_t n_chunk_ctx = 8; // audio codes of context on each side of a streamed chunk
+};
+
+// order in which the server fills the token budget of an iteration, after the tokens of the generating slots
+enum common_sched_policy {
+    COMMON_SCHED_POLICY_DECODE_FIRST, // prompts in arrival order
+    COMMON_SCHED_POLICY_FAIR,         // the budget is split evenly between the prompts
+    COMMON_SCHED_POLICY_PRIORITY,     // prompts in order of request priority, then arrival
 };
 
 enum common_reasoning_format {
@@ -236,12 +246,14 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // KV cache block size in cells (0 = contiguous slots)
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
 
     int32_t n_gpu_layers      = -1;  // number of layers to store in VRAM (-1 - use default)
     int32_t main_gpu          = 0;   // the GPU that is used for scratch and small tensors
+    int32_t n_expert_resident = 0;   // page the MoE experts from the model file, keeping this many experts per layer resident (0 = disabled)
     float   tensor_split[128] = {0}; // how split tensors should be distributed across GPUs
 
     enum llama_split_mode split_mode = LLAMA_SPLIT_MODE_LAYER; // how to split the model across GPUs
@@ -275,6 +287,7 @@ struct common_params {
     std::string lookup_cache_static  = ""; // path of static ngram cache file for lookup decoding           // NOLINT
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding          // NOLINT
     std::string logits_file          = ""; // file for saving *all* logits                                  // NOLINT
+    std::string repack_cache         = ""; // path of the cache file for CPU repacked tensors               // NOLINT
 
     std::vector<std::string> in_files;   // all input files
     std::vector<std::string> antiprompt; // strings upon which more user input is prompted (a.k.a. reverse prompts)
@@ -303,7 +316,9 @@ struct common_params {
     bool   multiple_choice  = false;  // compute TruthfulQA score over random tasks from datafile supplied in prompt
     size_t multiple_choice_tasks = 0; // number of tasks to use when computing the TruthfulQA score. If 0, all tasks will be computed
 
-    bool   kl_divergence    = false; // compute KL divergence
+    bool    kl_divergence       = false; // compute KL divergence
+    int32_t kl_divergence_top_k = 0;     // save only the top k log-probabilities of each token to the KL divergence base (0 = all)
+    bool    fused_logprobs      = false; // compute the log-probabilities in the graph instead of returning the logits
 
     bool usage             = false; // print usage
     bool completion        = false; // print source-able completion script
@@ -319,6 +334,7 @@ struct common_params {
     bool simple_io         = false; // improves compatibility with subprocesses and limited consoles
     bool cont_batching     = true;  // insert new sequences for decoding on-the-fly
     bool flash_attn        = false; // flash attention
+    bool swa_full          = false; // use full-size KV cache buffers for the sliding-window layers
     bool no_perf           = false; // disable performance metrics
     bool ctx_shift         = true;  // context shift on inifinite text generation
 
@@ -357,6 +373,12 @@ struct common_params {
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t n_prefix_cache = 0;            // max number of tokens kept in the server-wide prefix cache (0 = disabled)
+    int32_t kv_tier_host   = 0;            // max MiB of host memory for the KV of evicted prompts (0 = disabled)
+    int32_t kv_tier_disk   = 4096;         // max MiB of disk space for the KV of evicted prompts
+    int32_t n_sched_budget = 0;            // max number of tokens decoded per server iteration (0 = n_batch)
+
+    common_sched_policy sched_policy = COMMON_SCHED_POLICY_DECODE_FIRST;
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -370,6 +392,8 @@ struct common_params {
     std::string ssl_file_key  = "";                                                                         // NOLINT
     std::string ssl_file_cert = "";                                                                         // NOLINT
 
+    bool http_epoll = false; // serve the HTTP connections from an epoll event loop instead of a thread per connection
+
     // "advanced" endpoints are disabled by default for better security
     bool webui            = true;
     bool endpoint_slots   = false;
@@ -379,6 +403,7 @@ struct common_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    std::string kv_tier_path; // directory of the disk tier of the KV of evicted prompts (empty = no disk tier)
 
     float slot_prompt_similarity = 0.5f;
 
@@ -396,6 +421,11 @@ struct common_params {
 
     std::string chunk_separator = "\n"; // chunk separator for context embedding
 
+    std::string index_file;                     // persistent embedding index, created if missing and extended with new context files
+    ggml_type   index_type    = GGML_TYPE_Q8_0; // type of the vectors of a new index
+    int32_t     index_n_list  = 0;              // number of IVF lists of a new index (0 = exhaustive search)
+    int32_t     index_n_probe = 8;              // number of IVF lists scanned per query
+
     // passkey params
     int32_t n_junk = 250; // number of times to repeat the junk text
     int32_t i_pos  = -1;  // position of the passkey in the junk text
@@ -543,6 +573,9 @@ struct ggml_threadpool_params ggml_threadpool_params_from_cpu_params(const cpu_p
 // clear LoRA adapters from context, then apply new list of adapters
 void common_set_adapter_lora(struct llama_context * ctx, std::vector<common_adapter_lora_info> & lora);
 
+// set the adapters of a single sequence, the sequences of a batch can use different adapters
+void common_set_adapter_lora_seq(struct llama_context * ctx, llama_seq_id seq_id, std::vector<common_adapter_lora_info> & lora);
+
 std::string                   get_model_endpoint();
 
 //
@@ -0,0 +1,811 @@
+#include "embd-index.h"
+
+#include "log.h"
+
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpp.h"
+#include "gguf.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <random>
+
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+            #include <sys/stat.h>
+            #include <fcntl.h>
+        #endif
+    #endif
+#endif
+
+#define EMBD_INDEX_KEY_N_EMBD "embd_index.n_embd"
+#define EMBD_INDEX_KEY_N_LIST "embd_index.n_list"
+#define EMBD_INDEX_KEY_FILES  "embd_index.files"
+
+#define EMBD_INDEX_TENSOR_EMBD      "embd_index.embd"
+#define EMBD_INDEX_TENSOR_CENTROIDS "embd_index.centroids"
+#define EMBD_INDEX_TENSOR_LIST_OFFS "embd_index.list_offs"
+#define EMBD_INDEX_TENSOR_FILE_ID   "embd_index.file_id"
+#define EMBD_INDEX_TENSOR_FILEPOS   "embd_index.filepos"
+#define EMBD_INDEX_TENSOR_TEXT_OFFS "embd_index.text_offs"
+#define EMBD_INDEX_TENSOR_TEXT      "embd_index.text"
+
+// k-means training samples per IVF list
+#define EMBD_INDEX_KMEANS_SAMPLES 64
+#define EMBD_INDEX_KMEANS_ITERS   10
+
+// the rows of the index, either mapped from an index file or allocated by common_embd_index_build
+// the buffer is always host memory, so the metadata tensors are read directly through their data pointers
+struct embd_index_storage {
+    ggml_context_ptr        ctx;
+    ggml_backend_buffer_ptr buf;
+
+    void * mapping      = nullptr;
+    size_t mapping_size = 0;
+
+    int64_t n_rows = 0;
+
+    ggml_tensor * embd      = nullptr; // [n_embd, n_rows]
+    ggml_tensor * centroids = nullptr; // f32 [n_embd, n_list], IVF only
+    ggml_tensor * list_offs = nullptr; // i64 [n_list + 1], first row of each list, IVF only
+    ggml_tensor * file_id   = nullptr; // i32 [n_rows]
+    ggml_tensor * filepos   = nullptr; // i64 [n_rows]
+    ggml_tensor * text_offs = nullptr; // i64 [n_rows + 1]
+    ggml_tensor * text      = nullptr; // i8  [n_text]
+
+    ~embd_index_storage() {
+        buf.reset();
+#if defined(_POSIX_MAPPED_FILES)
+        if (mapping) {
+            munmap(mapping, mapping_size);
+        }
+#endif
+    }
+};
+
+struct common_embd_index {
+    int32_t   n_embd;
+    ggml_type type;
+    int32_t   n_list; // requested number of lists until the centroids are trained
+
+    std::vector<std::string> files;
+
+    std::unique_ptr<embd_index_storage> storage;
+
+    // rows queued by common_embd_index_add
+    std::vector<uint8_t>     add_embd;
+    std::vector<int32_t>     add_file_id;
+    std::vector<int64_t>     add_filepos;
+    std::vector<std::string> add_text;
+
+    ggml_backend_ptr     backend;
+    ggml_gallocr_t       galloc = nullptr;
+    std::vector<uint8_t> buf_compute_meta;
+
+    ~common_embd_index() {
+        ggml_gallocr_free(galloc);
+    }
+};
+
+void common_embd_index_deleter::operator()(common_embd_index * idx) {
+    delete idx;
+}
+
+static common_embd_index_ptr embd_index_new(int32_t n_embd, ggml_type type, int32_t n_list, int32_t n_threads) {
+    common_embd_index_ptr idx(new common_embd_index);
+
+    idx->n_embd  = n_embd;
+    idx->type    = type;
+    idx->n_list  = n_list;
+    idx->storage.reset(new embd_index_storage);
+
+    idx->backend.reset(ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr));
+    if (!idx->backend) {
+        LOG_ERR("%s: failed to initialize the CPU backend\n", __func__);
+        return nullptr;
+    }
+
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(idx->backend.get()));
+    auto set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
+    if (set_n_threads_fn && n_threads > 0) {
+        set_n_threads_fn(idx->backend.get(), n_threads);
+    }
+
+    idx->galloc = ggml_gallocr_new(ggml_backend_get_default_buffer_type(idx->backend.get()));
+
+    return idx;
+}
+
+struct embd_index_segment {
+    ggml_tensor * rows; // [n_embd, *]
+    int64_t       i0;
+    int64_t       n;
+};
+
+// dot products of the rows of each segment with the n_x vectors x
+// the scores of a segment are a [n, n_x] block of scores, the blocks follow each other in the order of segs
+static void embd_index_mul_mat(common_embd_index * idx, const std::vector<embd_index_segment> & segs, const float * x, int64_t n_x, std::vector<float> & scores) {
+    const size_t n_nodes = 2*segs.size() + 1;
+
+    idx->buf_compute_meta.resize(ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false));
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ idx->buf_compute_meta.size(),
+        /*.mem_buffer =*/ idx->buf_compute_meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context_ptr ctx(ggml_init(params));
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx.get(), n_nodes, false);
+
+    ggml_tensor * inp = ggml_new_tensor_2d(ctx.get(), GGML_TYPE_F32, idx->n_embd, n_x);
+    ggml_set_input(inp);
+
+    std::vector<ggml_tensor *> outs;
+    for (const auto & seg : segs) {
+        ggml_tensor * rows = ggml_view_2d(ctx.get(), seg.rows, seg.rows->ne[0], seg.n, seg.rows->nb[1], seg.i0*seg.rows->nb[1]);
+        ggml_tensor * out  = ggml_mul_mat(ctx.get(), rows, inp);
+        ggml_set_output(out);
+        ggml_build_forward_expand(gf, out);
+        outs.push_back(out);
+    }
+
+    if (!ggml_gallocr_alloc_graph(idx->galloc, gf)) {
+        GGML_ABORT("%s: failed to allocate the compute buffer\n", __func__);
+    }
+
+    ggml_backend_tensor_set(inp, x, 0, ggml_nbytes(inp));
+
+    if (ggml_backend_graph_compute(idx->backend.get(), gf) != GGML_STATUS_SUCCESS) {
+        GGML_ABORT("%s: failed to compute the scores\n", __func__);
+    }
+
+    size_t n_scores = 0;
+    for (const auto * out : outs) {
+        n_scores += ggml_nelements(out);
+    }
+
+    scores.resize(n_scores);
+
+    size_t offs = 0;
+    for (const auto * out : outs) {
+        ggml_backend_tensor_get(out, scores.data() + offs, 0, ggml_nbytes(out));
+        offs += ggml_nelements(out);
+    }
+}
+
+// nearest centroid of the rows [i0, i0 + n) of rows
+static void embd_index_assign(
+        common_embd_index * idx, ggml_tensor * rows, int64_t i0, int64_t n, const std::vector<float> & centroids, int32_t * list, float * score) {
+    const int64_t n_list = centroids.size()/idx->n_embd;
+
+    // bound the size of the score matrix
+    const int64_t n_batch = std::max<int64_t>(1, (1 << 24)/n_list);
+
+    std::vector<float> scores;
+    for (int64_t b0 = 0; b0 < n; b0 += n_batch) {
+        const int64_t nb = std::min(n_batch, n - b0);
+
+        embd_index_mul_mat(idx, { { rows, i0 + b0, nb } }, centroids.data(), n_list, scores);
+
+        for (int64_t i = 0; i < nb; ++i) {
+            int32_t best = 0;
+            for (int32_t l = 1; l < n_list; ++l) {
+                if (scores[l*nb + i] > scores[best*nb + i]) {
+                    best = l;
+                }
+            }
+            list[b0 + i] = best;
+            if (score) {
+                score[b0 + i] = scores[best*nb + i];
+            }
+        }
+    }
+}
+
+static void embd_index_normalize(float * v, int64_t n) {
+    double sum = 0.0;
+    for (int64_t i = 0; i < n; ++i) {
+        sum += (double) v[i]*v[i];
+    }
+    const float norm = sum > 0.0 ? 1.0/std::sqrt(sum) : 0.0f;
+    for (int64_t i = 0; i < n; ++i) {
+        v[i] *= norm;
+    }
+}
+
+// spherical k-means on a random sample of the n_rows rows of embd
+static std::vector<float> embd_index_train(common_embd_index * idx, const ggml_tensor * embd, int64_t n_rows, int32_t n_list) {
+    const int64_t n_embd   = idx->n_embd;
+    const int64_t n_sample = std::min<int64_t>(n_rows, (int64_t) EMBD_INDEX_KMEANS_SAMPLES*n_list);
+    const size_t  row_size = ggml_row_size(idx->type, n_embd);
+
+    LOG_INF("%s: training %d lists on %lld rows\n", __func__, n_list, (long long) n_sample);
+
+    std::mt19937 rng(42);
+
+    std::vector<int64_t> ids(n_rows);
+    std::iota(ids.begin(), ids.end(), 0);
+    for (int64_t i = 0; i < n_sample; ++i) {
+        std::swap(ids[i], ids[std::uniform_int_distribution<int64_t>(i, n_rows - 1)(rng)]);
+    }
+
+    // the sample is dequantized so that the centroids are fit to what the queries will be scored against
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context_ptr ctx(ggml_init(params));
+
+    ggml_tensor * sample = ggml_new_tensor_2d(ctx.get(), GGML_TYPE_F32, n_embd, n_sample);
+
+    ggml_backend_buffer_ptr buf(ggml_backend_alloc_ctx_tensors_from_buft(ctx.get(), ggml_backend_cpu_buffer_type()));
+
+    const auto * traits = ggml_get_type_traits(idx->type);
+    for (int64_t i = 0; i < n_sample; ++i) {
+        const char * src = (const char *) embd->data + ids[i]*row_size;
+        float      * dst = (float *) sample->data + i*n_embd;
+        if (idx->type == GGML_TYPE_F32) {
+            memcpy(dst, src, row_size);
+        } else {
+            traits->to_float(src, dst, n_embd);
+        }
+    }
+
+    std::vector<float> centroids((const float *) sample->data, (const float *) sample->data + n_list*n_embd);
+
+    std::vector<int32_t> list(n_sample);
+    std::vector<float>   score(n_sample);
+    std::vector<int64_t> count(n_list);
+
+    for (int iter = 0; iter < EMBD_INDEX_KMEANS_ITERS; ++iter) {
+        embd_index_assign(idx, sample, 0, n_sample, centroids, list.data(), score.data());
+
+        std::fill(centroids.begin(), centroids.end(), 0.0f);
+        std::fill(count.begin(), count.end(), 0);
+
+        for (int64_t i = 0; i < n_sample; ++i) {
+            const float * x = (const float *) sample->data + i*n_embd;
+            float       * c = centroids.data() + list[i]*n_embd;
+            for (int64_t j = 0; j < n_embd; ++j) {
+                c[j] += x[j];
+            }
+            count[list[i]]++;
+        }
+
+        for (int32_t l = 0; l < n_list; ++l) {
+            float * c = centroids.data() + l*n_embd;
+            if (count[l] == 0) {
+                // re-seed an empty list with the sample that is farthest from its centroid
+                const int64_t i = std::min_element(score.begin(), score.end()) - score.begin();
+                memcpy(c, (const float *) sample->data + i*n_embd, n_embd*sizeof(float));
+                score[i] = 1.0f;
+            }
+            embd_index_normalize(c, n_embd);
+        }
+    }
+
+    return centroids;
+}
+
+common_embd_index_ptr common_embd_index_init(int32_t n_embd, enum ggml_type type, int32_t n_list, int32_t n_threads) {
+    if (n_embd % ggml_blck_size(type) != 0) {
+        LOG_WRN("%s: n_embd = %d is not a multiple of the block size of %s, using f16\n", __func__, n_embd, ggml_type_name(type));
+        type = GGML_TYPE_F16;
+    }
+
+    return embd_index_new(n_embd, type, std::max(0, n_list), n_threads);
+}
+
+common_embd_index_ptr common_embd_index_load(const std::string & fname, int32_t n_threads) {
+    ggml_context * ctx_meta = nullptr;
+
+    gguf_init_params params = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ &ctx_meta,
+    };
+
+    gguf_context_ptr gctx(gguf_init_from_file(fname.c_str(), params));
+    if (!gctx) {
+        LOG_ERR("%s: failed to load index from %s\n", __func__, fname.c_str());
+        return nullptr;
+    }
+
+    std::unique_ptr<embd_index_storage> storage(new embd_index_storage);
+    storage->ctx.reset(ctx_meta);
+
+    const int64_t kid_n_embd = gguf_find_key(gctx.get(), EMBD_INDEX_KEY_N_EMBD);
+    const int64_t kid_n_list = gguf_find_key(gctx.get(), EMBD_INDEX_KEY_N_LIST);
+    const int64_t kid_files  = gguf_find_key(gctx.get(), EMBD_INDEX_KEY_FILES);
+
+    storage->embd      = ggml_get_tensor(ctx_meta, EMBD_INDEX_TENSOR_EMBD);
+    storage->centroids = ggml_get_tensor(ctx_meta, EMBD_INDEX_TENSOR_CENTROIDS);
+    storage->list_offs = ggml_get_tensor(ctx_meta, EMBD_INDEX_TENSOR_LIST_OFFS);
+    storage->file_id   = ggml_get_tensor(ctx_meta, EMBD_INDEX_TENSOR_FILE_ID);
+    storage->filepos   = ggml_get_tensor(ctx_meta, EMBD_INDEX_TENSOR_FILEPOS);
+    storage->text_offs = ggml_get_tensor(ctx_meta, EMBD_INDEX_TENSOR_TEXT_OFFS);
+    storage->text      = ggml_get_tensor(ctx_meta, EMBD_INDEX_TENSOR_TEXT);
+
+    if (kid_n_embd < 0 || kid_n_list < 0 || kid_files < 0 ||
+        !storage->embd || !storage->file_id || !storage->filepos || !storage->text_offs || !storage->text) {
+        LOG_ERR("%s: %s is not an embedding index\n", __func__, fname.c_str());
+        return nullptr;
+    }
+
+    const int32_t n_embd = gguf_get_val_u32(gctx.get(), kid_n_embd);
+    const int32_t n_list = gguf_get_val_u32(gctx.get(), kid_n_list);
+    const int64_t n_rows = storage->embd->ne[1];
+
+    if (storage->embd->ne[0] != n_embd ||
+        storage->file_id  ->type != GGML_TYPE_I32 || storage->file_id  ->ne[0] != n_rows ||
+        storage->filepos  ->type != GGML_TYPE_I64 || storage->filepos  ->ne[0] != n_rows ||
+        storage->text_offs->type != GGML_TYPE_I64 || storage->text_offs->ne[0] != n_rows + 1 ||
+        (n_list > 0 && (!storage->centroids || !storage->list_offs ||
+                        storage->centroids->type != GGML_TYPE_F32 || storage->centroids->ne[0] != n_embd || storage->centroids->ne[1] != n_list ||
+                        storage->list_offs->type != GGML_TYPE_I64 || storage->list_offs->ne[0] != n_list + 1))) {
+        LOG_ERR("%s: %s has inconsistent tensor shapes\n", __func__, fname.c_str());
+        return nullptr;
+    }
+
+    common_embd_index_ptr idx = embd_index_new(n_embd, storage->embd->type, n_list, n_threads);
+    if (!idx) {
+        return nullptr;
+    }
+
+    for (size_t i = 0; i < gguf_get_arr_n(gctx.get(), kid_files); ++i) {
+        idx->files.push_back(gguf_get_arr_str(gctx.get(), kid_files, i));
+    }
+
+    // the data section is aligned, so it can back a CPU buffer directly
+    const size_t data_offs = gguf_get_data_offset(gctx.get());
+
+#if defined(_POSIX_MAPPED_FILES)
+    {
+        const int fd = open(fname.c_str(), O_RDONLY);
+        if (fd == -1) {
+            LOG_ERR("%s: failed to open %s: %s\n", __func__, fname.c_str(), strerror(errno));
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < data_offs) {
+            close(fd);
+            LOG_ERR("%s: %s is truncated\n", __func__, fname.c_str());
+            return nullptr;
+        }
+
+        storage->mapping_size = st.st_size;
+        storage->mapping      = mmap(NULL, storage->mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (storage->mapping == MAP_FAILED) {
+            storage->mapping = nullptr;
+            LOG_ERR("%s: failed to mmap %s: %s\n", __func__, fname.c_str(), strerror(errno));
+            return nullptr;
+        }
+
+        // queries touch a few lists of an IVF index, do not read ahead the whole file
+        if (n_list > 0) {
+            posix_madvise(storage->mapping, storage->mapping_size, POSIX_MADV_RANDOM);
+        }
+
+        storage->buf.reset(ggml_backend_cpu_buffer_from_ptr((char *) storage->mapping + data_offs, storage->mapping_size - data_offs));
+    }
+#else
+    {
+        std::ifstream f(fname, std::ios::binary | std::ios::ate);
+        const size_t size = f.tellg();
+        if (!f || size < data_offs) {
+            LOG_ERR("%s: %s is truncated\n", __func__, fname.c_str());
+            return nullptr;
+        }
+
+        storage->buf.reset(ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), size - data_offs));
+
+        f.seekg(data_offs);
+        if (!f.read((char *) ggml_backend_buffer_get_base(storage->buf.get()), size - data_offs)) {
+            LOG_ERR("%s: failed to read %s\n", __func__, fname.c_str());
+            return nullptr;
+        }
+    }
+#endif
+
+    // ggml_backend_tensor_alloc asserts that the tensors are in the buffer, check it first
+    char * base = (char *) ggml_backend_buffer_get_base(storage->buf.get());
+    const size_t size = ggml_backend_buffer_get_size(storage->buf.get());
+    for (int64_t i = 0; i < gguf_get_n_tensors(gctx.get()); ++i) {
+        ggml_tensor * t = ggml_get_tensor(ctx_meta, gguf_get_tensor_name(gctx.get(), i));
+        const size_t offs = gguf_get_tensor_offset(gctx.get(), i);
+        if (offs > size || ggml_nbytes(t) > size - offs ||
+            ggml_backend_tensor_alloc(storage->buf.get(), t, base + offs) != GGML_STATUS_SUCCESS) {
+            LOG_ERR("%s: %s is truncated\n", __func__, fname.c_str());
+            return nullptr;
+        }
+    }
+
+    // the searches and common_embd_index_get_chunk use the file ids and the offsets without checking them
+    {
+        const int32_t * file_id   = (const int32_t *) storage->file_id->data;
+        const int64_t * text_offs = (const int64_t *) storage->text_offs->data;
+
+        bool ok = text_offs[0] == 0 && text_offs[n_rows] <= (int64_t) ggml_nbytes(storage->text);
+        for (int64_t r = 0; r < n_rows && ok; ++r) {
+            ok = file_id[r] >= 0 && file_id[r] < (int64_t) idx->files.size() && text_offs[r] <= text_offs[r + 1];
+        }
+
+        if (n_list > 0) {
+            const int64_t * list_offs = (const int64_t *) storage->list_offs->data;
+
+            ok = ok && list_offs[0] == 0 && list_offs[n_list] == n_rows;
+            for (int32_t l = 0; l < n_list && ok; ++l) {
+                ok = list_offs[l] <= list_offs[l + 1];
+            }
+        }
+
+        if (!ok) {
+            LOG_ERR("%s: %s has invalid file ids or offsets\n", __func__, fname.c_str());
+            return nullptr;
+        }
+    }
+
+    storage->n_rows = n_rows;
+    idx->storage = std::move(storage);
+
+    LOG_INF("%s: loaded %lld rows of %s from %s (%zu files, %d lists)\n", __func__,
+            (long long) n_rows, ggml_type_name(idx->type), fname.c_str(), idx->files.size(), n_list);
+
+    return idx;
+}
+
+bool common_embd_index_save(const common_embd_index * idx, const std::string & fname) {
+    const auto & storage = *idx->storage;
+
+    if (!idx->add_file_id.empty()) {
+        LOG_ERR("%s: the index has queued rows, call common_embd_index_build first\n", __func__);
+        return false;
+    }
+    if (storage.n_rows == 0) {
+        LOG_ERR("%s: the index is empty\n", __func__);
+        return false;
+    }
+
+    gguf_context_ptr gctx(gguf_init_empty());
+
+    std::vector<const char *> files;
+    for (const auto & file : idx->files) {
+        files.push_back(file.c_str());
+    }
+
+    gguf_set_val_u32(gctx.get(), EMBD_INDEX_KEY_N_EMBD, idx->n_embd);
+    gguf_set_val_u32(gctx.get(), EMBD_INDEX_KEY_N_LIST, storage.centroids ? idx->n_list : 0);
+    gguf_set_arr_str(gctx.get(), EMBD_INDEX_KEY_FILES, files.data(), files.size());
+
+    std::vector<const ggml_tensor *> tensors = { storage.embd };
+    if (storage.centroids) {
+        tensors.push_back(storage.centroids);
+        tensors.push_back(storage.list_offs);
+    }
+    tensors.push_back(storage.file_id);
+    tensors.push_back(storage.filepos);
+    tensors.push_back(storage.text_offs);
+    tensors.push_back(storage.text);
+
+    for (const auto * t : tensors) {
+        gguf_add_tensor(gctx.get(), t);
+    }
+
+    // write next to the destination and rename, the destination may be mapped by this index
+    const std::string fname_tmp = fname + ".tmp";
+
+    FILE * f = ggml_fopen(fname_tmp.c_str(), "wb");
+    if (!f) {
+        LOG_ERR("%s: failed to open %s for writing\n", __func__, fname_tmp.c_str());
+        return false;
+    }
+
+    std::vector<uint8_t> meta(gguf_get_meta_size(gctx.get()));
+    gguf_get_meta_data(gctx.get(), meta.data());
+
+    bool ok = fwrite(meta.data(), 1, meta.size(), f) == meta.size();
+
+    const size_t alignment = gguf_get_alignment(gctx.get());
+    const std::vector<uint8_t> zeros(alignment, 0);
+
+    for (const auto * t : tensors) {
+        const size_t nbytes = ggml_nbytes(t);
+        const size_t npad   = GGML_PAD(nbytes, alignment) - nbytes;
+
+        ok = ok && fwrite(t->data, 1, nbytes, f) == nbytes;
+        ok = ok && fwrite(zeros.data(), 1, npad, f) == npad;
+    }
+
+    ok = fclose(f) == 0 && ok;
+
+    if (!ok || std::rename(fname_tmp.c_str(), fname.c_str()) != 0) {
+        LOG_ERR("%s: failed to write %s\n", __func__, fname.c_str());
+        std::remove(fname_tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void common_embd_index_add(common_embd_index * idx, const common_embd_index_chunk & chunk, const float * embd) {
+    const size_t row_size = ggml_row_size(idx->type, idx->n_embd);
+
+    auto it = std::find(idx->files.begin(), idx->files.end(), chunk.filename);
+    if (it == idx->files.end()) {
+        it = idx->files.insert(idx->files.end(), chunk.filename);
+    }
+
+    idx->add_embd.resize(idx->add_embd.size() + row_size);
+    ggml_quantize_chunk(idx->type, embd, idx->add_embd.data() + idx->add_embd.size() - row_size, 0, 1, idx->n_embd, nullptr);
+
+    idx->add_file_id.push_back(it - idx->files.begin());
+    idx->add_filepos.push_back(chunk.filepos);
+    idx->add_text.push_back(chunk.text);
+}
+
+void common_embd_index_build(common_embd_index * idx) {
+    const auto & old = *idx->storage;
+
+    const int64_t n_add = idx->add_file_id.size();
+    if (n_add == 0) {
+        return;
+    }
+
+    const int64_t n_embd   = idx->n_embd;
+    const int64_t n_old    = old.n_rows;
+    const int64_t n_rows   = n_old + n_add;
+    const size_t  row_size = ggml_row_size(idx->type, n_embd);
+
+    const int32_t n_list = old.centroids ? idx->n_list : std::min<int64_t>(idx->n_list, n_rows);
+
+    int64_t n_text = old.text ? ggml_nelements(old.text) : 0;
+    for (const auto & text : idx->add_text) {
+        n_text += text.size();
+    }
+
+    std::unique_ptr<embd_index_storage> storage(new embd_index_storage);
+    {
+        ggml_init_params params = {
+            /*.mem_size   =*/ 8*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+
+        ggml_context * ctx = ggml_init(params);
+        storage->ctx.reset(ctx);
+
+        storage->embd = ggml_new_tensor_2d(ctx, idx->type, n_embd, n_rows);
+        ggml_set_name(storage->embd, EMBD_INDEX_TENSOR_EMBD);
+
+        if (n_list > 0) {
+            storage->centroids = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_list);
+            storage->list_offs = ggml_new_tensor_1d(ctx, GGML_TYPE_I64, n_list + 1);
+            ggml_set_name(storage->centroids, EMBD_INDEX_TENSOR_CENTROIDS);
+            ggml_set_name(storage->list_offs, EMBD_INDEX_TENSOR_LIST_OFFS);
+        }
+
+        storage->file_id   = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_rows);
+        storage->filepos   = ggml_new_tensor_1d(ctx, GGML_TYPE_I64, n_rows);
+        storage->text_offs = ggml_new_tensor_1d(ctx, GGML_TYPE_I64, n_rows + 1);
+        storage->text      = ggml_new_tensor_1d(ctx, GGML_TYPE_I8,  std::max<int64_t>(n_text, 1));
+        ggml_set_name(storage->file_id,   EMBD_INDEX_TENSOR_FILE_ID);
+        ggml_set_name(storage->filepos,   EMBD_INDEX_TENSOR_FILEPOS);
+        ggml_set_name(storage->text_offs, EMBD_INDEX_TENSOR_TEXT_OFFS);
+        ggml_set_name(storage->text,      EMBD_INDEX_TENSOR_TEXT);
+
+        storage->buf.reset(ggml_backend_alloc_ctx_tensors_from_buft(ctx, ggml_backend_cpu_buffer_type()));
+        storage->n_rows = n_rows;
+    }
+
+    // gather the rows in their current order: the old rows sorted by list, then the queued rows
+    char * embd = (char *) storage->embd->data;
+
+    std::vector<int32_t> file_id(n_rows);
+    std::vector<int64_t> filepos(n_rows);
+    std::vector<int64_t> text_offs(n_rows + 1, 0);
+    std::vector<char>    text(n_text);
+
+    if (n_old > 0) {
+        memcpy(embd,             old.embd->data,    n_old*row_size);
+        memcpy(file_id.data(),   old.file_id->data, n_old*sizeof(int32_t));
+        memcpy(filepos.data(),   old.filepos->data, n_old*sizeof(int64_t));
+        memcpy(text_offs.data(), old.text_offs->data, n_old*sizeof(int64_t));
+        memcpy(text.data(),      old.text->data,    ((const int64_t *) old.text_offs->data)[n_old]);
+    }
+
+    int64_t offs = n_old > 0 ? ((const int64_t *) old.text_offs->data)[n_old] : 0;
+    for (int64_t i = 0; i < n_add; ++i) {
+        const int64_t r = n_old + i;
+        memcpy(embd + r*row_size, idx->add_embd.data() + i*row_size, row_size);
+        file_id[r]   = idx->add_file_id[i];
+        filepos[r]   = idx->add_filepos[i];
+        text_offs[r] = offs;
+        memcpy(text.data() + offs, idx->add_text[i].data(), idx->add_text[i].size());
+        offs += idx->add_text[i].size();
+    }
+    text_offs[n_rows] = offs;
+
+    // assign the rows to the IVF lists and sort them by list, keeping the order of the rows within a list
+    std::vector<int32_t> list(n_rows, 0);
+    std::vector<int64_t> list_offs(n_list + 1, 0);
+
+    if (n_list > 0) {
+        std::vector<float> centroids;
+
+        int64_t n_assigned = 0;
+        if (old.centroids) {
+            centroids.assign((const float *) old.centroids->data, (const float *) old.centroids->data + n_list*n_embd);
+
+            const int64_t * old_offs = (const int64_t *) old.list_offs->data;
+            for (int32_t l = 0; l < n_list; ++l) {
+                std::fill(list.begin() + old_offs[l], list.begin() + old_offs[l + 1], l);
+            }
+            n_assigned = n_old;
+        } else {
+            centroids = embd_index_train(idx, storage->embd, n_rows, n_list);
+            idx->n_list = n_list;
+        }
+
+        embd_index_assign(idx, storage->embd, n_assigned, n_rows - n_assigned, centroids, list.data() + n_assigned, nullptr);
+
+        memcpy(storage->centroids->data, centroids.data(), centroids.size()*sizeof(float));
+    }
+
+    std::vector<int64_t> perm(n_rows);
+    std::iota(perm.begin(), perm.end(), 0);
+    std::stable_sort(perm.begin(), perm.end(), [&](int64_t a, int64_t b) { return list[a] < list[b]; });
+
+    for (int64_t i = 0; i < n_rows; ++i) {
+        list_offs[list[i] + 1]++;
+    }
+    for (int32_t l = 0; l < n_list; ++l) {
+        list_offs[l + 1] += list_offs[l];
+    }
+
+    // the vectors are already in the buffer, permute them in place by following the cycles of perm
+    {
+        std::vector<char> tmp(row_size);
+        std::vector<bool> done(n_rows, false);
+
+        for (int64_t s = 0; s < n_rows; ++s) {
+            if (done[s] || perm[s] == s) {
+                continue;
+            }
+            memcpy(tmp.data(), embd + s*row_size, row_size);
+            int64_t i = s;
+            while (perm[i] != s) {
+                memcpy(embd + i*row_size, embd + perm[i]*row_size, row_size);
+                done[i] = true;
+                i = perm[i];
+            }
+            memcpy(embd + i*row_size, tmp.data(), row_size);
+            done[i] = true;
+        }
+    }
+
+    {
+        int32_t * dst_file_id   = (int32_t *) storage->file_id->data;
+        int64_t * dst_filepos   = (int64_t *) storage->filepos->data;
+        int64_t * dst_text_offs = (int64_t *) storage->text_offs->data;
+        char    * dst_text      = (char    *) storage->text->data;
+
+        int64_t pos = 0;
+        for (int64_t i = 0; i < n_rows; ++i) {
+            const int64_t r = perm[i];
+            const int64_t n = text_offs[r + 1] - text_offs[r];
+
+            dst_file_id[i]   = file_id[r];
+            dst_filepos[i]   = filepos[r];
+            dst_text_offs[i] = pos;
+            memcpy(dst_text + pos, text.data() + text_offs[r], n);
+            pos += n;
+        }
+        dst_text_offs[n_rows] = pos;
+
+        if (n_list > 0) {
+            memcpy(storage->list_offs->data, list_offs.data(), list_offs.size()*sizeof(int64_t));
+        }
+    }
+
+    idx->storage = std::move(storage);
+
+    idx->add_embd.clear();
+    idx->add_file_id.clear();
+    idx->add_filepos.clear();
+    idx->add_text.clear();
+}
+
+std::vector<common_embd_index_result> common_embd_index_search(common_embd_index * idx, const float * query, int32_t top_k, int32_t n_probe) {
+    const auto & storage = *idx->storage;
+
+    if (storage.n_rows == 0 || top_k <= 0) {
+        return {};
+    }
+
+    std::vector<embd_index_segment> segs;
+    std::vector<float> scores;
+
+    if (storage.centroids && n_probe < idx->n_list) {
+        embd_index_mul_mat(idx, { { storage.centroids, 0, idx->n_list } }, query, 1, scores);
+
+        std::vector<int32_t> lists(idx->n_list);
+        std::iota(lists.begin(), lists.end(), 0);
+        std::partial_sort(lists.begin(), lists.begin() + std::max(n_probe, 1), lists.end(), [&](int32_t a, int32_t b) {
+            return scores[a] > scores[b];
+        });
+
+        const int64_t * list_offs = (const int64_t *) storage.list_offs->data;
+        for (int32_t i = 0; i < std::max(n_probe, 1); ++i) {
+            const int32_t l = lists[i];
+            if (list_offs[l + 1] > list_offs[l]) {
+                segs.push_back({ storage.embd, list_offs[l], list_offs[l + 1] - list_offs[l] });
+            }
+        }
+    } else {
+        segs.push_back({ storage.embd, 0, storage.n_rows });
+    }
+
+    embd_index_mul_mat(idx, segs, query, 1, scores);
+
+    std::vector<common_embd_index_result> res;
+    res.reserve(scores.size());
+    for (const auto & seg : segs) {
+        for (int64_t i = 0; i < seg.n; ++i) {
+            res.push_back({ seg.i0 + i, scores[res.size()] });
+        }
+    }
+
+    const size_t n_res = std::min<size_t>(top_k, res.size());
+    std::partial_sort(res.begin(), res.begin() + n_res, res.end(), [](const common_embd_index_result & a, const common_embd_index_result & b) {
+        return a.score > b.score;
+    });
+    res.resize(n_res);
+
+    return res;
+}
+
+int32_t common_embd_index_n_embd(const common_embd_index * idx) {
+    return idx->n_embd;
+}
+
+int32_t common_embd_index_n_list(const common_embd_index * idx) {
+    return idx->storage->centroids ? idx->n_list : 0;
+}
+
+int64_t common_embd_index_n_rows(const common_embd_index * idx) {
+    return idx->storage->n_rows;
+}
+
+bool common_embd_index_has_file(const common_embd_index * idx, const std::string & filename) {
+    return std::find(idx->files.begin(), idx->files.end(), filename) != idx->files.end();
+}
+
+common_embd_index_chunk common_embd_index_get_chunk(const common_embd_index * idx, int64_t id) {
+    const auto & storage = *idx->storage;
+
+    GGML_ASSERT(id >= 0 && id < storage.n_rows);
+
+    const int64_t * text_offs = (const int64_t *) storage.text_offs->data;
+
+    common_embd_index_chunk chunk;
+    chunk.filename = idx->files[((const int32_t *) storage.file_id->data)[id]];
+    chunk.filepos  = ((const int64_t *) storage.filepos->data)[id];
+    chunk.text     = std::string((const char *) storage.text->data + text_offs[id], text_offs[id + 1] - text_offs[id]);
+
+    return chunk;
+}
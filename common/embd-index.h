@@ -0,0 +1,68 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Persistent index of L2-normalized embeddings for retrieval.
+//
+// The index is a GGUF file: the vectors are quantized to f32, f16 or q8_0 and stored as a single
+// [n_embd, n_rows] tensor next to the chunk metadata. On load the file is memory-mapped and the vectors
+// are scored in place with a ggml matrix multiplication on the CPU backend, so queries use the SIMD
+// dot products of the quantized type and the index does not have to fit in RAM.
+//
+// With n_list > 0 the rows are grouped into an inverted file (IVF): the rows are partitioned into n_list
+// contiguous lists by k-means centroids and a query only scans the n_probe lists with the closest centroids.
+// The centroids are trained the first time the index is built. Rows added later are assigned to the
+// existing lists, so an index can be extended without re-embedding the rows it already holds.
+
+struct common_embd_index;
+
+struct common_embd_index_deleter {
+    void operator()(common_embd_index * idx);
+};
+
+typedef std::unique_ptr<common_embd_index, common_embd_index_deleter> common_embd_index_ptr;
+
+struct common_embd_index_chunk {
+    std::string filename;
+    int64_t     filepos;
+    std::string text;
+};
+
+struct common_embd_index_result {
+    int64_t id;    // row in the index
+    float   score; // dot product with the query
+};
+
+// create an empty index for n_embd-dimensional vectors
+// n_list: number of IVF lists, 0 for exhaustive search
+common_embd_index_ptr common_embd_index_init(int32_t n_embd, enum ggml_type type, int32_t n_list, int32_t n_threads);
+
+// memory-map an index written by common_embd_index_save, returns nullptr on failure
+common_embd_index_ptr common_embd_index_load(const std::string & fname, int32_t n_threads);
+
+// write the index to fname, the file is replaced atomically so it can be the file the index was loaded from
+bool common_embd_index_save(const common_embd_index * idx, const std::string & fname);
+
+// queue a normalized embedding and its chunk, the row becomes searchable after common_embd_index_build
+void common_embd_index_add(common_embd_index * idx, const common_embd_index_chunk & chunk, const float * embd);
+
+// merge the queued rows into the index, training the IVF centroids if the index does not have them yet
+void common_embd_index_build(common_embd_index * idx);
+
+// the top_k rows with the highest dot product with the normalized query, best first
+// n_probe: number of IVF lists to scan, ignored for an exhaustive index
+std::vector<common_embd_index_result> common_embd_index_search(common_embd_index * idx, const float * query, int32_t top_k, int32_t n_probe);
+
+int32_t common_embd_index_n_embd(const common_embd_index * idx);
+int32_t common_embd_index_n_list(const common_embd_index * idx);
+int64_t common_embd_index_n_rows(const common_embd_index * idx);
+
+// whether chunks of filename have been added to the index
+bool common_embd_index_has_file(const common_embd_index * idx, const std::string & filename);
+
+common_embd_index_chunk common_embd_index_get_chunk(const common_embd_index * idx, int64_t id);
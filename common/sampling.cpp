@@ -111,6 +111,13 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
+    // when > 0, the sampling chain starts with a top-k sampler with this k (see common_sampler_top_k_sparse)
+    int32_t top_k_sparse;
+
+    // the tokens that the samplers before the top-k sampler can modify, always kept in the candidates
+    std::vector<llama_token> top_k_keep;  // logit bias
+    int32_t                  top_k_n_prev; // the last accepted tokens (penalties)
+
     void set_logits(struct llama_context * ctx, int idx) {
         const auto * logits = llama_get_logits_ith(ctx, idx);
 
@@ -127,8 +134,104 @@ struct common_sampler {
 
         cur_p = { cur.data(), cur.size(), -1, false };
     }
+
+    // same as set_logits, but only the top_k_sparse largest logits and the tokens in top_k_keep are used as candidates
+    // this avoids materializing and partitioning the entire vocabulary for each sampled token, while the result of
+    // the top-k sampler stays the same: at most top_k_keep.size() of the candidates can be moved out of the top-k
+    void set_logits_top_k(struct llama_context * ctx, int idx) {
+        const llama_model * model = llama_get_model(ctx);
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+
+        std::vector<llama_token> keep = top_k_keep;
+        for (int i = 0; i < std::min<int>(top_k_n_prev, prev.size()); ++i) {
+            keep.push_back(prev.rat(i));
+        }
+
+        std::sort(keep.begin(), keep.end());
+        keep.erase(std::unique(keep.begin(), keep.end()), keep.end());
+
+        const int k = std::min<int>(n_vocab, top_k_sparse + keep.size());
+
+        cur.resize(k + keep.size());
+
+        const int n_top = llama_get_logits_top_k_ith(ctx, idx, k, cur.data());
+        if (n_top < 0) {
+            set_logits(ctx, idx);
+            return;
+        }
+
+        const auto * logits = llama_get_logits_ith(ctx, idx);
+
+        int n = n_top;
+        for (const llama_token token_id : keep) {
+            if (token_id < 0 || token_id >= n_vocab) {
+                continue;
+            }
+
+            const bool found = std::any_of(cur.begin(), cur.begin() + n_top, [token_id](const llama_token_data & td) {
+                return td.id == token_id;
+            });
+
+            if (!found) {
+                cur[n++] = llama_token_data{token_id, logits[token_id], 0.0f};
+            }
+        }
+
+        cur.resize(n);
+
+        cur_p = { cur.data(), cur.size(), -1, false };
+    }
 };
 
+// returns the k of the top-k sampler if the sampling chain can be applied to the top-k candidates instead of the
+// entire vocabulary - i.e. the chain starts with top-k, preceded only by samplers that modify a known set of tokens
+static int32_t common_sampler_top_k_sparse(const common_params_sampling & params, int32_t n_vocab, int32_t n_prev, int32_t & n_prev_keep) {
+    n_prev_keep = 0;
+
+    if (params.mirostat != 0 || params.top_k <= 0 || params.top_k >= n_vocab) {
+        return 0;
+    }
+
+    if (params.top_n_sigma >= 0) {
+        return params.top_k;
+    }
+
+    for (const auto & cnstr : params.samplers) {
+        switch (cnstr) {
+            case COMMON_SAMPLER_TYPE_TOP_K:
+                return params.top_k;
+            case COMMON_SAMPLER_TYPE_PENALTIES:
+                {
+                    if (params.penalty_last_n == 0 ||
+                        (params.penalty_repeat == 1.0f && params.penalty_freq == 0.0f && params.penalty_present == 0.0f)) {
+                        break;
+                    }
+
+                    // the penalized tokens must be in the history of the common_sampler
+                    if (params.penalty_last_n < 0 || params.penalty_last_n > n_prev) {
+                        return 0;
+                    }
+
+                    n_prev_keep = params.penalty_last_n;
+                } break;
+            case COMMON_SAMPLER_TYPE_DRY:
+                {
+                    if (params.dry_multiplier == 0.0f || params.dry_base < 1.0f || params.dry_penalty_last_n == 0) {
+                        break;
+                    }
+
+                    return 0;
+                }
+            default:
+                return 0;
+        }
+    }
+
+    return 0;
+}
+
 std::string common_params_sampling::print() const {
     char result[1024];
 
@@ -220,8 +323,18 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
         /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
         /* .cur    = */ {},
         /* .cur_p  = */ {},
+        /* .top_k_sparse = */ 0,
+        /* .top_k_keep   = */ {},
+        /* .top_k_n_prev = */ 0,
     };
 
+    result->top_k_sparse = common_sampler_top_k_sparse(params, llama_vocab_n_tokens(vocab), result->prev.capacity, result->top_k_n_prev);
+    if (result->top_k_sparse > 0) {
+        for (const auto & lb : params.logit_bias) {
+            result->top_k_keep.push_back(lb.token);
+        }
+    }
+
     llama_sampler_chain_add(result->chain,
             llama_sampler_init_logit_bias(
                 llama_vocab_n_tokens(vocab),
@@ -324,6 +437,9 @@ struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
         /* .prev   = */ gsmpl->prev,
         /* .cur    = */ gsmpl->cur,
         /* .cur_p  = */ gsmpl->cur_p,
+        /* .top_k_sparse = */ gsmpl->top_k_sparse,
+        /* .top_k_keep   = */ gsmpl->top_k_keep,
+        /* .top_k_n_prev = */ gsmpl->top_k_n_prev,
     };
 }
 
@@ -339,7 +455,12 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 }
 
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+    // the grammar has to see the entire vocabulary
+    if (gsmpl->top_k_sparse > 0 && !grammar_first) {
+        gsmpl->set_logits_top_k(ctx, idx);
+    } else {
+        gsmpl->set_logits(ctx, idx);
+    }
 
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
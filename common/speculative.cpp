@@ -14,15 +14,22 @@ struct common_speculative {
     struct llama_context * ctx;
     struct common_sampler * smpl;
 
+    llama_seq_id seq_id;
+    int32_t      n_ctx;
+
     llama_batch batch;
     llama_tokens prompt;
 };
 
 struct common_speculative * common_speculative_init(
-        struct llama_context * ctx_dft) {
+        struct llama_context * ctx_dft,
+        llama_seq_id seq_id,
+        int32_t n_ctx) {
     auto * result = new common_speculative {
         /* .ctx    = */ ctx_dft,
         /* .smpl   = */ nullptr,
+        /* .seq_id = */ seq_id,
+        /* .n_ctx  = */ n_ctx > 0 ? n_ctx : (int32_t) llama_n_ctx(ctx_dft),
         /* .batch  = */ llama_batch_init(llama_n_batch(ctx_dft), 0, 1),
         /* .prompt = */ {},
     };
@@ -155,7 +162,7 @@ llama_tokens speculative_gen_draft(
     LOG_DBG("%s: n_past = %d\n", __func__, n_past);
 
     common_batch_clear(batch);
-    common_batch_add  (batch, id_last, n_past, { 0 }, true);
+    common_batch_add  (batch, id_last, n_past, { spec->seq_id }, true);
 
     llama_decode(ctx, batch);
 
@@ -173,7 +180,7 @@ llama_tokens speculative_gen_draft(
             break;
         }
 
-        common_batch_add(batch, id, n_past + i + 1, { 0 }, true);
+        common_batch_add(batch, id, n_past + i + 1, { spec->seq_id }, true);
 
         // evaluate the drafted tokens on the draft model
         llama_decode(ctx, batch);
@@ -187,140 +194,211 @@ llama_tokens common_speculative_gen_draft(
         struct common_speculative_params params,
         const llama_tokens & prompt_tgt,
         llama_token id_last) {
-    auto & batch  = spec->batch;
-    auto & ctx    = spec->ctx;
-    auto & smpl   = spec->smpl;
-    auto & prompt = spec->prompt;
+    std::vector<common_speculative_draft> drafts = {
+        { spec, params, &prompt_tgt, id_last, {} },
+    };
 
-    int reuse_i = 0;
-    int reuse_n = 0;
+    common_speculative_gen_drafts(spec->batch, drafts);
 
-    const int n_ctx = llama_n_ctx(ctx) - params.n_draft;
+    return std::move(drafts[0].result);
+}
 
-    const int i_start = std::max<int>(0, (int) prompt_tgt.size() - n_ctx);
+void common_speculative_gen_drafts(
+        llama_batch & batch,
+        std::vector<common_speculative_draft> & drafts) {
+    if (drafts.empty()) {
+        return;
+    }
 
-    // reuse as much as possible from the old draft context
-    // ideally, the draft context should be as big as the target context and we will always reuse the entire prompt
-    for (int i = 0; i < (int) prompt.size(); ++i) {
-        int cur = 0;
-        while (i_start + cur < (int) prompt_tgt.size() &&
-               i       + cur < (int) prompt.size() &&
-               prompt_tgt[i_start + cur] == prompt[i + cur]) {
-            cur++;
-        }
+    auto * ctx = drafts[0].spec->ctx;
 
-        if ((cur >= params.n_reuse || n_ctx >= (int) prompt_tgt.size()) && cur > reuse_n) {
-            reuse_i = i;
-            reuse_n = cur;
-        }
-    }
+    const int n_batch = llama_n_batch(ctx);
 
-    LOG_DBG("%s: reuse_i = %d, reuse_n = %d, prompt = %d\n", __func__, reuse_i, reuse_n, (int) prompt.size());
+    // the batch index of the last evaluated token of each draft, -1 if the draft is complete
+    std::vector<int> i_batch(drafts.size(), -1);
 
-    llama_tokens result;
-    result.reserve(params.n_draft);
+    common_batch_clear(batch);
 
-    if (reuse_n == 0) {
-        llama_kv_self_clear(ctx);
+    for (size_t k = 0; k < drafts.size(); ++k) {
+        auto & draft = drafts[k];
 
-        prompt.clear();
-    } else {
-        // this happens when a previous draft has been discarded (for example, due to being too small), but the
-        // target model agreed with it. in this case, we simply pass back the previous results to save compute
-        if (reuse_i + reuse_n < (int) prompt.size() && prompt[reuse_i + reuse_n] == id_last) {
-            for (int i = reuse_i + reuse_n + 1; i < (int) prompt.size(); ++i) {
-                result.push_back(prompt[i]);
+        GGML_ASSERT(draft.spec->ctx == ctx && "all speculators must share the same draft context");
 
-                if (params.n_draft <= (int) result.size()) {
-                    break;
-                }
+        auto & prompt = draft.spec->prompt;
+
+        const auto & params     = draft.params;
+        const auto & prompt_tgt = *draft.prompt;
+
+        const llama_seq_id seq_id = draft.spec->seq_id;
+
+        draft.result.clear();
+        draft.result.reserve(params.n_draft);
+
+        int reuse_i = 0;
+        int reuse_n = 0;
+
+        const int n_ctx = draft.spec->n_ctx - params.n_draft;
+
+        const int i_start = std::max<int>(0, (int) prompt_tgt.size() - n_ctx);
+
+        // reuse as much as possible from the old draft context
+        // ideally, the draft context should be as big as the target context and we will always reuse the entire prompt
+        for (int i = 0; i < (int) prompt.size(); ++i) {
+            int cur = 0;
+            while (i_start + cur < (int) prompt_tgt.size() &&
+                   i       + cur < (int) prompt.size() &&
+                   prompt_tgt[i_start + cur] == prompt[i + cur]) {
+                cur++;
             }
 
-            return result;
+            if ((cur >= params.n_reuse || n_ctx >= (int) prompt_tgt.size()) && cur > reuse_n) {
+                reuse_i = i;
+                reuse_n = cur;
+            }
         }
 
-        if (reuse_i > 0) {
-            llama_kv_self_seq_rm (ctx, 0, 0, reuse_i);
-            llama_kv_self_seq_add(ctx, 0, reuse_i, -1, -reuse_i);
+        LOG_DBG("%s: seq_id = %d, reuse_i = %d, reuse_n = %d, prompt = %d\n", __func__, seq_id, reuse_i, reuse_n, (int) prompt.size());
+
+        if (reuse_n == 0) {
+            llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+
+            prompt.clear();
+        } else {
+            // this happens when a previous draft has been discarded (for example, due to being too small), but the
+            // target model agreed with it. in this case, we simply pass back the previous results to save compute
+            if (reuse_i + reuse_n < (int) prompt.size() && prompt[reuse_i + reuse_n] == draft.id_last) {
+                for (int i = reuse_i + reuse_n + 1; i < (int) prompt.size(); ++i) {
+                    draft.result.push_back(prompt[i]);
+
+                    if (params.n_draft <= (int) draft.result.size()) {
+                        break;
+                    }
+                }
+
+                continue;
+            }
+
+            if (reuse_i > 0) {
+                llama_kv_self_seq_rm (ctx, seq_id, 0, reuse_i);
+                llama_kv_self_seq_add(ctx, seq_id, reuse_i, -1, -reuse_i);
+
+                prompt.erase(prompt.begin(), prompt.begin() + reuse_i);
+            }
+
+            if (reuse_n < (int) prompt.size()) {
+                llama_kv_self_seq_rm (ctx, seq_id, reuse_n, -1);
 
-            prompt.erase(prompt.begin(), prompt.begin() + reuse_i);
+                prompt.erase(prompt.begin() + reuse_n, prompt.end());
+            }
         }
 
-        if (reuse_n < (int) prompt.size()) {
-            llama_kv_self_seq_rm (ctx, 0, reuse_n, -1);
+        // add any new tokens in the prompt to the batch
+        // we should rarely end-up here during normal decoding
+        for (size_t i = i_start + reuse_n; i < prompt_tgt.size(); ++i) {
+            //LOG_DBG("i = %d, i_start = %d, reuse_n = %d, i - i_start = %d, id = %6d\n", i, i_start, reuse_n, i - i_start, prompt_tgt[i]);
+            if (batch.n_tokens == n_batch) {
+                llama_decode(ctx, batch);
+                common_batch_clear(batch);
+            }
+
+            common_batch_add(batch, prompt_tgt[i], i - i_start, { seq_id }, false);
 
-            prompt.erase(prompt.begin() + reuse_n, prompt.end());
+            prompt.push_back(prompt_tgt[i]);
         }
-    }
 
-    // prepare a batch to evaluate any new tokens in the prompt
-    common_batch_clear(batch);
+        // mark as active - the actual index is set below, once the new prompt tokens of all drafts have been added
+        i_batch[k] = 0;
+    }
 
-    for (size_t i = i_start + reuse_n; i < prompt_tgt.size(); ++i) {
-        //LOG_DBG("i = %d, i_start = %d, reuse_n = %d, i - i_start = %d, id = %6d\n", i, i_start, reuse_n, i - i_start, prompt_tgt[i]);
-        common_batch_add(batch, prompt_tgt[i], i - i_start, { 0 }, false);
+    int n_active = 0;
+    for (size_t k = 0; k < drafts.size(); ++k) {
+        n_active += i_batch[k] >= 0;
+    }
 
-        prompt.push_back(prompt_tgt[i]);
+    if (n_active == 0) {
+        return;
     }
 
-    // we should rarely end-up here during normal decoding
-    if (batch.n_tokens > 0) {
-        //LOG_DBG("%s: draft prompt batch: %s\n", __func__, string_from(ctx, batch).c_str());
+    GGML_ASSERT(n_active <= n_batch);
 
+    // the last tokens must end up in the same batch to get their logits
+    if (batch.n_tokens + n_active > n_batch) {
         llama_decode(ctx, batch);
+        common_batch_clear(batch);
     }
 
-    const llama_pos n_past = prompt.size();
+    for (size_t k = 0; k < drafts.size(); ++k) {
+        if (i_batch[k] < 0) {
+            continue;
+        }
 
-    LOG_DBG("%s: n_past = %d\n", __func__, n_past);
+        auto & prompt = drafts[k].spec->prompt;
 
-    common_batch_clear(batch);
-    common_batch_add  (batch, id_last, n_past, { 0 }, true);
+        const llama_pos n_past = prompt.size();
 
-    prompt.push_back(id_last);
+        LOG_DBG("%s: seq_id = %d, n_past = %d\n", __func__, drafts[k].spec->seq_id, n_past);
 
-    //LOG_DBG("%s: draft prompt: %s\n", __func__, string_from(ctx, prompt).c_str());
+        i_batch[k] = batch.n_tokens;
 
-    llama_decode(ctx, batch);
+        common_batch_add(batch, drafts[k].id_last, n_past, { drafts[k].spec->seq_id }, true);
 
-    common_sampler_reset(smpl);
+        prompt.push_back(drafts[k].id_last);
 
-    // sample n_draft tokens from the draft model
-    for (int i = 0; i < params.n_draft; ++i) {
+        common_sampler_reset(drafts[k].spec->smpl);
+    }
+
+    //LOG_DBG("%s: draft prompt batch: %s\n", __func__, string_from(ctx, batch).c_str());
+
+    llama_decode(ctx, batch);
+
+    // sample the draft tokens of all sequences, one position at a time
+    while (n_active > 0) {
         common_batch_clear(batch);
 
-        common_sampler_sample(smpl, ctx, 0, true);
+        for (size_t k = 0; k < drafts.size(); ++k) {
+            if (i_batch[k] < 0) {
+                continue;
+            }
 
-        const auto * cur_p = common_sampler_get_candidates(smpl);
+            auto & draft = drafts[k];
+            auto & smpl  = draft.spec->smpl;
 
-        for (int k = 0; k < std::min(3, (int) cur_p->size); ++k) {
-            LOG_DBG(" - draft candidate %3d, pos %3d: %6d (%8.3f) '%s'\n",
-                    k, i, cur_p->data[k].id, cur_p->data[k].p, common_token_to_piece(ctx, cur_p->data[k].id).c_str());
-        }
+            const int i = draft.result.size();
 
-        // add drafted token for each sequence
-        const llama_token id = cur_p->data[0].id;
+            common_sampler_sample(smpl, ctx, i_batch[k], true);
 
-        common_sampler_accept(smpl, id, true);
+            const auto * cur_p = common_sampler_get_candidates(smpl);
 
-        result.push_back(id);
+            for (int j = 0; j < std::min(3, (int) cur_p->size); ++j) {
+                LOG_DBG(" - draft candidate %3d, pos %3d: %6d (%8.3f) '%s'\n",
+                        j, i, cur_p->data[j].id, cur_p->data[j].p, common_token_to_piece(ctx, cur_p->data[j].id).c_str());
+            }
 
-        if (params.n_draft <= (int) result.size()) {
-            break;
-        }
+            // add drafted token for each sequence
+            const llama_token id = cur_p->data[0].id;
 
-        // only collect very high-confidence draft tokens
-        if (cur_p->data[0].p < params.p_min) {
-            break;
-        }
+            common_sampler_accept(smpl, id, true);
 
-        common_batch_add(batch, id, n_past + i + 1, { 0 }, true);
+            draft.result.push_back(id);
 
-        // evaluate the drafted tokens on the draft model
-        llama_decode(ctx, batch);
+            // only collect very high-confidence draft tokens
+            if (draft.params.n_draft <= (int) draft.result.size() || cur_p->data[0].p < draft.params.p_min) {
+                i_batch[k] = -1;
+                n_active--;
+                continue;
+            }
 
-        prompt.push_back(id);
-    }
+            i_batch[k] = batch.n_tokens;
 
-    return result;
+            // the position follows the id_last token
+            common_batch_add(batch, id, draft.spec->prompt.size(), { draft.spec->seq_id }, true);
+
+            draft.spec->prompt.push_back(id);
+        }
+
+        if (batch.n_tokens > 0) {
+            // evaluate the drafted tokens on the draft model
+            llama_decode(ctx, batch);
+        }
+    }
 }
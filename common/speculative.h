@@ -12,7 +12,10 @@ struct common_speculative_params {
     float p_min = 0.75f; // min probability required to accept a token in the draft
 };
 
-struct common_speculative * common_speculative_init(struct llama_context * ctx_dft);
+// seq_id - the sequence of the draft context used by this speculator
+// n_ctx  - the context available to the sequence (0 = the entire draft context)
+//          multiple speculators can share a draft context by using different sequences
+struct common_speculative * common_speculative_init(struct llama_context * ctx_dft, llama_seq_id seq_id = 0, int32_t n_ctx = 0);
 
 void common_speculative_free(struct common_speculative * spec);
 
@@ -32,3 +35,20 @@ llama_tokens common_speculative_gen_draft(
         struct common_speculative_params   params,
                       const llama_tokens & prompt,
                              llama_token   id_last);
+
+struct common_speculative_draft {
+    struct common_speculative        * spec;
+    struct common_speculative_params   params;
+
+    const llama_tokens * prompt;  // the tokens currently in the target context
+    llama_token          id_last; // the last sampled token, not yet in the target context
+
+    llama_tokens result;          // the drafted tokens
+};
+
+// generate the drafts for multiple speculators sharing the same draft context
+// the tokens of all sequences are evaluated together - one draft model decode per drafted position
+// batch must be able to hold at least llama_n_batch(ctx_dft) tokens
+void common_speculative_gen_drafts(
+                                   llama_batch & batch,
+        std::vector<common_speculative_draft> & drafts);
@@ -170,6 +170,30 @@ static void process_logits(std::ostream& out, int n_vocab, const float * logits,
     out.write((const char *)log_probs.data(), n_token*nv*sizeof(uint16_t));
 }
 
+// the log-probabilities of the next tokens, computed in the graph
+static void process_logprobs(const float * logprobs, int n_token, double & nll, double & nll2, float * prob_history) {
+    for (int i = 0; i < n_token; ++i) {
+        const double v = -logprobs[i];
+        nll  += v;
+        nll2 += v*v;
+
+        prob_history[i] = expf(logprobs[i]);
+    }
+}
+
+// writes the log-probabilities of the next tokens followed by the top tokens and their log-probabilities
+static void process_logprobs(std::ostream & out, int n_top, const float * logprobs, const llama_token * top, const float * top_logprobs,
+        int n_token, double & nll, double & nll2) {
+    for (int i = 0; i < n_token; ++i) {
+        const double v = -logprobs[i];
+        nll  += v;
+        nll2 += v*v;
+    }
+    out.write((const char *)logprobs,     n_token*sizeof(float));
+    out.write((const char *)top,          size_t(n_token)*n_top*sizeof(llama_token));
+    out.write((const char *)top_logprobs, size_t(n_token)*n_top*sizeof(float));
+}
+
 struct kl_divergence_result {
     double sum_nll          = 0.0;
     double sum_nll2         = 0.0;
@@ -291,6 +315,53 @@ static void process_logits(int n_vocab, const float * logits, const int * tokens
     }
 }
 
+// logprobs: the log-probabilities of the next token, of the n_top base tokens and of the most likely token
+// the part of the base distribution outside of its top tokens is lumped together in a single bucket,
+// so the result is a lower bound of the KL divergence over the full vocabulary
+static std::pair<double, float> kl_divergence_top_k(int n_top, const float * logprobs, llama_token top, float base_logprob,
+        const llama_token * base_top, const float * base_top_logprobs, kl_divergence_result & kld) {
+    const float nll = -logprobs[0];
+    kld.sum_nll  += nll;
+    kld.sum_nll2 += nll*nll;
+
+    const float nll_base = -base_logprob;
+    kld.sum_nll_base  += nll_base;
+    kld.sum_nll_base2 += nll_base*nll_base;
+
+    kld.sum_nll_nll_base += nll*nll_base;
+
+    double sum = 0;
+    double sum_p_base = 0;
+    double sum_p = 0;
+    for (int i = 0; i < n_top; ++i) {
+        const float p_base = expf(base_top_logprobs[i]);
+        sum += p_base * (base_top_logprobs[i] - logprobs[1 + i]);
+        sum_p_base += p_base;
+        sum_p += expf(logprobs[1 + i]);
+    }
+    const double p_base_rest = 1.0 - sum_p_base;
+    if (p_base_rest > 1e-6) {
+        sum += p_base_rest * log(p_base_rest/std::max(1.0 - sum_p, 1e-30));
+    }
+    kld.sum_kld  += sum;
+    kld.sum_kld2 += sum*sum;
+    ++kld.count;
+    if (top == base_top[0]) {
+        ++kld.n_same_top;
+    }
+
+    const float p_base = expf(-nll_base);
+    const float p = expf(-nll);
+    const float p_diff = p - p_base;
+    kld.sum_p_diff  += p_diff;
+    const double p_diff2 = p_diff*p_diff;
+    kld.sum_p_diff2 += p_diff2;
+    kld.sum_p_diff4 += p_diff2*p_diff2;
+    kld.max_p_diff = std::max(kld.max_p_diff, std::fabs(p_diff));
+
+    return std::make_pair(sum, p_diff);
+}
+
 static results_perplexity perplexity_v2(llama_context * ctx, const common_params & params) {
     // Download: https://huggingface.co/datasets/ggml-org/ci/resolve/main/wikitext-2-raw-v1.zip
     // Run `./perplexity -m models/7B/ggml-model-q4_0.bin -f wiki.test.raw`
@@ -454,6 +525,15 @@ static results_perplexity perplexity(llama_context * ctx, const common_params &
     const bool add_bos = llama_vocab_get_add_bos(vocab);
     GGML_ASSERT(!llama_vocab_get_add_eos(vocab));
 
+    // with fused log-probabilities, the graph computes the log-likelihood of the next token (and the top tokens of
+    // a --kl-divergence-top-k base) so that only a few values per token are copied from the backend
+    const int n_top = params.logits_file.empty() ? 0 : params.kl_divergence_top_k;
+    const bool fused = n_top > 0 || (params.fused_logprobs && params.logits_file.empty());
+
+    if (params.fused_logprobs && !fused) {
+        LOG_WRN("%s: --fused-logprobs is ignored when saving all logits, use --kl-divergence-top-k\n", __func__);
+    }
+
     std::ofstream logits_stream;
     if (!params.logits_file.empty()) {
         logits_stream.open(params.logits_file.c_str(), std::ios::binary);
@@ -461,8 +541,13 @@ static results_perplexity perplexity(llama_context * ctx, const common_params &
             LOG_ERR("%s: failed to open %s for writing\n", __func__, params.logits_file.c_str());
             return {};
         }
-        LOG_INF("%s: saving all logits to %s\n", __func__, params.logits_file.c_str());
-        logits_stream.write("_logits_", 8);
+        if (n_top > 0) {
+            LOG_INF("%s: saving the top %d log-probabilities to %s\n", __func__, n_top, params.logits_file.c_str());
+            logits_stream.write("_logtop_", 8);
+        } else {
+            LOG_INF("%s: saving all logits to %s\n", __func__, params.logits_file.c_str());
+            logits_stream.write("_logits_", 8);
+        }
         logits_stream.write(reinterpret_cast<const char *>(&n_ctx), sizeof(n_ctx));
     }
 
@@ -507,11 +592,12 @@ static results_perplexity perplexity(llama_context * ctx, const common_params &
     llama_batch batch = llama_batch_init(std::min(n_batch, n_ctx*n_seq), 0, 1);
 
     std::vector<float> logits;
-    if (num_batches > 1) {
+    if (num_batches > 1 && !fused) {
         logits.reserve(size_t(n_ctx) * n_vocab);
     }
 
-    LOG_INF("%s: calculating perplexity over %d chunks, n_ctx=%d, batch_size=%d, n_seq=%d\n", __func__, n_chunk, n_ctx, n_batch, n_seq);
+    LOG_INF("%s: calculating perplexity over %d chunks, n_ctx=%d, batch_size=%d, n_seq=%d%s\n", __func__, n_chunk, n_ctx, n_batch, n_seq,
+            fused ? ", fused logprobs" : "");
 
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
@@ -519,9 +605,14 @@ static results_perplexity perplexity(llama_context * ctx, const common_params &
     if (!params.logits_file.empty()) {
         logits_stream.write((const char *)&n_vocab, sizeof(n_vocab));
         logits_stream.write((const char *)&n_chunk, sizeof(n_chunk));
+        if (n_top > 0) {
+            logits_stream.write((const char *)&n_top, sizeof(n_top));
+        }
         logits_stream.write((const char *)tokens.data(), n_chunk*n_ctx*sizeof(tokens[0]));
-        const int nv = 2*((n_vocab + 1)/2) + 4;
-        log_probs.resize(n_ctx * nv);
+        if (n_top == 0) {
+            const int nv = 2*((n_vocab + 1)/2) + 4;
+            log_probs.resize(n_ctx * nv);
+        }
     }
 
     // We get the logits for all the tokens in the context window (params.n_ctx)
@@ -538,6 +629,23 @@ static results_perplexity perplexity(llama_context * ctx, const common_params &
     // process the entire prompt.
     const int first = n_ctx/2;
 
+    // fused: the log-probabilities of the scored tokens of each sequence of the batch
+    const int n_scored = n_ctx - 1 - first;
+
+    std::vector<llama_token> targets;
+    std::vector<float>       fused_logprobs;
+    std::vector<llama_token> fused_top;
+    std::vector<float>       fused_top_logprobs;
+
+    if (fused) {
+        llama_set_logprobs(ctx, 1, n_top);
+
+        targets.resize(std::min(n_batch, n_ctx*n_seq));
+        fused_logprobs.resize(size_t(n_seq)*n_scored);
+        fused_top.resize(size_t(n_seq)*n_scored*n_top);
+        fused_top_logprobs.resize(size_t(n_seq)*n_scored*n_top);
+    }
+
     for (int i = 0; i < n_chunk; i += n_seq) {
         const int start =     i * n_ctx;
         const int end   = start + n_ctx;
@@ -575,6 +683,12 @@ static results_perplexity perplexity(llama_context * ctx, const common_params &
                     batch.seq_id  [idx][0] = seq;
                     batch.logits  [idx]    = batch.pos[idx] >= first ? 1 : 0;
 
+                    if (fused) {
+                        // the last token has no next token to score
+                        batch.logits[idx] = batch.logits[idx] && batch.pos[idx] < n_ctx - 1;
+                        targets[idx] = batch.logits[idx] ? tokens[seq_start + k + 1] : 0;
+                    }
+
                     n_outputs += batch.logits[idx] != 0;
                 }
                 batch.n_tokens += batch_size;
@@ -583,12 +697,31 @@ static results_perplexity perplexity(llama_context * ctx, const common_params &
                 tokens[seq_start] = token_org;
             }
 
+            if (fused) {
+                llama_set_logprobs_targets(ctx, targets.data(), batch.n_tokens);
+            }
+
             if (llama_decode(ctx, batch)) {
                 LOG_INF("%s : failed to eval\n", __func__);
                 return {tokens, -1, logit_history, prob_history};
             }
 
-            if (num_batches > 1 && n_outputs > 0) {
+            if (fused) {
+                for (int idx = 0; idx < batch.n_tokens; ++idx) {
+                    if (!batch.logits[idx]) {
+                        continue;
+                    }
+                    const size_t row = size_t(batch.seq_id[idx][0])*n_scored + batch.pos[idx] - first;
+
+                    const float * lp = llama_get_logprobs_ith(ctx, idx);
+                    fused_logprobs[row] = lp[0];
+                    if (n_top > 0) {
+                        const llama_token * top = llama_get_logprobs_top_ith(ctx, idx);
+                        std::copy(top,    top    + n_top, fused_top.begin()          + row*n_top);
+                        std::copy(lp + 1, lp + 1 + n_top, fused_top_logprobs.begin() + row*n_top);
+                    }
+                }
+            } else if (num_batches > 1 && n_outputs > 0) {
                 const auto * batch_logits = llama_get_logits(ctx);
                 logits.insert(logits.end(), batch_logits, batch_logits + size_t(n_outputs) * n_vocab);
             }
@@ -609,10 +742,17 @@ static results_perplexity perplexity(llama_context * ctx, const common_params &
         }
 
         for (int seq = 0; seq < n_seq_batch; seq++) {
-            const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits_ith(ctx, seq*n_ctx + first);
+            const float * all_logits = num_batches > 1 || fused ? logits.data() : llama_get_logits_ith(ctx, seq*n_ctx + first);
 
             llama_token * tokens_data = tokens.data() + start + seq*n_ctx + first;
-            if (!params.logits_file.empty()) {
+            if (fused && n_top > 0) {
+                process_logprobs(logits_stream, n_top, fused_logprobs.data() + size_t(seq)*n_scored,
+                        fused_top.data() + size_t(seq)*n_scored*n_top, fused_top_logprobs.data() + size_t(seq)*n_scored*n_top,
+                        n_scored, nll, nll2);
+            } else if (fused) {
+                process_logprobs(fused_logprobs.data() + size_t(seq)*n_scored, n_scored, nll, nll2,
+                        prob_history.data() + start + seq*n_ctx + first);
+            } else if (!params.logits_file.empty()) {
                 process_logits(logits_stream, n_vocab, all_logits,
                         tokens_data, n_ctx - 1 - first,
                         workers, log_probs, nll, nll2);
@@ -655,6 +795,10 @@ static results_perplexity perplexity(llama_context * ctx, const common_params &
 
     llama_batch_free(batch);
 
+    if (fused) {
+        llama_set_logprobs(ctx, 0, 0);
+    }
+
     return {tokens, ppl, logit_history, prob_history};
 }
 
@@ -1695,10 +1839,13 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
         LOG_ERR("%s: failed to open %s\n", __func__, params.logits_file.c_str());
         return;
     }
+    // a base saved with --kl-divergence-top-k only has the top log-probabilities of each token
+    bool top_k = false;
     {
         char check[9]; check[8] = 0;
         in.read(check, 8);
-        if (in.fail() || strncmp("_logits_", check, 8) != 0) {
+        top_k = !in.fail() && strncmp("_logtop_", check, 8) == 0;
+        if (in.fail() || (!top_k && strncmp("_logits_", check, 8) != 0)) {
             LOG_ERR("%s: %s does not look like a file containing log-probabilities\n", __func__, params.logits_file.c_str());
             return;
         }
@@ -1723,6 +1870,16 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
         LOG_ERR("%s: inconsistent vocabulary (%d vs %d)\n", __func__, n_vocab, llama_vocab_n_tokens(vocab));
     }
 
+    int n_top = 0;
+    if (top_k) {
+        if (in.read((char *)&n_top, sizeof(n_top)).fail() || n_top <= 0 || n_top > n_vocab) {
+            LOG_ERR("%s: failed reading the number of top log-probabilities from %s\n", __func__, params.logits_file.c_str());
+            return;
+        }
+        LOG_INF("%s: %s has the top %d log-probabilities of each token, the KL divergence is computed from them\n",
+                __func__, params.logits_file.c_str(), n_top);
+    }
+
     std::vector<llama_token> tokens(size_t(n_ctx) * n_chunk);
     if (in.read((char *)tokens.data(), tokens.size()*sizeof(tokens[0])).fail()) {
         LOG_ERR("%s: failed reading evaluation tokens from %s\n", __func__, params.logits_file.c_str());
@@ -1735,14 +1892,32 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
     const bool add_bos = llama_vocab_get_add_bos(vocab);
     GGML_ASSERT(!llama_vocab_get_add_eos(vocab));
 
-    std::vector<uint16_t> log_probs_uint16(size_t(n_ctx - 1 - n_ctx/2) * nv);
-    std::vector<float>    kld_values(size_t(n_ctx - 1 - n_ctx/2)*n_chunk);
-    std::vector<float> p_diff_values(size_t(n_ctx - 1 - n_ctx/2)*n_chunk);
+    const int first    = n_ctx/2;
+    const int n_scored = n_ctx - 1 - first;
+
+    std::vector<uint16_t> log_probs_uint16(top_k ? 0 : size_t(n_scored) * nv);
+    std::vector<float>    kld_values(size_t(n_scored)*n_chunk);
+    std::vector<float> p_diff_values(size_t(n_scored)*n_chunk);
     std::vector<float> logits;
-    if (num_batches > 1) {
+    if (num_batches > 1 && !top_k) {
         logits.reserve(size_t(n_ctx) * n_vocab);
     }
 
+    // top_k: the log-probabilities of the next token and of the top tokens of the base are computed in the graph
+    std::vector<float>       base_logprobs;
+    std::vector<llama_token> base_top;
+    std::vector<float>       base_top_logprobs;
+    std::vector<llama_token> targets;
+
+    if (top_k) {
+        llama_set_logprobs(ctx, 1 + n_top, 1);
+
+        base_logprobs.resize(n_scored);
+        base_top.resize(size_t(n_scored)*n_top);
+        base_top_logprobs.resize(size_t(n_scored)*n_top);
+        targets.resize(size_t(n_batch)*(1 + n_top));
+    }
+
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
     auto mean_and_uncertainty = [] (double sum, double sum2, size_t count) {
@@ -1773,7 +1948,14 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
 
         const auto t_start = std::chrono::high_resolution_clock::now();
 
-        if (in.read((char *)log_probs_uint16.data(), log_probs_uint16.size()*sizeof(uint16_t)).fail()) {
+        if (top_k) {
+            in.read((char *)base_logprobs.data(),     base_logprobs.size()*sizeof(float));
+            in.read((char *)base_top.data(),          base_top.size()*sizeof(llama_token));
+            in.read((char *)base_top_logprobs.data(), base_top_logprobs.size()*sizeof(float));
+        } else {
+            in.read((char *)log_probs_uint16.data(), log_probs_uint16.size()*sizeof(uint16_t));
+        }
+        if (in.fail()) {
             LOG_ERR("%s: failed reading log-probs for chunk %d\n", __func__, i);
             return;
         }
@@ -1797,7 +1979,23 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
 
             common_batch_clear(batch);
             for (int i = 0; i < batch_size; i++) {
-                common_batch_add(batch, tokens[batch_start + i], j*n_batch + i, {0}, true);
+                const int pos = j*n_batch + i;
+                if (top_k) {
+                    // only the scored tokens are output, with their next token and the top tokens of the base as targets
+                    const bool output = pos >= first && pos < (int) n_ctx - 1;
+                    common_batch_add(batch, tokens[batch_start + i], pos, {0}, output);
+                    if (output) {
+                        llama_token * dst = targets.data() + size_t(i)*(1 + n_top);
+                        dst[0] = tokens[batch_start + i + 1];
+                        std::copy_n(base_top.begin() + size_t(pos - first)*n_top, n_top, dst + 1);
+                    }
+                } else {
+                    common_batch_add(batch, tokens[batch_start + i], pos, {0}, true);
+                }
+            }
+
+            if (top_k) {
+                llama_set_logprobs_targets(ctx, targets.data(), batch.n_tokens);
             }
 
             if (llama_decode(ctx, batch)) {
@@ -1809,7 +2007,22 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
             // restore the original token in case it was set to BOS
             tokens[batch_start] = token_org;
 
-            if (num_batches > 1) {
+            if (top_k) {
+                for (int i = 0; i < batch.n_tokens; i++) {
+                    if (!batch.logits[i]) {
+                        continue;
+                    }
+                    const int row = batch.pos[i] - first;
+
+                    const float * lp = llama_get_logprobs_ith(ctx, i);
+                    const llama_token top = llama_get_logprobs_top_ith(ctx, i)[0];
+
+                    std::pair<double, float> v = kl_divergence_top_k(n_top, lp, top, base_logprobs[row],
+                            base_top.data() + size_t(row)*n_top, base_top_logprobs.data() + size_t(row)*n_top, kld);
+                    kld_ptr[row]    = (float)v.first;
+                    p_diff_ptr[row] = v.second;
+                }
+            } else if (num_batches > 1) {
                 const auto * batch_logits = llama_get_logits(ctx);
                 logits.insert(logits.end(), batch_logits, batch_logits + size_t(batch_size) * n_vocab);
             }
@@ -1832,12 +2045,13 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
         LOG("\n");
         LOG("chunk             PPL               ln(PPL(Q)/PPL(base))          KL Divergence              Δp RMS            Same top p\n");
 
-        const int first = n_ctx/2;
-        const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits(ctx);
-        process_logits(n_vocab, all_logits + size_t(first)*n_vocab, tokens.data() + start + first, n_ctx - 1 - first,
-                workers, log_probs_uint16, kld, kld_ptr, p_diff_ptr);
-        p_diff_ptr += n_ctx - 1 - first;
-        kld_ptr    += n_ctx - 1 - first;
+        if (!top_k) {
+            const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits(ctx);
+            process_logits(n_vocab, all_logits + size_t(first)*n_vocab, tokens.data() + start + first, n_scored,
+                    workers, log_probs_uint16, kld, kld_ptr, p_diff_ptr);
+        }
+        p_diff_ptr += n_scored;
+        kld_ptr    += n_scored;
 
         LOG("%4d", i+1);
 
@@ -1870,6 +2084,10 @@ static void kl_divergence(llama_context * ctx, const common_params & params) {
     }
     LOG("\n");
 
+    if (top_k) {
+        llama_set_logprobs(ctx, 0, 0);
+    }
+
     if (kld.count < 100) return; // we do not wish to do statistics on so few values
 
     std::sort(kld_values.begin(), kld_values.end());
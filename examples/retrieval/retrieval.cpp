@@ -1,15 +1,16 @@
 #include "arg.h"
 #include "common.h"
+#include "embd-index.h"
 #include "log.h"
 #include "llama.h"
 
-#include <algorithm>
 #include <fstream>
 #include <iostream> // TODO: remove me
 
 static void print_usage(int, char ** argv) {
     LOG("\nexample usage:\n");
     LOG("\n    %s --model ./models/bge-base-en-v1.5-f16.gguf --top-k 3 --context-file README.md --context-file License --chunk-size 100 --chunk-separator .\n", argv[0]);
+    LOG("\n    %s --model ./models/bge-base-en-v1.5-f16.gguf --top-k 3 --index-file docs.gguf --context-file README.md --chunk-size 100 --chunk-separator .\n", argv[0]);
     LOG("\n");
 }
 
@@ -22,8 +23,6 @@ struct chunk {
     std::string textdata;
     // tokenized text data
     std::vector<llama_token> tokens;
-    // embedding
-    std::vector<float> embedding;
 };
 
 // chunk file data to chunks of size >= chunk_size
@@ -128,23 +127,11 @@ int main(int argc, char ** argv) {
         LOG_ERR("chunk_size must be positive\n");
         return 1;
     }
-    if (params.context_files.empty()) {
-        LOG_ERR("context_files must be specified\n");
+    if (params.context_files.empty() && params.index_file.empty()) {
+        LOG_ERR("context_files or index_file must be specified\n");
         return 1;
     }
 
-    LOG_INF("processing files:\n");
-    for (auto & context_file : params.context_files) {
-        LOG_INF("%s\n", context_file.c_str());
-    }
-
-    std::vector<chunk> chunks;
-    for (auto & context_file : params.context_files) {
-        std::vector<chunk> file_chunk = chunk_file(context_file, params.chunk_size, params.chunk_separator);
-        chunks.insert(chunks.end(), file_chunk.begin(), file_chunk.end());
-    }
-    LOG_INF("Number of chunks: %zu\n", chunks.size());
-
     llama_backend_init();
     llama_numa_init(params.numa);
 
@@ -181,6 +168,42 @@ int main(int argc, char ** argv) {
         LOG_INF("%s\n", common_params_get_system_info(params).c_str());
     }
 
+    const int n_embd = llama_model_n_embd(model);
+
+    // load the index, or start a new one
+    common_embd_index_ptr idx;
+    if (!params.index_file.empty() && std::ifstream(params.index_file).good()) {
+        idx = common_embd_index_load(params.index_file, params.cpuparams.n_threads);
+        if (!idx) {
+            return 1;
+        }
+        if (common_embd_index_n_embd(idx.get()) != n_embd) {
+            LOG_ERR("%s: index %s has n_embd = %d, the model has n_embd = %d\n",
+                    __func__, params.index_file.c_str(), common_embd_index_n_embd(idx.get()), n_embd);
+            return 1;
+        }
+    } else {
+        idx = common_embd_index_init(n_embd, params.index_type, params.index_n_list, params.cpuparams.n_threads);
+        if (!idx) {
+            return 1;
+        }
+    }
+
+    // only the files that are not in the index yet are embedded
+    LOG_INF("processing files:\n");
+    std::vector<chunk> chunks;
+    for (auto & context_file : params.context_files) {
+        if (common_embd_index_has_file(idx.get(), context_file)) {
+            LOG_INF("%s (already indexed)\n", context_file.c_str());
+            continue;
+        }
+        LOG_INF("%s\n", context_file.c_str());
+
+        std::vector<chunk> file_chunk = chunk_file(context_file, params.chunk_size, params.chunk_separator);
+        chunks.insert(chunks.end(), file_chunk.begin(), file_chunk.end());
+    }
+    LOG_INF("Number of chunks: %zu\n", chunks.size());
+
     // max batch size
     const uint64_t n_batch = params.n_batch;
     GGML_ASSERT(params.n_batch >= params.n_ctx);
@@ -216,14 +239,28 @@ int main(int argc, char ** argv) {
     const int n_chunks = chunks.size();
     struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
 
-    // allocate output
-    const int n_embd = llama_model_n_embd(model);
-    std::vector<float> embeddings(n_chunks * n_embd, 0);
-    float * emb = embeddings.data();
+    // embeddings of the current batch
+    std::vector<float> embeddings;
 
-    // break into batches
+    // embed the prompts of the current batch and queue them in the index
     int p = 0; // number of prompts processed already
     int s = 0; // number of prompts in current batch
+    auto add_batch = [&]() {
+        embeddings.resize(s * n_embd);
+        batch_decode(ctx, batch, embeddings.data(), s, n_embd);
+        common_batch_clear(batch);
+
+        for (int i = p; i < p + s; i++) {
+            common_embd_index_add(idx.get(), { chunks[i].filename, (int64_t) chunks[i].filepos, chunks[i].textdata }, embeddings.data() + (i - p) * n_embd);
+            // the index keeps its own copy of the text
+            chunks[i] = chunk();
+        }
+
+        p += s;
+        s = 0;
+    };
+
+    // break into batches
     for (int k = 0; k < n_chunks; k++) {
         // clamp to n_batch tokens
         auto & inp = chunks[k].tokens;
@@ -232,11 +269,7 @@ int main(int argc, char ** argv) {
 
         // encode if at capacity
         if (batch.n_tokens + n_toks > n_batch) {
-            float * out = emb + p * n_embd;
-            batch_decode(ctx, batch, out, s, n_embd);
-            common_batch_clear(batch);
-            p += s;
-            s = 0;
+            add_batch();
         }
 
         // add to batch
@@ -245,14 +278,22 @@ int main(int argc, char ** argv) {
     }
 
     // final batch
-    float * out = emb + p * n_embd;
-    batch_decode(ctx, batch, out, s, n_embd);
-
-    // save embeddings to chunks
-    for (int i = 0; i < n_chunks; i++) {
-        chunks[i].embedding = std::vector<float>(emb + i * n_embd, emb + (i + 1) * n_embd);
-        // clear tokens as they are no longer needed
-        chunks[i].tokens.clear();
+    if (s > 0) {
+        add_batch();
+    }
+
+    common_embd_index_build(idx.get());
+
+    if (common_embd_index_n_rows(idx.get()) == 0) {
+        LOG_ERR("%s: no chunks to search\n", __func__);
+        return 1;
+    }
+
+    if (!params.index_file.empty() && n_chunks > 0) {
+        if (!common_embd_index_save(idx.get(), params.index_file)) {
+            return 1;
+        }
+        LOG_INF("%s: saved %lld chunks to %s\n", __func__, (long long int) common_embd_index_n_rows(idx.get()), params.index_file.c_str());
     }
 
     struct llama_batch query_batch = llama_batch_init(n_batch, 0, 1);
@@ -261,7 +302,9 @@ int main(int argc, char ** argv) {
     std::string query;
     while (true) {
         LOG("Enter query: ");
-        std::getline(std::cin, query);
+        if (!std::getline(std::cin, query)) {
+            break;
+        }
         std::vector<int32_t> query_tokens = common_tokenize(ctx, query, true);
 
         batch_add_seq(query_batch, query_tokens, 0);
@@ -271,25 +314,18 @@ int main(int argc, char ** argv) {
 
         common_batch_clear(query_batch);
 
-        // compute cosine similarities
+        // the embeddings are normalized, so the dot products are the cosine similarities
         {
-            std::vector<std::pair<int, float>> similarities;
-            for (int i = 0; i < n_chunks; i++) {
-                float sim = common_embd_similarity_cos(chunks[i].embedding.data(), query_emb.data(), n_embd);
-                similarities.push_back(std::make_pair(i, sim));
-            }
-
-            // sort similarities
-            std::sort(similarities.begin(), similarities.end(), [](const std::pair<int, float> & a, const std::pair<int, float> & b) {
-                return a.second > b.second;
-            });
+            const auto results = common_embd_index_search(idx.get(), query_emb.data(), params.sampling.top_k, params.index_n_probe);
 
             LOG("Top %d similar chunks:\n", params.sampling.top_k);
-            for (int i = 0; i < std::min(params.sampling.top_k, (int) chunks.size()); i++) {
-                LOG("filename: %s\n", chunks[similarities[i].first].filename.c_str());
-                LOG("filepos: %lld\n", (long long int) chunks[similarities[i].first].filepos);
-                LOG("similarity: %f\n", similarities[i].second);
-                LOG("textdata:\n%s\n", chunks[similarities[i].first].textdata.c_str());
+            for (const auto & res : results) {
+                const auto chunk = common_embd_index_get_chunk(idx.get(), res.id);
+
+                LOG("filename: %s\n", chunk.filename.c_str());
+                LOG("filepos: %lld\n", (long long int) chunk.filepos);
+                LOG("similarity: %f\n", res.score);
+                LOG("textdata:\n%s\n", chunk.text.c_str());
                 LOG("--------------------\n");
             }
         }
@@ -299,6 +335,7 @@ int main(int argc, char ** argv) {
     llama_perf_context_print(ctx);
 
     // clean up
+    llama_batch_free(batch);
     llama_batch_free(query_batch);
     llama_backend_free();
 }
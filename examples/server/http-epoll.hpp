@@ -0,0 +1,737 @@
+#pragma once
+
+#include "httplib.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+// the body of a response that is produced after its handler has returned, e.g. the events of a streaming completion
+struct http_stream {
+    virtual ~http_stream() = default;
+
+    // set the function to call, from any thread, when more of the body may be available
+    virtual void set_notify(std::function<void()> notify) = 0;
+
+    // append the available part of the body to out without blocking, returns false once the body is complete
+    virtual bool read(std::string & out) = 0;
+
+    // the response is over: the body has been sent completely, or the client went away before
+    virtual void close(bool complete) = 0;
+};
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// httplib server that serves its connections from an epoll event loop instead of a thread per connection
+//
+// httplib::Server still accepts the connections, routes the requests and formats the responses: the loop
+// thread reads a request without blocking, a fixed pool of workers runs it through process_request() on the
+// buffered bytes, and the loop writes the response. A handler that answers with set_stream() returns as soon
+// as the headers are ready, then the loop writes the body as the stream produces it. An idle or slow
+// streaming client costs a socket and its buffers instead of a thread, and a client that does not read is
+// not sent more than max_pending bytes ahead: the rest of the body waits in the stream
+class http_epoll_server : public httplib::Server {
+public:
+    explicit http_epoll_server(int n_workers) {
+        // the accepted sockets are only handed to the loop, there is no need for a thread pool
+        new_task_queue = [] { return new inline_queue(); };
+
+        fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        fd_wake  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd_epoll < 0 || fd_wake < 0) {
+            return;
+        }
+
+        epoll_event ev = {};
+        ev.events   = EPOLLIN;
+        ev.data.u64 = 0;
+        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_wake, &ev);
+
+        thread_loop = std::thread([this] { loop(); });
+        for (int i = 0; i < n_workers; ++i) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ~http_epoll_server() override {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv_jobs.notify_all();
+        wake();
+
+        if (thread_loop.joinable()) {
+            thread_loop.join();
+        }
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        for (int fd : { fd_epoll, fd_wake }) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    bool is_valid() const override {
+        return fd_epoll >= 0 && fd_wake >= 0;
+    }
+
+    // answer the request handled by the calling thread with a chunked body that the event loop reads from stream
+    // returns false if the calling thread is not a worker of an http_epoll_server
+    static bool set_stream(httplib::Response & res, const std::string & content_type, std::shared_ptr<http_stream> stream) {
+        job * j = current_job();
+        if (j == nullptr) {
+            return false;
+        }
+
+        j->stream = std::move(stream);
+
+        // httplib writes the status line and the headers, the provider is only called if the response is sent
+        res.set_chunked_content_provider(content_type, [j](size_t, httplib::DataSink &) {
+            j->streaming = true;
+            return false;
+        });
+
+        return true;
+    }
+
+private:
+    static constexpr size_t max_pending = 64*1024; // bytes of a stream queued for a client that does not read
+    static constexpr size_t max_header  = 64*1024;
+
+    struct inline_queue : httplib::TaskQueue {
+        bool enqueue(std::function<void()> fn) override {
+            fn();
+            return true;
+        }
+        void shutdown() override {}
+    };
+
+    // a request handed to the workers
+    struct job {
+        uint64_t id_conn;
+        int      fd;
+
+        std::string request;
+        std::string remote_addr;
+        int         remote_port;
+        std::string local_addr;
+        int         local_port;
+        bool        close_connection;
+
+        std::string response;
+        bool        connection_closed = false;
+
+        std::shared_ptr<http_stream> stream;
+        bool streaming = false; // the headers of the stream were written
+    };
+
+    struct conn {
+        uint64_t id;
+        int      fd;
+
+        std::string remote_addr;
+        int         remote_port = 0;
+        std::string local_addr;
+        int         local_port  = 0;
+
+        std::string in;         // received bytes of the next requests
+        std::string out;        // bytes to send, from n_out on
+        size_t      n_out = 0;
+
+        std::shared_ptr<http_stream> stream; // the body of the response being sent
+
+        bool busy          = false; // a worker handles a request of the connection
+        bool eof           = false; // the client closed the connection
+        bool close_after   = false; // close once the pending bytes are sent
+        bool sent_continue = false;
+
+        size_t n_requests = 0;
+
+        std::chrono::steady_clock::time_point t_active;
+    };
+
+    // reads the buffered request and collects the response
+    class buffer_stream : public httplib::Stream {
+    public:
+        explicit buffer_stream(job & j) : j(j) {}
+
+        bool is_readable()   const override { return pos < j.request.size(); }
+        bool wait_readable() const override { return is_readable(); }
+        bool wait_writable() const override { return true; }
+
+        ssize_t read(char * ptr, size_t size) override {
+            const size_t n = std::min(size, j.request.size() - pos);
+            memcpy(ptr, j.request.data() + pos, n);
+            pos += n;
+            return n;
+        }
+
+        ssize_t write(const char * ptr, size_t size) override {
+            j.response.append(ptr, size);
+            return size;
+        }
+
+        void get_remote_ip_and_port(std::string & ip, int & port) const override {
+            ip   = j.remote_addr;
+            port = j.remote_port;
+        }
+
+        void get_local_ip_and_port(std::string & ip, int & port) const override {
+            ip   = j.local_addr;
+            port = j.local_port;
+        }
+
+        // used by httplib to check if the client is still connected while the request is handled
+        socket_t socket() const override { return j.fd; }
+
+        time_t duration() const override { return 0; }
+
+    private:
+        job &  j;
+        size_t pos = 0;
+    };
+
+    int fd_epoll = -1;
+    int fd_wake  = -1; // eventfd, wakes up the loop
+
+    std::thread              thread_loop;
+    std::vector<std::thread> workers;
+
+    // loop thread only
+    std::unordered_map<uint64_t, std::unique_ptr<conn>> conns;
+    uint64_t id_next = 1;
+
+    // hand-over between the loop, the workers, the acceptor and the streams
+    std::mutex              mutex;
+    std::condition_variable cv_jobs;
+    bool                    stopping = false;
+
+    std::deque<job>       jobs;
+    std::vector<job>      jobs_done;
+    std::vector<socket_t> socks_new;
+    std::vector<uint64_t> conns_ready; // connections with a stream that may have more data
+
+    static job *& current_job() {
+        static thread_local job * j = nullptr;
+        return j;
+    }
+
+    void wake() {
+        const uint64_t one = 1;
+        ssize_t res = ::write(fd_wake, &one, sizeof(one));
+        (void) res;
+    }
+
+    // called by the accept loop of httplib::Server, the connection is closed by the event loop
+    bool process_and_close_socket(socket_t sock) override {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            socks_new.push_back(sock);
+        }
+        wake();
+        return true;
+    }
+
+    //
+    // workers
+    //
+
+    void work() {
+        while (true) {
+            job j;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_jobs.wait(lock, [&] { return stopping || !jobs.empty(); });
+                if (stopping) {
+                    return;
+                }
+                j = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            buffer_stream strm(j);
+
+            current_job() = &j;
+            process_request(strm, j.remote_addr, j.remote_port, j.local_addr, j.local_port, j.close_connection, j.connection_closed,
+                [](httplib::Request & req) {
+                    // the loop has already asked for the body
+                    req.headers.erase("Expect");
+                });
+            current_job() = nullptr;
+
+            if (j.response.empty()) {
+                j.connection_closed = true;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobs_done.push_back(std::move(j));
+            }
+            wake();
+        }
+    }
+
+    //
+    // event loop
+    //
+
+    void loop() {
+        std::vector<epoll_event> events(256);
+
+        auto t_check = std::chrono::steady_clock::now();
+
+        while (true) {
+            const int n = epoll_wait(fd_epoll, events.data(), events.size(), 1000);
+
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.u64 == 0) {
+                    uint64_t val;
+                    ssize_t res = ::read(fd_wake, &val, sizeof(val));
+                    (void) res;
+                    continue;
+                }
+
+                auto it = conns.find(events[i].data.u64);
+                if (it != conns.end()) {
+                    on_event(*it->second, events[i].events);
+                }
+            }
+
+            std::vector<socket_t> socks;
+            std::vector<job>      done;
+            std::vector<uint64_t> ready;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (stopping) {
+                    break;
+                }
+                socks.swap(socks_new);
+                done .swap(jobs_done);
+                ready.swap(conns_ready);
+            }
+
+            for (socket_t sock : socks) {
+                on_accept(sock);
+            }
+            for (job & j : done) {
+                on_job_done(j);
+            }
+            for (uint64_t id : ready) {
+                auto it = conns.find(id);
+                if (it != conns.end() && it->second->stream) {
+                    progress(*it->second);
+                }
+            }
+
+            const auto now = std::chrono::steady_clock::now();
+            if (now - t_check >= std::chrono::seconds(1)) {
+                t_check = now;
+                check_timeouts(now);
+            }
+        }
+
+        std::vector<uint64_t> ids;
+        for (const auto & it : conns) {
+            ids.push_back(it.first);
+        }
+        for (uint64_t id : ids) {
+            close_conn(*conns.at(id));
+        }
+    }
+
+    void on_accept(socket_t sock) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+        auto c = std::make_unique<conn>();
+        c->id = id_next++;
+        c->fd = sock;
+        c->t_active = std::chrono::steady_clock::now();
+        httplib::detail::get_remote_ip_and_port(sock, c->remote_addr, c->remote_port);
+        httplib::detail::get_local_ip_and_port (sock, c->local_addr,  c->local_port);
+
+        // edge-triggered: the socket is read and written until it would block
+        epoll_event ev = {};
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = c->id;
+        if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, sock, &ev) != 0) {
+            httplib::detail::close_socket(sock);
+            return;
+        }
+
+        conns[c->id] = std::move(c);
+    }
+
+    void on_event(conn & c, uint32_t events) {
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            receive(c);
+        }
+        if (events & (EPOLLHUP | EPOLLERR)) {
+            c.eof = true;
+        }
+
+        if (c.eof) {
+            // the connection is closed when the worker is done with its request
+            if (!c.busy) {
+                close_conn(c);
+            }
+            return;
+        }
+
+        progress(c);
+    }
+
+    void on_job_done(job & j) {
+        auto it = conns.find(j.id_conn);
+        if (it == conns.end()) {
+            if (j.stream) {
+                j.stream->close(false);
+            }
+            return;
+        }
+
+        conn & c = *it->second;
+
+        c.busy = false;
+        c.n_requests++;
+        c.t_active = std::chrono::steady_clock::now();
+        c.out += j.response;
+
+        if (j.close_connection || j.connection_closed) {
+            c.close_after = true;
+        }
+
+        if (j.stream) {
+            if (j.streaming) {
+                c.stream = std::move(j.stream);
+
+                const uint64_t id = c.id;
+                c.stream->set_notify([this, id] {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        conns_ready.push_back(id);
+                    }
+                    wake();
+                });
+            } else {
+                // the handler failed after it started the stream, or this is a HEAD request
+                j.stream->close(false);
+            }
+        }
+
+        if (c.eof) {
+            close_conn(c);
+            return;
+        }
+
+        progress(c);
+    }
+
+    // queue the available body of the stream, send, and start the next request once the response is over
+    void progress(conn & c) {
+        if (c.stream) {
+            pump(c);
+        }
+        if (flush(c)) {
+            next_request(c);
+        }
+    }
+
+    // read what the client sent, until the socket would block
+    void receive(conn & c) {
+        char buf[16*1024];
+        while (true) {
+            const ssize_t n = ::recv(c.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                c.in.append(buf, n);
+                c.t_active = std::chrono::steady_clock::now();
+                continue;
+            }
+            if (n == 0) {
+                c.eof = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                c.eof = true;
+            }
+            break;
+        }
+    }
+
+    // send the pending bytes until the socket would block, returns false if the connection was closed
+    bool flush(conn & c) {
+        while (c.n_out < c.out.size()) {
+            const ssize_t n = ::send(c.fd, c.out.data() + c.n_out, c.out.size() - c.n_out, MSG_NOSIGNAL);
+            if (n > 0) {
+                c.n_out += n;
+                c.t_active = std::chrono::steady_clock::now();
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // wait for EPOLLOUT
+                if (c.n_out >= max_pending) {
+                    c.out.erase(0, c.n_out);
+                    c.n_out = 0;
+                }
+                return true;
+            }
+            close_conn(c);
+            return false;
+        }
+
+        c.out.clear();
+        c.n_out = 0;
+
+        if (c.close_after && !c.busy && !c.stream) {
+            close_conn(c);
+            return false;
+        }
+
+        return true;
+    }
+
+    // move the available body of the stream to the pending bytes as chunks, as long as the client keeps up
+    void pump(conn & c) {
+        std::string body;
+        while (c.stream && c.out.size() - c.n_out < max_pending) {
+            body.clear();
+            const bool more = c.stream->read(body);
+
+            if (!body.empty()) {
+                char hex[32];
+                snprintf(hex, sizeof(hex), "%zx\r\n", body.size());
+                c.out += hex;
+                c.out += body;
+                c.out += "\r\n";
+            }
+
+            if (!more) {
+                c.out += "0\r\n\r\n";
+                c.stream->close(true);
+                c.stream.reset();
+                return;
+            }
+
+            if (body.empty()) {
+                return;
+            }
+        }
+    }
+
+    // hand the next buffered request to the workers
+    void next_request(conn & c) {
+        if (c.busy || c.stream || c.close_after || c.eof || c.in.empty()) {
+            return;
+        }
+
+        bool expect_continue = false;
+        bool too_large       = false;
+        const size_t n = request_size(c.in, payload_max_length_, expect_continue, too_large);
+        if (too_large) {
+            // like httplib, answer 413 without reading the body and close the connection
+            c.in.clear();
+            c.out += "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            c.close_after = true;
+            flush(c);
+            return;
+        }
+        if (n == std::string::npos) {
+            close_conn(c);
+            return;
+        }
+        if (n == 0) {
+            if (expect_continue && !c.sent_continue) {
+                c.sent_continue = true;
+                c.out += "HTTP/1.1 100 Continue\r\n\r\n";
+                flush(c);
+            }
+            return;
+        }
+
+        job j;
+        j.id_conn          = c.id;
+        j.fd               = c.fd;
+        j.request          = c.in.substr(0, n);
+        j.remote_addr      = c.remote_addr;
+        j.remote_port      = c.remote_port;
+        j.local_addr       = c.local_addr;
+        j.local_port       = c.local_port;
+        j.close_connection = c.n_requests + 1 >= keep_alive_max_count_ || svr_sock_ == INVALID_SOCKET;
+
+        c.in.erase(0, n);
+        c.busy          = true;
+        c.sent_continue = false;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobs.push_back(std::move(j));
+        }
+        cv_jobs.notify_one();
+    }
+
+    void close_conn(conn & c) {
+        if (c.stream) {
+            c.stream->close(false);
+            c.stream.reset();
+        }
+
+        if (c.busy) {
+            // the worker still uses the socket, close it when the request is done
+            c.eof = true;
+            return;
+        }
+
+        epoll_ctl(fd_epoll, EPOLL_CTL_DEL, c.fd, nullptr);
+        httplib::detail::shutdown_socket(c.fd);
+        httplib::detail::close_socket(c.fd);
+
+        conns.erase(c.id);
+    }
+
+    void check_timeouts(std::chrono::steady_clock::time_point now) {
+        std::vector<uint64_t> expired;
+        for (const auto & it : conns) {
+            const conn & c = *it.second;
+            if (c.busy) {
+                continue;
+            }
+
+            const auto t_idle = std::chrono::duration_cast<std::chrono::seconds>(now - c.t_active).count();
+
+            if (c.n_out < c.out.size()) {
+                // the client does not read the response
+                if (t_idle >= write_timeout_sec_) {
+                    expired.push_back(c.id);
+                }
+            } else if (c.stream) {
+                // waiting for the body
+            } else if (c.in.empty()) {
+                if (t_idle >= keep_alive_timeout_sec_) {
+                    expired.push_back(c.id);
+                }
+            } else if (t_idle >= read_timeout_sec_) {
+                expired.push_back(c.id);
+            }
+        }
+
+        for (uint64_t id : expired) {
+            close_conn(*conns.at(id));
+        }
+    }
+
+    // size of the complete request at the start of buf, 0 if more bytes are needed and npos if it is malformed
+    // the body is delimited by Content-Length or by the chunked transfer coding, too_large is set if it is longer than
+    // max_body
+    static size_t request_size(const std::string & buf, size_t max_body, bool & expect_continue, bool & too_large) {
+        expect_continue = false;
+        too_large       = false;
+
+        const size_t end = buf.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            return buf.size() > max_header ? std::string::npos : 0;
+        }
+
+        const size_t n_head = end + 4;
+
+        size_t n_body  = 0;
+        bool   chunked = false;
+
+        for (size_t pos = buf.find("\r\n") + 2; pos < end; ) {
+            const size_t eol = buf.find("\r\n", pos);
+            const size_t sep = buf.find(':', pos);
+            if (sep < eol) {
+                const std::string key = buf.substr(pos, sep - pos);
+
+                size_t val = sep + 1;
+                while (val < eol && (buf[val] == ' ' || buf[val] == '\t')) {
+                    val++;
+                }
+                const std::string value = buf.substr(val, eol - val);
+
+                if (httplib::detail::case_ignore::equal(key, "Content-Length")) {
+                    errno  = 0;
+                    n_body = std::strtoull(value.c_str(), nullptr, 10);
+                    if (errno == ERANGE || n_body > max_body) {
+                        too_large = true;
+                        return std::string::npos;
+                    }
+                } else if (httplib::detail::case_ignore::equal(key, "Transfer-Encoding")) {
+                    chunked = httplib::detail::case_ignore::equal(value, "chunked");
+                } else if (httplib::detail::case_ignore::equal(key, "Expect")) {
+                    expect_continue = httplib::detail::case_ignore::equal(value, "100-continue");
+                }
+            }
+            pos = eol + 2;
+        }
+
+        if (!chunked) {
+            return buf.size() - n_head < n_body ? 0 : n_head + n_body;
+        }
+
+        // the chunks, then the trailer that ends with an empty line
+        size_t pos = n_head;
+        n_body = 0;
+        while (true) {
+            size_t eol = buf.find("\r\n", pos);
+            if (eol == std::string::npos) {
+                return 0;
+            }
+
+            // the size of the chunk is checked before it is added to anything
+            errno = 0;
+            const size_t n_chunk = std::strtoull(buf.c_str() + pos, nullptr, 16);
+            if (errno == ERANGE || n_chunk > max_body - n_body) {
+                too_large = true;
+                return std::string::npos;
+            }
+            n_body += n_chunk;
+            pos = eol + 2;
+
+            if (n_chunk == 0) {
+                while (true) {
+                    eol = buf.find("\r\n", pos);
+                    if (eol == std::string::npos) {
+                        return 0;
+                    }
+                    if (eol == pos) {
+                        return pos + 2;
+                    }
+                    pos = eol + 2;
+                }
+            }
+
+            // the chunk and its CRLF
+            if (buf.size() - pos < 2 || n_chunk > buf.size() - pos - 2) {
+                return 0;
+            }
+            pos += n_chunk + 2;
+        }
+    }
+};
+
+#endif // __linux__
@@ -1,4 +1,5 @@
 #include "utils.hpp"
+#include "http-epoll.hpp"
 
 #include "arg.h"
 #include "common.h"
@@ -23,9 +24,12 @@
 #include <condition_variable>
 #include <cstddef>
 #include <cinttypes>
+#include <cstdio>
 #include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <signal.h>
 #include <thread>
 #include <unordered_map>
@@ -101,6 +105,8 @@ struct slot_params {
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
 
+    int32_t priority = 0; // scheduling priority of the request, higher first
+
     std::vector<common_adapter_lora_info> lora;
 
     std::vector<std::string> antiprompt;
@@ -165,6 +171,7 @@ struct slot_params {
             {"max_tokens",                n_predict}, // User configured n_predict
             {"n_keep",                    n_keep},
             {"n_discard",                 n_discard},
+            {"priority",                  priority},
             {"ignore_eos",                sampling.ignore_eos},
             {"stream",                    stream},
             {"logit_bias",                format_logit_bias(sampling.logit_bias)},
@@ -243,6 +250,7 @@ struct server_task {
         params.n_discard        = json_value(data, "n_discard",          defaults.n_discard);
       //params.t_max_prompt_ms  = json_value(data, "t_max_prompt_ms",    defaults.t_max_prompt_ms); // TODO: implement
         params.t_max_predict_ms = json_value(data, "t_max_predict_ms",   defaults.t_max_predict_ms);
+        params.priority         = json_value(data, "priority",           defaults.priority);
         params.response_fields  = json_value(data, "response_fields",   std::vector<std::string>());
 
         params.sampling.top_k              = json_value(data, "top_k",              defaults.sampling.top_k);
@@ -1241,13 +1249,14 @@ struct server_slot {
     // only used for completion/embedding/infill/rerank
     server_task_type task_type = SERVER_TASK_TYPE_COMPLETION;
 
-    llama_batch batch_spec = {};
-
     llama_context * ctx = nullptr;
-    llama_context * ctx_dft = nullptr;
+    llama_context * ctx_dft = nullptr; // shared by all slots, each slot uses its own sequence
 
     common_speculative * spec = nullptr;
 
+    // the draft tokens evaluated together with the sampled token in the current batch
+    llama_tokens drafted;
+
     std::vector<common_adapter_lora_info> lora;
 
     // the index relative to completion multi-task request
@@ -1282,6 +1291,9 @@ struct server_slot {
 
     llama_tokens cache_tokens;
 
+    // the KV tier entry that is read back from disk before the prompt of this slot is processed (-1 - none)
+    int32_t id_kv_tier = -1;
+
     std::vector<completion_token_output> generated_token_probs;
 
     bool has_next_token = true;
@@ -1328,6 +1340,7 @@ struct server_slot {
         n_past             = 0;
         n_sent_text        = 0;
         task_type          = SERVER_TASK_TYPE_COMPLETION;
+        id_kv_tier         = -1;
 
         generated_tokens.clear();
         generated_token_probs.clear();
@@ -1342,8 +1355,7 @@ struct server_slot {
     }
 
     bool can_batch_with(server_slot & other_slot) const {
-        return is_non_causal() == other_slot.is_non_causal()
-            && are_lora_equal(lora, other_slot.lora);
+        return is_non_causal() == other_slot.is_non_causal();
     }
 
     bool has_budget(const common_params & global_params) {
@@ -1540,339 +1552,1097 @@ struct server_metrics {
     }
 };
 
-struct server_queue {
-    int id = 0;
-    bool running;
+// server-wide cache of prompt prefixes
+// prompts that are evicted from a slot are kept in the KV cache under a spare sequence id and indexed
+// by a radix tree over their tokens, so that any slot can copy the longest matching prefix
+// the entries are dropped in LRU order when their total size exceeds the budget or when the KV cache is full
+struct server_prefix_cache {
+    struct entry {
+        llama_seq_id seq_id = -1;
+        llama_tokens tokens;
 
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+        std::vector<common_adapter_lora_info> lora;
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+        int64_t t_last_used = 0;
+    };
 
-    // callback functions
-    std::function<void(server_task &&)> callback_new_task;
-    std::function<void(void)>           callback_update_slots;
+    // the entries that pass through a node hold the KV of the whole prefix up to the end of its edge
+    struct node {
+        llama_tokens edge;
 
-    // Add a new task to the end of the queue
-    int post(server_task && task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        GGML_ASSERT(task.id != -1);
-        // if this is cancel task make sure to clean up pending tasks
-        if (task.type == SERVER_TASK_TYPE_CANCEL) {
-            cleanup_pending_task(task.id_target);
-        }
-        const int task_id = task.id;
-        QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
-        }
-        condition_tasks.notify_one();
-        return task_id;
-    }
+        std::map<llama_token, std::unique_ptr<node>> children;
+        std::set<int32_t> ids;
+    };
 
-    // multi-task version of post()
-    int post(std::vector<server_task> && tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
-            }
-            // if this is cancel task make sure to clean up pending tasks
-            if (task.type == SERVER_TASK_TYPE_CANCEL) {
-                cleanup_pending_task(task.id_target);
-            }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
-            }
-        }
-        condition_tasks.notify_one();
-        return 0;
-    }
+    int32_t n_budget = 0; // max number of tokens held by the entries, 0 - disabled
+    int32_t n_tokens = 0; // number of tokens currently held by the entries
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task && task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
-    }
+    llama_seq_id seq_id_base = 0; // the sequence ids of the entries start after the slots
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
-    }
+    std::map<int32_t, entry> entries;
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task &&)> callback) {
-        callback_new_task = std::move(callback);
-    }
+    node root;
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
-    }
+    int32_t id_next = 0;
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
-        }
-        condition_tasks.notify_one();
-    }
+    std::vector<llama_seq_id> seq_ids_free;
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
+    // called with the entries that are dropped, while their KV is still in the cache
+    std::function<void(const entry &)> on_evict;
+
+    void init(int32_t n_budget, llama_seq_id seq_id_base) {
+        this->n_budget    = n_budget;
+        this->seq_id_base = seq_id_base;
     }
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
+    bool enabled() const {
+        return n_budget > 0;
+    }
 
-        while (true) {
-            QUE_DBG("%s", "processing new tasks\n");
+    // length of the longest prefix of tokens held by an entry with matching lora (nullptr - any lora)
+    size_t find(const llama_tokens & tokens, const std::vector<common_adapter_lora_info> * lora, int32_t & id_found) const {
+        size_t n_best = 0;
+        id_found = -1;
 
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    lock.unlock();
-                    break;
-                }
-                server_task task = std::move(queue_tasks.front());
-                queue_tasks.pop_front();
-                lock.unlock();
+        const node * cur = &root;
+        size_t n_cur = 0;
 
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(std::move(task));
+        while (n_cur < tokens.size()) {
+            auto it = cur->children.find(tokens[n_cur]);
+            if (it == cur->children.end()) {
+                break;
             }
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
+            const node * child = it->second.get();
 
-            callback_update_slots();
+            size_t n_match = 0;
+            while (n_match < child->edge.size() && n_cur + n_match < tokens.size() && child->edge[n_match] == tokens[n_cur + n_match]) {
+                n_match++;
+            }
 
-            QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
+            for (const int32_t id : child->ids) {
+                if (lora == nullptr || are_lora_equal(entries.at(id).lora, *lora)) {
+                    n_best   = n_cur + n_match;
+                    id_found = id;
+                    break;
                 }
             }
+
+            if (n_match < child->edge.size()) {
+                break;
+            }
+
+            cur    = child;
+            n_cur += n_match;
         }
-    }
 
-private:
-    void cleanup_pending_task(int id_target) {
-        // no need lock because this is called exclusively by post()
-        auto rm_func = [id_target](const server_task & task) {
-            return task.id_target == id_target;
-        };
-        queue_tasks.erase(
-            std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
-            queue_tasks.end());
-        queue_tasks_deferred.erase(
-            std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
-            queue_tasks_deferred.end());
+        return n_best;
     }
-};
 
-struct server_response {
-    bool running = true;
+    // keep the KV of seq_id_src for the given tokens in a new entry, returns false if the tokens are not kept
+    bool store(llama_context * ctx, llama_seq_id seq_id_src, const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora) {
+        if (tokens.empty() || (int32_t) tokens.size() > n_budget) {
+            return false;
+        }
 
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+        int32_t id_found = -1;
+        if (find(tokens, &lora, id_found) == tokens.size()) {
+            // already covered by an entry
+            entries.at(id_found).t_last_used = ggml_time_us();
+            return true;
+        }
 
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+        while (n_tokens + (int32_t) tokens.size() > n_budget) {
+            evict(ctx);
+        }
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+        entry ent;
+        if (seq_ids_free.empty()) {
+            ent.seq_id = seq_id_base + (llama_seq_id) entries.size();
+        } else {
+            ent.seq_id = seq_ids_free.back();
+            seq_ids_free.pop_back();
+        }
+        ent.tokens      = tokens;
+        ent.lora        = lora;
+        ent.t_last_used = ggml_time_us();
 
-    // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+        llama_kv_self_seq_rm(ctx, ent.seq_id, -1, -1);
+        llama_kv_self_seq_cp(ctx, seq_id_src, ent.seq_id, 0, tokens.size());
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
-    }
+        const int32_t id = id_next++;
 
-    void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        tree_insert(id, tokens);
 
-        for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
-        }
-    }
+        n_tokens += tokens.size();
+        entries[id] = std::move(ent);
 
-    // when the request is finished, we can remove task associated with it
-    void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        SRV_DBG("prefix cache: stored entry %d, seq_id = %d, n_tokens = %zu, total = %d\n", id, entries[id].seq_id, tokens.size(), n_tokens);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
-        // make sure to clean up all pending results
-        queue_results.erase(
-            std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
-                return res->id == id_task;
-            }),
-            queue_results.end());
+        return true;
     }
 
-    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+    // copy the first n tokens of an entry to a sequence
+    void load(llama_context * ctx, int32_t id, llama_seq_id seq_id_dst, size_t n) {
+        entry & ent = entries.at(id);
 
-        for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
-        }
+        llama_kv_self_seq_cp(ctx, ent.seq_id, seq_id_dst, 0, n);
+
+        ent.t_last_used = ggml_time_us();
     }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                if (!running) {
-                    SRV_DBG("%s : queue result stop\n", __func__);
-                    std::terminate(); // we cannot return here since the caller is HTTP code
-                }
-                return !queue_results.empty();
-            });
+    // drop the least recently used entry, returns false if there are no entries
+    bool evict(llama_context * ctx) {
+        if (entries.empty()) {
+            return false;
+        }
 
-            for (size_t i = 0; i < queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+        auto it_lru = entries.begin();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->second.t_last_used < it_lru->second.t_last_used) {
+                it_lru = it;
             }
         }
 
-        // should never reach here
-    }
+        SRV_DBG("prefix cache: evicting entry %d, seq_id = %d, n_tokens = %zu\n", it_lru->first, it_lru->second.seq_id, it_lru->second.tokens.size());
 
-    // same as recv(), but have timeout in seconds
-    // if timeout is reached, nullptr is returned
-    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
+        if (on_evict) {
+            on_evict(it_lru->second);
+        }
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        llama_kv_self_seq_rm(ctx, it_lru->second.seq_id, -1, -1);
 
-            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
-            if (!running) {
-                SRV_DBG("%s : queue result stop\n", __func__);
-                std::terminate(); // we cannot return here since the caller is HTTP code
-            }
-            if (cr_res == std::cv_status::timeout) {
-                return nullptr;
-            }
-        }
+        tree_erase(it_lru->first, it_lru->second.tokens);
+
+        n_tokens -= it_lru->second.tokens.size();
+        seq_ids_free.push_back(it_lru->second.seq_id);
+        entries.erase(it_lru);
 
-        // should never reach here
+        return true;
     }
 
-    // single-task version of recv()
-    server_task_result_ptr recv(int id_task) {
-        std::unordered_set<int> id_tasks = {id_task};
-        return recv(id_tasks);
+    // forget all entries - the KV cache is expected to be cleared by the caller
+    void clear() {
+        entries.clear();
+        seq_ids_free.clear();
+        root.children.clear();
+        n_tokens = 0;
     }
 
-    // Send a new result to a waiting id_task
-    void send(server_task_result_ptr && result) {
-        SRV_DBG("sending result for task id = %d\n", result->id);
+private:
+    void tree_insert(int32_t id, const llama_tokens & tokens) {
+        node * cur = &root;
+        size_t n_cur = 0;
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result->id == id_task) {
-                SRV_DBG("task id = %d pushed to result queue\n", result->id);
+        while (n_cur < tokens.size()) {
+            auto & child = cur->children[tokens[n_cur]];
 
-                queue_results.emplace_back(std::move(result));
-                condition_results.notify_all();
+            if (!child) {
+                child = std::make_unique<node>();
+                child->edge.assign(tokens.begin() + n_cur, tokens.end());
+                child->ids.insert(id);
                 return;
             }
+
+            size_t n_match = 0;
+            while (n_match < child->edge.size() && n_cur + n_match < tokens.size() && child->edge[n_match] == tokens[n_cur + n_match]) {
+                n_match++;
+            }
+
+            if (n_match < child->edge.size()) {
+                // split the edge - the new node keeps the entries of the old one
+                auto mid = std::make_unique<node>();
+                mid->edge.assign(child->edge.begin(), child->edge.begin() + n_match);
+                mid->ids = child->ids;
+
+                child->edge.erase(child->edge.begin(), child->edge.begin() + n_match);
+
+                const llama_token tok = child->edge[0];
+                mid->children[tok] = std::move(child);
+                child = std::move(mid);
+            }
+
+            child->ids.insert(id);
+
+            cur    = child.get();
+            n_cur += n_match;
         }
     }
 
-    // terminate the waiting loop
-    void terminate() {
-        running = false;
-        condition_results.notify_all();
+    void tree_erase(int32_t id, const llama_tokens & tokens) {
+        node * cur = &root;
+        size_t n_cur = 0;
+
+        while (n_cur < tokens.size()) {
+            auto it = cur->children.find(tokens[n_cur]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            node * child = it->second.get();
+            child->ids.erase(id);
+
+            if (child->ids.empty()) {
+                // no other entry passes through this node
+                cur->children.erase(it);
+                break;
+            }
+
+            cur    = child;
+            n_cur += child->edge.size();
+        }
     }
 };
 
-struct server_context {
-    common_params params_base;
+// host memory and disk tiers below the KV cache
+// the KV of the prompts that are dropped from the slots or from the prefix cache is copied to a pool in host memory
+// the least recently used entries of the pool are written to files and the oldest files are deleted when the disk budget
+// is exceeded. the files are written and read by a background thread - a slot whose prompt matches an entry on disk waits
+// for the entry to be read back while the other slots keep decoding
+struct server_kv_tiers {
+    enum entry_state {
+        KV_TIER_HOST,    // the data is in host memory
+        KV_TIER_WRITING, // the data is in host memory and is being written to disk
+        KV_TIER_DISK,    // the data is only on disk
+        KV_TIER_READING, // the data is being read from disk
+    };
 
-    // note: keep these alive - they determine the lifetime of the model, context, etc.
-    common_init_result llama_init;
-    common_init_result llama_init_dft;
+    struct entry {
+        llama_tokens tokens;
 
-    llama_model * model = nullptr;
-    llama_context * ctx = nullptr;
+        std::vector<common_adapter_lora_info> lora;
 
-    const llama_vocab * vocab = nullptr;
+        entry_state state = KV_TIER_HOST;
 
-    llama_model * model_dft = nullptr;
+        std::vector<uint8_t> data; // the state of the sequence, from llama_state_seq_get_data()
+        size_t n_bytes = 0;
 
-    llama_context_params cparams_dft;
+        int64_t t_last_used = 0;
 
-    llama_batch batch = {};
+        bool pinned = false; // being restored to a slot, never dropped or moved to disk
+    };
 
-    bool clean_kv_cache = true;
-    bool add_bos_token  = true;
-    bool has_eos_token  = false;
+    // a file operation of the I/O thread, the data of the entry is not touched by the main thread until it is done
+    struct io_job {
+        int32_t id    = -1;
+        bool    write = false;
 
-    int32_t n_ctx; // total context for all clients / slots
+        uint8_t * data    = nullptr;
+        size_t    n_bytes = 0;
 
-    // slots / clients
-    std::vector<server_slot> slots;
-    json default_generation_settings_for_props;
+        std::string fname;
 
-    server_queue    queue_tasks;
+        bool ok = false;
+    };
+
+    size_t host_budget = 0; // max number of bytes of the entries in host memory, 0 - disabled
+    size_t disk_budget = 0; // max number of bytes of the entries on disk, 0 - no disk tier
+
+    size_t host_size = 0; // number of bytes of the entries in host memory, not counting the entries being written
+    size_t disk_size = 0; // number of bytes of the entries on disk, including the entries being written or read
+
+    std::string path; // directory of the files, ends with a separator
+
+    std::map<int32_t, entry> entries;
+
+    int32_t id_next = 0;
+
+    // called by the I/O thread after each job
+    std::function<void()> on_io_done;
+
+    std::thread             io_thread;
+    std::mutex              io_mutex;
+    std::condition_variable io_cv;
+    std::deque<io_job>      io_jobs;
+    std::vector<io_job>     io_jobs_done;
+    bool                    io_running = false;
+
+    ~server_kv_tiers() {
+        if (io_thread.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(io_mutex);
+                io_running = false;
+            }
+            io_cv.notify_one();
+            io_thread.join();
+        }
+
+        for (const auto & it : entries) {
+            if (it.second.state != KV_TIER_HOST) {
+                std::remove(fname(it.first).c_str());
+            }
+        }
+    }
+
+    void init(size_t host_budget, size_t disk_budget, const std::string & path) {
+        this->host_budget = host_budget;
+        this->disk_budget = path.empty() ? 0 : disk_budget;
+        this->path        = path;
+
+        if (this->disk_budget > 0) {
+            io_running = true;
+            io_thread  = std::thread(&server_kv_tiers::io_loop, this);
+        }
+    }
+
+    bool enabled() const {
+        return host_budget > 0;
+    }
+
+    // length of the longest prefix of tokens held by an entry with matching lora
+    // an entry is always restored as a whole, so the entries that would be mostly discarded are skipped
+    size_t find(const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora, int32_t & id_found) const {
+        size_t n_best = 0;
+        id_found = -1;
+
+        for (const auto & it : entries) {
+            const size_t n_match = common_lcp(it.second.tokens, tokens);
+
+            if (n_match > n_best && 4*n_match >= it.second.tokens.size() && are_lora_equal(it.second.lora, lora)) {
+                n_best   = n_match;
+                id_found = it.first;
+            }
+        }
+
+        return n_best;
+    }
+
+    // copy the KV of seq_id for the given tokens to a new entry in host memory
+    void store(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora) {
+        if (!enabled() || tokens.empty()) {
+            return;
+        }
+
+        for (auto it = entries.begin(); it != entries.end();) {
+            entry & ent = it->second;
+
+            if (!are_lora_equal(ent.lora, lora) || common_lcp(ent.tokens, tokens) < std::min(ent.tokens.size(), tokens.size())) {
+                ++it;
+                continue;
+            }
+
+            if (ent.tokens.size() >= tokens.size()) {
+                // already covered by an entry
+                ent.t_last_used = ggml_time_us();
+                return;
+            }
+
+            // the new entry covers this one
+            if (!ent.pinned && (ent.state == KV_TIER_HOST || ent.state == KV_TIER_DISK)) {
+                it = drop(it);
+            } else {
+                ++it;
+            }
+        }
+
+        const size_t n_bytes = llama_state_seq_get_size(ctx, seq_id);
+        if (n_bytes == 0 || n_bytes > host_budget) {
+            return;
+        }
+
+        while (host_size + n_bytes > host_budget) {
+            if (!spill()) {
+                SRV_DBG("kv tiers: no room for seq_id = %d, n_tokens = %zu\n", seq_id, tokens.size());
+                return;
+            }
+        }
+
+        entry ent;
+        ent.tokens = tokens;
+        ent.lora   = lora;
+        ent.data.resize(n_bytes);
+
+        ent.n_bytes = llama_state_seq_get_data(ctx, ent.data.data(), n_bytes, seq_id);
+        if (ent.n_bytes != n_bytes) {
+            SRV_WRN("kv tiers: failed to copy the state of seq_id = %d\n", seq_id);
+            return;
+        }
+
+        ent.t_last_used = ggml_time_us();
+
+        const int32_t id = id_next++;
+
+        host_size += n_bytes;
+
+        SRV_DBG("kv tiers: stored entry %d, n_tokens = %zu, size = %.2f MiB, host = %.2f MiB\n", id, tokens.size(), n_bytes/1024.0/1024.0, host_size/1024.0/1024.0);
+
+        entries[id] = std::move(ent);
+    }
+
+    // returns true if the data of the entry is in host memory, otherwise starts reading it back from disk
+    bool fetch(int32_t id) {
+        entry & ent = entries.at(id);
+
+        ent.t_last_used = ggml_time_us();
+
+        if (ent.state == KV_TIER_DISK) {
+            SRV_DBG("kv tiers: reading entry %d from disk, n_tokens = %zu\n", id, ent.tokens.size());
+
+            ent.state = KV_TIER_READING;
+            ent.data.resize(ent.n_bytes);
+
+            submit({ id, false, ent.data.data(), ent.n_bytes, fname(id) });
+        }
+
+        return ent.state == KV_TIER_HOST || ent.state == KV_TIER_WRITING;
+    }
+
+    // the entries stored while an entry is pinned cannot take its place
+    void pin(int32_t id, bool pinned) {
+        entries.at(id).pinned = pinned;
+    }
+
+    bool is_reading(int32_t id) const {
+        const auto it = entries.find(id);
+
+        return it != entries.end() && it->second.state == KV_TIER_READING;
+    }
+
+    // copy the first n tokens of an entry in host memory to a sequence
+    // returns false if there is no room for the cells of the entry in the KV cache
+    bool load(llama_context * ctx, int32_t id, llama_seq_id seq_id_dst, size_t n) {
+        entry & ent = entries.at(id);
+
+        if (llama_state_seq_set_data(ctx, ent.data.data(), ent.n_bytes, seq_id_dst) != ent.n_bytes) {
+            return false;
+        }
+
+        llama_kv_self_seq_rm(ctx, seq_id_dst, n, -1);
+
+        ent.t_last_used = ggml_time_us();
+
+        return true;
+    }
+
+    // apply the results of the jobs done by the I/O thread
+    void poll() {
+        std::vector<io_job> done;
+        {
+            std::unique_lock<std::mutex> lock(io_mutex);
+            done.swap(io_jobs_done);
+        }
+
+        for (const io_job & job : done) {
+            // the entries with pending jobs are never dropped
+            auto it = entries.find(job.id);
+            entry & ent = it->second;
+
+            if (!job.ok) {
+                SRV_WRN("kv tiers: failed to %s file '%s' - dropping entry %d\n", job.write ? "write" : "read", job.fname.c_str(), job.id);
+
+                std::remove(job.fname.c_str());
+
+                disk_size -= ent.n_bytes;
+                entries.erase(it);
+                continue;
+            }
+
+            if (job.write) {
+                ent.state = KV_TIER_DISK;
+                ent.data.clear();
+                ent.data.shrink_to_fit();
+            } else {
+                std::remove(job.fname.c_str());
+
+                ent.state       = KV_TIER_HOST;
+                ent.t_last_used = ggml_time_us();
+
+                disk_size -= ent.n_bytes;
+                host_size += ent.n_bytes;
+
+                while (host_size > host_budget) {
+                    if (!spill()) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    std::string fname(int32_t id) const {
+        return path + "kv-tier-" + std::to_string(id) + ".bin";
+    }
+
+    std::map<int32_t, entry>::iterator lru(entry_state state) {
+        auto it_lru = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->second.state == state && !it->second.pinned && (it_lru == entries.end() || it->second.t_last_used < it_lru->second.t_last_used)) {
+                it_lru = it;
+            }
+        }
+
+        return it_lru;
+    }
+
+    // forget an entry in host memory or on disk
+    std::map<int32_t, entry>::iterator drop(std::map<int32_t, entry>::iterator it) {
+        if (it->second.state == KV_TIER_HOST) {
+            host_size -= it->second.n_bytes;
+        } else {
+            std::remove(fname(it->first).c_str());
+            disk_size -= it->second.n_bytes;
+        }
+
+        return entries.erase(it);
+    }
+
+    // move the least recently used entry in host memory to disk, or drop it if it does not fit there
+    // returns false if all the entries in host memory are pinned
+    bool spill() {
+        auto it = lru(KV_TIER_HOST);
+        if (it == entries.end()) {
+            return false;
+        }
+
+        entry & ent = it->second;
+
+        while (ent.n_bytes <= disk_budget && disk_size + ent.n_bytes > disk_budget) {
+            auto it_disk = lru(KV_TIER_DISK);
+            if (it_disk == entries.end()) {
+                // the files being written or read cannot be deleted
+                break;
+            }
+            drop(it_disk);
+        }
+
+        if (disk_size + ent.n_bytes > disk_budget) {
+            SRV_DBG("kv tiers: dropping entry %d, n_tokens = %zu\n", it->first, ent.tokens.size());
+
+            drop(it);
+            return true;
+        }
+
+        SRV_DBG("kv tiers: writing entry %d to disk, n_tokens = %zu\n", it->first, ent.tokens.size());
+
+        host_size -= ent.n_bytes;
+        disk_size += ent.n_bytes;
+
+        ent.state = KV_TIER_WRITING;
+
+        submit({ it->first, true, ent.data.data(), ent.n_bytes, fname(it->first) });
+
+        return true;
+    }
+
+    void submit(io_job && job) {
+        {
+            std::unique_lock<std::mutex> lock(io_mutex);
+            io_jobs.push_back(std::move(job));
+        }
+        io_cv.notify_one();
+    }
+
+    void io_loop() {
+        while (true) {
+            io_job job;
+            {
+                std::unique_lock<std::mutex> lock(io_mutex);
+                io_cv.wait(lock, [&]{
+                    return !io_jobs.empty() || !io_running;
+                });
+                if (!io_running) {
+                    return;
+                }
+                job = std::move(io_jobs.front());
+                io_jobs.pop_front();
+            }
+
+            FILE * f = std::fopen(job.fname.c_str(), job.write ? "wb" : "rb");
+            if (f) {
+                const size_t n = job.write ? std::fwrite(job.data, 1, job.n_bytes, f) : std::fread(job.data, 1, job.n_bytes, f);
+
+                job.ok = std::fclose(f) == 0 && n == job.n_bytes;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(io_mutex);
+                io_jobs_done.push_back(std::move(job));
+            }
+
+            on_io_done();
+        }
+    }
+};
+
+// decides which prompt tokens are decoded in each iteration
+// the tokens of the generating slots are always decoded, the prompts are processed in chunks that fit the rest of the
+// token budget of the iteration, so that a long prompt does not delay the next token of every other slot
+struct server_scheduler {
+    common_sched_policy policy = COMMON_SCHED_POLICY_DECODE_FIRST;
+
+    int32_t n_budget = 0; // max number of tokens per iteration, 0 - n_batch
+
+    void init(common_sched_policy policy, int32_t n_budget) {
+        this->policy   = policy;
+        this->n_budget = n_budget;
+    }
+
+    // number of prompt tokens that can be added to a batch that already holds n_tokens tokens
+    // the prompts get at least a quarter of the budget, so that they are not starved by the generating slots
+    int32_t get_prompt_budget(int32_t n_batch, int32_t n_tokens) const {
+        const int32_t n_max = n_budget > 0 ? std::min(n_budget, n_batch) : n_batch;
+
+        return std::max(0, std::min(std::max(n_max - n_tokens, std::max(n_max/4, 1)), n_batch - n_tokens));
+    }
+
+    // the order in which the slots are given prompt tokens
+    std::vector<server_slot *> get_order(std::vector<server_slot> & slots) const {
+        std::vector<server_slot *> res;
+        res.reserve(slots.size());
+        for (server_slot & slot : slots) {
+            res.push_back(&slot);
+        }
+
+        const auto n_left = [](const server_slot * slot) -> int32_t {
+            return slot->state == SLOT_STATE_STARTED ? (int32_t) slot->prompt_tokens.size() : slot->n_prompt_tokens - slot->n_past;
+        };
+
+        std::stable_sort(res.begin(), res.end(), [&](const server_slot * a, const server_slot * b) {
+            switch (policy) {
+                case COMMON_SCHED_POLICY_FAIR:
+                    if (n_left(a) != n_left(b)) {
+                        return n_left(a) < n_left(b);
+                    }
+                    break;
+                case COMMON_SCHED_POLICY_PRIORITY:
+                    if (a->params.priority != b->params.priority) {
+                        return a->params.priority > b->params.priority;
+                    }
+                    break;
+                case COMMON_SCHED_POLICY_DECODE_FIRST:
+                    break;
+            }
+            return a->id_task < b->id_task;
+        });
+
+        return res;
+    }
+
+    // number of tokens given to the next prompt out of the n_left tokens left for the n_slots prompts not served yet
+    int32_t get_chunk(int32_t n_left, int32_t n_slots) const {
+        if (policy == COMMON_SCHED_POLICY_FAIR && n_slots > 1) {
+            return (n_left + n_slots - 1)/n_slots;
+        }
+
+        return n_left;
+    }
+};
+
+struct server_queue {
+    int id = 0;
+    bool running;
+
+    // queues
+    std::deque<server_task> queue_tasks;
+    std::deque<server_task> queue_tasks_deferred;
+
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
+
+    // callback functions
+    std::function<void(server_task &&)> callback_new_task;
+    std::function<void(void)>           callback_update_slots;
+
+    // Add a new task to the end of the queue
+    int post(server_task && task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        GGML_ASSERT(task.id != -1);
+        // if this is cancel task make sure to clean up pending tasks
+        if (task.type == SERVER_TASK_TYPE_CANCEL) {
+            cleanup_pending_task(task.id_target);
+        }
+        const int task_id = task.id;
+        QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
+        if (front) {
+            queue_tasks.push_front(std::move(task));
+        } else {
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+        return task_id;
+    }
+
+    // multi-task version of post()
+    int post(std::vector<server_task> && tasks, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
+            }
+            // if this is cancel task make sure to clean up pending tasks
+            if (task.type == SERVER_TASK_TYPE_CANCEL) {
+                cleanup_pending_task(task.id_target);
+            }
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
+            if (front) {
+                queue_tasks.push_front(std::move(task));
+            } else {
+                queue_tasks.push_back(std::move(task));
+            }
+        }
+        condition_tasks.notify_one();
+        return 0;
+    }
+
+    // Add a new task, but defer until one slot is available
+    void defer(server_task && task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        QUE_DBG("defer task, id = %d\n", task.id);
+        queue_tasks_deferred.push_back(std::move(task));
+        condition_tasks.notify_one();
+    }
+
+    // Get the next id for creating a new task
+    int get_new_id() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int new_id = id++;
+        return new_id;
+    }
+
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task &&)> callback) {
+        callback_new_task = std::move(callback);
+    }
+
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
+
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // the task with the highest priority goes first, the tasks with the same priority in the order they were deferred
+    void pop_deferred_task() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (!queue_tasks_deferred.empty()) {
+            auto it = std::max_element(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), [](const server_task & a, const server_task & b) {
+                return a.params.priority < b.params.priority;
+            });
+            queue_tasks.emplace_back(std::move(*it));
+            queue_tasks_deferred.erase(it);
+        }
+        condition_tasks.notify_one();
+    }
+
+    // end the start_loop routine
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        running = false;
+        condition_tasks.notify_all();
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        running = true;
+
+        while (true) {
+            QUE_DBG("%s", "processing new tasks\n");
+
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    lock.unlock();
+                    break;
+                }
+                server_task task = std::move(queue_tasks.front());
+                queue_tasks.pop_front();
+                lock.unlock();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(std::move(task));
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            QUE_DBG("%s", "waiting for new tasks\n");
+            {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    condition_tasks.wait(lock, [&]{
+                        return (!queue_tasks.empty() || !running);
+                    });
+                }
+            }
+        }
+    }
+
+private:
+    void cleanup_pending_task(int id_target) {
+        // no need lock because this is called exclusively by post()
+        auto rm_func = [id_target](const server_task & task) {
+            return task.id_target == id_target;
+        };
+        queue_tasks.erase(
+            std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
+            queue_tasks.end());
+        queue_tasks_deferred.erase(
+            std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
+            queue_tasks_deferred.end());
+    }
+};
+
+// the results of the tasks of one request
+// there is a single consumer, the HTTP thread that waits for the request, so a result only wakes up that thread
+struct server_response_channel {
+    std::deque<server_task_result_ptr> results;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    // called after a result is queued, for the consumers that do not wait in recv()
+    std::function<void()> notify;
+};
+
+using server_response_channel_ptr = std::shared_ptr<server_response_channel>;
+
+struct server_response {
+    std::atomic<bool> running = true;
+
+    // the channel of each task waiting for a result, the tasks of a request share a channel
+    std::unordered_map<int, server_response_channel_ptr> channels;
+
+    // only protects the map, the results are queued under the lock of their channel
+    std::mutex mutex_results;
+
+    // add the id_task to the list of tasks waiting for response
+    void add_waiting_task_id(int id_task) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) channels.size());
+        channels[id_task] = std::make_shared<server_response_channel>();
+    }
+
+    void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        auto channel = std::make_shared<server_response_channel>();
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & task : tasks) {
+            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) channels.size());
+            channels[task.id] = channel;
+        }
+    }
+
+    // when the request is finished, we can remove task associated with it
+    void remove_waiting_task_id(int id_task) {
+        remove_waiting_task_ids({ id_task });
+    }
+
+    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+        std::vector<server_response_channel_ptr> removed;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+
+            for (const auto & id_task : id_tasks) {
+                SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) channels.size());
+
+                auto it = channels.find(id_task);
+                if (it != channels.end()) {
+                    removed.push_back(std::move(it->second));
+                    channels.erase(it);
+                }
+            }
+        }
+
+        // make sure to clean up all pending results, the other tasks of the request may still use the channel
+        for (auto & channel : removed) {
+            std::unique_lock<std::mutex> lock(channel->mutex);
+            channel->results.erase(
+                std::remove_if(channel->results.begin(), channel->results.end(), [&id_tasks](const server_task_result_ptr & res) {
+                    return id_tasks.find(res->id) != id_tasks.end();
+                }),
+                channel->results.end());
+        }
+    }
+
+    // This function blocks the thread until there is a response for one of the id_tasks
+    // the id_tasks must have been added together by add_waiting_tasks(), or be a single task
+    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
+        server_response_channel_ptr channel = get_channel(id_tasks);
+
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        channel->cv.wait(lock, [&]{
+            if (!running) {
+                SRV_DBG("%s : queue result stop\n", __func__);
+                std::terminate(); // we cannot return here since the caller is HTTP code
+            }
+            return !channel->results.empty();
+        });
+
+        server_task_result_ptr res = std::move(channel->results.front());
+        channel->results.pop_front();
+        return res;
+    }
+
+    // same as recv(), but have timeout in seconds
+    // if timeout is reached, nullptr is returned
+    server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
+        server_response_channel_ptr channel = get_channel(id_tasks);
+
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        const bool ready = channel->cv.wait_for(lock, std::chrono::seconds(timeout), [&]{
+            return !running || !channel->results.empty();
+        });
+        if (!running) {
+            SRV_DBG("%s : queue result stop\n", __func__);
+            std::terminate(); // we cannot return here since the caller is HTTP code
+        }
+        if (!ready) {
+            return nullptr;
+        }
+
+        server_task_result_ptr res = std::move(channel->results.front());
+        channel->results.pop_front();
+        return res;
+    }
+
+    // same as recv(), but returns nullptr right away if there is no result
+    server_task_result_ptr try_recv(const std::unordered_set<int> & id_tasks) {
+        server_response_channel_ptr channel = get_channel(id_tasks);
+
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        if (channel->results.empty()) {
+            return nullptr;
+        }
+
+        server_task_result_ptr res = std::move(channel->results.front());
+        channel->results.pop_front();
+        return res;
+    }
+
+    // call notify after each result for one of the id_tasks is queued
+    void set_notify(const std::unordered_set<int> & id_tasks, std::function<void()> notify) {
+        server_response_channel_ptr channel = get_channel(id_tasks);
+
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        channel->notify = std::move(notify);
+    }
+
+    // single-task version of recv()
+    server_task_result_ptr recv(int id_task) {
+        std::unordered_set<int> id_tasks = {id_task};
+        return recv(id_tasks);
+    }
+
+    // Send a new result to a waiting id_task
+    void send(server_task_result_ptr && result) {
+        SRV_DBG("sending result for task id = %d\n", result->id);
+
+        server_response_channel_ptr channel;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+
+            auto it = channels.find(result->id);
+            if (it == channels.end()) {
+                return;
+            }
+            channel = it->second;
+        }
+
+        SRV_DBG("task id = %d pushed to result queue\n", result->id);
+
+        {
+            std::unique_lock<std::mutex> lock(channel->mutex);
+            channel->results.push_back(std::move(result));
+            if (channel->notify) {
+                channel->notify();
+            }
+        }
+        channel->cv.notify_one();
+    }
+
+    // terminate the waiting loop
+    void terminate() {
+        running = false;
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (auto & it : channels) {
+            // lock the channel so that a waiter cannot miss the update of running
+            std::unique_lock<std::mutex> lock_channel(it.second->mutex);
+            it.second->cv.notify_all();
+        }
+    }
+
+private:
+    server_response_channel_ptr get_channel(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        server_response_channel_ptr channel;
+        for (const auto & id_task : id_tasks) {
+            auto it = channels.find(id_task);
+            if (it == channels.end()) {
+                continue;
+            }
+            GGML_ASSERT((!channel || channel == it->second) && "the tasks of a request must share a channel");
+            channel = it->second;
+        }
+        GGML_ASSERT(channel && "recv() on tasks that are not waiting");
+
+        return channel;
+    }
+};
+
+struct server_context {
+    common_params params_base;
+
+    // note: keep these alive - they determine the lifetime of the model, context, etc.
+    common_init_result llama_init;
+    common_init_result llama_init_dft;
+
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+
+    const llama_vocab * vocab = nullptr;
+
+    llama_model * model_dft = nullptr;
+    llama_context * ctx_dft = nullptr;
+
+    int32_t n_ctx_dft = 0; // draft context per slot
+
+    llama_batch batch = {};
+    llama_batch batch_dft = {};
+
+    bool clean_kv_cache = true;
+    bool add_bos_token  = true;
+    bool has_eos_token  = false;
+
+    int32_t n_ctx; // total context for all clients / slots
+    int32_t n_swa = 0; // sliding window of the model (0 - none)
+
+    // slots / clients
+    std::vector<server_slot> slots;
+    json default_generation_settings_for_props;
+
+    server_queue    queue_tasks;
     server_response queue_results;
 
     server_metrics metrics;
 
+    server_scheduler scheduler;
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
+    server_prefix_cache prefix_cache;
+    server_kv_tiers     kv_tiers;
+
     common_chat_templates_ptr chat_templates;
 
     ~server_context() {
@@ -1881,16 +2651,12 @@ struct server_context {
             common_sampler_free(slot.smpl);
             slot.smpl = nullptr;
 
-            llama_free(slot.ctx_dft);
-            slot.ctx_dft = nullptr;
-
             common_speculative_free(slot.spec);
             slot.spec = nullptr;
-
-            llama_batch_free(slot.batch_spec);
         }
 
         llama_batch_free(batch);
+        llama_batch_free(batch_dft);
     }
 
     bool load_model(const common_params & params) {
@@ -1908,9 +2674,18 @@ struct server_context {
             return false;
         }
 
+        // the adapters are set per slot
+        llama_clear_adapter_lora(ctx);
+
         vocab = llama_model_get_vocab(model);
 
         n_ctx = llama_n_ctx(ctx);
+        n_swa = llama_model_n_swa(model);
+
+        if (params_base.n_cache_reuse > 0 && !llama_kv_self_can_shift(ctx)) {
+            SRV_WRN("%s", "cache reuse requires shifting the KV cache, which is not supported by this context - disabling\n");
+            params_base.n_cache_reuse = 0;
+        }
 
         add_bos_token = llama_vocab_get_add_bos(vocab);
         has_eos_token = llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL;
@@ -1922,9 +2697,9 @@ struct server_context {
 
             params_dft.devices      = params_base.speculative.devices;
             params_dft.model        = params_base.speculative.model;
-            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
+            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? n_ctx : params_base.speculative.n_ctx * params_base.n_parallel;
             params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
-            params_dft.n_parallel   = 1;
+            params_dft.n_parallel   = params_base.n_parallel; // one sequence per slot
 
             // force F16 KV cache for the draft model for extra performance
             params_dft.cache_type_k = GGML_TYPE_F16;
@@ -1933,25 +2708,23 @@ struct server_context {
             llama_init_dft = common_init_from_params(params_dft);
 
             model_dft = llama_init_dft.model.get();
+            ctx_dft   = llama_init_dft.context.get();
 
             if (model_dft == nullptr) {
                 SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.path.c_str());
                 return false;
             }
 
-            if (!common_speculative_are_compatible(ctx, llama_init_dft.context.get())) {
+            if (!common_speculative_are_compatible(ctx, ctx_dft)) {
                 SRV_ERR("the draft model '%s' is not compatible with the target model '%s'\n", params_base.speculative.model.path.c_str(), params_base.model.path.c_str());
 
                 return false;
             }
 
-            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
-
-            cparams_dft = common_context_params_to_llama(params_dft);
-            cparams_dft.n_batch = n_ctx_dft;
+            // the draft context is shared by all slots so that the drafts can be generated with a single decode
+            n_ctx_dft = llama_n_ctx(ctx_dft) / params_base.n_parallel;
 
-            // the context is not needed - we will create one for each slot
-            llama_init_dft.context.reset();
+            batch_dft = llama_batch_init(llama_n_batch(ctx_dft), 0, 1);
         }
 
         chat_templates = common_chat_templates_init(model, params_base.chat_template);
@@ -1979,16 +2752,10 @@ struct server_context {
             slot.n_ctx = n_ctx_slot;
             slot.n_predict = params_base.n_predict;
 
-            if (model_dft) {
-                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+            if (ctx_dft) {
+                slot.ctx_dft = ctx_dft;
 
-                slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
-                if (slot.ctx_dft == nullptr) {
-                    SRV_ERR("%s", "failed to create draft context\n");
-                    return;
-                }
-
-                slot.spec = common_speculative_init(slot.ctx_dft);
+                slot.spec = common_speculative_init(ctx_dft, slot.id, n_ctx_dft);
                 if (slot.spec == nullptr) {
                     SRV_ERR("%s", "failed to create speculator\n");
                     return;
@@ -2010,6 +2777,38 @@ struct server_context {
 
         default_generation_settings_for_props = slots[0].to_json();
 
+        if (params_base.n_prefix_cache > 0) {
+            if (llama_model_is_recurrent(model)) {
+                SRV_WRN("%s", "the prefix cache is not supported for recurrent models - disabling\n");
+            } else {
+                SRV_INF("initializing prefix cache, n_tokens = %d\n", params_base.n_prefix_cache);
+
+                prefix_cache.init(params_base.n_prefix_cache, params_base.n_parallel);
+            }
+        }
+
+        if (params_base.kv_tier_host > 0) {
+            if (llama_model_is_recurrent(model)) {
+                SRV_WRN("%s", "the KV tiers are not supported for recurrent models - disabling\n");
+            } else {
+                SRV_INF("initializing KV tiers, host = %d MiB, disk = %d MiB, path = '%s'\n",
+                        params_base.kv_tier_host, params_base.kv_tier_path.empty() ? 0 : params_base.kv_tier_disk, params_base.kv_tier_path.c_str());
+
+                // wake up the slots that wait for an entry to be read from disk
+                kv_tiers.on_io_done = [this]() {
+                    server_task task(SERVER_TASK_TYPE_NEXT_RESPONSE);
+                    task.id = queue_tasks.get_new_id();
+                    queue_tasks.post(std::move(task));
+                };
+
+                kv_tiers.init((size_t) params_base.kv_tier_host << 20, (size_t) params_base.kv_tier_disk << 20, params_base.kv_tier_path);
+
+                prefix_cache.on_evict = [this](const server_prefix_cache::entry & ent) {
+                    kv_tiers.store(ctx, ent.seq_id, ent.tokens, ent.lora);
+                };
+            }
+        }
+
         // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
         // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
         {
@@ -2019,6 +2818,8 @@ struct server_context {
             batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
         }
 
+        scheduler.init(params_base.sched_policy, params_base.n_sched_budget);
+
         metrics.init();
     }
 
@@ -2116,8 +2917,12 @@ struct server_context {
 
         if (!are_lora_equal(slot.params.lora, slot.lora)) {
             // if lora is changed, we cannot reuse cached tokens
+            cache_store(slot);
             slot.cache_tokens.clear();
             slot.lora = slot.params.lora;
+
+            // the adapters apply only to the tokens of the slot, slots with different adapters share batches
+            common_set_adapter_lora_seq(ctx, slot.id, slot.lora);
         }
 
         bool can_detokenize = can_be_detokenized(ctx, slot.prompt_tokens);
@@ -2150,12 +2955,6 @@ struct server_context {
             }
         }
 
-        if (slot.ctx_dft) {
-            llama_batch_free(slot.batch_spec);
-
-            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
-        }
-
         slot.state = SLOT_STATE_STARTED;
 
         SLT_INF(slot, "%s", "processing task\n");
@@ -2169,6 +2968,155 @@ struct server_context {
         // clear the entire KV cache
         llama_kv_self_clear(ctx);
         clean_kv_cache = false;
+
+        prefix_cache.clear();
+    }
+
+    // number of leading tokens of the slot cache that can be shared with another sequence
+    // the KV cells of these tokens must not be shifted
+    size_t prefix_cache_n_shared(const server_slot & slot) const {
+        if (!prefix_cache.enabled()) {
+            return 0;
+        }
+
+        int32_t id_found;
+        size_t n_shared = prefix_cache.find(slot.cache_tokens, nullptr, id_found);
+
+        for (const server_slot & other : slots) {
+            if (other.id != slot.id) {
+                n_shared = std::max(n_shared, common_lcp(other.cache_tokens, slot.cache_tokens));
+            }
+        }
+
+        return n_shared;
+    }
+
+    // keep the KV of the slot cache in the prefix cache, or in the KV tiers if it does not fit there
+    void cache_store(const server_slot & slot) {
+        if (!prefix_cache.store(ctx, slot.id, slot.cache_tokens, slot.lora)) {
+            kv_tiers.store(ctx, slot.id, slot.cache_tokens, slot.lora);
+        }
+    }
+
+    // before processing a new prompt, keep the part of the slot cache that would be discarded in the prefix cache
+    // and copy the longest matching prefix held by another slot, by the prefix cache or by the KV tiers
+    // returns false while the slot waits for a KV tier entry to be read from disk
+    bool prefix_cache_update(server_slot & slot) {
+        const llama_tokens & prompt_tokens = slot.prompt_tokens;
+
+        size_t n_best = common_lcp(slot.cache_tokens, prompt_tokens);
+
+        if (slot.cache_tokens.size() > n_best) {
+            cache_store(slot);
+        }
+
+        const server_slot * slot_src = nullptr;
+        for (const server_slot & other : slots) {
+            if (other.id == slot.id || !are_lora_equal(other.lora, slot.lora)) {
+                continue;
+            }
+
+            const size_t n_match = common_lcp(other.cache_tokens, prompt_tokens);
+            if (n_match > n_best) {
+                n_best   = n_match;
+                slot_src = &other;
+            }
+        }
+
+        int32_t id_entry = -1;
+        {
+            const size_t n_match = prefix_cache.find(prompt_tokens, &slot.lora, id_entry);
+            if (n_match > n_best) {
+                n_best   = n_match;
+                slot_src = nullptr;
+            } else {
+                id_entry = -1;
+            }
+        }
+
+        int32_t id_tier = -1;
+        {
+            const size_t n_match = kv_tiers.find(prompt_tokens, slot.lora, id_tier);
+            if (n_match > n_best) {
+                n_best   = n_match;
+                slot_src = nullptr;
+                id_entry = -1;
+            } else {
+                id_tier = -1;
+            }
+        }
+
+        slot.id_kv_tier = -1;
+
+        if (id_tier >= 0 && !kv_tiers.fetch(id_tier)) {
+            SLT_DBG(slot, "waiting for %zu prompt tokens to be read from disk\n", n_best);
+
+            slot.id_kv_tier = id_tier;
+            return false;
+        }
+
+        if (slot_src == nullptr && id_entry < 0 && id_tier < 0) {
+            return true;
+        }
+
+        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+
+        if (slot_src) {
+            SLT_INF(slot, "reusing %zu prompt tokens from slot %d\n", n_best, slot_src->id);
+
+            llama_kv_self_seq_cp(ctx, slot_src->id, slot.id, 0, n_best);
+        } else if (id_entry >= 0) {
+            SLT_INF(slot, "reusing %zu prompt tokens from the prefix cache\n", n_best);
+
+            prefix_cache.load(ctx, id_entry, slot.id, n_best);
+        } else {
+            // the cells of the entry must be contiguous - make room by dropping prefix cache entries if needed
+            // the dropped entries go to the KV tiers, the entry is pinned so that they do not replace it
+            kv_tiers.pin(id_tier, true);
+
+            bool loaded = kv_tiers.load(ctx, id_tier, slot.id, n_best);
+            while (!loaded && prefix_cache.evict(ctx)) {
+                loaded = kv_tiers.load(ctx, id_tier, slot.id, n_best);
+            }
+
+            kv_tiers.pin(id_tier, false);
+
+            if (loaded) {
+                SLT_INF(slot, "restored %zu prompt tokens from the KV tiers\n", n_best);
+            } else {
+                SLT_WRN(slot, "failed to restore %zu prompt tokens from the KV tiers\n", n_best);
+
+                n_best = 0;
+            }
+        }
+
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_best);
+
+        return true;
+    }
+
+    // drop the cache of the least recently used idle slot to free KV cells, keeping its KV in the KV tiers
+    // returns false if there is no such slot
+    bool kv_tiers_evict_slot() {
+        server_slot * slot_lru = nullptr;
+        for (server_slot & slot : slots) {
+            if (!slot.is_processing() && !slot.cache_tokens.empty() && (slot_lru == nullptr || slot.t_last_used < slot_lru->t_last_used)) {
+                slot_lru = &slot;
+            }
+        }
+
+        if (!kv_tiers.enabled() || slot_lru == nullptr) {
+            return false;
+        }
+
+        SLT_INF(*slot_lru, "evicting %zu cached tokens to the KV tiers\n", slot_lru->cache_tokens.size());
+
+        kv_tiers.store(ctx, slot_lru->id, slot_lru->cache_tokens, slot_lru->lora);
+
+        llama_kv_self_seq_rm(ctx, slot_lru->id, -1, -1);
+        slot_lru->cache_tokens.clear();
+
+        return true;
     }
 
     bool process_token(completion_token_output & result, server_slot & slot) {
@@ -2592,48 +3540,6 @@ struct server_context {
         result_handler(results);
     }
 
-    // receive the results from task(s), in stream mode
-    void receive_cmpl_results_stream(
-            const std::unordered_set<int> & id_tasks,
-            const std::function<bool(server_task_result_ptr&)> & result_handler,
-            const std::function<void(json)> & error_handler,
-            const std::function<bool()> & is_connection_closed) {
-        size_t n_finished = 0;
-        while (true) {
-            server_task_result_ptr result = queue_results.recv_with_timeout(id_tasks, HTTP_POLLING_SECONDS);
-
-            if (is_connection_closed()) {
-                cancel_tasks(id_tasks);
-                return;
-            }
-
-            if (result == nullptr) {
-                continue; // retry
-            }
-
-            if (result->is_error()) {
-                error_handler(result->to_json());
-                cancel_tasks(id_tasks);
-                return;
-            }
-
-            GGML_ASSERT(
-                dynamic_cast<server_task_result_cmpl_partial*>(result.get()) != nullptr
-                || dynamic_cast<server_task_result_cmpl_final*>(result.get()) != nullptr
-            );
-            if (!result_handler(result)) {
-                cancel_tasks(id_tasks);
-                break;
-            }
-
-            if (result->is_stop()) {
-                if (++n_finished == id_tasks.size()) {
-                    break;
-                }
-            }
-        }
-    }
-
     //
     // Functions to process the task
     //
@@ -2846,17 +3752,27 @@ struct server_context {
     }
 
     void update_slots() {
+        kv_tiers.poll();
+
         // check if all slots are idle
         {
             bool all_idle = true;
+            bool any_wait = false;
 
             for (auto & slot : slots) {
-                if (slot.is_processing()) {
+                if (slot.is_processing() && kv_tiers.is_reading(slot.id_kv_tier)) {
+                    any_wait = true;
+                } else if (slot.is_processing()) {
                     all_idle = false;
                     break;
                 }
             }
 
+            if (all_idle && any_wait) {
+                // nothing to decode until the KV tiers are done reading - the I/O thread posts a new task then
+                return;
+            }
+
             if (all_idle) {
                 SRV_INF("%s", "all slots are idle\n");
                 if (clean_kv_cache) {
@@ -2890,7 +3806,13 @@ struct server_context {
                 // Shift context
                 const int n_keep    = slot.params.n_keep + add_bos_token;
                 const int n_left    = slot.n_past - n_keep;
-                const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+                int       n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
+
+                // the cells shared with other sequences cannot be shifted - discard them from this slot instead
+                const int n_shared = prefix_cache_n_shared(slot);
+                if (n_shared > n_keep + n_discard) {
+                    n_discard = std::min(n_left, n_shared - n_keep);
+                }
 
                 SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
@@ -2911,6 +3833,15 @@ struct server_context {
             }
         }
 
+        // reuse the prompt prefixes held by the other slots, by the prefix cache and by the KV tiers
+        if (prefix_cache.enabled() || kv_tiers.enabled()) {
+            for (server_slot & slot : slots) {
+                if (slot.state == SLOT_STATE_STARTED && slot.params.cache_prompt && !slot.is_non_causal()) {
+                    prefix_cache_update(slot);
+                }
+            }
+        }
+
         // start populating the batch for this iteration
         common_batch_clear(batch);
 
@@ -2921,16 +3852,84 @@ struct server_context {
             return params_base.special || slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
         };
 
+        // generate the drafts of all speculating slots - the draft sequences are evaluated together
+        if (ctx_dft) {
+            std::vector<common_speculative_draft> drafts;
+            std::vector<server_slot *> slots_dft;
+
+            for (auto & slot : slots) {
+                slot.drafted.clear();
+
+                if (slot.state != SLOT_STATE_GENERATING || !slot.can_speculate()) {
+                    continue;
+                }
+
+                // determine the max draft that fits the current slot state
+                int n_draft_max = slot.params.speculative.n_max;
+
+                // note: n_past is not yet increased for the sampled token
+                //       also, need to leave space for 1 extra token to allow context shifts
+                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+
+                if (slot.n_remaining > 0) {
+                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
+                }
+
+                SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+
+                if (n_draft_max < slot.params.speculative.n_min) {
+                    SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+                    continue;
+                }
+
+                struct common_speculative_params params_spec;
+                params_spec.n_draft   = n_draft_max;
+                params_spec.n_reuse   = n_ctx_dft - slot.params.speculative.n_max;
+                params_spec.p_min     = slot.params.speculative.p_min;
+
+                drafts.push_back({ slot.spec, params_spec, &slot.cache_tokens, slot.sampled, {} });
+                slots_dft.push_back(&slot);
+            }
+
+            common_speculative_gen_drafts(batch_dft, drafts);
+
+            for (size_t i = 0; i < drafts.size(); ++i) {
+                server_slot & slot = *slots_dft[i];
+
+                // keep track of total number of tokens generated in the draft
+                slot.n_draft_total += drafts[i].result.size();
+
+                // ignore small drafts
+                if (slot.params.speculative.n_min > (int) drafts[i].result.size()) {
+                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) drafts[i].result.size(), slot.params.speculative.n_min);
+                    continue;
+                }
+
+                slot.drafted = std::move(drafts[i].result);
+            }
+        }
+
+        // the slots with a draft to verify in this batch
+        std::vector<server_slot *> slots_spec;
+
+        // the number of generating slots that still have to be added to the batch
+        int n_generating = std::count_if(slots.begin(), slots.end(), [](const server_slot & slot) {
+            return slot.state == SLOT_STATE_GENERATING;
+        });
+
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
             if (slot.state != SLOT_STATE_GENERATING) {
                 continue;
             }
 
+            n_generating--;
+
             // check if we can batch this slot with the previous one
             if (!slot_batched) {
                 slot_batched = &slot;
             } else if (!slot_batched->can_batch_with(slot)) {
+                slot.drafted.clear();
                 continue;
             }
 
@@ -2938,6 +3937,23 @@ struct server_context {
 
             common_batch_add(batch, slot.sampled, slot.n_past, { slot.id }, true);
 
+            // the draft is verified in the same batch - keep the sampled and drafted tokens of the slot within one llama_decode
+            // and leave room for the sampled tokens of the remaining slots
+            const int n_draft_fit = (int) llama_n_batch(ctx) - batch.n_tokens - n_generating;
+            if ((int) slot.drafted.size() > n_draft_fit) {
+                slot.drafted.resize(std::max(0, n_draft_fit));
+            }
+
+            for (size_t i = 0; i < slot.drafted.size(); ++i) {
+                common_batch_add(batch, slot.drafted[i], slot.n_past + 1 + i, { slot.id }, true);
+            }
+
+            if (!slot.drafted.empty()) {
+                SLT_DBG(slot, "verifying draft, size = %d\n", (int) slot.drafted.size());
+
+                slots_spec.push_back(&slot);
+            }
+
             slot.n_past += 1;
 
             if (slot.params.cache_prompt) {
@@ -2952,9 +3968,41 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
-        // next, batch any pending prompts without exceeding n_batch
+        // next, batch any pending prompts without exceeding the token budget of the iteration
         if (params_base.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            const int32_t n_prompt_end = batch.n_tokens + scheduler.get_prompt_budget(n_batch, batch.n_tokens);
+
+            const std::vector<server_slot *> order = scheduler.get_order(slots);
+
+            // the slots with a prompt that can share this batch and have not been given tokens yet
+            int32_t n_prompt_slots = 0;
+            {
+                server_slot * slot_first = slot_batched;
+                for (server_slot * slot : order) {
+                    if (slot->id_kv_tier >= 0 || !slot->is_processing()) {
+                        continue;
+                    }
+
+                    if (!slot_first) {
+                        slot_first = slot;
+                    } else if (!slot_first->can_batch_with(*slot)) {
+                        continue;
+                    }
+
+                    if (slot->state == SLOT_STATE_PROCESSING_PROMPT || slot->state == SLOT_STATE_STARTED) {
+                        n_prompt_slots++;
+                    }
+                }
+            }
+
+            for (server_slot * slot_ptr : order) {
+                server_slot & slot = *slot_ptr;
+
+                // the prompt is processed once the KV tier entry that matches it has been read
+                if (slot.id_kv_tier >= 0) {
+                    continue;
+                }
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -2968,6 +4016,8 @@ struct server_context {
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
                     auto & prompt_tokens = slot.prompt_tokens;
 
+                    const int32_t n_chunk = scheduler.get_chunk(n_prompt_end - batch.n_tokens, n_prompt_slots--);
+
                     // TODO: maybe move branch to outside of this loop in the future
                     if (slot.state == SLOT_STATE_STARTED) {
                         slot.t_start_process_prompt = ggml_time_us();
@@ -3065,6 +4115,9 @@ struct server_context {
                                     size_t head_c = slot.n_past; // cache
                                     size_t head_p = slot.n_past; // current prompt
 
+                                    // the cells shared with other sequences cannot be shifted
+                                    const size_t n_shared = prefix_cache_n_shared(slot);
+
                                     SLT_DBG(slot, "trying to reuse chunks with size > %d, slot.n_past = %d\n", params_base.n_cache_reuse, slot.n_past);
 
                                     while (head_c < slot.cache_tokens.size() &&
@@ -3078,7 +4131,7 @@ struct server_context {
                                             n_match++;
                                         }
 
-                                        if (n_match >= (size_t) params_base.n_cache_reuse) {
+                                        if (n_match >= (size_t) params_base.n_cache_reuse && head_c >= n_shared) {
                                             SLT_INF(slot, "reusing chunk with size %zu, shifting KV cache [%zu, %zu) -> [%zu, %zu)\n", n_match, head_c, head_c + n_match, head_p, head_p + n_match);
                                             //for (size_t i = head_p; i < head_p + n_match; i++) {
                                             //    SLT_DBG(slot, "cache token %3zu: %6d '%s'\n", i, prompt_tokens[i], common_token_to_piece(ctx, prompt_tokens[i]).c_str());
@@ -3113,6 +4166,19 @@ struct server_context {
                             slot.n_past--;
                         }
 
+                        // the sliding-window layers only keep the last positions of the sequence - continuing
+                        // at n_past needs the window before it
+                        if (slot.n_past > 0 && n_swa > 0) {
+                            const llama_pos pos_min = llama_kv_self_seq_pos_min(ctx, slot.id);
+
+                            if (pos_min < 0 || pos_min > std::max(0, slot.n_past - n_swa + 1)) {
+                                SLT_WRN(slot, "the KV cache of the sliding-window layers does not cover n_past = %d (pos_min = %d, n_swa = %d) - processing the full prompt\n",
+                                        slot.n_past, pos_min, n_swa);
+
+                                slot.n_past = 0;
+                            }
+                        }
+
                         slot.n_prompt_tokens_processed = 0;
                     }
 
@@ -3124,6 +4190,14 @@ struct server_context {
                         }
                     }
 
+                    // the prompts of non-causal tasks cannot be split - they are only limited by n_batch
+                    const int32_t n_chunk_end = slot.is_non_causal() ? n_batch : batch.n_tokens + n_chunk;
+
+                    // no budget left for this prompt in the current batch - will continue next iter
+                    if (batch.n_tokens >= n_chunk_end) {
+                        continue;
+                    }
+
                     // keep only the common part
                     if (!llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1)) {
                         // could not partially delete (likely using a non-Transformer model)
@@ -3139,7 +4213,7 @@ struct server_context {
                     slot.cache_tokens.resize(slot.n_past);
 
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_chunk_end) {
                         // without pooling, we want to output the embeddings for all the tokens in the batch
                         const bool need_embd = slot.task_type == SERVER_TASK_TYPE_EMBEDDING && llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
 
@@ -3178,7 +4252,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_prompt_end) {
                     break;
                 }
             }
@@ -3194,8 +4268,6 @@ struct server_context {
         if (slot_batched) {
             // make sure we're in the right embedding mode
             llama_set_embeddings(ctx, slot_batched->is_non_causal());
-            // apply lora, only need to do it once per batch
-            common_set_adapter_lora(ctx, slot_batched->lora);
         }
 
         // process the created batch of tokens
@@ -3216,6 +4288,15 @@ struct server_context {
             metrics.on_decoded(slots);
 
             if (ret != 0) {
+                if (ret == 1 && (prefix_cache.evict(ctx) || kv_tiers_evict_slot())) {
+                    // free some KV cells held by the prefix cache or by an idle slot and retry
+                    i -= n_batch;
+
+                    SRV_WRN("failed to find free space in the KV cache, evicted a cached prompt and retrying, i = %d, n_batch = %d\n", i, n_batch);
+
+                    continue; // continue loop of n_batch
+                }
+
                 if (n_batch == 1 || ret < 0) {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
                     SRV_ERR("failed to decode the batch: KV cache is full - try increasing it via the context size, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
@@ -3264,6 +4345,57 @@ struct server_context {
 
                 const int tok_idx = slot.i_batch - i;
 
+                if (!slot.drafted.empty()) {
+                    // the batch can be split in the middle of the draft when retrying with a smaller size
+                    // in that case only the part of the draft in the current view is verified
+                    slot.drafted.resize(std::min<int>(slot.drafted.size(), n_tokens - 1 - tok_idx));
+
+                    std::vector<int> idxs(slot.drafted.size() + 1);
+                    for (size_t k = 0; k < idxs.size(); ++k) {
+                        idxs[k] = tok_idx + k;
+                    }
+
+                    // the accepted tokens from the speculation
+                    const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, idxs, slot.drafted);
+
+                    slot.i_batch = -1;
+
+                    slot.n_past += ids.size() - 1;
+
+                    slot.t_token_generation = (ggml_time_us() - slot.t_start_generation) / 1e3;
+
+                    // update how many tokens out of draft was accepted
+                    slot.n_draft_accepted += ids.size() - 1;
+
+                    slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
+
+                    for (size_t k = 0; k < ids.size(); ++k) {
+                        completion_token_output result;
+
+                        result.tok          = ids[k];
+                        result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                        result.prob         = 1.0f; // set later
+
+                        // TODO: set result.probs
+
+                        // count the tokens one at a time so that the budget check in process_token() is exact
+                        slot.n_decoded += 1;
+
+                        if (!process_token(result, slot)) {
+                            // release slot because of stop condition
+                            slot.release();
+                            slot.print_timings();
+                            send_final_response(slot);
+                            metrics.on_prediction(slot);
+                            break;
+                        }
+                    }
+
+                    SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) slot.drafted.size(), slot.n_past);
+
+                    continue; // continue loop of slots
+                }
+
                 llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
 
                 slot.i_batch = -1;
@@ -3300,116 +4432,93 @@ struct server_context {
                     continue;
                 }
             }
+        }
 
-            // do speculative decoding
-            for (auto & slot : slots) {
-                if (!slot.is_processing() || !slot.can_speculate()) {
-                    continue;
-                }
-
-                if (slot.state != SLOT_STATE_GENERATING) {
-                    continue;
-                }
-
-                // determine the max draft that fits the current slot state
-                int n_draft_max = slot.params.speculative.n_max;
-
-                // note: n_past is not yet increased for the `id` token sampled above
-                //       also, need to leave space for 1 extra token to allow context shifts
-                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+        // remove the rejected draft tokens from the KV cache
+        for (server_slot * slot : slots_spec) {
+            llama_kv_self_seq_rm(ctx, slot->id, slot->n_past, -1);
 
-                if (slot.n_remaining > 0) {
-                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
-                }
+            slot->drafted.clear();
+        }
 
-                SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+        SRV_DBG("%s", "run slots completed\n");
+    }
 
-                if (n_draft_max < slot.params.speculative.n_min) {
-                    SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+    json model_meta() const {
+        return json {
+            {"vocab_type",  llama_vocab_type       (vocab)},
+            {"n_vocab",     llama_vocab_n_tokens   (vocab)},
+            {"n_ctx_train", llama_model_n_ctx_train(model)},
+            {"n_embd",      llama_model_n_embd     (model)},
+            {"n_params",    llama_model_n_params   (model)},
+            {"size",        llama_model_size       (model)},
+        };
+    }
+};
 
-                    continue;
-                }
+// the results of the tasks of a streaming completion, as server-sent events
+struct server_cmpl_stream : http_stream {
+    server_context & ctx_server;
 
-                llama_token id = slot.sampled;
+    const std::unordered_set<int> id_tasks;
+    const oaicompat_type          oaicompat;
 
-                struct common_speculative_params params_spec;
-                params_spec.n_draft   = n_draft_max;
-                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
-                params_spec.p_min     = slot.params.speculative.p_min;
+    size_t n_finished = 0;
 
-                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, slot.cache_tokens, id);
+    server_cmpl_stream(server_context & ctx_server, const std::unordered_set<int> & id_tasks, oaicompat_type oaicompat)
+        : ctx_server(ctx_server), id_tasks(id_tasks), oaicompat(oaicompat) {}
 
-                // keep track of total number of tokens generated in the draft
-                slot.n_draft_total += draft.size();
+    void set_notify(std::function<void()> notify) override {
+        ctx_server.queue_results.set_notify(id_tasks, std::move(notify));
+    }
 
-                // ignore small drafts
-                if (slot.params.speculative.n_min > (int) draft.size()) {
-                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+    bool read(std::string & out) override {
+        while (true) {
+            server_task_result_ptr result = ctx_server.queue_results.try_recv(id_tasks);
+            if (result == nullptr) {
+                return true;
+            }
 
-                    continue;
-                }
+            if (result->is_error()) {
+                out += format_server_sent_event("error", result->to_json());
+                ctx_server.cancel_tasks(id_tasks);
+                break;
+            }
 
-                // construct the speculation batch
-                common_batch_clear(slot.batch_spec);
-                common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
+            GGML_ASSERT(
+                dynamic_cast<server_task_result_cmpl_partial*>(result.get()) != nullptr
+                || dynamic_cast<server_task_result_cmpl_final*>(result.get()) != nullptr
+            );
 
-                for (size_t i = 0; i < draft.size(); ++i) {
-                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
+            json res_json = result->to_json();
+            if (res_json.is_array()) {
+                for (const auto & res : res_json) {
+                    out += format_server_sent_event("data", res);
                 }
+            } else {
+                out += format_server_sent_event("data", res_json);
+            }
 
-                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
-
-                llama_decode(ctx, slot.batch_spec);
-
-                // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
-
-                slot.n_past    += ids.size();
-                slot.n_decoded += ids.size();
-
-                // update how many tokens out of draft was accepted
-                slot.n_draft_accepted += ids.size() - 1;
-
-                slot.cache_tokens.push_back(id);
-                slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
-
-                llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
-
-                for (size_t i = 0; i < ids.size(); ++i) {
-                    completion_token_output result;
-
-                    result.tok          = ids[i];
-                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
-                    result.prob         = 1.0f; // set later
-
-                    // TODO: set result.probs
-
-                    if (!process_token(result, slot)) {
-                        // release slot because of stop condition
-                        slot.release();
-                        slot.print_timings();
-                        send_final_response(slot);
-                        metrics.on_prediction(slot);
-                        break;
-                    }
+            if (result->is_stop()) {
+                if (++n_finished == id_tasks.size()) {
+                    break;
                 }
-
-                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
             }
         }
 
-        SRV_DBG("%s", "run slots completed\n");
+        if (oaicompat != OAICOMPAT_TYPE_NONE) {
+            out += "data: [DONE]\n\n";
+        }
+
+        return false;
     }
 
-    json model_meta() const {
-        return json {
-            {"vocab_type",  llama_vocab_type       (vocab)},
-            {"n_vocab",     llama_vocab_n_tokens   (vocab)},
-            {"n_ctx_train", llama_model_n_ctx_train(model)},
-            {"n_embd",      llama_model_n_embd     (model)},
-            {"n_params",    llama_model_n_params   (model)},
-            {"size",        llama_model_size       (model)},
-        };
+    void close(bool complete) override {
+        if (!complete) {
+            // the HTTP connection was closed, cancel the generation
+            ctx_server.cancel_tasks(id_tasks);
+        }
+        ctx_server.queue_results.remove_waiting_task_ids(id_tasks);
     }
 };
 
@@ -3481,6 +4590,29 @@ int main(int argc, char ** argv) {
     svr.reset(new httplib::Server());
 #endif
 
+    if (params.n_threads_http < 1) {
+        // +2 threads for monitoring endpoints
+        params.n_threads_http = std::max(params.n_parallel + 2, (int32_t) std::thread::hardware_concurrency() - 1);
+    }
+
+    if (params.http_epoll) {
+#if defined(__linux__)
+        if (params.ssl_file_key != "" || params.ssl_file_cert != "") {
+            LOG_ERR("%s: --http-epoll does not support SSL\n", __func__);
+            return 1;
+        }
+        LOG_INF("Running the HTTP connections on an epoll event loop\n");
+        svr.reset(new http_epoll_server(params.n_threads_http));
+        if (!svr->is_valid()) {
+            LOG_ERR("%s: failed to create the HTTP event loop\n", __func__);
+            return 1;
+        }
+#else
+        LOG_ERR("%s: --http-epoll is only supported on Linux\n", __func__);
+        return 1;
+#endif
+    }
+
     std::atomic<server_state> state{SERVER_STATE_LOADING_MODEL};
 
     svr->set_default_headers({{"Server", "llama.cpp"}});
@@ -3497,6 +4629,60 @@ int main(int argc, char ** argv) {
         res.status = 200;
     };
 
+    // send the events of the stream as they are produced
+    auto res_stream = [](httplib::Response & res, const std::shared_ptr<http_stream> & stream) {
+#if defined(__linux__)
+        if (http_epoll_server::set_stream(res, "text/event-stream", stream)) {
+            return; // the event loop writes the body
+        }
+#endif
+        // thread per connection: the HTTP thread waits for the results
+        struct wakeup {
+            std::mutex mutex;
+            std::condition_variable cv;
+            bool ready = true;
+        };
+        auto w = std::make_shared<wakeup>();
+
+        stream->set_notify([w]() {
+            {
+                std::unique_lock<std::mutex> lock(w->mutex);
+                w->ready = true;
+            }
+            w->cv.notify_one();
+        });
+
+        const auto chunked_content_provider = [stream, w](size_t, httplib::DataSink & sink) {
+            {
+                std::unique_lock<std::mutex> lock(w->mutex);
+                w->cv.wait_for(lock, std::chrono::seconds(HTTP_POLLING_SECONDS), [&]{ return w->ready; });
+                w->ready = false;
+            }
+
+            // note: do not use req.is_connection_closed here because req is already destroyed
+            if (!sink.is_writable()) {
+                return false;
+            }
+
+            std::string out;
+            const bool more = stream->read(out);
+            if (!out.empty() && !sink.write(out.data(), out.size())) {
+                // sending failed (HTTP connection closed), cancel the generation
+                return false;
+            }
+            if (!more) {
+                sink.done();
+            }
+            return true;
+        };
+
+        auto on_complete = [stream](bool success) {
+            stream->close(success);
+        };
+
+        res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+    };
+
     svr->set_exception_handler([&res_error](const httplib::Request &, httplib::Response & res, const std::exception_ptr & ep) {
         std::string message;
         try {
@@ -3938,7 +5124,7 @@ int main(int argc, char ** argv) {
 
     // handle completion-like requests (completion, chat, infill)
     // we can optionally provide a custom format for partial results and final results
-    const auto handle_completions_impl = [&ctx_server, &res_error, &res_ok](
+    const auto handle_completions_impl = [&ctx_server, &res_error, &res_ok, &res_stream](
             server_task_type type,
             json & data,
             std::function<bool()> is_connection_closed,
@@ -4012,39 +5198,7 @@ int main(int argc, char ** argv) {
 
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
-            const auto chunked_content_provider = [task_ids, &ctx_server, oaicompat](size_t, httplib::DataSink & sink) {
-                ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
-                    json res_json = result->to_json();
-                    if (res_json.is_array()) {
-                        for (const auto & res : res_json) {
-                            if (!server_sent_event(sink, "data", res)) {
-                                // sending failed (HTTP connection closed), cancel the generation
-                                return false;
-                            }
-                        }
-                        return true;
-                    } else {
-                        return server_sent_event(sink, "data", res_json);
-                    }
-                }, [&](const json & error_data) {
-                    server_sent_event(sink, "error", error_data);
-                }, [&sink]() {
-                    // note: do not use req.is_connection_closed here because req is already destroyed
-                    return !sink.is_writable();
-                });
-                if (oaicompat != OAICOMPAT_TYPE_NONE) {
-                    static const std::string ev_done = "data: [DONE]\n\n";
-                    sink.write(ev_done.data(), ev_done.size());
-                }
-                sink.done();
-                return false;
-            };
-
-            auto on_complete = [task_ids, &ctx_server] (bool) {
-                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
-            };
-
-            res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+            res_stream(res, std::make_shared<server_cmpl_stream>(ctx_server, task_ids, oaicompat));
         }
     };
 
@@ -4534,12 +5688,10 @@ int main(int argc, char ** argv) {
     //
     // Start the server
     //
-    if (params.n_threads_http < 1) {
-        // +2 threads for monitoring endpoints
-        params.n_threads_http = std::max(params.n_parallel + 2, (int32_t) std::thread::hardware_concurrency() - 1);
-    }
     log_data["n_threads_http"] =  std::to_string(params.n_threads_http);
-    svr->new_task_queue = [&params] { return new httplib::ThreadPool(params.n_threads_http); };
+    if (!params.http_epoll) {
+        svr->new_task_queue = [&params] { return new httplib::ThreadPool(params.n_threads_http); };
+    }
 
     // clean up function, to be called before exit
     auto clean_up = [&svr, &ctx_server]() {
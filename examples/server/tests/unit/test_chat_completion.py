@@ -57,8 +57,10 @@ def test_chat_completion(model, system_prompt, user_prompt, max_tokens, re_conte
         ("You are a coding assistant.", "Write the fibonacci function in c++.", 128, "(Aside|she|felter|alonger)+", 104, 64, "length"),
     ]
 )
-def test_chat_completion_stream(system_prompt, user_prompt, max_tokens, re_content, n_prompt, n_predicted, finish_reason):
+@pytest.mark.parametrize("http_epoll", HTTP_EPOLL_MODES)
+def test_chat_completion_stream(system_prompt, user_prompt, max_tokens, re_content, n_prompt, n_predicted, finish_reason, http_epoll: bool):
     global server
+    server.http_epoll = http_epoll
     server.model_alias = None # try using DEFAULT_OAICOMPAT_MODEL
     server.start()
     res = server.make_stream_request("POST", "/chat/completions", data={
@@ -233,8 +235,10 @@ def test_invalid_chat_completion_req(messages):
     assert "error" in res.body
 
 
-def test_chat_completion_with_timings_per_token():
+@pytest.mark.parametrize("http_epoll", HTTP_EPOLL_MODES)
+def test_chat_completion_with_timings_per_token(http_epoll: bool):
     global server
+    server.http_epoll = http_epoll
     server.start()
     res = server.make_stream_request("POST", "/chat/completions", data={
         "max_tokens": 10,
@@ -277,8 +281,10 @@ def test_logprobs():
     assert aggregated_text == output_text
 
 
-def test_logprobs_stream():
+@pytest.mark.parametrize("http_epoll", HTTP_EPOLL_MODES)
+def test_logprobs_stream(http_epoll: bool):
     global server
+    server.http_epoll = http_epoll
     server.start()
     client = OpenAI(api_key="dummy", base_url=f"http://{server.server_host}:{server.server_port}/v1")
     res = client.chat.completions.create(
@@ -41,8 +41,10 @@ def test_completion(prompt: str, n_predict: int, re_content: str, n_prompt: int,
     ("I believe the meaning of life is", 8, "(going|bed)+", 18, 8, False),
     ("Write a joke about AI from a very long prompt which will not be truncated", 256, "(princesses|everyone|kids|Anna|forest)+", 46, 64, False),
 ])
-def test_completion_stream(prompt: str, n_predict: int, re_content: str, n_prompt: int, n_predicted: int, truncated: bool):
+@pytest.mark.parametrize("http_epoll", HTTP_EPOLL_MODES)
+def test_completion_stream(prompt: str, n_predict: int, re_content: str, n_prompt: int, n_predicted: int, truncated: bool, http_epoll: bool):
     global server
+    server.http_epoll = http_epoll
     server.start()
     res = server.make_stream_request("POST", "/completion", data={
         "n_predict": n_predict,
@@ -69,8 +71,10 @@ def test_completion_stream(prompt: str, n_predict: int, re_content: str, n_promp
             content += data["content"]
 
 
-def test_completion_stream_vs_non_stream():
+@pytest.mark.parametrize("http_epoll", HTTP_EPOLL_MODES)
+def test_completion_stream_vs_non_stream(http_epoll: bool):
     global server
+    server.http_epoll = http_epoll
     server.start()
     res_stream = server.make_stream_request("POST", "/completion", data={
         "n_predict": 8,
@@ -102,8 +106,10 @@ def test_completion_with_openai_library():
     assert match_regex("(going|bed)+", res.choices[0].text)
 
 
-def test_completion_stream_with_openai_library():
+@pytest.mark.parametrize("http_epoll", HTTP_EPOLL_MODES)
+def test_completion_stream_with_openai_library(http_epoll: bool):
     global server
+    server.http_epoll = http_epoll
     server.start()
     client = OpenAI(api_key="dummy", base_url=f"http://{server.server_host}:{server.server_port}/v1")
     res = client.completions.create(
@@ -353,8 +359,10 @@ def test_n_probs():
             assert "bytes" in prob and type(prob["bytes"]) == list
 
 
-def test_n_probs_stream():
+@pytest.mark.parametrize("http_epoll", HTTP_EPOLL_MODES)
+def test_n_probs_stream(http_epoll: bool):
     global server
+    server.http_epoll = http_epoll
     server.start()
     res = server.make_stream_request("POST", "/completion", data={
         "prompt": "I believe the meaning of life is",
@@ -0,0 +1,110 @@
+import pytest
+import socket
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.server_slots = True
+
+
+def make_raw_request(method: str, path: str, body: dict | None = None, close: bool = False) -> bytes:
+    content = json.dumps(body).encode() if body is not None else b""
+    headers = f"{method} {path} HTTP/1.1\r\nHost: {server.server_host}\r\n"
+    if body is not None:
+        headers += f"Content-Type: application/json\r\nContent-Length: {len(content)}\r\n"
+    if close:
+        headers += "Connection: close\r\n"
+    return (headers + "\r\n").encode() + content
+
+
+def read_until_closed(sock: socket.socket) -> bytes:
+    data = b""
+    while True:
+        chunk = sock.recv(65536)
+        if not chunk:
+            return data
+        data += chunk
+
+
+@pytest.mark.parametrize("http_epoll", HTTP_EPOLL_MODES)
+def test_stream_client_disconnect(http_epoll: bool):
+    global server
+    server.http_epoll = http_epoll
+    server.n_predict = -1
+    server.start()
+    # the generation only ends when the task is cancelled
+    sock = socket.create_connection((server.server_host, server.server_port))
+    sock.sendall(make_raw_request("POST", "/completion", {
+        "prompt": "I believe the meaning of life is",
+        "n_predict": -1,
+        "ignore_eos": True,
+        "stream": True,
+    }))
+    data = b""
+    while data.count(b"data: ") < 4:
+        chunk = sock.recv(4096)
+        assert chunk
+        data += chunk
+    sock.close()
+    # the only slot is released and serves the next request
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 8,
+    }, timeout=10)
+    assert res.status_code == 200
+    assert res.body["timings"]["predicted_n"] == 8
+    res = server.make_request("GET", "/slots")
+    assert res.status_code == 200
+    assert not res.body[0]["is_processing"]
+
+
+@pytest.mark.skipif(True not in HTTP_EPOLL_MODES, reason="the epoll event loop is only supported on Linux")
+def test_pipelined_requests():
+    global server
+    # the thread per connection front-end waits for new data on the socket and does not serve pipelined requests
+    server.http_epoll = True
+    server.start()
+    sock = socket.create_connection((server.server_host, server.server_port))
+    sock.settimeout(10)
+    sock.sendall(
+        make_raw_request("POST", "/completion", {"prompt": "I believe the meaning of life is", "n_predict": 4, "stream": True}) +
+        make_raw_request("POST", "/completion", {"prompt": "I believe the meaning of life is", "n_predict": 4}) +
+        make_raw_request("GET", "/health") +
+        make_raw_request("POST", "/tokenize", {"content": "hello"}, close=True)
+    )
+    responses = read_until_closed(sock).split(b"HTTP/1.1 ")[1:]
+    sock.close()
+    # the responses come back in the order of the requests
+    assert len(responses) == 4
+    assert all(r.startswith(b"200") for r in responses)
+    assert b"text/event-stream" in responses[0] and responses[0].count(b"data: ") == 5
+    assert b'"timings"' in responses[1] and b"data: " not in responses[1]
+    assert b'"ok"' in responses[2]
+    assert b'"tokens"' in responses[3]
+
+
+@pytest.mark.skipif(True not in HTTP_EPOLL_MODES, reason="the epoll event loop is only supported on Linux")
+@pytest.mark.parametrize("headers,body", [
+    ("Content-Length: 99999999999999999999999\r\n", b"{}"),
+    ("Transfer-Encoding: chunked\r\n", b"fffffffffffffffffffff\r\n{}\r\n0\r\n\r\n"),
+])
+def test_payload_too_large(headers: str, body: bytes):
+    global server
+    server.http_epoll = True
+    server.start()
+    # the body sizes overflow 64 bits, the request is rejected before reading the body
+    sock = socket.create_connection((server.server_host, server.server_port))
+    sock.settimeout(10)
+    sock.sendall(f"POST /tokenize HTTP/1.1\r\nHost: {server.server_host}\r\nContent-Type: application/json\r\n{headers}\r\n".encode() + body)
+    response = read_until_closed(sock)
+    sock.close()
+    assert response.startswith(b"HTTP/1.1 413")
+    # the server still serves the next requests
+    res = server.make_request("POST", "/tokenize", data={"content": "hello"})
+    assert res.status_code == 200
@@ -0,0 +1,99 @@
+import pytest
+import glob
+import shutil
+import time
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+SENTENCES = [
+    "The quick brown fox jumps over the lazy dog. ",
+    "Once upon a time, there was a small village. ",
+    "I believe the meaning of life is to be happy. ",
+]
+
+QUESTION = "What is the capital of France?"
+
+KV_TIER_PATH = "./tmp/kv-tiers"
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.n_ctx = 2048
+    server.temperature = 0.0
+
+
+def make_prompt(sentence: str, n_tokens: int) -> str:
+    # repeat the sentence to get about n_tokens tokens
+    res = server.make_request("POST", "/tokenize", data={"content": sentence})
+    assert res.status_code == 200
+    return sentence * (n_tokens // len(res.body["tokens"]) + 1)
+
+
+def complete(prompt: str, id_slot: int = -1) -> int:
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 4,
+        "id_slot": id_slot,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    return res.body["timings"]["prompt_n"]
+
+
+def test_restore_from_host_tier():
+    global server
+    server.kv_tier_host = 64
+    server.start()
+
+    prompt = make_prompt(SENTENCES[0], 256)
+    n_full = complete(prompt)
+
+    # the KV of the first prompt is moved to the host memory tier when the slot processes another prompt
+    complete(make_prompt(SENTENCES[1], 256))
+
+    assert complete(prompt + QUESTION) < n_full // 4
+
+
+def test_restore_from_disk_tier():
+    global server
+    shutil.rmtree(KV_TIER_PATH, ignore_errors=True)
+    os.makedirs(KV_TIER_PATH)
+    server.kv_tier_host = 1
+    server.kv_tier_disk = 64
+    server.kv_tier_path = KV_TIER_PATH
+    server.start()
+
+    # the KV of the first two prompts does not fit in 1 MiB of host memory, the first one is written to disk
+    prompts = [make_prompt(sentence, 1000) for sentence in SENTENCES]
+    n_full = [complete(prompt) for prompt in prompts][0]
+
+    for _ in range(50):
+        if len(glob.glob(os.path.join(KV_TIER_PATH, "kv-tier-*.bin"))) > 0:
+            break
+        time.sleep(0.1)
+    assert len(glob.glob(os.path.join(KV_TIER_PATH, "kv-tier-*.bin"))) > 0
+
+    assert complete(prompts[0] + QUESTION) < n_full // 4
+
+
+def test_restore_while_evicting_prefix_cache():
+    global server
+    server.n_slots = 2
+    server.n_ctx = 2560
+    server.n_prefix_cache = 1100
+    server.kv_tier_host = 1
+    server.kv_tier_disk = None
+    server.kv_tier_path = None
+    server.start()
+
+    # the first prompt goes from slot 0 to the prefix cache, then to the host memory tier
+    prompts = [make_prompt(sentence, 1000) for sentence in SENTENCES]
+    n_full = [complete(prompt, id_slot=0) for prompt in prompts][0]
+
+    # the second prompt in the prefix cache and the third one in slot 0 leave no room for the first one in the KV cache,
+    # the prefix cache entry is evicted to the KV tiers while the first prompt is restored to slot 1
+    assert complete(prompts[0] + QUESTION, id_slot=1) < n_full // 4
@@ -0,0 +1,68 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+LONG_PREFIX = "The quick brown fox jumps over the lazy dog. " * 8
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 2
+    server.n_ctx = 1024
+    server.n_prefix_cache = 512
+    server.temperature = 0.0
+
+
+def test_prefix_reused_across_slots():
+    global server
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PREFIX + "What is the capital of France?",
+        "id_slot": 0,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    n_full = res.body["timings"]["prompt_n"]
+
+    # slot 1 has an empty cache, but the prefix is held by slot 0
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PREFIX + "What is the capital of Germany?",
+        "id_slot": 1,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] < n_full // 4
+
+
+def test_prefix_reused_after_eviction():
+    global server
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PREFIX + "What is the capital of France?",
+        "id_slot": 0,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    n_full = res.body["timings"]["prompt_n"]
+
+    # overwrite both slots with unrelated prompts - the first prompt goes to the prefix cache
+    for id_slot in [0, 1]:
+        res = server.make_request("POST", "/completion", data={
+            "prompt": "Once upon a time, there was a small village",
+            "id_slot": id_slot,
+            "cache_prompt": True,
+        })
+        assert res.status_code == 200
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PREFIX + "What is the capital of Italy?",
+        "id_slot": 1,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] < n_full // 4
@@ -0,0 +1,82 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+LONG_PROMPT = "The quick brown fox jumps over the lazy dog. " * 16
+SHORT_PROMPT = "I believe the meaning of life is"
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 3
+    server.n_ctx = 2048
+    server.n_sched_budget = 16
+    server.temperature = 0.0
+
+
+@pytest.mark.parametrize("sched_policy", ["decode-first", "fair", "priority"])
+def test_chunked_prompts_match_sequential(sched_policy: str):
+    global server
+    server.sched_policy = sched_policy
+    server.start()
+
+    prompts = [LONG_PROMPT, SHORT_PROMPT, LONG_PROMPT + SHORT_PROMPT]
+
+    def complete(prompt: str, priority: int):
+        return server.make_request("POST", "/completion", data={
+            "prompt": prompt,
+            "n_predict": 8,
+            "cache_prompt": False,
+            "priority": priority,
+        })
+
+    expected = [complete(prompt, 0).body["content"] for prompt in prompts]
+
+    # the prompts are longer than the budget - they are processed in chunks interleaved with each other
+    results = parallel_function_calls([(complete, (prompt, i)) for i, prompt in enumerate(prompts)])
+    for res, content in zip(results, expected):
+        assert res.status_code == 200
+        assert res.body["content"] == content
+
+
+def test_priority_in_generation_settings():
+    global server
+    server.start()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": SHORT_PROMPT,
+        "n_predict": 1,
+        "priority": 5,
+    })
+    assert res.status_code == 200
+    assert res.body["generation_settings"]["priority"] == 5
+
+
+def test_priority_overtakes_queued_request():
+    global server
+    server.n_slots = 1
+    server.sched_policy = "priority"
+    server.start()
+
+    done = []
+
+    def complete(name: str, priority: int, n_predict: int, delay: float):
+        time.sleep(delay)
+        res = server.make_request("POST", "/completion", data={
+            "prompt": SHORT_PROMPT,
+            "n_predict": n_predict,
+            "ignore_eos": True,
+            "priority": priority,
+        })
+        assert res.status_code == 200
+        done.append(name)
+
+    # the first request takes the only slot, the two others wait in the queue and the one with the higher priority is served first
+    parallel_function_calls([
+        (complete, ("busy", 0, 256, 0.0)),
+        (complete, ("low",  0, 8,   0.2)),
+        (complete, ("high", 5, 8,   0.4)),
+    ])
+    assert done == ["busy", "high", "low"]
@@ -108,6 +108,7 @@ def test_with_ctx_shift():
 @pytest.mark.parametrize("n_slots,n_requests", [
     (1, 2),
     (2, 2),
+    (4, 8),
 ])
 def test_multi_requests_parallel(n_slots: int, n_requests: int):
     global server
@@ -124,3 +125,42 @@ def test_multi_requests_parallel(n_slots: int, n_requests: int):
     for res in results:
         assert res.status_code == 200
         assert match_regex("(wise|kind|owl|answer)+", res.body["content"])
+
+
+def test_multi_requests_parallel_with_and_without_draft():
+    global server
+    prompts = [
+        "I believe the meaning of life is",
+        "Once upon a time",
+        "The little owl",
+        "Lily and her mom",
+    ]
+
+    def run_requests():
+        tasks = []
+        for prompt in prompts:
+            tasks.append((server.make_request, ("POST", "/completion", {
+                "prompt": prompt,
+                "n_predict": 24,
+                "temperature": 0.0,
+                "top_k": 1,
+            })))
+        results = parallel_function_calls(tasks)
+        for res in results:
+            assert res.status_code == 200
+            assert res.body["tokens_predicted"] == 24
+        return [res.body["content"] for res in results]
+
+    server.model_draft = None  # disable draft model
+    server.n_slots = len(prompts)
+    server.start()
+    contents_no_draft = run_requests()
+    server.stop()
+
+    # the drafts of all slots are generated and verified in shared batches
+    create_server()
+    server.n_slots = len(prompts)
+    server.start()
+    contents_draft = run_requests()
+
+    assert contents_no_draft == contents_draft
@@ -67,6 +67,13 @@ class ServerProcess:
     id_slot: int | None = None
     cache_prompt: bool | None = None
     n_slots: int | None = None
+    n_prefix_cache: int | None = None
+    kv_tier_host: int | None = None
+    kv_tier_disk: int | None = None
+    kv_tier_path: str | None = None
+    n_sched_budget: int | None = None
+    sched_policy: str | None = None
+    http_epoll: bool | None = None
     ctk: str | None = None
     ctv: str | None = None
     fa: bool | None = None
@@ -157,6 +164,20 @@ class ServerProcess:
             server_args.extend(["--ctx-size", self.n_ctx])
         if self.n_slots:
             server_args.extend(["--parallel", self.n_slots])
+        if self.n_prefix_cache:
+            server_args.extend(["--prefix-cache", self.n_prefix_cache])
+        if self.kv_tier_host:
+            server_args.extend(["--kv-tier-host", self.kv_tier_host])
+        if self.kv_tier_disk:
+            server_args.extend(["--kv-tier-disk", self.kv_tier_disk])
+        if self.kv_tier_path:
+            server_args.extend(["--kv-tier-path", self.kv_tier_path])
+        if self.n_sched_budget:
+            server_args.extend(["--sched-budget", self.n_sched_budget])
+        if self.sched_policy:
+            server_args.extend(["--sched-policy", self.sched_policy])
+        if self.http_epoll:
+            server_args.append("--http-epoll")
         if self.ctk:
             server_args.extend(["-ctk", self.ctk])
         if self.ctv:
@@ -294,6 +315,9 @@ class ServerProcess:
 
 server_instances: Set[ServerProcess] = set()
 
+# the HTTP connections can run on an epoll event loop on Linux only
+HTTP_EPOLL_MODES = [False, True] if sys.platform == "linux" else [False]
+
 
 class ServerPreset:
     @staticmethod
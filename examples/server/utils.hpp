@@ -516,7 +516,7 @@ static std::string tokens_to_output_formatted_string(const llama_context * ctx,
     return out;
 }
 
-static bool server_sent_event(httplib::DataSink & sink, const char * event, const json & data) {
+static std::string format_server_sent_event(const char * event, const json & data) {
     const std::string str =
         std::string(event) + ": " +
         data.dump(-1, ' ', false, json::error_handler_t::replace) +
@@ -524,7 +524,7 @@ static bool server_sent_event(httplib::DataSink & sink, const char * event, cons
 
     LOG_DBG("data stream, to_send: %s", str.c_str());
 
-    return sink.write(str.c_str(), str.size());
+    return str;
 }
 
 //
@@ -9,6 +9,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <complex>
 #include <cstdio>
 #include <fstream>
 #include <map>
@@ -87,29 +88,61 @@ struct wav_header {
     uint32_t data_size;
 };
 
-static bool save_wav16(const std::string & fname, const std::vector<float> & data, int sample_rate) {
-    std::ofstream file(fname, std::ios::binary);
-    if (!file) {
-        LOG_ERR("%s: Failed to open file '%s' for writing.\n", __func__, fname.c_str());
-        return false;
+// writes 16-bit PCM samples as they are produced
+// the sizes in the header are only known when the file is closed, a reader of a pipe sees the maximum sizes
+struct wav_writer {
+    std::ofstream file;
+    wav_header    header;
+    uint32_t      n_samples = 0;
+
+    std::vector<int16_t> pcm;
+
+    bool open(const std::string & fname, int sample_rate) {
+        file.open(fname, std::ios::binary);
+        if (!file) {
+            LOG_ERR("%s: Failed to open file '%s' for writing.\n", __func__, fname.c_str());
+            return false;
+        }
+
+        header.sample_rate = sample_rate;
+        header.byte_rate = header.sample_rate * header.num_channels * (header.bits_per_sample / 8);
+        header.block_align = header.num_channels * (header.bits_per_sample / 8);
+        header.data_size = UINT32_MAX - 36;
+        header.chunk_size = UINT32_MAX;
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        return file.good();
     }
 
-    wav_header header;
-    header.sample_rate = sample_rate;
-    header.byte_rate = header.sample_rate * header.num_channels * (header.bits_per_sample / 8);
-    header.block_align = header.num_channels * (header.bits_per_sample / 8);
-    header.data_size = data.size() * (header.bits_per_sample / 8);
-    header.chunk_size = 36 + header.data_size;
+    bool write(const std::vector<float> & data) {
+        pcm.resize(data.size());
+        for (size_t i = 0; i < data.size(); ++i) {
+            pcm[i] = static_cast<int16_t>(std::clamp(data[i] * 32767.0, -32768.0, 32767.0));
+        }
+
+        file.write(reinterpret_cast<const char*>(pcm.data()), pcm.size() * sizeof(int16_t));
+        file.flush();
 
-    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        n_samples += data.size();
 
-    for (const auto & sample : data) {
-        int16_t pcm_sample = static_cast<int16_t>(std::clamp(sample * 32767.0, -32768.0, 32767.0));
-        file.write(reinterpret_cast<const char*>(&pcm_sample), sizeof(pcm_sample));
+        return file.good();
     }
 
-    return file.good();
-}
+    bool close() {
+        header.data_size = n_samples * (header.bits_per_sample / 8);
+        header.chunk_size = 36 + header.data_size;
+
+        bool ok = file.good();
+        if (file.seekp(0)) {
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            ok = file.good();
+        }
+        file.close();
+
+        return ok;
+    }
+};
 
 static void fill_hann_window(int length, bool periodic, float * output) {
     int offset = -1;
@@ -121,161 +154,356 @@ static void fill_hann_window(int length, bool periodic, float * output) {
     }
 }
 
-// very poor-man fft
-static void twiddle(float * real, float * imag, int k, int N) {
-    float angle = 2 * M_PI * k / N;
-    *real = cos(angle);
-    *imag = sin(angle);
+typedef std::complex<float> cplx;
+
+// std::complex multiplication handles inf/nan and is not inlined without -ffast-math
+static inline cplx cmul(cplx a, cplx b) {
+    return { a.real()*b.real() - a.imag()*b.imag(), a.real()*b.imag() + a.imag()*b.real() };
 }
 
-static void irfft(int n, const float * inp_cplx, float * out_real) {
-    int N = n / 2 + 1;
+// mixed-radix complex FFT, out[k] = sum_j in[j] e^(2 pi i j k / n)
+// the sign is the one of the inverse transform and the result is not normalized
+// n_fft = 1280 of the vocoder is 2^8 * 5, so the radix-4 and radix-2 butterflies do most of the work
+struct fft_plan {
+    int n;
+
+    std::vector<int>  factors;
+    std::vector<cplx> w; // e^(2 pi i k / n)
+
+    explicit fft_plan(int n) : n(n), w(n) {
+        int m = n;
+        for (int p : { 4, 2, 3, 5 }) {
+            while (m % p == 0) {
+                factors.push_back(p);
+                m /= p;
+            }
+        }
+        for (int p = 7; m > 1; p += 2) {
+            while (m % p == 0) {
+                factors.push_back(p);
+                m /= p;
+            }
+        }
+
+        for (int k = 0; k < n; ++k) {
+            const double angle = 2.0 * M_PI * k / n;
+            w[k] = cplx(cos(angle), sin(angle));
+        }
+    }
 
-    std::vector<float> real_input(N);
-    std::vector<float> imag_input(N);
-    for (int i = 0; i < N; ++i) {
-        real_input[i] = inp_cplx[2 * i];
-        imag_input[i] = inp_cplx[2 * i + 1];
+    void compute(const cplx * in, cplx * out) const {
+        compute(in, out, 1, 0);
     }
 
-    std::vector<float> real_output(n);
-    std::vector<float> imag_output(n);
+private:
+    // DFT of the n/stride samples in[0], in[stride], ... using the factors from f on
+    void compute(const cplx * in, cplx * out, int stride, size_t f) const {
+        const int m = n/stride;
+        if (m == 1) {
+            out[0] = in[0];
+            return;
+        }
 
-    for (int k = 0; k < n; ++k) {
-        real_output[k] = 0.0f;
-        imag_output[k] = 0.0f;
-        for (int m = 0; m < N; ++m) {
-            float twiddle_real;
-            float twiddle_imag;
+        const int p = factors[f];
+        const int q = m/p;
 
-            twiddle(&twiddle_real, &twiddle_imag, k * m, n);
+        // DFTs of the p decimated sequences, the r-th one is written to out[r*q, (r + 1)*q)
+        for (int r = 0; r < p; ++r) {
+            compute(in + r*stride, out + r*q, stride*p, f + 1);
+        }
 
-            real_output[k] += real_input[m] * twiddle_real - imag_input[m] * twiddle_imag;
-            imag_output[k] += real_input[m] * twiddle_imag + imag_input[m] * twiddle_real;
+        cplx t[5];
+        std::vector<cplx> tg;
+        if (p > 5) {
+            tg.resize(p);
+        }
+        cplx * tr = p > 5 ? tg.data() : t;
+
+        // out[k + s*q] = sum_r e^(2 pi i r (k + s*q) / m) out[k + r*q]
+        for (int k = 0; k < q; ++k) {
+            tr[0] = out[k];
+            for (int r = 1; r < p; ++r) {
+                tr[r] = cmul(out[k + r*q], w[r*k*stride]);
+            }
+
+            switch (p) {
+                case 2:
+                    {
+                        out[k    ] = tr[0] + tr[1];
+                        out[k + q] = tr[0] - tr[1];
+                    } break;
+                case 4:
+                    {
+                        const cplx a0 = tr[0] + tr[2];
+                        const cplx a1 = tr[0] - tr[2];
+                        const cplx a2 = tr[1] + tr[3];
+                        const cplx d3 = tr[1] - tr[3];
+                        const cplx a3 = cplx(-d3.imag(), d3.real()); // i*(t1 - t3)
+
+                        out[k      ] = a0 + a2;
+                        out[k +   q] = a1 + a3;
+                        out[k + 2*q] = a0 - a2;
+                        out[k + 3*q] = a1 - a3;
+                    } break;
+                default:
+                    {
+                        for (int s = 0; s < p; ++s) {
+                            cplx sum = tr[0];
+                            for (int r = 1; r < p; ++r) {
+                                sum += cmul(tr[r], w[((r*s) % p)*(n/p)]);
+                            }
+                            out[k + s*q] = sum;
+                        }
+                    } break;
+            }
         }
     }
+};
+
+// inverse real FFT of even size n from its n/2 + 1 complex bins, normalized like numpy.fft.irfft
+// the even and odd samples are computed together as the real and imaginary parts of a complex FFT of size n/2
+struct irfft_plan {
+    int n;
 
-    for (int i = 0; i < n; ++i) {
-        out_real[i] = real_output[i] / N;
+    fft_plan          fft;
+    std::vector<cplx> w; // e^(2 pi i k / n), k < n/2
+
+    explicit irfft_plan(int n) : n(n), fft(n/2), w(n/2) {
+        for (int k = 0; k < n/2; ++k) {
+            const double angle = 2.0 * M_PI * k / n;
+            w[k] = cplx(cos(angle), sin(angle));
+        }
     }
-}
 
+    // inp_cplx: n/2 + 1 interleaved (real, imag) bins, buf: scratch of n complex values
+    void compute(const float * inp_cplx, float * out_real, std::vector<cplx> & buf) const {
+        const int m = n/2;
+
+        buf.resize(2*m);
+
+        cplx * z   = buf.data();
+        cplx * res = buf.data() + m;
+
+        // the imaginary parts of the DC and Nyquist bins do not contribute to a real signal
+        auto bin = [&](int k) {
+            return cplx(inp_cplx[2*k], k == 0 || k == m ? 0.0f : inp_cplx[2*k + 1]);
+        };
+
+        for (int k = 0; k < m; ++k) {
+            const cplx xk = bin(k);
+            const cplx xc = std::conj(bin(m - k));
+
+            // spectra of the even samples (xk + xc) and of the odd samples (xk - xc) e^(2 pi i k / n), times 2
+            const cplx d = cmul(xk - xc, w[k]);
+            z[k] = (xk + xc) + cplx(-d.imag(), d.real());
+        }
+
+        fft.compute(z, res);
+
+        const float scale = 1.0f/n;
+        for (int j = 0; j < m; ++j) {
+            out_real[2*j + 0] = res[j].real()*scale;
+            out_real[2*j + 1] = res[j].imag()*scale;
+        }
+    }
+};
+
+// inverse STFT of the vocoder output, computed as the frames arrive:
+// the windowed frames are overlap-added and a sample is returned once no later frame overlaps it
+//
+// this is the incremental form of
 //
 //  y = torch.nn.functional.fold(
 //       data, output_size=(1, output_size), kernel_size=(1, self.win_length), stride=(1, self.hop_length),
 //  )[:, 0, 0, pad:-pad]
 //
-// data.shape =  torch.Size([1, 1280, 261])
-// output_size =  84480
-// win_length =  1280
-// hop_length =  320
-// pad =  480
-//
-static void fold(const std::vector<float> & data, int64_t n_out, int64_t n_win, int64_t n_hop, int64_t n_pad, std::vector<float> & output) {
-    int64_t output_height = n_out;
-    int64_t kernel_w = n_win;
-    int64_t stride_w = n_hop;
-    int64_t width    = n_out;
-
-    output.resize(width, 0.0f);
-
-    int64_t col_idx = 0;
-    for (int64_t w_col = 0; w_col < width; ++w_col) {
-        int64_t start = w_col * stride_w - n_pad;
-        int64_t end   = start + kernel_w;
-
-        for (int64_t w_im = start; w_im < end; ++w_im) {
-            if (w_im >= 0 && w_im < output_height && col_idx < (int64_t) data.size()) {
-                output[w_im] += data[col_idx];
-            }
-            col_idx++;
-        }
-    }
-
-    output.resize(n_out - 2 * n_pad);
-}
-
-// TODO: not optimized at all
-static std::vector<float> embd_to_audio(
-        const float * embd,
-        const int n_codes,
-        const int n_embd,
-        const int n_thread) {
+// normalized by the folded squared window, with win_length = 1280, hop_length = 320, pad = 480
+struct vocoder_istft {
     const int n_fft = 1280;
     const int n_hop = 320;
     const int n_win = 1280;
     const int n_pad = (n_win - n_hop)/2;
-    const int n_out = (n_codes - 1)*n_hop + n_win;
 
-    std::vector<float> hann(n_fft);
+    irfft_plan irfft;
 
-    fill_hann_window(hann.size(), true, hann.data());
+    std::vector<float> hann;
 
-    int n_spec = n_embd*n_codes;
+    // overlap-added frames and squared windows, from sample n_done on
+    std::vector<float> audio;
+    std::vector<float> env;
 
-    std::vector<float> E (n_spec);
-    std::vector<float> S (n_spec);
-    std::vector<float> ST(n_spec);
+    int64_t n_frames = 0;
+    int64_t n_done   = 0; // samples returned so far, including the n_pad samples that are cut at the start
 
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd; ++k) {
-            E[k*n_codes + l] = embd[l*n_embd + k];
-        }
+    vocoder_istft() : irfft(n_fft), hann(n_fft) {
+        fill_hann_window(hann.size(), true, hann.data());
     }
 
-    for (int k = 0; k < n_embd/2; ++k) {
-        for (int l = 0; l < n_codes; ++l) {
-            float mag = E[(k           )*n_codes + l];
-            float phi = E[(k + n_embd/2)*n_codes + l];
+    // add the frames of n_codes vocoder outputs
+    void add(const float * embd, int n_codes, int n_embd, int n_thread) {
+        std::vector<float> res(n_codes*n_fft);
+
+        n_thread = std::max(1, std::min(n_thread, n_codes));
+
+        std::vector<std::thread> workers(n_thread);
+        for (int i = 0; i < n_thread; ++i) {
+            workers[i] = std::thread([&, i]() {
+                std::vector<float> spec(n_embd);
+                std::vector<cplx>  buf;
 
-            mag = exp(mag);
+                for (int l = i; l < n_codes; l += n_thread) {
+                    const float * e = embd + l*n_embd;
 
-            if (mag > 1e2) {
-                mag = 1e2;
+                    // the first half of the embedding is the log-magnitude, the second half the phase
+                    for (int k = 0; k < n_embd/2; ++k) {
+                        const float mag = std::min(expf(e[k]), 1e2f);
+                        const float phi = e[k + n_embd/2];
+
+                        spec[2*k + 0] = mag*cosf(phi);
+                        spec[2*k + 1] = mag*sinf(phi);
+                    }
+
+                    irfft.compute(spec.data(), res.data() + l*n_fft, buf);
+
+                    for (int j = 0; j < n_fft; ++j) {
+                        res[l*n_fft + j] *= hann[j];
+                    }
+                }
+            });
+        }
+        for (int i = 0; i < n_thread; ++i) {
+            workers[i].join();
+        }
+
+        const int64_t n_end = (n_frames + n_codes - 1)*n_hop + n_win;
+
+        audio.resize(n_end - n_done, 0.0f);
+        env  .resize(n_end - n_done, 0.0f);
+
+        for (int l = 0; l < n_codes; ++l) {
+            const int64_t i0 = (n_frames + l)*n_hop - n_done;
+            for (int j = 0; j < n_win; ++j) {
+                audio[i0 + j] += res[l*n_fft + j];
+                env  [i0 + j] += hann[j]*hann[j];
             }
-            S[2*(k*n_codes + l) + 0] = mag*cosf(phi);
-            S[2*(k*n_codes + l) + 1] = mag*sinf(phi);
         }
+
+        n_frames += n_codes;
     }
 
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd/2; ++k) {
-            ST[l*n_embd + 2*k + 0] = S[2*(k*n_codes + l) + 0];
-            ST[l*n_embd + 2*k + 1] = S[2*(k*n_codes + l) + 1];
+    // the samples that are complete, or all the remaining samples of the utterance if last
+    void pop(std::vector<float> & out, bool last) {
+        out.clear();
+
+        if (n_frames == 0) {
+            return;
         }
-    }
 
-    std::vector<float> res  (n_codes*n_fft);
-    std::vector<float> hann2(n_codes*n_fft);
-
-    std::vector<std::thread> workers(n_thread);
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i] = std::thread([&, i]() {
-            for (int l = i; l < n_codes; l += n_thread) {
-                irfft(n_fft, ST.data() + l*n_embd, res.data() + l*n_fft);
-                for (int j = 0; j < n_fft; ++j) {
-                    res  [l*n_fft + j] *= hann[j];
-                    hann2[l*n_fft + j]  = hann[j] * hann[j];
-                }
-            }
-        });
-    }
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i].join();
+        const int64_t n_end = last ? n_frames*n_hop + n_pad : n_frames*n_hop;
+
+        for (int64_t i = std::max<int64_t>(n_done, n_pad); i < n_end; ++i) {
+            out.push_back(audio[i - n_done] / env[i - n_done]);
+        }
+
+        if (n_end > n_done) {
+            audio.erase(audio.begin(), audio.begin() + (n_end - n_done));
+            env  .erase(env  .begin(), env  .begin() + (n_end - n_done));
+            n_done = n_end;
+        }
     }
+};
+
+// runs the vocoder on the audio codes as they are generated and appends the audio to a wav file
+// the vocoder is not causal, so a chunk of n_chunk codes is decoded together with n_ctx codes of context on
+// each side and its audio is written as soon as the n_ctx codes after it have been generated
+// with n_chunk = 0 all the codes are decoded at once when the generation ends
+struct vocoder_stream {
+    llama_context * ctx;
+
+    int n_embd;
+    int n_chunk;
+    int n_ctx;
+    int n_thread;
+
+    std::vector<llama_token> codes; // audio codes, relative to the first audio token
+
+    int n_decoded = 0;
+
+    vocoder_istft istft;
+    wav_writer    wav;
 
     std::vector<float> audio;
-    std::vector<float> env;
 
-    fold(res,   n_out, n_win, n_hop, n_pad, audio);
-    fold(hann2, n_out, n_win, n_hop, n_pad, env); // TODO: can be done once
+    int64_t t_voc_us         = 0;
+    int64_t t_first_audio_us = -1;
+
+    bool add(llama_token code) {
+        codes.push_back(code);
 
-    for (size_t i = 0; i < audio.size(); ++i) {
-        audio[i] /= env[i];
+        if (n_chunk > 0 && (int) codes.size() >= n_decoded + n_chunk + n_ctx) {
+            return decode(n_decoded + n_chunk, false);
+        }
+
+        return true;
     }
 
-    return audio;
-}
+    bool finish() {
+        return decode(codes.size(), true) && wav.close();
+    }
+
+private:
+    bool decode(int c1, bool last) {
+        const int64_t t_start_us = ggml_time_us();
+
+        if (c1 > n_decoded) {
+            const int w0 = std::max(0, n_decoded - n_ctx);
+            const int w1 = last ? (int) codes.size() : std::min((int) codes.size(), c1 + n_ctx);
+
+            // each window starts again at position 0 - drop the cells of the previous one, or the KV cache of the
+            // vocoder fills up once more codes than its n_ctx have been decoded
+            llama_kv_self_seq_rm(ctx, 0, -1, -1);
+
+            llama_batch batch = llama_batch_init(w1 - w0, 0, 1);
+
+            for (int i = w0; i < w1; ++i) {
+                common_batch_add(batch, codes[i], i - w0, { 0 }, true);
+            }
+
+            const int ret = llama_decode(ctx, batch);
+
+            llama_batch_free(batch);
+
+            if (ret != 0) {
+                LOG_ERR("%s: llama_decode() failed\n", __func__);
+                return false;
+            }
+
+            istft.add(llama_get_embeddings(ctx) + (n_decoded - w0)*n_embd, c1 - n_decoded, n_embd, n_thread);
+
+            n_decoded = c1;
+        }
+
+        istft.pop(audio, last);
+
+        // zero out first 0.25 seconds
+        for (size_t i = 0; i < audio.size() && wav.n_samples + i < (size_t) wav.header.sample_rate/4; ++i) {
+            audio[i] = 0.0f;
+        }
+
+        if (!wav.write(audio)) {
+            LOG_ERR("%s: failed to write audio\n", __func__);
+            return false;
+        }
+
+        if (t_first_audio_us < 0 && !audio.empty()) {
+            t_first_audio_us = ggml_time_us();
+        }
+
+        t_voc_us += ggml_time_us() - t_start_us;
+
+        return true;
+    }
+};
 
 static const std::map<int, std::string> ones = {
     {0, "zero"}, {1, "one"}, {2, "two"}, {3, "three"}, {4, "four"},
@@ -603,6 +831,22 @@ int main(int argc, char ** argv) {
 
     LOG_INF("%s: loading done\n", __func__);
 
+    const int n_sr = 24000; // sampling rate
+
+    // the codes of parallel sequences are interleaved, they are only vocoded when the generation ends
+    const bool stream = params.vocoder.n_chunk > 0 && n_parallel == 1;
+
+    vocoder_stream voc;
+    voc.ctx      = ctx_cts;
+    voc.n_embd   = llama_model_n_embd(model_cts);
+    voc.n_chunk  = stream ? params.vocoder.n_chunk : 0;
+    voc.n_ctx    = params.vocoder.n_chunk_ctx;
+    voc.n_thread = params.cpuparams.n_threads;
+
+    if (!voc.wav.open(params.out_file, n_sr)) {
+        return ENOENT;
+    }
+
     const auto t_main_start = ggml_time_us();
 
     std::vector<llama_token> codes;
@@ -892,6 +1136,13 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
 
                 codes.push_back(new_token_id);
 
+                // vocode the audio codes while the generation continues
+                if (stream && new_token_id >= 151672 && new_token_id <= 155772) {
+                    if (!voc.add(new_token_id - 151672)) {
+                        return 1;
+                    }
+                }
+
                 const auto * cands = common_sampler_get_candidates(smpl[i]);
 
                 // is it an end of generation? -> mark the stream as finished
@@ -1005,85 +1256,26 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
         LOG_INF("%s: codes audio size: %d\n", __func__, (int) codes.size());
     }
 
-    for (auto & token : codes) {
-        token -= 151672;
-    }
-
-    const auto t_voc_start = ggml_time_us();
-
-    const int n_codes = codes.size();
-
-    llama_batch batch = llama_batch_init(n_codes, 0, 1);
-
-    for (size_t i = 0; i < codes.size(); ++i) {
-        common_batch_add(batch, codes[i], i, { 0 }, true); // TODO: all logits?
-    }
-    GGML_ASSERT(batch.n_tokens == n_codes);
-
-    if (llama_decode(ctx_cts, batch) != 0) {
-        LOG_ERR("%s: llama_decode() failed\n", __func__);
-        return 1;
-    }
-
-    llama_synchronize(ctx_cts);
-
-    LOG_INF("%s: time for vocoder:      %.3f ms\n", __func__, (ggml_time_us() - t_voc_start) / 1000.0f);
-
-    const auto t_spec_start = ggml_time_us();
-
-#if 1
-    // spectral operations
-    const int n_embd = llama_model_n_embd(model_cts);
-    const float * embd = llama_get_embeddings(ctx_cts);
-
-    auto audio = embd_to_audio(embd, n_codes, n_embd, params.cpuparams.n_threads);
-
-#else
-    // read the spectrogram from a file for debugging purposes
-    std::vector<float> audio;
-    {
-        std::ifstream fin("out.bin", std::ios::binary);
-        if (!fin) {
-            LOG_ERR("%s: failed to open file '%s'\n", __func__, "out.bin");
-            return 1;
+    if (!stream) {
+        for (auto token : codes) {
+            voc.add(token - 151672);
         }
-
-        std::vector<float> embd;
-
-        int n_codes;
-        int n_embd;
-
-        fin.read(reinterpret_cast<char *>(&n_codes), sizeof(int));
-        fin.read(reinterpret_cast<char *>(&n_embd), sizeof(int));
-
-        embd.resize(n_codes * n_embd);
-        fin.read(reinterpret_cast<char *>(embd.data()), n_codes * n_embd * sizeof(float));
-        fin.close();
-
-        LOG_INF("%s: n_codes: %d, n_embd: %d\n", __func__, n_codes, n_embd);
-
-        audio = embd_to_audio(embd.data(), n_codes, n_embd, params.cpuparams.n_threads);
-    }
-#endif
-
-    const int n_sr = 24000; // sampling rate
-
-    // zero out first 0.25 seconds
-    for (int i = 0; i < 24000/4; ++i) {
-        audio[i] = 0.0f;
     }
 
-    LOG_INF("%s: time for spectral ops: %.3f ms\n", __func__, (ggml_time_us() - t_spec_start) / 1000.0f);
-    LOG_INF("%s: total time:            %.3f ms\n", __func__, (ggml_time_us() - t_main_start) / 1000.0f);
-
     int retval = 0;
 
-    if (save_wav16(params.out_file, audio, n_sr)) {
+    if (voc.finish()) {
         LOG_INF("%s: audio written to file '%s'\n", __func__, params.out_file.c_str());
     } else {
         retval = ENOENT;
     }
 
+    LOG_INF("%s: time for vocoder:      %.3f ms\n", __func__, voc.t_voc_us / 1000.0f);
+    if (voc.t_first_audio_us >= 0) {
+        LOG_INF("%s: time to first audio:   %.3f ms\n", __func__, (voc.t_first_audio_us - t_main_start) / 1000.0f);
+    }
+    LOG_INF("%s: total time:            %.3f ms\n", __func__, (ggml_time_us() - t_main_start) / 1000.0f);
+
     llama_backend_free();
 
     return retval;
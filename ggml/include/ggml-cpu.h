@@ -70,6 +70,9 @@ extern "C" {
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_BACKEND_API enum ggml_status  ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    // number of nodes of the graph that are computed as a part of a fused kernel instead of on their own (for testing)
+    GGML_BACKEND_API int ggml_graph_n_fused_nodes(const struct ggml_cgraph * cgraph);
+
     //
     // system info
     //
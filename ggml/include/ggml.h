@@ -560,6 +560,7 @@ extern "C" {
         GGML_TENSOR_FLAG_OUTPUT =  2, // ...is an output for the GGML compute graph
         GGML_TENSOR_FLAG_PARAM  =  4, // ...contains trainable parameters
         GGML_TENSOR_FLAG_LOSS   =  8, // ...defines loss for numerical optimization (multiple loss tensors add up)
+        GGML_TENSOR_FLAG_SPLIT_INPUT = 16, // ...is read by another split of the backend scheduler (set by ggml_backend_sched)
     };
 
     struct ggml_init_params {
@@ -1393,6 +1394,11 @@ extern "C" {
             float                 scale,
             float                 max_bias);
 
+    // optional block summary of the mask of a ggml_soft_max_ext node (see ggml_flash_attn_ext_set_mask_blk)
+    GGML_API void ggml_soft_max_ext_set_mask_blk(
+            struct ggml_tensor * a,
+            struct ggml_tensor * blk);
+
     GGML_API struct ggml_tensor * ggml_soft_max_ext_back(
             struct ggml_context * ctx,
             struct ggml_tensor  * a,
@@ -1813,6 +1819,21 @@ extern "C" {
     GGML_API enum ggml_prec ggml_flash_attn_ext_get_prec(
             const struct ggml_tensor * a);
 
+#define GGML_KQ_MASK_BLK 32
+
+    // summary of a KQ mask in blocks of GGML_KQ_MASK_BLK KV cells
+    // the backends may skip the masked blocks and the mask reads of the zero blocks
+    enum ggml_kq_mask_blk {
+        GGML_KQ_MASK_BLK_MIXED  = 0, // any mask values
+        GGML_KQ_MASK_BLK_MASKED = 1, // all -INF
+        GGML_KQ_MASK_BLK_ZERO   = 2, // all 0.0f
+    };
+
+    // blk:  [n_kv/GGML_KQ_MASK_BLK (rounded up), n_batch_pad, 1, 1] GGML_TYPE_I8, one row per mask row
+    GGML_API void ggml_flash_attn_ext_set_mask_blk(
+            struct ggml_tensor * a,
+            struct ggml_tensor * blk);
+
     // TODO: needs to be adapted to ggml_flash_attn_ext
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
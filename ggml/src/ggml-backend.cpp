@@ -643,6 +643,7 @@ struct ggml_backend_sched {
     // hash map of the nodes in the graph
     struct ggml_hash_set  hash_set;
     int                 * hv_tensor_backend_ids; // [hash_set.size]
+    int                 * hv_tensor_split_ids;   // [hash_set.size]
     struct ggml_tensor ** hv_tensor_copies;      // [hash_set.size][n_backends][n_copies]
 
     int * node_backend_ids; // [graph_size]
@@ -1247,6 +1248,41 @@ static void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct gg
 
     struct ggml_cgraph * graph_copy = &sched->graph;
 
+    // flag the results that are read by another split, directly or through a copy
+    // the backends cannot see these reads in the graph of a split, e.g. the CPU backend must not skip storing them
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &sched->splits[i];
+        for (int j = split->i_start; j < split->i_end; j++) {
+            graph->nodes[j]->flags &= ~GGML_TENSOR_FLAG_SPLIT_INPUT;
+            sched->hv_tensor_split_ids[hash_id(graph->nodes[j])] = i;
+        }
+    }
+    auto set_split_input = [](struct ggml_tensor * t) {
+        t->flags |= GGML_TENSOR_FLAG_SPLIT_INPUT;
+        if (t->view_src) {
+            t->view_src->flags |= GGML_TENSOR_FLAG_SPLIT_INPUT;
+        }
+    };
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &sched->splits[i];
+        for (int j = 0; j < split->n_inputs; j++) {
+            set_split_input(split->inputs[j]);
+        }
+        for (int j = split->i_start; j < split->i_end; j++) {
+            for (int k = 0; k < GGML_MAX_SRC; k++) {
+                struct ggml_tensor * src = graph->nodes[j]->src[k];
+                // the copies of the inputs are not in the hash set, their sources are the inputs of the split
+                if (src == NULL || !ggml_hash_contains(&sched->hash_set, src)) {
+                    continue;
+                }
+                const int src_split_id = sched->hv_tensor_split_ids[hash_id(src)];
+                if (src_split_id != -1 && src_split_id != i) {
+                    set_split_input(src);
+                }
+            }
+        }
+    }
+
     for (int i = 0; i < sched->n_splits; i++) {
         struct ggml_backend_sched_split * split = &sched->splits[i];
         split->graph = ggml_graph_view(graph, split->i_start, split->i_end);
@@ -1468,6 +1504,7 @@ ggml_backend_sched_t ggml_backend_sched_new(
     // FIXME: needs to be size*2 to account for leafs (do it in graph_split instead)
     sched->hash_set    = ggml_hash_set_new(graph_size);
     sched->hv_tensor_backend_ids = (int *) malloc(sched->hash_set.size * sizeof(sched->hv_tensor_backend_ids[0]));
+    sched->hv_tensor_split_ids   = (int *) malloc(sched->hash_set.size * sizeof(sched->hv_tensor_split_ids[0]));
     sched->hv_tensor_copies      = (ggml_tensor **) malloc(sched->hash_set.size * sched->n_backends * sched->n_copies * sizeof(struct ggml_tensor *));
 
     const size_t ggml_sched_max_splits = graph_size; // at most there is one split for each node in the graph
@@ -1517,6 +1554,7 @@ void ggml_backend_sched_free(ggml_backend_sched_t sched) {
     ggml_hash_set_free(&sched->hash_set);
     free(sched->splits);
     free(sched->hv_tensor_backend_ids);
+    free(sched->hv_tensor_split_ids);
     free(sched->hv_tensor_copies);
     free(sched->node_backend_ids);
     free(sched->leaf_backend_ids);
@@ -1533,6 +1571,7 @@ void ggml_backend_sched_reset(ggml_backend_sched_t sched) {
     if (!sched->is_reset) {
         ggml_hash_set_reset(&sched->hash_set);
         memset(sched->hv_tensor_backend_ids, -1, sched->hash_set.size * sizeof(sched->hv_tensor_backend_ids[0]));
+        memset(sched->hv_tensor_split_ids,   -1, sched->hash_set.size * sizeof(sched->hv_tensor_split_ids[0]));
         memset(sched->hv_tensor_copies,       0, sched->hash_set.size * sched->n_backends * sched->n_copies * sizeof(struct ggml_tensor *));
         sched->is_reset = true;
     }
@@ -55,6 +55,33 @@ struct block_q4_Kx8 {
 
 static_assert(sizeof(block_q4_Kx8) == sizeof(ggml_half) * 16 + K_SCALE_SIZE * 8 + QK_K * 4, "wrong q4_K block size/padding");
 
+// Q5_K and Q6_K super-blocks of 8 rows: the 256 quants of each row are split in 32 chunks of 8 consecutive quants,
+// chunk k of the 8 rows is stored as 64 consecutive bytes (8 bytes per row) so that it can be unpacked with 2 loads
+// - qs/ql: the low 4 bits of chunks k and k + 16 share the bytes at offset (k % 16) * 64 (low and high nibble)
+// - qh:    Q5_K stores the 5th bit of chunk k in bit k / 4 of the bytes at offset (k % 4) * 64
+//          Q6_K stores the upper 2 bits of chunk k in bits 2 * (k / 8) of the bytes at offset (k % 8) * 64
+// the 6-bit scales and mins of Q5_K sub-block sb of row j are split in the same way, so that they can be unpacked with
+// constant shifts: the low 4 bits of both are stored in byte sb * 8 + j (scale in the low nibble), the upper 2 bits
+// in bits 2 * (sb / 4) (scale) and 4 + 2 * (sb / 4) (min) of byte 64 + (sb % 4) * 8 + j
+struct block_q5_Kx8 {
+    ggml_half d[8];      // super-block scale for quantized scales
+    ggml_half dmin[8];   // super-block scale for quantized mins
+    uint8_t scales[96];  // scales and mins, quantized with 6 bits
+    uint8_t qs[1024];    // low 4 bits of the quants
+    uint8_t qh[256];     // high bit of the quants
+};
+
+static_assert(sizeof(block_q5_Kx8) == sizeof(ggml_half) * 16 + K_SCALE_SIZE * 8 + QK_K * 5, "wrong q5_K block size/padding");
+
+struct block_q6_Kx8 {
+    ggml_half d[8];      // super-block scales
+    int8_t scales[128];  // scales of the 16 sub-blocks, interleaved per sub-block: scales[sb * 8 + row]
+    uint8_t ql[1024];    // low 4 bits of the quants
+    uint8_t qh[512];     // upper 2 bits of the quants
+};
+
+static_assert(sizeof(block_q6_Kx8) == sizeof(ggml_half) * 8 + (QK_K / 16) * 8 + QK_K * 6, "wrong q6_K block size/padding");
+
 struct block_q8_Kx4 {
     float d[4];              // delta
     int8_t qs[QK_K * 4];     // quants
@@ -1659,6 +1686,349 @@ static void ggml_gemv_iq4_nl_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs,
     }
 }
 
+#if defined(__AVX2__)
+// The AVX2 kernels of the 8x8 interleaved Q8_0, Q5_K and Q6_K layouts keep the results of the 8 rows in the order
+// 0 1 4 5 2 3 6 7 produced by _mm256_hadd_epi32 of the partial sums of rows 0-3 and 4-7; this permutation is its own
+// inverse and is used both to reorder the per row scales and to restore the order of the results
+static inline __m256i rows_8x8_perm(void) {
+    return _mm256_set_epi32(7, 6, 3, 2, 5, 4, 1, 0);
+}
+
+// broadcast 8 consecutive int8_t values to the four 64 bit lanes
+// note: the per row scales and mins are sign-extended to 32 bits, so they are multiplied with the bsums of the LHS with
+// _mm256_madd_epi16 and the bsums zero-extended to 32 bits, which is cheaper than _mm256_mullo_epi32
+static inline __m256i bcast_i8x8(const int8_t * x) {
+    int64_t v;
+    memcpy(&v, x, sizeof(v));
+    return _mm256_set1_epi64x(v);
+}
+#endif
+
+// unpack the 6-bit scales and mins of the 8 rows of a block_q5_Kx8 to sc[sub-block][row] and mn[sub-block][row]
+static inline void unpack_q5_Kx8_scales(const uint8_t * scales, uint8_t sc[8][8], uint8_t mn[8][8]) {
+#if defined(__AVX2__)
+    const __m256i m4  = _mm256_set1_epi8(0x0F);
+    const __m256i m3  = _mm256_set1_epi8(0x03);
+    const __m256i m30 = _mm256_set1_epi8(0x30);
+
+    const __m256i lo0 = _mm256_loadu_si256((const __m256i *) scales);
+    const __m256i lo1 = _mm256_loadu_si256((const __m256i *) (scales + 32));
+    const __m256i hi  = _mm256_loadu_si256((const __m256i *) (scales + 64));
+
+    _mm256_storeu_si256((__m256i *) sc[0], _mm256_or_si256(_mm256_and_si256(lo0, m4), _mm256_slli_epi16(_mm256_and_si256(hi, m3), 4)));
+    _mm256_storeu_si256((__m256i *) sc[4], _mm256_or_si256(_mm256_and_si256(lo1, m4), _mm256_and_si256(_mm256_slli_epi16(hi, 2), m30)));
+    _mm256_storeu_si256((__m256i *) mn[0], _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(lo0, 4), m4), _mm256_and_si256(hi, m30)));
+    _mm256_storeu_si256((__m256i *) mn[4], _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(lo1, 4), m4), _mm256_and_si256(_mm256_srli_epi16(hi, 2), m30)));
+#else
+    for (int sb = 0; sb < 8; sb++) {
+        for (int j = 0; j < 8; j++) {
+            const uint8_t lo = scales[sb * 8 + j];
+            const uint8_t hi = scales[64 + (sb % 4) * 8 + j] >> (2 * (sb / 4));
+            sc[sb][j] = (lo & 0xF) | ((hi & 3) << 4);
+            mn[sb][j] = (lo >>  4) | (((hi >> 4) & 3) << 4);
+        }
+    }
+#endif
+}
+
+// quant i (0..7) of chunk k (0..31) of row j, without offset
+static inline int q5_Kx8_quant(const block_q5_Kx8 & b, int k, int j, int i) {
+    const int o = j * 8 + i;
+    return ((b.qs[(k % 16) * 64 + o] >> (4 * (k / 16))) & 0xF) | (((b.qh[(k % 4) * 64 + o] >> (k / 4)) & 1) << 4);
+}
+
+static inline int q6_Kx8_quant(const block_q6_Kx8 & b, int k, int j, int i) {
+    const int o = j * 8 + i;
+    return ((b.ql[(k % 16) * 64 + o] >> (4 * (k / 16))) & 0xF) | (((b.qh[(k % 8) * 64 + o] >> (2 * (k / 8))) & 3) << 4);
+}
+
+static void ggml_gemv_q8_0_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if defined(__AVX2__)
+    const __m256i perm = rows_8x8_perm();
+
+    const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+
+        __m256 acc = _mm256_setzero_ps();
+        for (int l = 0; l < nb; l++) {
+            __m256i p0123 = _mm256_setzero_si256();
+            __m256i p4567 = _mm256_setzero_si256();
+            for (int k = 0; k < qk / blocklen; k++) {
+                const __m256i b0123 = _mm256_loadu_si256((const __m256i *) (b_ptr[l].qs + k * ncols_interleaved * blocklen));
+                const __m256i b4567 = _mm256_loadu_si256((const __m256i *) (b_ptr[l].qs + k * ncols_interleaved * blocklen + 32));
+                const __m256i a     = bcast_i8x8(a_ptr[l].qs + k * blocklen);
+                p0123 = mul_sum_i8_pairs_acc_int32x8(p0123, b0123, a);
+                p4567 = mul_sum_i8_pairs_acc_int32x8(p4567, b4567, a);
+            }
+            const __m256 d = _mm256_mul_ps(_mm256_permutevar8x32_ps(GGML_F32Cx8_LOAD(b_ptr[l].d), perm),
+                                           _mm256_set1_ps(GGML_FP16_TO_FP32(a_ptr[l].d)));
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_hadd_epi32(p0123, p4567)), d, acc);
+        }
+        _mm256_storeu_ps(s + x * ncols_interleaved, _mm256_permutevar8x32_ps(acc, perm));
+    }
+    return;
+#endif // #if defined(__AVX2__)
+    {
+        float sumf[8];
+        int sumi;
+
+        const block_q8_0 * a_ptr = (const block_q8_0 *) vy;
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+
+            for (int j = 0; j < ncols_interleaved; j++) sumf[j] = 0.0;
+            for (int l = 0; l < nb; l++) {
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    sumi = 0;
+                    for (int k = 0; k < (qk / blocklen); k++) {
+                        for (int i = 0; i < blocklen; ++i) {
+                            sumi += b_ptr[l].qs[k * ncols_interleaved * blocklen + j * blocklen + i] * a_ptr[l].qs[k * blocklen + i];
+                        }
+                    }
+                    sumf[j] += sumi * GGML_FP16_TO_FP32(b_ptr[l].d[j]) * GGML_FP16_TO_FP32(a_ptr[l].d);
+                }
+            }
+            for (int j = 0; j < ncols_interleaved; j++) s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
+static void ggml_gemv_q5_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+    uint8_t sc[8][8];
+    uint8_t mn[8][8];
+
+#if defined(__AVX2__)
+    const __m256i perm = rows_8x8_perm();
+    const __m256i m4   = _mm256_set1_epi8(0x0F);
+    const __m256i m10  = _mm256_set1_epi8(0x10);
+
+    const block_q8_K * a_ptr = (const block_q8_K *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q5_Kx8 * b_ptr = (const block_q5_Kx8 *) vx + (x * nb);
+
+        __m256 acc = _mm256_setzero_ps();
+        for (int l = 0; l < nb; l++) {
+            unpack_q5_Kx8_scales(b_ptr[l].scales, sc, mn);
+
+            __m256i isum = _mm256_setzero_si256();
+            __m256i imin = _mm256_setzero_si256();
+            // sub-blocks sb and sb + 4 share the bytes of qs (low and high nibble) and of qh (bits sb and sb + 4),
+            // so each pair of loads unpacks two chunks
+            for (int sb = 0; sb < QK_K / 64; sb++) {
+                const __m256i shh = _mm256_set1_epi32(sb);
+
+                __m256i p0123[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+                __m256i p4567[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+                for (int k = sb * 4; k < sb * 4 + 4; k++) {
+                    const uint8_t * qs = b_ptr[l].qs + k * 64;
+                    const uint8_t * qh = b_ptr[l].qh + (k % 4) * 64;
+
+                    const __m256i qs0123 = _mm256_loadu_si256((const __m256i *) qs);
+                    const __m256i qs4567 = _mm256_loadu_si256((const __m256i *) (qs + 32));
+                    const __m256i qh0123 = _mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) qh), shh);
+                    const __m256i qh4567 = _mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) (qh + 32)), shh);
+
+                    const __m256i a0 = bcast_i8x8(a_ptr[l].qs + k * blocklen);
+                    const __m256i a1 = bcast_i8x8(a_ptr[l].qs + (k + 16) * blocklen);
+                    p0123[0] = mul_sum_us8_pairs_acc_int32x8(p0123[0], _mm256_or_si256(_mm256_and_si256(qs0123, m4), _mm256_and_si256(_mm256_slli_epi16(qh0123, 4), m10)), a0);
+                    p4567[0] = mul_sum_us8_pairs_acc_int32x8(p4567[0], _mm256_or_si256(_mm256_and_si256(qs4567, m4), _mm256_and_si256(_mm256_slli_epi16(qh4567, 4), m10)), a0);
+                    p0123[1] = mul_sum_us8_pairs_acc_int32x8(p0123[1], _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(qs0123, 4), m4), _mm256_and_si256(qh0123, m10)), a1);
+                    p4567[1] = mul_sum_us8_pairs_acc_int32x8(p4567[1], _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(qs4567, 4), m4), _mm256_and_si256(qh4567, m10)), a1);
+                }
+                for (int h = 0; h < 2; h++) {
+                    const int is = sb + h * 4;
+                    const __m256i scales = _mm256_permutevar8x32_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) sc[is])), perm);
+                    const __m256i mins   = _mm256_permutevar8x32_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) mn[is])), perm);
+
+                    isum = _mm256_add_epi32(isum, _mm256_mullo_epi32(_mm256_hadd_epi32(p0123[h], p4567[h]), scales));
+                    imin = _mm256_add_epi32(imin, _mm256_madd_epi16(mins, _mm256_set1_epi32((uint16_t) (a_ptr[l].bsums[2 * is] + a_ptr[l].bsums[2 * is + 1]))));
+                }
+            }
+            const __m256 a_d  = _mm256_set1_ps(a_ptr[l].d);
+            const __m256 d    = _mm256_mul_ps(_mm256_permutevar8x32_ps(GGML_F32Cx8_LOAD(b_ptr[l].d),    perm), a_d);
+            const __m256 dmin = _mm256_mul_ps(_mm256_permutevar8x32_ps(GGML_F32Cx8_LOAD(b_ptr[l].dmin), perm), a_d);
+            acc = _mm256_fmadd_ps (_mm256_cvtepi32_ps(isum), d,    acc);
+            acc = _mm256_fnmadd_ps(_mm256_cvtepi32_ps(imin), dmin, acc);
+        }
+        _mm256_storeu_ps(s + x * ncols_interleaved, _mm256_permutevar8x32_ps(acc, perm));
+    }
+    return;
+#endif // #if defined(__AVX2__)
+    {
+        float sumf[8];
+        int sumi;
+        int summ;
+
+        const block_q8_K * a_ptr = (const block_q8_K *) vy;
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q5_Kx8 * b_ptr = (const block_q5_Kx8 *) vx + (x * nb);
+
+            for (int j = 0; j < ncols_interleaved; j++) sumf[j] = 0.0;
+            for (int l = 0; l < nb; l++) {
+                unpack_q5_Kx8_scales(b_ptr[l].scales, sc, mn);
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    sumi = 0;
+                    summ = 0;
+                    for (int sb = 0; sb < QK_K / 32; sb++) {
+                        int sumsb = 0;
+                        for (int k = sb * 4; k < sb * 4 + 4; k++) {
+                            for (int i = 0; i < blocklen; ++i) {
+                                sumsb += q5_Kx8_quant(b_ptr[l], k, j, i) * a_ptr[l].qs[k * blocklen + i];
+                            }
+                        }
+                        sumi += sumsb * sc[sb][j];
+                        summ += mn[sb][j] * (a_ptr[l].bsums[2 * sb] + a_ptr[l].bsums[2 * sb + 1]);
+                    }
+                    sumf[j] += (sumi * GGML_FP16_TO_FP32(b_ptr[l].d[j]) - summ * GGML_FP16_TO_FP32(b_ptr[l].dmin[j])) * a_ptr[l].d;
+                }
+            }
+            for (int j = 0; j < ncols_interleaved; j++) s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
+static void ggml_gemv_q6_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if defined(__AVX2__)
+    const __m256i perm = rows_8x8_perm();
+    const __m256i m4   = _mm256_set1_epi8(0x0F);
+    const __m256i m30  = _mm256_set1_epi8(0x30);
+
+    const block_q8_K * a_ptr = (const block_q8_K *) vy;
+    for (int x = 0; x < nc / ncols_interleaved; x++) {
+        const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+
+        __m256 acc = _mm256_setzero_ps();
+        for (int l = 0; l < nb; l++) {
+            __m256i isum = _mm256_setzero_si256();
+            __m256i ioff = _mm256_setzero_si256();
+            // sub-blocks sb and sb + 8 share the bytes of ql (low and high nibble) and of qh (bits 2 * (sb / 4) and
+            // 4 + 2 * (sb / 4)), so each pair of loads unpacks two chunks
+            for (int sb = 0; sb < QK_K / 32; sb++) {
+                const __m256i shh = _mm256_set1_epi32(2 * (sb / 4));
+
+                __m256i p0123[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+                __m256i p4567[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+                for (int k = sb * 2; k < sb * 2 + 2; k++) {
+                    const uint8_t * ql = b_ptr[l].ql + k * 64;
+                    const uint8_t * qh = b_ptr[l].qh + (k % 8) * 64;
+
+                    const __m256i ql0123 = _mm256_loadu_si256((const __m256i *) ql);
+                    const __m256i ql4567 = _mm256_loadu_si256((const __m256i *) (ql + 32));
+                    const __m256i qh0123 = _mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) qh), shh);
+                    const __m256i qh4567 = _mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) (qh + 32)), shh);
+
+                    const __m256i a0 = bcast_i8x8(a_ptr[l].qs + k * blocklen);
+                    const __m256i a1 = bcast_i8x8(a_ptr[l].qs + (k + 16) * blocklen);
+                    p0123[0] = mul_sum_us8_pairs_acc_int32x8(p0123[0], _mm256_or_si256(_mm256_and_si256(ql0123, m4), _mm256_and_si256(_mm256_slli_epi16(qh0123, 4), m30)), a0);
+                    p4567[0] = mul_sum_us8_pairs_acc_int32x8(p4567[0], _mm256_or_si256(_mm256_and_si256(ql4567, m4), _mm256_and_si256(_mm256_slli_epi16(qh4567, 4), m30)), a0);
+                    p0123[1] = mul_sum_us8_pairs_acc_int32x8(p0123[1], _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql0123, 4), m4), _mm256_and_si256(qh0123, m30)), a1);
+                    p4567[1] = mul_sum_us8_pairs_acc_int32x8(p4567[1], _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(ql4567, 4), m4), _mm256_and_si256(qh4567, m30)), a1);
+                }
+                for (int h = 0; h < 2; h++) {
+                    const int is = sb + h * 8;
+                    const __m256i scales = _mm256_permutevar8x32_epi32(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (b_ptr[l].scales + is * 8))), perm);
+
+                    isum = _mm256_add_epi32(isum, _mm256_mullo_epi32(_mm256_hadd_epi32(p0123[h], p4567[h]), scales));
+                    ioff = _mm256_add_epi32(ioff, _mm256_madd_epi16(scales, _mm256_set1_epi32((uint16_t) a_ptr[l].bsums[is])));
+                }
+            }
+            // the quants are stored with an offset of 32
+            isum = _mm256_sub_epi32(isum, _mm256_slli_epi32(ioff, 5));
+
+            const __m256 d = _mm256_mul_ps(_mm256_permutevar8x32_ps(GGML_F32Cx8_LOAD(b_ptr[l].d), perm), _mm256_set1_ps(a_ptr[l].d));
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(isum), d, acc);
+        }
+        _mm256_storeu_ps(s + x * ncols_interleaved, _mm256_permutevar8x32_ps(acc, perm));
+    }
+    return;
+#endif // #if defined(__AVX2__)
+    {
+        float sumf[8];
+        int sumi;
+        int sumo;
+
+        const block_q8_K * a_ptr = (const block_q8_K *) vy;
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+
+            for (int j = 0; j < ncols_interleaved; j++) sumf[j] = 0.0;
+            for (int l = 0; l < nb; l++) {
+                for (int j = 0; j < ncols_interleaved; j++) {
+                    sumi = 0;
+                    sumo = 0;
+                    for (int sb = 0; sb < QK_K / 16; sb++) {
+                        int sumsb = 0;
+                        for (int k = sb * 2; k < sb * 2 + 2; k++) {
+                            for (int i = 0; i < blocklen; ++i) {
+                                sumsb += q6_Kx8_quant(b_ptr[l], k, j, i) * a_ptr[l].qs[k * blocklen + i];
+                            }
+                        }
+                        sumi += sumsb * b_ptr[l].scales[sb * 8 + j];
+                        sumo += b_ptr[l].scales[sb * 8 + j] * a_ptr[l].bsums[sb];
+                    }
+                    sumf[j] += (sumi - 32 * sumo) * GGML_FP16_TO_FP32(b_ptr[l].d[j]) * a_ptr[l].d;
+                }
+            }
+            for (int j = 0; j < ncols_interleaved; j++) s[x * ncols_interleaved + j] = sumf[j];
+        }
+    }
+}
+
 static void ggml_gemm_q4_0_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -5647,51 +6017,417 @@ static void ggml_gemm_iq4_nl_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs,
     }
 }
 
-static block_q4_0x4 make_block_q4_0x4(block_q4_0 * in, unsigned int blck_size_interleave) {
-    block_q4_0x4 out;
+static void ggml_gemm_q8_0_8x8_q8_0(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
 
-    for (int i = 0; i < 4; i++) {
-        out.d[i] = in[i].d;
-    }
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
 
-    const int end = QK4_0 * 2 / blck_size_interleave;
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
 
-    if (blck_size_interleave == 8) {
-        const uint64_t xor_mask = 0x8888888888888888ULL;
-        for (int i = 0; i < end; ++i) {
-            int src_id = i % 4;
-            int src_offset = (i / 4) * blck_size_interleave;
-            int dst_offset = i * blck_size_interleave;
+#if defined(__AVX2__)
+    const __m256i perm = rows_8x8_perm();
 
-            uint64_t elems;
-            // Using memcpy to avoid unaligned memory accesses
-            memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint64_t));
-            elems ^= xor_mask;
-            memcpy(&out.qs[dst_offset], &elems, sizeof(uint64_t));
-        }
-    } else if (blck_size_interleave == 4) {
-        const uint32_t xor_mask = 0x88888888;
-        for (int i = 0; i < end; ++i) {
-            int src_id = i % 4;
-            int src_offset = (i / 4) * blck_size_interleave;
-            int dst_offset = i * blck_size_interleave;
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
 
-            uint32_t elems;
-            memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint32_t));
-            elems ^= xor_mask;
-            memcpy(&out.qs[dst_offset], &elems, sizeof(uint32_t));
+            __m256 acc[4];
+            for (int m = 0; m < 4; m++) {
+                acc[m] = _mm256_setzero_ps();
+            }
+            for (int l = 0; l < nb; l++) {
+                __m256i p0123[4];
+                __m256i p4567[4];
+                for (int m = 0; m < 4; m++) {
+                    p0123[m] = _mm256_setzero_si256();
+                    p4567[m] = _mm256_setzero_si256();
+                }
+                for (int k = 0; k < qk / blocklen; k++) {
+                    const __m256i b0123 = _mm256_loadu_si256((const __m256i *) (b_ptr[l].qs + k * ncols_interleaved * blocklen));
+                    const __m256i b4567 = _mm256_loadu_si256((const __m256i *) (b_ptr[l].qs + k * ncols_interleaved * blocklen + 32));
+                    for (int m = 0; m < 4; m++) {
+                        const __m256i a = bcast_i8x8(a_ptr[l].qs + k * 4 * blocklen + m * blocklen);
+                        p0123[m] = mul_sum_i8_pairs_acc_int32x8(p0123[m], b0123, a);
+                        p4567[m] = mul_sum_i8_pairs_acc_int32x8(p4567[m], b4567, a);
+                    }
+                }
+                const __m256 d = _mm256_permutevar8x32_ps(GGML_F32Cx8_LOAD(b_ptr[l].d), perm);
+                for (int m = 0; m < 4; m++) {
+                    acc[m] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_hadd_epi32(p0123[m], p4567[m])),
+                                             _mm256_mul_ps(d, _mm256_set1_ps(GGML_FP16_TO_FP32(a_ptr[l].d[m]))), acc[m]);
+                }
+            }
+            for (int m = 0; m < 4; m++) {
+                _mm256_storeu_ps(s + (y * 4 + m) * bs + x * ncols_interleaved, _mm256_permutevar8x32_ps(acc[m], perm));
+            }
         }
-    } else {
-        GGML_ASSERT(false);
     }
+    return;
+#endif // #if defined(__AVX2__)
+    {
+        float sumf[4][8];
+        int sumi;
 
-    return out;
-}
-
-// interleave 8 block_q4_0s in blocks of blck_size_interleave
-// returns an interleaved block_q4_0x8
-// in the interleaved block_q4_0x8, place deltas for 8 block_q4_0 blocks
-// first, then interleave quants from 8 block_q4_0s in blocks of blck_size_interleave
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_0x4 * a_ptr = (const block_q8_0x4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q8_0x8 * b_ptr = (const block_q8_0x8 *) vx + (x * nb);
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) sumf[m][j] = 0.0;
+                }
+                for (int l = 0; l < nb; l++) {
+                    for (int m = 0; m < 4; m++) {
+                        for (int j = 0; j < ncols_interleaved; j++) {
+                            sumi = 0;
+                            for (int k = 0; k < (qk / blocklen); k++) {
+                                for (int i = 0; i < blocklen; ++i) {
+                                    sumi += b_ptr[l].qs[k * ncols_interleaved * blocklen + j * blocklen + i] *
+                                            a_ptr[l].qs[k * 4 * blocklen + m * blocklen + i];
+                                }
+                            }
+                            sumf[m][j] += sumi * GGML_FP16_TO_FP32(b_ptr[l].d[j]) * GGML_FP16_TO_FP32(a_ptr[l].d[m]);
+                        }
+                    }
+                }
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++)
+                        s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+                }
+            }
+        }
+    }
+}
+
+static void ggml_gemm_q5_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+    uint8_t sc[8][8];
+    uint8_t mn[8][8];
+
+#if defined(__AVX2__)
+    const __m256i perm = rows_8x8_perm();
+    const __m256i m4   = _mm256_set1_epi8(0x0F);
+    const __m256i m1   = _mm256_set1_epi8(0x01);
+
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q5_Kx8 * b_ptr = (const block_q5_Kx8 *) vx + (x * nb);
+
+            __m256 acc[4];
+            for (int m = 0; m < 4; m++) {
+                acc[m] = _mm256_setzero_ps();
+            }
+            for (int l = 0; l < nb; l++) {
+                unpack_q5_Kx8_scales(b_ptr[l].scales, sc, mn);
+
+                __m256i isum[4];
+                __m256i imin[4];
+                for (int m = 0; m < 4; m++) {
+                    isum[m] = _mm256_setzero_si256();
+                    imin[m] = _mm256_setzero_si256();
+                }
+                for (int sb = 0; sb < QK_K / 32; sb++) {
+                    __m256i p0123[4];
+                    __m256i p4567[4];
+                    for (int m = 0; m < 4; m++) {
+                        p0123[m] = _mm256_setzero_si256();
+                        p4567[m] = _mm256_setzero_si256();
+                    }
+                    // the chunks of a sub-block share the shift counts
+                    const __m256i shl = _mm256_set1_epi32(4 * (sb / 4));
+                    const __m256i shh = _mm256_set1_epi32(sb);
+                    for (int k = sb * 4; k < sb * 4 + 4; k++) {
+                        const uint8_t * qs = b_ptr[l].qs + (k % 16) * 64;
+                        const uint8_t * qh = b_ptr[l].qh + (k % 4) * 64;
+
+                        const __m256i q0123 = _mm256_or_si256(
+                            _mm256_and_si256(_mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) qs), shl), m4),
+                            _mm256_slli_epi16(_mm256_and_si256(_mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) qh), shh), m1), 4));
+                        const __m256i q4567 = _mm256_or_si256(
+                            _mm256_and_si256(_mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) (qs + 32)), shl), m4),
+                            _mm256_slli_epi16(_mm256_and_si256(_mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) (qh + 32)), shh), m1), 4));
+
+                        for (int m = 0; m < 4; m++) {
+                            const __m256i a = bcast_i8x8(a_ptr[l].qs + k * 4 * blocklen + m * blocklen);
+                            p0123[m] = mul_sum_us8_pairs_acc_int32x8(p0123[m], q0123, a);
+                            p4567[m] = mul_sum_us8_pairs_acc_int32x8(p4567[m], q4567, a);
+                        }
+                    }
+                    const __m256i scales = _mm256_permutevar8x32_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) sc[sb])), perm);
+                    const __m256i mins   = _mm256_permutevar8x32_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) mn[sb])), perm);
+
+                    // bsums of the 16-element groups 2*sb and 2*sb + 1 of each row
+                    const int16_t * bsums = a_ptr[l].bsums + (sb / 2) * 16 + (sb % 2) * 2;
+                    for (int m = 0; m < 4; m++) {
+                        isum[m] = _mm256_add_epi32(isum[m], _mm256_mullo_epi32(_mm256_hadd_epi32(p0123[m], p4567[m]), scales));
+                        imin[m] = _mm256_add_epi32(imin[m], _mm256_madd_epi16(mins, _mm256_set1_epi32((uint16_t) (bsums[m * 4] + bsums[m * 4 + 1]))));
+                    }
+                }
+                const __m256 d    = _mm256_permutevar8x32_ps(GGML_F32Cx8_LOAD(b_ptr[l].d),    perm);
+                const __m256 dmin = _mm256_permutevar8x32_ps(GGML_F32Cx8_LOAD(b_ptr[l].dmin), perm);
+                for (int m = 0; m < 4; m++) {
+                    const __m256 a_d = _mm256_set1_ps(a_ptr[l].d[m]);
+                    acc[m] = _mm256_fmadd_ps (_mm256_cvtepi32_ps(isum[m]), _mm256_mul_ps(d,    a_d), acc[m]);
+                    acc[m] = _mm256_fnmadd_ps(_mm256_cvtepi32_ps(imin[m]), _mm256_mul_ps(dmin, a_d), acc[m]);
+                }
+            }
+            for (int m = 0; m < 4; m++) {
+                _mm256_storeu_ps(s + (y * 4 + m) * bs + x * ncols_interleaved, _mm256_permutevar8x32_ps(acc[m], perm));
+            }
+        }
+    }
+    return;
+#endif // #if defined(__AVX2__)
+    {
+        float sumf[4][8];
+        int sumi;
+        int summ;
+
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q5_Kx8 * b_ptr = (const block_q5_Kx8 *) vx + (x * nb);
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) sumf[m][j] = 0.0;
+                }
+                for (int l = 0; l < nb; l++) {
+                    unpack_q5_Kx8_scales(b_ptr[l].scales, sc, mn);
+                    for (int m = 0; m < 4; m++) {
+                        for (int j = 0; j < ncols_interleaved; j++) {
+                            sumi = 0;
+                            summ = 0;
+                            for (int sb = 0; sb < QK_K / 32; sb++) {
+                                int sumsb = 0;
+                                for (int k = sb * 4; k < sb * 4 + 4; k++) {
+                                    for (int i = 0; i < blocklen; ++i) {
+                                        sumsb += q5_Kx8_quant(b_ptr[l], k, j, i) * a_ptr[l].qs[k * 4 * blocklen + m * blocklen + i];
+                                    }
+                                }
+                                const int16_t * bsums = a_ptr[l].bsums + (sb / 2) * 16 + m * 4 + (sb % 2) * 2;
+                                sumi += sumsb * sc[sb][j];
+                                summ += mn[sb][j] * (bsums[0] + bsums[1]);
+                            }
+                            sumf[m][j] += (sumi * GGML_FP16_TO_FP32(b_ptr[l].d[j]) - summ * GGML_FP16_TO_FP32(b_ptr[l].dmin[j])) * a_ptr[l].d[m];
+                        }
+                    }
+                }
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++)
+                        s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+                }
+            }
+        }
+    }
+}
+
+static void ggml_gemm_q6_K_8x8_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int qk = QK_K;
+    const int nb = n / qk;
+    const int ncols_interleaved = 8;
+    const int blocklen = 8;
+
+    assert (n % qk == 0);
+    assert (nr % 4 == 0);
+    assert (nc % ncols_interleaved == 0);
+
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    UNUSED(nb);
+    UNUSED(ncols_interleaved);
+    UNUSED(blocklen);
+
+#if defined(__AVX2__)
+    const __m256i perm = rows_8x8_perm();
+    const __m256i m4   = _mm256_set1_epi8(0x0F);
+    const __m256i m3   = _mm256_set1_epi8(0x03);
+
+    for (int y = 0; y < nr / 4; y++) {
+        const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+        for (int x = 0; x < nc / ncols_interleaved; x++) {
+            const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+
+            __m256 acc[4];
+            for (int m = 0; m < 4; m++) {
+                acc[m] = _mm256_setzero_ps();
+            }
+            for (int l = 0; l < nb; l++) {
+                __m256i isum[4];
+                __m256i ioff[4];
+                for (int m = 0; m < 4; m++) {
+                    isum[m] = _mm256_setzero_si256();
+                    ioff[m] = _mm256_setzero_si256();
+                }
+                for (int sb = 0; sb < QK_K / 16; sb++) {
+                    __m256i p0123[4];
+                    __m256i p4567[4];
+                    for (int m = 0; m < 4; m++) {
+                        p0123[m] = _mm256_setzero_si256();
+                        p4567[m] = _mm256_setzero_si256();
+                    }
+                    // the chunks of a sub-block share the shift counts
+                    const __m256i shl = _mm256_set1_epi32(4 * (sb / 8));
+                    const __m256i shh = _mm256_set1_epi32(2 * (sb / 4));
+                    for (int k = sb * 2; k < sb * 2 + 2; k++) {
+                        const uint8_t * ql = b_ptr[l].ql + (k % 16) * 64;
+                        const uint8_t * qh = b_ptr[l].qh + (k % 8) * 64;
+
+                        const __m256i q0123 = _mm256_or_si256(
+                            _mm256_and_si256(_mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) ql), shl), m4),
+                            _mm256_slli_epi16(_mm256_and_si256(_mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) qh), shh), m3), 4));
+                        const __m256i q4567 = _mm256_or_si256(
+                            _mm256_and_si256(_mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) (ql + 32)), shl), m4),
+                            _mm256_slli_epi16(_mm256_and_si256(_mm256_srlv_epi32(_mm256_loadu_si256((const __m256i *) (qh + 32)), shh), m3), 4));
+
+                        for (int m = 0; m < 4; m++) {
+                            const __m256i a = bcast_i8x8(a_ptr[l].qs + k * 4 * blocklen + m * blocklen);
+                            p0123[m] = mul_sum_us8_pairs_acc_int32x8(p0123[m], q0123, a);
+                            p4567[m] = mul_sum_us8_pairs_acc_int32x8(p4567[m], q4567, a);
+                        }
+                    }
+                    const __m256i scales = _mm256_permutevar8x32_epi32(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (b_ptr[l].scales + sb * 8))), perm);
+
+                    // bsums of the 16-element group sb of each row
+                    const int16_t * bsums = a_ptr[l].bsums + (sb / 4) * 16 + (sb % 4);
+                    for (int m = 0; m < 4; m++) {
+                        isum[m] = _mm256_add_epi32(isum[m], _mm256_mullo_epi32(_mm256_hadd_epi32(p0123[m], p4567[m]), scales));
+                        ioff[m] = _mm256_add_epi32(ioff[m], _mm256_madd_epi16(scales, _mm256_set1_epi32((uint16_t) bsums[m * 4])));
+                    }
+                }
+                const __m256 d = _mm256_permutevar8x32_ps(GGML_F32Cx8_LOAD(b_ptr[l].d), perm);
+                for (int m = 0; m < 4; m++) {
+                    // the quants are stored with an offset of 32
+                    const __m256i isumo = _mm256_sub_epi32(isum[m], _mm256_slli_epi32(ioff[m], 5));
+                    acc[m] = _mm256_fmadd_ps(_mm256_cvtepi32_ps(isumo), _mm256_mul_ps(d, _mm256_set1_ps(a_ptr[l].d[m])), acc[m]);
+                }
+            }
+            for (int m = 0; m < 4; m++) {
+                _mm256_storeu_ps(s + (y * 4 + m) * bs + x * ncols_interleaved, _mm256_permutevar8x32_ps(acc[m], perm));
+            }
+        }
+    }
+    return;
+#endif // #if defined(__AVX2__)
+    {
+        float sumf[4][8];
+        int sumi;
+        int sumo;
+
+        for (int y = 0; y < nr / 4; y++) {
+            const block_q8_Kx4 * a_ptr = (const block_q8_Kx4 *) vy + (y * nb);
+            for (int x = 0; x < nc / ncols_interleaved; x++) {
+                const block_q6_Kx8 * b_ptr = (const block_q6_Kx8 *) vx + (x * nb);
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++) sumf[m][j] = 0.0;
+                }
+                for (int l = 0; l < nb; l++) {
+                    for (int m = 0; m < 4; m++) {
+                        for (int j = 0; j < ncols_interleaved; j++) {
+                            sumi = 0;
+                            sumo = 0;
+                            for (int sb = 0; sb < QK_K / 16; sb++) {
+                                int sumsb = 0;
+                                for (int k = sb * 2; k < sb * 2 + 2; k++) {
+                                    for (int i = 0; i < blocklen; ++i) {
+                                        sumsb += q6_Kx8_quant(b_ptr[l], k, j, i) * a_ptr[l].qs[k * 4 * blocklen + m * blocklen + i];
+                                    }
+                                }
+                                sumi += sumsb * b_ptr[l].scales[sb * 8 + j];
+                                sumo += b_ptr[l].scales[sb * 8 + j] * a_ptr[l].bsums[(sb / 4) * 16 + m * 4 + (sb % 4)];
+                            }
+                            sumf[m][j] += (sumi - 32 * sumo) * GGML_FP16_TO_FP32(b_ptr[l].d[j]) * a_ptr[l].d[m];
+                        }
+                    }
+                }
+                for (int m = 0; m < 4; m++) {
+                    for (int j = 0; j < ncols_interleaved; j++)
+                        s[(y * 4 + m) * bs + x * ncols_interleaved + j] = sumf[m][j];
+                }
+            }
+        }
+    }
+}
+
+static block_q4_0x4 make_block_q4_0x4(block_q4_0 * in, unsigned int blck_size_interleave) {
+    block_q4_0x4 out;
+
+    for (int i = 0; i < 4; i++) {
+        out.d[i] = in[i].d;
+    }
+
+    const int end = QK4_0 * 2 / blck_size_interleave;
+
+    if (blck_size_interleave == 8) {
+        const uint64_t xor_mask = 0x8888888888888888ULL;
+        for (int i = 0; i < end; ++i) {
+            int src_id = i % 4;
+            int src_offset = (i / 4) * blck_size_interleave;
+            int dst_offset = i * blck_size_interleave;
+
+            uint64_t elems;
+            // Using memcpy to avoid unaligned memory accesses
+            memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint64_t));
+            elems ^= xor_mask;
+            memcpy(&out.qs[dst_offset], &elems, sizeof(uint64_t));
+        }
+    } else if (blck_size_interleave == 4) {
+        const uint32_t xor_mask = 0x88888888;
+        for (int i = 0; i < end; ++i) {
+            int src_id = i % 4;
+            int src_offset = (i / 4) * blck_size_interleave;
+            int dst_offset = i * blck_size_interleave;
+
+            uint32_t elems;
+            memcpy(&elems, &in[src_id].qs[src_offset], sizeof(uint32_t));
+            elems ^= xor_mask;
+            memcpy(&out.qs[dst_offset], &elems, sizeof(uint32_t));
+        }
+    } else {
+        GGML_ASSERT(false);
+    }
+
+    return out;
+}
+
+// interleave 8 block_q4_0s in blocks of blck_size_interleave
+// returns an interleaved block_q4_0x8
+// in the interleaved block_q4_0x8, place deltas for 8 block_q4_0 blocks
+// first, then interleave quants from 8 block_q4_0s in blocks of blck_size_interleave
 static block_q4_0x8 make_block_q4_0x8(block_q4_0 * in, unsigned int blck_size_interleave) {
     block_q4_0x8 out;
 
@@ -5951,6 +6687,209 @@ static int repack_iq4_nl_to_iq4_nl_4_bl(struct ggml_tensor * t, int interleave_b
     GGML_UNUSED(data_size);
 }
 
+// interleave 8 block_q8_0s in blocks of blck_size_interleave
+static block_q8_0x8 make_block_q8_0x8(block_q8_0 * in, unsigned int blck_size_interleave) {
+    block_q8_0x8 out;
+
+    for (int i = 0; i < 8; i++) {
+        out.d[i] = in[i].d;
+    }
+
+    const int end = QK8_0 * 8 / blck_size_interleave;
+
+    for (int i = 0; i < end; ++i) {
+        int src_id = i % 8;
+        int src_offset = (i / 8) * blck_size_interleave;
+        int dst_offset = i * blck_size_interleave;
+
+        memcpy(&out.qs[dst_offset], &in[src_id].qs[src_offset], blck_size_interleave);
+    }
+
+    return out;
+}
+
+// see block_q5_Kx8 for the layout of the quants
+static block_q5_Kx8 make_block_q5_Kx8(block_q5_K * in, unsigned int blck_size_interleave) {
+    GGML_ASSERT(blck_size_interleave == 8);
+
+    block_q5_Kx8 out;
+    memset(out.scales, 0, sizeof(out.scales));
+    memset(out.qs, 0, sizeof(out.qs));
+    memset(out.qh, 0, sizeof(out.qh));
+
+    uint8_t q[QK_K];
+
+    for (int j = 0; j < 8; j++) {
+        out.d[j]    = in[j].GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.d;
+        out.dmin[j] = in[j].GGML_COMMON_AGGR_U.GGML_COMMON_AGGR_S.dmin;
+
+        const uint8_t * scales = in[j].scales;
+        for (int sb = 0; sb < QK_K / 32; sb++) {
+            uint8_t sc;
+            uint8_t mn;
+            if (sb < 4) {
+                sc = scales[sb] & 63;
+                mn = scales[sb + 4] & 63;
+            } else {
+                sc = (scales[sb + 4] & 0xF) | ((scales[sb - 4] >> 6) << 4);
+                mn = (scales[sb + 4] >>  4) | ((scales[sb]     >> 6) << 4);
+            }
+            out.scales[sb * 8 + j]             = (sc & 0xF) | ((mn & 0xF) << 4);
+            out.scales[64 + (sb % 4) * 8 + j] |= ((sc >> 4) | ((mn >> 4) << 4)) << (2 * (sb / 4));
+        }
+
+        // unpack the 5-bit quants in the order of dequantize_row_q5_K
+        for (int n = 0; n < QK_K / 64; n++) {
+            const uint8_t * ql = in[j].qs + 32 * n;
+            for (int l = 0; l < 32; l++) {
+                q[64 * n + l]      = (ql[l] & 0xF) | (((in[j].qh[l] >> (2 * n + 0)) & 1) << 4);
+                q[64 * n + l + 32] = (ql[l] >>  4) | (((in[j].qh[l] >> (2 * n + 1)) & 1) << 4);
+            }
+        }
+
+        for (int v = 0; v < QK_K; v++) {
+            const int k = v / 8;
+            const int o = j * 8 + v % 8;
+            out.qs[(k % 16) * 64 + o] |= (q[v] & 0xF) << (4 * (k / 16));
+            out.qh[(k % 4) * 64 + o]  |= (q[v] >> 4) << (k / 4);
+        }
+    }
+
+    return out;
+}
+
+// see block_q6_Kx8 for the layout of the quants
+static block_q6_Kx8 make_block_q6_Kx8(block_q6_K * in, unsigned int blck_size_interleave) {
+    GGML_ASSERT(blck_size_interleave == 8);
+
+    block_q6_Kx8 out;
+    memset(out.ql, 0, sizeof(out.ql));
+    memset(out.qh, 0, sizeof(out.qh));
+
+    uint8_t q[QK_K];
+
+    for (int j = 0; j < 8; j++) {
+        out.d[j] = in[j].d;
+        for (int sb = 0; sb < QK_K / 16; sb++) {
+            out.scales[sb * 8 + j] = in[j].scales[sb];
+        }
+
+        // unpack the 6-bit quants in the order of dequantize_row_q6_K
+        for (int n = 0; n < QK_K / 128; n++) {
+            const uint8_t * ql = in[j].ql + 64 * n;
+            const uint8_t * qh = in[j].qh + 32 * n;
+            for (int l = 0; l < 32; l++) {
+                q[128 * n + l]      = (ql[l]      & 0xF) | (((qh[l] >> 0) & 3) << 4);
+                q[128 * n + l + 32] = (ql[l + 32] & 0xF) | (((qh[l] >> 2) & 3) << 4);
+                q[128 * n + l + 64] = (ql[l]      >>  4) | (((qh[l] >> 4) & 3) << 4);
+                q[128 * n + l + 96] = (ql[l + 32] >>  4) | (((qh[l] >> 6) & 3) << 4);
+            }
+        }
+
+        for (int v = 0; v < QK_K; v++) {
+            const int k = v / 8;
+            const int o = j * 8 + v % 8;
+            out.ql[(k % 16) * 64 + o] |= (q[v] & 0xF) << (4 * (k / 16));
+            out.qh[(k % 8) * 64 + o]  |= (q[v] >> 4) << (2 * (k / 8));
+        }
+    }
+
+    return out;
+}
+
+static int repack_q8_0_to_q8_0_8_bl(struct ggml_tensor * t, int interleave_block, const void * GGML_RESTRICT data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q8_0);
+    GGML_ASSERT(interleave_block == 8);
+    constexpr int nrows_interleaved = 8;
+
+    block_q8_0x8 * dst = (block_q8_0x8*)t->data;
+    const block_q8_0 * src = (const block_q8_0*) data;
+    block_q8_0 dst_tmp[8];
+    int nrow = ggml_nrows(t);
+    int nblocks = t->ne[0] / QK8_0;
+
+    GGML_ASSERT(data_size == nrow * nblocks * sizeof(block_q8_0));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % 8 != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i  = 0; i < nrows_interleaved; i++ ) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block_q8_0x8(dst_tmp, interleave_block);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    GGML_UNUSED(data_size);
+}
+
+static int repack_q5_K_to_q5_K_8_bl(struct ggml_tensor * t, int interleave_block, const void * GGML_RESTRICT data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q5_K);
+    GGML_ASSERT(interleave_block == 8);
+    constexpr int nrows_interleaved = 8;
+
+    block_q5_Kx8 * dst = (block_q5_Kx8*)t->data;
+    const block_q5_K * src = (const block_q5_K*) data;
+    block_q5_K dst_tmp[8];
+    int nrow = ggml_nrows(t);
+    int nblocks = t->ne[0] / QK_K;
+
+    GGML_ASSERT(data_size == nrow * nblocks * sizeof(block_q5_K));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % 8 != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i  = 0; i < nrows_interleaved; i++ ) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block_q5_Kx8(dst_tmp, interleave_block);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    GGML_UNUSED(data_size);
+}
+
+static int repack_q6_K_to_q6_K_8_bl(struct ggml_tensor * t, int interleave_block, const void * GGML_RESTRICT data, size_t data_size) {
+    GGML_ASSERT(t->type == GGML_TYPE_Q6_K);
+    GGML_ASSERT(interleave_block == 8);
+    constexpr int nrows_interleaved = 8;
+
+    block_q6_Kx8 * dst = (block_q6_Kx8*)t->data;
+    const block_q6_K * src = (const block_q6_K*) data;
+    block_q6_K dst_tmp[8];
+    int nrow = ggml_nrows(t);
+    int nblocks = t->ne[0] / QK_K;
+
+    GGML_ASSERT(data_size == nrow * nblocks * sizeof(block_q6_K));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % 8 != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i  = 0; i < nrows_interleaved; i++ ) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block_q6_Kx8(dst_tmp, interleave_block);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    GGML_UNUSED(data_size);
+}
+
 namespace ggml::cpu::aarch64 {
 // repack
 template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS>
@@ -5973,6 +6912,18 @@ template <> int repack<block_q4_K, 8, 8>(struct ggml_tensor * t, const void * da
     return repack_q4_K_to_q4_K_8_bl(t, 8, data, data_size);
 }
 
+template <> int repack<block_q8_0, 8, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_q8_0_to_q8_0_8_bl(t, 8, data, data_size);
+}
+
+template <> int repack<block_q5_K, 8, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_q5_K_to_q5_K_8_bl(t, 8, data, data_size);
+}
+
+template <> int repack<block_q6_K, 8, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_q6_K_to_q6_K_8_bl(t, 8, data, data_size);
+}
+
 template <> int repack<block_iq4_nl, 4, 4>(struct ggml_tensor * t, const void * data, size_t data_size) {
     return repack_iq4_nl_to_iq4_nl_4_bl(t, 4, data, data_size);
 }
@@ -6002,6 +6953,18 @@ template <> void gemv<block_q4_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t
     ggml_gemv_q4_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemv<block_q8_0, 8, 8, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q8_0_8x8_q8_0(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q5_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q5_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q6_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q6_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
 template <> void gemv<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
     ggml_gemv_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
@@ -6026,6 +6989,18 @@ template <> void gemm<block_q4_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t
     ggml_gemm_q4_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemm<block_q8_0, 8, 8, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q8_0_8x8_q8_0(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q5_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q5_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q6_K, 8, 8, GGML_TYPE_Q8_K>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q6_K_8x8_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
 template <> void gemm<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
     ggml_gemm_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
@@ -6281,6 +7256,13 @@ static const tensor_traits<block_q4_0, 8, 4, GGML_TYPE_Q8_0> q4_0_4x8_q8_0;
 static const tensor_traits<block_q4_0, 8, 8, GGML_TYPE_Q8_0> q4_0_8x8_q8_0;
 static const tensor_traits<block_q4_K, 8, 8, GGML_TYPE_Q8_K> q4_K_8x8_q8_K;
 
+// instance for Q5_K and Q6_K
+static const tensor_traits<block_q5_K, 8, 8, GGML_TYPE_Q8_K> q5_K_8x8_q8_K;
+static const tensor_traits<block_q6_K, 8, 8, GGML_TYPE_Q8_K> q6_K_8x8_q8_K;
+
+// instance for Q8
+static const tensor_traits<block_q8_0, 8, 8, GGML_TYPE_Q8_0> q8_0_8x8_q8_0;
+
 // instance for IQ4
 static const tensor_traits<block_iq4_nl, 4, 4, GGML_TYPE_Q8_0> iq4_nl_4x4_q8_0;
 
@@ -6309,6 +7291,24 @@ static const ggml::cpu::tensor_traits * ggml_aarch64_get_optimal_repack_type(con
                 return &ggml::cpu::aarch64::q4_K_8x8_q8_K;
             }
         }
+    } else if (cur->type == GGML_TYPE_Q5_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q5_K_8x8_q8_K;
+            }
+        }
+    } else if (cur->type == GGML_TYPE_Q6_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q6_K_8x8_q8_K;
+            }
+        }
+    } else if (cur->type == GGML_TYPE_Q8_0) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q8_0_8x8_q8_0;
+            }
+        }
     } else if (cur->type == GGML_TYPE_IQ4_NL) {
         if (ggml_cpu_has_neon() && ggml_cpu_has_dotprod()) {
             if (cur->ne[1] % 4 == 0) {
@@ -445,6 +445,11 @@ struct ggml_threadpool {
     struct ggml_cgraph * cgraph;
     struct ggml_cplan  * cplan;
 
+    // per node plan of the current graph
+    uint8_t * node_fusion;    // enum ggml_cpu_fusion
+    uint8_t * node_barrier;   // != 0 -> the threads have to synchronize after computing the node
+    int       node_plan_size;
+
     // synchronization primitives
     atomic_int n_graph;       // incremented when there is work to be done (i.e each graph)
     atomic_int GGML_CACHE_ALIGN n_barrier;
@@ -1466,6 +1471,27 @@ struct mmid_row_mapping {
     int32_t i2;
 };
 
+// src1 row of a row mapping
+// desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
+//       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
+//       the original src1 data pointer, so we should index using the indices directly
+// TODO: this is a bit of a hack, we should probably have a better way to handle this
+static const char * ggml_mul_mat_id_src1_row(
+    const struct ggml_tensor * src1,
+    const void * wdata,
+    const struct mmid_row_mapping row_mapping,
+    const size_t row_size,
+    const bool contiguous) {
+
+    const int64_t i11 = row_mapping.i1 % src1->ne[1];
+    const int64_t i12 = row_mapping.i2; // row index in src1
+
+    return (const char *) wdata +
+        (contiguous
+        ? (i11             + i12*src1->ne[1])*row_size
+        : (i11*src1->nb[1] + i12*src1->nb[2]));
+}
+
 static void ggml_compute_forward_mul_mat_id_one_chunk(
     struct ggml_tensor * dst,
     const struct ggml_tensor * src0,
@@ -1500,22 +1526,11 @@ static void ggml_compute_forward_mul_mat_id_one_chunk(
                 const int64_t _i12 = ir1; // logical row index for this expert
 
                 struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, _i12);
-                const int id       = row_mapping.i1; // selected expert index
-
-                const int64_t  i11 = id % ne11;
-                const int64_t  i12 = row_mapping.i2; // row index in src1
 
-                const int64_t  i1 = id;  // selected expert index
-                const int64_t  i2 = i12; // row
+                const int64_t  i1 = row_mapping.i1; // selected expert index
+                const int64_t  i2 = row_mapping.i2; // row
 
-                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
-                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
-                //       the original src1 data pointer, so we should index using the indices directly
-                // TODO: this is a bit of a hack, we should probably have a better way to handle this
-                const char * src1_col = (const char *) wdata +
-                    (src1_cont || src1->type != vec_dot_type
-                    ? (i11      + i12*ne11)*row_size
-                    : (i11*nb11 + i12*nb12));
+                const char * src1_col = ggml_mul_mat_id_src1_row(src1, wdata, row_mapping, row_size, src1_cont || src1->type != vec_dot_type);
 
                 float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2));
 
@@ -1537,6 +1552,35 @@ static void * incr_ptr_aligned(void ** p, size_t size, size_t align) {
     return ptr;
 }
 
+// number of chunks in which the rows of one expert are split
+static void ggml_mul_mat_id_chunks(int64_t nr0, int64_t nr1, int nth, bool disable_chunking, int64_t * nchunk0, int64_t * nchunk1) {
+    if (disable_chunking) {
+        *nchunk0 = nr0 > nr1 ? nth : 1;
+        *nchunk1 = nr0 > nr1 ? 1 : nth;
+        return;
+    }
+
+    int chunk_size = 16;
+    if (nr0 == 1 || nr1 == 1) {
+        chunk_size = 64;
+    }
+
+    *nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
+    *nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
+}
+
+// experts with at least this many rows are multiplied with llamafile_sgemm instead of vec_dot
+#define MMID_SGEMM_MIN_ROWS 32
+
+static bool ggml_mul_mat_id_use_sgemm(int64_t cne1) {
+#if GGML_USE_LLAMAFILE
+    return cne1 >= MMID_SGEMM_MIN_ROWS;
+#else
+    GGML_UNUSED(cne1);
+    return false;
+#endif
+}
+
 static void ggml_compute_forward_mul_mat_id(
         const struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
@@ -1583,8 +1627,20 @@ static void ggml_compute_forward_mul_mat_id(
     struct mmid_row_mapping * matrix_rows = // [n_as][ids->ne[0]*ids->ne[1]]
         incr_ptr_aligned(&wdata_cur, n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping), sizeof(int64_t));
 
-    char (*atomic_current_chunk)[CACHE_LINE_SIZE] = // [n_as]
-        incr_ptr_aligned(&wdata_cur, CACHE_LINE_SIZE * n_as, CACHE_LINE_SIZE);
+    int64_t * expert_chunks = // [n_as + 1]
+        incr_ptr_aligned(&wdata_cur, (n_as + 1)*sizeof(int64_t), sizeof(int64_t));
+
+    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+
+#if GGML_USE_LLAMAFILE
+    // src1 rows of the experts multiplied with sgemm, gathered by expert
+    char * sgemm_src1 = // [n_ids*ids->ne[1]][row_size]
+        incr_ptr_aligned(&wdata_cur, n_ids*ids->ne[1]*row_size, CACHE_LINE_SIZE);
+
+    // results of one sgemm call, at most ids->ne[1] rows at a time
+    float * sgemm_dst = // [ids->ne[1]][ne01]
+        incr_ptr_aligned(&wdata_cur, ids->ne[1]*ne01*sizeof(float), CACHE_LINE_SIZE);
+#endif
 
     GGML_ASSERT(params->wsize >= (size_t)((char *) wdata_cur - (char *) params->wdata));
 
@@ -1625,6 +1681,14 @@ static void ggml_compute_forward_mul_mat_id(
 #endif
     }
 
+#if defined(__aarch64__)
+    // disable for ARM
+    const bool disable_chunking = true;
+#else
+    // disable for NUMA
+    const bool disable_chunking = ggml_is_numa();
+#endif // defined(__aarch64__)
+
     if (ith == 0) {
         // initialize matrix_row_counts
         memset(matrix_row_counts, 0, n_as*sizeof(int64_t));
@@ -1640,61 +1704,84 @@ static void ggml_compute_forward_mul_mat_id(
                 matrix_row_counts[i02] += 1;
             }
         }
-    }
 
-    // reset current_chunk
-    for (int cur_a = ith; cur_a < n_as; cur_a += nth) {
-        atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
-        *current_chunk_ctr = nth;
+        // the (expert, chunk) work items of all the experts form a single queue, so that the threads do not idle
+        // when the experts only have a few rows each
+        expert_chunks[0] = 0;
+        for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+            const int64_t cne1 = matrix_row_counts[cur_a];
+
+            int64_t nchunk = 0;
+            if (cne1 > 0 && !ggml_mul_mat_id_use_sgemm(cne1)) {
+                int64_t nchunk0, nchunk1;
+                ggml_mul_mat_id_chunks(ne01, cne1, nth, disable_chunking, &nchunk0, &nchunk1);
+                nchunk = nchunk0*nchunk1;
+            }
+
+            expert_chunks[cur_a + 1] = expert_chunks[cur_a] + nchunk;
+        }
+
+        // Every thread starts at ith, so the first unprocessed chunk is nth.
+        atomic_store_explicit(&params->threadpool->current_chunk, nth, memory_order_relaxed);
     }
 
     ggml_barrier(params->threadpool);
 
+    const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+
+#if GGML_USE_LLAMAFILE
+    // gather the src1 rows of the experts with many rows
+    int64_t n_sgemm_rows = 0;
     for (int cur_a = 0; cur_a < n_as; ++cur_a) {
         const int64_t cne1 = matrix_row_counts[cur_a];
 
-        if (cne1 == 0) {
+        if (!ggml_mul_mat_id_use_sgemm(cne1)) {
             continue;
         }
 
-        const char * src0_cur = (const char *) src0->data + cur_a * nb02;
-        const void * wdata = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-        const size_t row_size = ggml_row_size(vec_dot_type, ne10);
-
-        const int64_t nr0 = ne01;
-        const int64_t nr1 = cne1;
+        for (int64_t ir1 = 0; ir1 < cne1; ++ir1) {
+            if ((n_sgemm_rows + ir1) % nth == ith) {
+                const struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, ir1);
 
-        int chunk_size = 16;
-        if (nr0 == 1 || nr1 == 1) {
-            chunk_size = 64;
+                memcpy(sgemm_src1 + (n_sgemm_rows + ir1)*row_size,
+                       ggml_mul_mat_id_src1_row(src1, wdata, row_mapping, row_size, src1_cont || src1->type != vec_dot_type),
+                       row_size);
+            }
         }
 
-#if defined(__aarch64__)
-        // disable for ARM
-        const bool disable_chunking = true;
-#else
-        // disable for NUMA
-        const bool disable_chunking = ggml_is_numa();
-#endif // defined(__aarch64__)
+        n_sgemm_rows += cne1;
+    }
+#endif
 
-        int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
-        int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
+    // process the queue
+    {
+        const int64_t n_chunks = expert_chunks[n_as];
 
-        if (nchunk0 * nchunk1 < nth * 4 || disable_chunking) {
-            nchunk0 = nr0 > nr1 ? nth : 1;
-            nchunk1 = nr0 > nr1 ? 1 : nth;
-        }
+        int64_t current_chunk = ith;
 
-        const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
-        const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
+        int cur_a = 0;
 
-        int current_chunk = ith;
+        while (current_chunk < n_chunks) {
+            // the chunks taken by a thread are increasing, so the expert can only move forward
+            while (expert_chunks[cur_a + 1] <= current_chunk) {
+                cur_a++;
+            }
+
+            const int64_t cne1 = matrix_row_counts[cur_a];
+
+            const char * src0_cur = (const char *) src0->data + cur_a * nb02;
+
+            const int64_t nr0 = ne01;
+            const int64_t nr1 = cne1;
+
+            int64_t nchunk0, nchunk1;
+            ggml_mul_mat_id_chunks(nr0, nr1, nth, disable_chunking, &nchunk0, &nchunk1);
 
-        atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
+            const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
+            const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-        while (current_chunk < nchunk0 * nchunk1) {
-            const int64_t ith0 = current_chunk % nchunk0;
-            const int64_t ith1 = current_chunk / nchunk0;
+            const int64_t ith0 = (current_chunk - expert_chunks[cur_a]) % nchunk0;
+            const int64_t ith1 = (current_chunk - expert_chunks[cur_a]) / nchunk0;
 
             const int64_t ir0_start = dr0 * ith0;
             const int64_t ir0_end = MIN(ir0_start + dr0, nr0);
@@ -1708,13 +1795,79 @@ static void ggml_compute_forward_mul_mat_id(
                 src0_cur, matrix_rows, row_size, src1_cont, wdata
             );
 
-            if (nth >= nchunk0 * nchunk1) {
-                break;
+            if (disable_chunking) {
+                // static assignment, each thread computes its own chunk of every expert
+                current_chunk += nth;
+            } else {
+                current_chunk = atomic_fetch_add_explicit(&params->threadpool->current_chunk, 1, memory_order_relaxed);
             }
+        }
+    }
+
+#if GGML_USE_LLAMAFILE
+    if (n_sgemm_rows == 0) {
+        return;
+    }
+
+    // the experts with many rows are multiplied by all threads together
+    ggml_barrier(params->threadpool);
+
+    int64_t sgemm_row = 0;
+    for (int cur_a = 0; cur_a < n_as; ++cur_a) {
+        const int64_t cne1 = matrix_row_counts[cur_a];
 
-            current_chunk = atomic_fetch_add_explicit(current_chunk_ctr, 1, memory_order_relaxed);
+        if (!ggml_mul_mat_id_use_sgemm(cne1)) {
+            continue;
         }
+
+        const char * src0_cur = (const char *) src0->data + cur_a * nb02;
+
+        for (int64_t ir1_start = 0; ir1_start < cne1; ir1_start += ids->ne[1]) {
+            const int64_t ir1_end = MIN(ir1_start + ids->ne[1], cne1);
+
+            if (!llamafile_sgemm(params,
+                                 ne01, ir1_end - ir1_start, ne00/ggml_blck_size(type),
+                                 src0_cur,
+                                 nb01/ggml_type_size(type),
+                                 sgemm_src1 + (sgemm_row + ir1_start)*row_size,
+                                 row_size/ggml_type_size(vec_dot_type),
+                                 sgemm_dst,
+                                 ne01,
+                                 type,
+                                 vec_dot_type,
+                                 GGML_TYPE_F32)) {
+                // not supported for these types, compute this part of the expert with vec_dot
+                const int64_t dr0 = (ne01 + nth - 1) / nth;
+
+                const int64_t ir0_start = dr0 * ith;
+                const int64_t ir0_end = MIN(ir0_start + dr0, ne01);
+
+                ggml_compute_forward_mul_mat_id_one_chunk(
+                    dst, src0, src1, ids, cur_a,
+                    ir0_start, ir0_end, ir1_start, ir1_end,
+                    src0_cur, matrix_rows, row_size, src1_cont, wdata
+                );
+                continue;
+            }
+
+            ggml_barrier(params->threadpool);
+
+            // scatter the results to dst
+            for (int64_t ir1 = ir1_start + ith; ir1 < ir1_end; ir1 += nth) {
+                const struct mmid_row_mapping row_mapping = MMID_MATRIX_ROW(cur_a, ir1);
+
+                memcpy((char *) dst->data + row_mapping.i1*nb1 + row_mapping.i2*nb2,
+                       sgemm_dst + (ir1 - ir1_start)*ne01,
+                       ne01*sizeof(float));
+            }
+
+            // sgemm_dst is reused by the next call
+            ggml_barrier(params->threadpool);
+        }
+
+        sgemm_row += cne1;
     }
+#endif
 }
 
 /////////////////////////////////
@@ -2597,6 +2750,8 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
 
     const size_t workers_size = sizeof(struct ggml_compute_state) * n_threads;
     ggml_aligned_free(threadpool->workers, workers_size);
+    free(threadpool->node_fusion);
+    free(threadpool->node_barrier);
     ggml_aligned_free(threadpool, sizeof(struct ggml_threadpool));
 }
 
@@ -2721,8 +2876,14 @@ struct ggml_cplan ggml_graph_plan(
                         cur += n_as * sizeof(int64_t) + sizeof(int64_t);
                         // matrix_rows
                         cur += n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping) + sizeof(int64_t);
-                        // atomic_current_chunk
-                        cur += CACHE_LINE_SIZE*n_as + CACHE_LINE_SIZE;
+                        // expert_chunks
+                        cur += (n_as + 1)*sizeof(int64_t) + sizeof(int64_t);
+#if GGML_USE_LLAMAFILE
+                        // sgemm_src1
+                        cur += ggml_row_size(vec_dot_type, src1->ne[0])*ids->ne[0]*ids->ne[1] + CACHE_LINE_SIZE;
+                        // sgemm_dst
+                        cur += sizeof(float)*src0->ne[1]*ids->ne[1] + CACHE_LINE_SIZE;
+#endif
                     } break;
                 case GGML_OP_OUT_PROD:
                     {
@@ -2781,6 +2942,14 @@ struct ggml_cplan ggml_graph_plan(
                         const int64_t ne20 = node->src[2]->ne[0]; // DV
 
                         cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+
+                        const int64_t n_chunks = ggml_compute_forward_flash_attn_ext_n_chunks(node, n_tasks);
+                        if (n_chunks > 1) {
+                            const int64_t nr = ggml_nrows(node->src[0]);
+
+                            cur += sizeof(float)*CACHE_LINE_SIZE_F32*n_tasks;
+                            cur += sizeof(float)*(ne20 + 2)*nr*n_chunks; // partial results of the split-KV chunks
+                        }
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -2827,6 +2996,504 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+// barrier elision
+//
+// every thread computes its part of every node, in graph order, so a barrier between two nodes is only needed when
+// the second node reads memory written by the first one, writes memory that the first one reads or writes, or both
+// of them use the work buffer in incompatible ways. consecutive nodes without such hazards (e.g. views, the ropes of
+// Q and K, the copies into the KV cache) are computed without synchronizing the threads in between
+
+// the maximum number of nodes tracked since the last barrier
+#define GGML_BARRIER_MAX_PENDING 32
+
+// work buffer usage of a node:
+//   GGML_SCRATCH_NONE   - the node does not use the work buffer
+//   > 0                 - each thread uses its own row of this size
+//   GGML_SCRATCH_SHARED - the work buffer (or other threadpool state) is shared between the threads
+//   GGML_SCRATCH_FENCE  - unknown memory access pattern, always synchronize before and after the node
+#define GGML_SCRATCH_NONE     0
+#define GGML_SCRATCH_SHARED (-1)
+#define GGML_SCRATCH_FENCE  (-2)
+
+static int64_t ggml_graph_node_scratch(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_SIN:
+        case GGML_OP_COS:
+        case GGML_OP_CONCAT:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_SCALE:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_CLAMP:
+        case GGML_OP_UNARY:
+            return GGML_SCRATCH_NONE;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            return ggml_is_quantized(node->src[0]->type) ? GGML_SCRATCH_SHARED : GGML_SCRATCH_NONE;
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            {
+                const enum ggml_type type0 = node->src[0]->type;
+                return type0 == node->type || type0 == GGML_TYPE_F32 || node->type == GGML_TYPE_F32 ?
+                    GGML_SCRATCH_NONE : GGML_SCRATCH_SHARED;
+            }
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+            return node->ne[0];
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+        case GGML_OP_FLASH_ATTN_EXT:
+            return GGML_SCRATCH_SHARED;
+        default:
+            return GGML_SCRATCH_FENCE;
+    }
+}
+
+// operator fusion
+//
+// common sequences of element-wise nodes are computed by a single kernel at the position of the last node of the
+// sequence, the other nodes are skipped. this avoids writing and reading back the intermediate results and the
+// barriers between the nodes
+enum ggml_cpu_fusion {
+    GGML_CPU_FUSION_NONE = 0,
+    GGML_CPU_FUSION_SKIP,             // computed as part of a later node
+    GGML_CPU_FUSION_RMS_NORM_MUL,     // mul(rms_norm(x), w)
+    GGML_CPU_FUSION_ADD_RMS_NORM,     // rms_norm(add(a, b)), the result of the add is stored as well
+    GGML_CPU_FUSION_ADD_RMS_NORM_MUL, // mul(rms_norm(add(a, b)), w), the result of the add is stored as well
+    GGML_CPU_FUSION_SWIGLU,           // mul(silu(g), u)
+};
+
+// the maximum distance between the first and the last node of a fused sequence
+#define GGML_CPU_FUSION_MAX_DIST 8
+
+static void ggml_compute_forward_fused(struct ggml_compute_params * params, struct ggml_tensor * tensor, enum ggml_cpu_fusion fusion) {
+    switch (fusion) {
+        case GGML_CPU_FUSION_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_rms_norm_fused(params, tensor, false, true);
+            } break;
+        case GGML_CPU_FUSION_ADD_RMS_NORM:
+            {
+                ggml_compute_forward_rms_norm_fused(params, tensor, true, false);
+            } break;
+        case GGML_CPU_FUSION_ADD_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_rms_norm_fused(params, tensor, true, true);
+            } break;
+        case GGML_CPU_FUSION_SWIGLU:
+            {
+                ggml_compute_forward_swiglu_fused(params, tensor);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
+struct ggml_mem_range {
+    const char * p0;
+    const char * p1;
+};
+
+static struct ggml_mem_range ggml_mem_range_of(const struct ggml_tensor * t) {
+    const char * p = (const char *) t->data;
+    struct ggml_mem_range r = { p, p + ggml_nbytes(t) };
+    return r;
+}
+
+static bool ggml_mem_range_overlap(struct ggml_mem_range a, struct ggml_mem_range b) {
+    return a.p0 < b.p1 && b.p0 < a.p1;
+}
+
+// memory accessed by a node, or by a fused sequence of nodes
+struct ggml_node_access {
+    struct ggml_mem_range dst[2];
+    struct ggml_mem_range src[GGML_MAX_SRC];
+    int n_dst;
+    int n_src;
+};
+
+static void ggml_node_access_add_src(struct ggml_node_access * acc, const struct ggml_tensor * t) {
+    if (t->data && acc->n_src < GGML_MAX_SRC) {
+        acc->src[acc->n_src++] = ggml_mem_range_of(t);
+    }
+}
+
+static void ggml_node_access_init(struct ggml_node_access * acc, const struct ggml_tensor * node, enum ggml_cpu_fusion fusion) {
+    acc->dst[0] = ggml_mem_range_of(node);
+    acc->n_dst  = 1;
+    acc->n_src  = 0;
+
+    switch (fusion) {
+        case GGML_CPU_FUSION_NONE:
+            {
+                for (int i = 0; i < GGML_MAX_SRC; i++) {
+                    if (node->src[i]) {
+                        ggml_node_access_add_src(acc, node->src[i]);
+                    }
+                }
+            } break;
+        case GGML_CPU_FUSION_RMS_NORM_MUL:
+            {
+                ggml_node_access_add_src(acc, node->src[0]->src[0]);
+                ggml_node_access_add_src(acc, node->src[1]);
+            } break;
+        case GGML_CPU_FUSION_ADD_RMS_NORM:
+        case GGML_CPU_FUSION_ADD_RMS_NORM_MUL:
+            {
+                const bool with_mul = fusion == GGML_CPU_FUSION_ADD_RMS_NORM_MUL;
+
+                const struct ggml_tensor * add = with_mul ? node->src[0]->src[0] : node->src[0];
+
+                acc->dst[acc->n_dst++] = ggml_mem_range_of(add);
+
+                ggml_node_access_add_src(acc, add->src[0]);
+                ggml_node_access_add_src(acc, add->src[1]);
+                if (with_mul) {
+                    ggml_node_access_add_src(acc, node->src[1]);
+                }
+            } break;
+        case GGML_CPU_FUSION_SWIGLU:
+            {
+                ggml_node_access_add_src(acc, node->src[0]->src[0]);
+                ggml_node_access_add_src(acc, node->src[1]);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
+static bool ggml_node_access_writes(const struct ggml_node_access * acc, struct ggml_mem_range r) {
+    for (int i = 0; i < acc->n_dst; i++) {
+        if (ggml_mem_range_overlap(acc->dst[i], r)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ggml_node_access_conflict(const struct ggml_node_access * a, const struct ggml_node_access * b) {
+    for (int i = 0; i < a->n_dst; i++) {
+        if (ggml_node_access_writes(b, a->dst[i])) {
+            return true;
+        }
+    }
+    for (int i = 0; i < a->n_src; i++) {
+        if (ggml_node_access_writes(b, a->src[i])) {
+            return true;
+        }
+    }
+    for (int i = 0; i < b->n_src; i++) {
+        if (ggml_node_access_writes(a, b->src[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ggml_graph_node_is_noop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return ggml_is_empty(node);
+    }
+}
+
+// number of times each tensor is used as a source by the nodes of a graph
+struct ggml_graph_uses {
+    struct ggml_hash_set set;
+    int32_t * counts;
+};
+
+static void ggml_graph_uses_init(struct ggml_graph_uses * uses, const struct ggml_cgraph * cgraph) {
+    size_t n_src = 0;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            n_src += cgraph->nodes[i]->src[j] != NULL;
+        }
+    }
+
+    uses->set.size = 2*n_src + 1;
+    uses->set.used = calloc(ggml_bitset_size(uses->set.size), sizeof(ggml_bitset_t));
+    uses->set.keys = malloc(uses->set.size*sizeof(struct ggml_tensor *));
+    uses->counts   = calloc(uses->set.size, sizeof(int32_t));
+    GGML_ASSERT(uses->set.used && uses->set.keys && uses->counts);
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (cgraph->nodes[i]->src[j]) {
+                uses->counts[ggml_hash_find_or_insert(&uses->set, cgraph->nodes[i]->src[j])]++;
+            }
+        }
+    }
+}
+
+static void ggml_graph_uses_free(struct ggml_graph_uses * uses) {
+    free(uses->set.used);
+    free(uses->set.keys);
+    free(uses->counts);
+}
+
+static int32_t ggml_graph_uses_get(const struct ggml_graph_uses * uses, const struct ggml_tensor * t) {
+    const size_t i = ggml_hash_find(&uses->set, t);
+    return i != GGML_HASHSET_FULL && ggml_bitset_get(uses->set.used, i) ? uses->counts[i] : 0;
+}
+
+// the result of node can be skipped when it is only used by a single node of the graph
+// the reads by other splits of the backend scheduler are not visible in the graph, the scheduler flags them
+static bool ggml_graph_node_can_elide(const struct ggml_graph_uses * uses, const struct ggml_tensor * node) {
+    return ggml_graph_uses_get(uses, node) == 1 && !(node->flags & (GGML_TENSOR_FLAG_OUTPUT | GGML_TENSOR_FLAG_SPLIT_INPUT));
+}
+
+static bool ggml_is_f32_rows(const struct ggml_tensor * t) {
+    return t->type == GGML_TYPE_F32 && t->nb[0] == sizeof(float) && t->data != NULL;
+}
+
+// index of node in the graph, searching backwards from node i
+static int ggml_graph_find_node_before(const struct ggml_cgraph * cgraph, int i, const struct ggml_tensor * node) {
+    for (int j = i - 1; j >= 0 && j >= i - GGML_CPU_FUSION_MAX_DIST; j--) {
+        if (cgraph->nodes[j] == node) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+// true if all the nodes between i0 and i1 (exclusive) do not compute anything
+static bool ggml_graph_nodes_are_noop(const struct ggml_cgraph * cgraph, const uint8_t * fusion, int i0, int i1) {
+    for (int j = i0 + 1; j < i1; j++) {
+        if (fusion[j] != GGML_CPU_FUSION_SKIP && !ggml_graph_node_is_noop(cgraph->nodes[j])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the fused kernels compute each row of a result right after reading the same row of the inputs, in any order across
+// the threads. the graph allocator can reuse the memory of an input that is dead after the first node of a sequence
+// for a later result, so a result can only overlap an input that is stored at the same rows (computed in place)
+static bool ggml_fusion_rows_in_place(const struct ggml_tensor * dst, const struct ggml_tensor * src) {
+    if (!ggml_mem_range_overlap(ggml_mem_range_of(dst), ggml_mem_range_of(src))) {
+        return true;
+    }
+    return dst->data == src->data && ggml_are_same_shape(dst, src) && ggml_are_same_stride(dst, src);
+}
+
+static void ggml_graph_plan_fusion(const struct ggml_cgraph * cgraph, uint8_t * fusion) {
+    const int n_nodes = cgraph->n_nodes;
+
+    memset(fusion, GGML_CPU_FUSION_NONE, n_nodes);
+
+    struct ggml_graph_uses uses;
+    ggml_graph_uses_init(&uses, cgraph);
+
+    for (int i = 0; i < n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (!ggml_is_f32_rows(node)) {
+            continue;
+        }
+
+        if (node->op == GGML_OP_RMS_NORM) {
+            // add -> rms_norm
+            const struct ggml_tensor * add = node->src[0];
+            if (add->op != GGML_OP_ADD || !ggml_is_f32_rows(add) ||
+                !ggml_is_f32_rows(add->src[0]) || !ggml_are_same_shape(add->src[0], add) ||
+                !ggml_is_f32_rows(add->src[1]) || add->src[1]->ne[0] != add->ne[0] || !ggml_can_repeat(add->src[1], add)) {
+                continue;
+            }
+
+            if (!ggml_fusion_rows_in_place(add,  add->src[0]) || !ggml_fusion_rows_in_place(add,  add->src[1]) ||
+                !ggml_fusion_rows_in_place(node, add->src[0]) || !ggml_fusion_rows_in_place(node, add->src[1]) ||
+                !ggml_fusion_rows_in_place(node, add)) {
+                continue;
+            }
+
+            const int j = ggml_graph_find_node_before(cgraph, i, add);
+            if (j < 0 || fusion[j] != GGML_CPU_FUSION_NONE || !ggml_graph_nodes_are_noop(cgraph, fusion, j, i)) {
+                continue;
+            }
+
+            fusion[j] = GGML_CPU_FUSION_SKIP;
+            fusion[i] = GGML_CPU_FUSION_ADD_RMS_NORM;
+        } else if (node->op == GGML_OP_MUL) {
+            const struct ggml_tensor * src0 = node->src[0];
+            const struct ggml_tensor * src1 = node->src[1];
+
+            if (src0 == src1 || !ggml_is_f32_rows(src1) || !ggml_are_same_shape(src0, node) ||
+                !ggml_graph_node_can_elide(&uses, src0)) {
+                continue;
+            }
+
+            const int j = ggml_graph_find_node_before(cgraph, i, src0);
+            if (j < 0) {
+                continue;
+            }
+
+            if (src0->op == GGML_OP_RMS_NORM) {
+                // (add ->) rms_norm -> mul
+                if (!ggml_is_f32_rows(src0) || !ggml_is_f32_rows(src0->src[0]) ||
+                    src1->ne[0] != node->ne[0] || !ggml_can_repeat(src1, node) ||
+                    !ggml_graph_nodes_are_noop(cgraph, fusion, j, i)) {
+                    continue;
+                }
+
+                const struct ggml_tensor * x = src0->src[0];
+                if (!ggml_fusion_rows_in_place(node, x) || !ggml_fusion_rows_in_place(node, src1)) {
+                    continue;
+                }
+                if (fusion[j] == GGML_CPU_FUSION_ADD_RMS_NORM &&
+                    (!ggml_fusion_rows_in_place(node, x->src[0]) || !ggml_fusion_rows_in_place(node, x->src[1]))) {
+                    continue;
+                }
+
+                if (fusion[j] == GGML_CPU_FUSION_NONE) {
+                    fusion[i] = GGML_CPU_FUSION_RMS_NORM_MUL;
+                } else if (fusion[j] == GGML_CPU_FUSION_ADD_RMS_NORM) {
+                    fusion[i] = GGML_CPU_FUSION_ADD_RMS_NORM_MUL;
+                } else {
+                    continue;
+                }
+                fusion[j] = GGML_CPU_FUSION_SKIP;
+            } else if (src0->op == GGML_OP_UNARY && ggml_get_unary_op(src0) == GGML_UNARY_OP_SILU) {
+                // silu -> mul, typically with the up projection computed in between
+                const struct ggml_tensor * g = src0->src[0];
+
+                if (fusion[j] != GGML_CPU_FUSION_NONE || !ggml_is_f32_rows(src0) || !ggml_is_f32_rows(g) ||
+                    !ggml_are_same_shape(g, node) || !ggml_are_same_shape(src1, node) ||
+                    !ggml_is_contiguous_1(g) || !ggml_is_contiguous_1(src1) || !ggml_is_contiguous_1(node) ||
+                    !ggml_fusion_rows_in_place(node, g) || !ggml_fusion_rows_in_place(node, src1)) {
+                    continue;
+                }
+
+                // g has to stay intact until it is read by the fused kernel
+                const struct ggml_mem_range rg = ggml_mem_range_of(g);
+
+                bool ok = true;
+                for (int k = j + 1; k < i && ok; k++) {
+                    if (fusion[k] == GGML_CPU_FUSION_SKIP || ggml_graph_node_is_noop(cgraph->nodes[k])) {
+                        continue;
+                    }
+
+                    struct ggml_node_access acc;
+                    ggml_node_access_init(&acc, cgraph->nodes[k], (enum ggml_cpu_fusion) fusion[k]);
+
+                    ok = !ggml_node_access_writes(&acc, rg);
+                }
+                if (!ok) {
+                    continue;
+                }
+
+                fusion[j] = GGML_CPU_FUSION_SKIP;
+                fusion[i] = GGML_CPU_FUSION_SWIGLU;
+            }
+        }
+    }
+
+    ggml_graph_uses_free(&uses);
+}
+
+// compute the barriers needed between the nodes of the graph
+static void ggml_graph_plan_barriers(const struct ggml_cgraph * cgraph, const uint8_t * fusion, uint8_t * barrier, int n_threads) {
+    const int n_nodes = cgraph->n_nodes;
+
+    if (n_threads == 1) {
+        // nothing to synchronize, keep checking for aborts after every node
+        memset(barrier, 1, n_nodes);
+        return;
+    }
+
+    memset(barrier, 0, n_nodes);
+
+    struct ggml_node_access pending[GGML_BARRIER_MAX_PENDING];
+    int     n_pending       = 0;
+    int64_t pending_scratch = GGML_SCRATCH_NONE;
+
+    for (int i = 0; i < n_nodes; i++) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (fusion[i] == GGML_CPU_FUSION_SKIP || ggml_graph_node_is_noop(node)) {
+            continue;
+        }
+
+        // the fused kernels do not use the work buffer
+        const int64_t scratch =
+            fusion[i] != GGML_CPU_FUSION_NONE ? GGML_SCRATCH_NONE :
+            node->data                        ? ggml_graph_node_scratch(node) : GGML_SCRATCH_FENCE;
+
+        struct ggml_node_access acc;
+        ggml_node_access_init(&acc, node, (enum ggml_cpu_fusion) fusion[i]);
+
+        bool sync = n_pending == GGML_BARRIER_MAX_PENDING ||
+            scratch == GGML_SCRATCH_FENCE || pending_scratch == GGML_SCRATCH_FENCE ||
+            (scratch != GGML_SCRATCH_NONE && pending_scratch != GGML_SCRATCH_NONE &&
+             (scratch == GGML_SCRATCH_SHARED || scratch != pending_scratch));
+
+        for (int j = 0; j < n_pending && !sync; j++) {
+            sync = ggml_node_access_conflict(&acc, &pending[j]);
+        }
+
+        if (sync && n_pending > 0) {
+            barrier[i - 1]  = 1;
+            n_pending       = 0;
+            pending_scratch = GGML_SCRATCH_NONE;
+        }
+
+        pending[n_pending++] = acc;
+        if (scratch != GGML_SCRATCH_NONE) {
+            pending_scratch = scratch;
+        }
+    }
+}
+
+int ggml_graph_n_fused_nodes(const struct ggml_cgraph * cgraph) {
+    uint8_t * fusion = malloc(cgraph->n_nodes);
+    GGML_ASSERT(fusion || cgraph->n_nodes == 0);
+
+    ggml_graph_plan_fusion(cgraph, fusion);
+
+    int n_fused = 0;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        n_fused += fusion[i] == GGML_CPU_FUSION_SKIP;
+    }
+
+    free(fusion);
+
+    return n_fused;
+}
+
+// analyse the graph of the threadpool before computing it
+static void ggml_graph_plan_nodes(struct ggml_threadpool * tp, int n_threads) {
+    const int n_nodes = tp->cgraph->n_nodes;
+
+    if (tp->node_plan_size < n_nodes) {
+        free(tp->node_fusion);
+        free(tp->node_barrier);
+        tp->node_fusion    = malloc(n_nodes);
+        tp->node_barrier   = malloc(n_nodes);
+        tp->node_plan_size = n_nodes;
+        GGML_ASSERT(tp->node_fusion && tp->node_barrier);
+    }
+
+    ggml_graph_plan_fusion  (tp->cgraph, tp->node_fusion);
+    ggml_graph_plan_barriers(tp->cgraph, tp->node_fusion, tp->node_barrier, n_threads);
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -2847,8 +3514,20 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
-        ggml_compute_forward(&params, node);
+        const enum ggml_cpu_fusion fusion = (enum ggml_cpu_fusion) tp->node_fusion[node_n];
+
+        if (fusion == GGML_CPU_FUSION_NONE) {
+            ggml_compute_forward(&params, node);
+        } else if (fusion != GGML_CPU_FUSION_SKIP) {
+            ggml_compute_forward_fused(&params, node, fusion);
+        }
 
+        if (node_n + 1 < cgraph->n_nodes && !tp->node_barrier[node_n]) {
+            // the next node does not depend on this one
+            continue;
+        }
+
+        // the abort is only signaled before a barrier, so that all threads observe it after the same node
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
             atomic_store_explicit(&tp->abort, node_n + 1, memory_order_relaxed);
@@ -3022,6 +3701,9 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
     {
         threadpool->cgraph           = cgraph;
         threadpool->cplan            = cplan;
+        threadpool->node_fusion      = NULL;
+        threadpool->node_barrier     = NULL;
+        threadpool->node_plan_size   = 0;
         threadpool->n_graph          = 0;
         threadpool->n_barrier        = 0;
         threadpool->n_barrier_passed = 0;
@@ -3111,6 +3793,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+    ggml_graph_plan_nodes(threadpool, n_threads);
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -7,6 +7,7 @@
 #include "vec.h"
 
 #include <float.h>
+#include <algorithm>
 
 #if defined(_MSC_VER)
 // disable "possible loss of data" to avoid hundreds of casts
@@ -2848,6 +2849,44 @@ static void ggml_compute_forward_silu_f32(
     }
 }
 
+// ggml_compute_forward_swiglu_fused
+
+// dst = mul(silu(g), u) computed in a single pass, dst->src[0] is the silu node
+// all tensors are F32 with the same shape and contiguous rows
+void ggml_compute_forward_swiglu_fused(
+        const ggml_compute_params * params,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * g = dst->src[0]->src[0];
+    const ggml_tensor * u = dst->src[1];
+
+    assert(ggml_is_contiguous_1(g));
+    assert(ggml_is_contiguous_1(u));
+    assert(ggml_is_contiguous_1(dst));
+    assert(ggml_are_same_shape(g, dst));
+    assert(ggml_are_same_shape(u, dst));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = dst->ne[0];
+    const int nr = ggml_nrows(dst);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        ggml_vec_swiglu_f32(nc,
+                (float *) ((char *) dst->data + i1*(dst->nb[1])),
+                (float *) ((char *) g->data   + i1*(g->nb[1])),
+                (float *) ((char *) u->data   + i1*(u->nb[1])));
+    }
+}
+
 static void ggml_compute_forward_silu_f16(
     const ggml_compute_params * params,
     ggml_tensor * dst) {
@@ -3243,6 +3282,78 @@ void ggml_compute_forward_rms_norm(
     }
 }
 
+// ggml_compute_forward_rms_norm_fused
+
+// rms_norm(x) with the residual add that produces x and/or the multiplication by the norm weight fused in
+// dst is the last node of the sequence:
+//   with_mul: dst = mul(rms_norm(x), w), otherwise dst = rms_norm(x)
+//   with_add: x   = add(a, b) is computed and stored row by row, right before it is normalized
+// all tensors are F32 with contiguous rows, w and b can be broadcast
+void ggml_compute_forward_rms_norm_fused(
+        const ggml_compute_params * params,
+        ggml_tensor * dst,
+        bool with_add,
+        bool with_mul) {
+
+    const ggml_tensor * norm = with_mul ? dst->src[0] : dst;
+    const ggml_tensor * w    = with_mul ? dst->src[1] : nullptr;
+    const ggml_tensor * x    = norm->src[0];
+    const ggml_tensor * a    = with_add ? x->src[0] : nullptr;
+    const ggml_tensor * b    = with_add ? x->src[1] : nullptr;
+
+    GGML_ASSERT(ggml_are_same_shape(x, dst));
+    GGML_ASSERT(x->nb[0] == sizeof(float) && dst->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_LOCALS(int64_t, ne0, x, ne)
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps >= 0.0f);
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                float * xr = (float *) ((char *) x->data + i01*x->nb[1] + i02*x->nb[2] + i03*x->nb[3]);
+
+                if (with_add) {
+                    const float * ar = (const float *) ((const char *) a->data + i01*a->nb[1] + i02*a->nb[2] + i03*a->nb[3]);
+                    const float * br = (const float *) ((const char *) b->data +
+                        (i01 % b->ne[1])*b->nb[1] + (i02 % b->ne[2])*b->nb[2] + (i03 % b->ne[3])*b->nb[3]);
+
+                    ggml_vec_add_f32(ne00, xr, ar, br);
+                }
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(xr[i00] * xr[i00]);
+                }
+
+                const float mean  = sum/ne00;
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                float * y = (float *) ((char *) dst->data + i01*dst->nb[1] + i02*dst->nb[2] + i03*dst->nb[3]);
+
+                if (y != xr) {
+                    memcpy(y, xr, ne00 * sizeof(float));
+                }
+
+                ggml_vec_scale_f32(ne00, y, scale);
+
+                if (with_mul) {
+                    const float * wr = (const float *) ((const char *) w->data +
+                        (i01 % w->ne[1])*w->nb[1] + (i02 % w->ne[2])*w->nb[2] + (i03 % w->ne[3])*w->nb[3]);
+
+                    ggml_vec_mul_f32(ne00, y, y, wr);
+                }
+            }
+        }
+    }
+}
+
 static void ggml_compute_forward_rms_norm_back_f32(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
@@ -4685,6 +4796,9 @@ static void ggml_compute_forward_soft_max_f32(
 
     const bool use_f16 = (src1 && src1->type == GGML_TYPE_F16);
 
+    // optional block summary of the mask
+    const ggml_tensor * blk = src1 ? dst->src[2] : NULL;
+
     for (int i1 = ir0; i1 < ir1; i1++) {
         // ALiBi
         const uint32_t h = (i1/ne01)%ne02; // head
@@ -4697,31 +4811,62 @@ static void ggml_compute_forward_soft_max_f32(
         ggml_fp16_t * mp_f16 = src1 ? (ggml_fp16_t *)((char *) src1->data) + (i1%ne01)*ne00 : NULL;
         float       * mp_f32 = src1 ? (float       *)((char *) src1->data) + (i1%ne01)*ne00 : NULL;
 
-        ggml_vec_cpy_f32  (nc, wp, sp);
-        ggml_vec_scale_f32(nc, wp, scale);
-        if (mp_f32) {
-            if (use_f16) {
-                for (int i = 0; i < nc; ++i) {
-                    wp[i] += slope*GGML_FP16_TO_FP32(mp_f16[i]);
-                }
-            } else {
-                for (int i = 0; i < nc; ++i) {
-                    wp[i] += slope*mp_f32[i];
+        const int8_t * bp = blk ? (int8_t *)((char *) blk->data + (i1%ne01)*blk->nb[1]) : NULL;
+
+        // with a mask summary the masked blocks do not contribute and are skipped
+        const int bs = bp ? GGML_KQ_MASK_BLK : nc;
+        const int nb = (nc + bs - 1)/bs;
+
+        float max = -INFINITY;
+
+        for (int ib = 0; ib < nb; ++ib) {
+            const int i0 = ib*bs;
+            const int n  = MIN(bs, nc - i0);
+
+            const int8_t b = bp ? bp[ib] : (int8_t) GGML_KQ_MASK_BLK_MIXED;
+            if (b == GGML_KQ_MASK_BLK_MASKED) {
+                continue;
+            }
+
+            ggml_vec_cpy_f32  (n, wp + i0, sp + i0);
+            ggml_vec_scale_f32(n, wp + i0, scale);
+            if (mp_f32 && b == GGML_KQ_MASK_BLK_MIXED) {
+                if (use_f16) {
+                    for (int i = i0; i < i0 + n; ++i) {
+                        wp[i] += slope*GGML_FP16_TO_FP32(mp_f16[i]);
+                    }
+                } else {
+                    for (int i = i0; i < i0 + n; ++i) {
+                        wp[i] += slope*mp_f32[i];
+                    }
                 }
             }
-        }
 
 #ifndef NDEBUG
-        for (int i = 0; i < nc; ++i) {
-            //printf("p[%d] = %f\n", i, p[i]);
-            assert(!isnan(wp[i]));
-        }
+            for (int i = i0; i < i0 + n; ++i) {
+                //printf("p[%d] = %f\n", i, p[i]);
+                assert(!isnan(wp[i]));
+            }
 #endif
 
-        float max = -INFINITY;
-        ggml_vec_max_f32(nc, &max, wp);
+            float max_b = -INFINITY;
+            ggml_vec_max_f32(n, &max_b, wp + i0);
+            max = MAX(max, max_b);
+        }
+
+        ggml_float sum = 0.0;
 
-        ggml_float sum = ggml_vec_soft_max_f32(nc, dp, wp, max);
+        for (int ib = 0; ib < nb; ++ib) {
+            const int i0 = ib*bs;
+            const int n  = MIN(bs, nc - i0);
+
+            if (bp && bp[ib] == GGML_KQ_MASK_BLK_MASKED) {
+                memset(dp + i0, 0, n*sizeof(float));
+                continue;
+            }
+
+            sum += ggml_vec_soft_max_f32(n, dp + i0, wp + i0, max);
+        }
         assert(sum > 0.0);
 
         sum = 1.0/sum;
@@ -6649,16 +6794,11 @@ static void ggml_compute_forward_argsort_f32(
             dst_data[j] = j;
         }
 
-        // C doesn't have a functional sort, so we do a bubble sort instead
-        for (int64_t j = 0; j < ne0; j++) {
-            for (int64_t k = j + 1; k < ne0; k++) {
-                if ((order == GGML_SORT_ORDER_ASC  && src_data[dst_data[j]] > src_data[dst_data[k]]) ||
-                    (order == GGML_SORT_ORDER_DESC && src_data[dst_data[j]] < src_data[dst_data[k]])) {
-                    int32_t tmp = dst_data[j];
-                    dst_data[j] = dst_data[k];
-                    dst_data[k] = tmp;
-                }
-            }
+        // stable, so that equal values keep the order of their indices
+        if (order == GGML_SORT_ORDER_ASC) {
+            std::stable_sort(dst_data, dst_data + ne0, [src_data](int32_t a, int32_t b) { return src_data[a] < src_data[b]; });
+        } else {
+            std::stable_sort(dst_data, dst_data + ne0, [src_data](int32_t a, int32_t b) { return src_data[a] > src_data[b]; });
         }
     }
 }
@@ -6683,6 +6823,27 @@ void ggml_compute_forward_argsort(
 
 // ggml_compute_forward_flash_attn_ext
 
+// min number of KV cells processed by a thread when a q row is split across threads
+#define GGML_FA_KV_CHUNK_MIN 256
+
+int64_t ggml_compute_forward_flash_attn_ext_n_chunks(const ggml_tensor * dst, int n_threads) {
+    const ggml_tensor * q = dst->src[0];
+    const ggml_tensor * k = dst->src[1];
+
+    // total rows in q
+    const int64_t nr = q->ne[1]*q->ne[2]*q->ne[3];
+
+    if (nr >= n_threads) {
+        return 1;
+    }
+
+    // split-KV: with fewer q rows than threads (e.g. during token generation), each thread processes
+    // a chunk of the KV cells of a row and the partial results are merged at the end
+    const int64_t n_chunks = (n_threads + nr - 1)/nr;
+
+    return MAX(1, MIN(n_chunks, k->ne[1]/GGML_FA_KV_CHUNK_MIN));
+}
+
 static void ggml_compute_forward_flash_attn_ext_f16(
         const ggml_compute_params * params,
         const ggml_tensor * q,
@@ -6735,16 +6896,29 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const int64_t rv3 = neq3/nev3;
 
     // parallelize by q rows using ggml_vec_dot_f32
+    // if there are not enough rows, each row is also split in chunks of KV cells
 
     // total rows in q
     const int nr = neq1*neq2*neq3;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    // optional block summary of the mask, masked blocks are skipped
+    const ggml_tensor * blk = mask ? dst->src[4] : NULL;
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    // chunks of KV cells per row
+    const int nc = ggml_compute_forward_flash_attn_ext_n_chunks(dst, nth);
+
+    // KV cells per chunk
+    const int64_t dc = (nek1 + nc - 1)/nc;
+
+    // work items (row x chunk) per thread
+    const int dw = (nr*nc + nth - 1)/nth;
+
+    // work item range for this thread
+    const int iw0 = dw*ith;
+    const int iw1 = MIN(iw0 + dw, nr*nc);
+
+    // partial results of the chunks: max KQ value, sum and VKQ accumulator
+    float * part = (float *) params->wdata + nth*(1*DK + 2*DV + CACHE_LINE_SIZE_F32);
 
     float scale         = 1.0f;
     float max_bias      = 0.0f;
@@ -6773,7 +6947,13 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
 
     // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
+    for (int iw = iw0; iw < iw1; ++iw) {
+        const int ir = iw/nc;
+
+        // KV cell range of the chunk
+        const int64_t ic0 = (iw%nc)*dc;
+        const int64_t ic1 = MIN(ic0 + dc, nek1);
+
         // q indices
         const int iq3 = ir/(neq2*neq1);
         const int iq2 = (ir - iq3*neq2*neq1)/neq1;
@@ -6797,6 +6977,7 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         }
 
         const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
+        const int8_t      * bp = blk  ? (int8_t      *)((char *) blk->data  + iq1*blk->nb[1])  : NULL;
 
         // k indices
         const int ik3 = iq3 / rk3;
@@ -6812,8 +6993,20 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         // online softmax / attention
         // loop over n_kv and n_head_kv
         // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
+        int8_t b = GGML_KQ_MASK_BLK_MIXED; // summary of the mask block of the current KV cell
+
+        for (int64_t ic = ic0; ic < ic1; ++ic) {
+            if (bp && (ic == ic0 || ic % GGML_KQ_MASK_BLK == 0)) {
+                b = bp[ic/GGML_KQ_MASK_BLK];
+
+                if (b == GGML_KQ_MASK_BLK_MASKED) {
+                    // skip to the next block
+                    ic = MIN((ic/GGML_KQ_MASK_BLK + 1)*GGML_KQ_MASK_BLK, ic1) - 1;
+                    continue;
+                }
+            }
+
+            const float mv = mp && b != GGML_KQ_MASK_BLK_ZERO ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
             if (mv == -INFINITY) {
                 continue;
             }
@@ -6885,6 +7078,17 @@ static void ggml_compute_forward_flash_attn_ext_f16(
             }
         }
 
+        if (nc > 1) {
+            // keep the partial result of the chunk, merged below
+            float * pw = part + iw*(DV + 2);
+
+            pw[0] = M;
+            pw[1] = S;
+            memcpy(pw + 2, VKQ32, DV*sizeof(float));
+
+            continue;
+        }
+
         // V /= S
         const float S_inv = 1.0f/S;
         ggml_vec_scale_f32(DV, VKQ32, S_inv);
@@ -6900,6 +7104,56 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         // permute(0, 2, 1, 3)
         memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
     }
+
+    if (nc == 1) {
+        return;
+    }
+
+    ggml_barrier(params->threadpool);
+
+    // merge the partial results of the chunks of each row
+    const int dr = (nr + nth - 1)/nth;
+
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    float * VKQ32 = (float *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const float * pr = part + ir*nc*(DV + 2);
+
+        float M = -INFINITY;
+        for (int ic = 0; ic < nc; ++ic) {
+            M = MAX(M, pr[ic*(DV + 2)]);
+        }
+
+        float S = 0.0f;
+        memset(VKQ32, 0, DV*sizeof(float));
+
+        for (int ic = 0; ic < nc; ++ic) {
+            const float * pw = pr + ic*(DV + 2);
+
+            if (pw[0] == -INFINITY) {
+                // all KV cells of the chunk are masked
+                continue;
+            }
+
+            const float ms = expf(pw[0] - M);
+
+            S += pw[1]*ms;
+            ggml_vec_mad_f32(DV, VKQ32, pw + 2, ms);
+        }
+
+        // V /= S
+        ggml_vec_scale_f32(DV, VKQ32, 1.0f/S);
+
+        const int iq3 = ir/(neq2*neq1);
+        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+
+        // permute(0, 2, 1, 3)
+        memcpy((char *) dst->data + (iq3*ne2*ne1 + iq2 + iq1*ne1)*nb1, VKQ32, nb1);
+    }
 }
 
 void ggml_compute_forward_flash_attn_ext(
@@ -3,7 +3,10 @@
 #include "ggml-backend-impl.h"
 #include "ggml-cpp.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <deque>
+#include <list>
 #include <string>
 #include <vector>
 #include <memory>
@@ -39,9 +42,34 @@ using ssize_t = __int64;
 typedef int sockfd_t;
 #endif
 
+// response of a command sent by the client without waiting for it
+struct rpc_pending_rsp {
+    uint8_t cmd;
+    void *  output;      // destination of the response, nullptr if it is only checked
+    size_t  output_size;
+};
+
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+
+    // client side: the socket is shared by all the buffers and backends of an endpoint, the fields below are only
+    // accessed with the mutex locked
+    std::mutex mutex;
+
+    // client side: the commands are pipelined, their responses are received in the order the commands were sent
+    std::deque<rpc_pending_rsp> pending;
+    size_t   pending_size = 0; // total size of the pending responses, including their size headers
+    uint64_t n_sent = 0;       // number of commands sent, used as sequence number by the events
+    uint64_t n_recv = 0;       // number of responses received
+
+    // client side: first failure of an asynchronous graph computation, reported when the backend waits for it or by
+    // the next graph_compute
+    ggml_status status = GGML_STATUS_SUCCESS;
+
+    // client side: ids and sizes of the graphs in the graph cache of the server, most recently used first
+    std::list<std::pair<uint64_t, uint64_t>> graph_cache;
+
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -93,12 +121,21 @@ enum rpc_cmd {
     RPC_CMD_INIT_TENSOR,
     RPC_CMD_GET_ALLOC_SIZE,
     RPC_CMD_HELLO,
+    RPC_CMD_GRAPH_RECOMPUTE,
+    RPC_CMD_GRAPH_UPDATE,
     RPC_CMD_COUNT,
 };
 
 // Try RPC_CMD_SET_TENSOR_HASH first when data size is larger than this threshold
 const size_t HASH_THRESHOLD = 10 * 1024 * 1024;
 
+// Number of deserialized graphs kept by the server for RPC_CMD_GRAPH_RECOMPUTE and RPC_CMD_GRAPH_UPDATE
+const size_t GRAPH_CACHE_SIZE = 32;
+
+// Receive the pending responses before sending a new command when they are larger than this threshold, so that the
+// server never blocks on sending a response while the client is blocked on sending a command
+const size_t MAX_PENDING_RSP_SIZE = 64 * 1024;
+
 struct rpc_msg_hello_rsp {
     uint8_t major;
     uint8_t minor;
@@ -174,6 +211,25 @@ struct rpc_msg_graph_compute_rsp {
     uint8_t result;
 };
 
+struct rpc_msg_graph_recompute_req {
+    uint64_t graph_id;   // FNV-1a hash of the serialized graph
+    uint64_t graph_size; // size of the serialized graph
+};
+
+struct rpc_msg_graph_recompute_rsp {
+    uint8_t found;
+    uint8_t result;
+};
+
+// followed by n_tensors * rpc_tensor
+struct rpc_msg_graph_update_req {
+    uint64_t base_id;    // graph cached by the server that is updated in place
+    uint64_t base_size;
+    uint64_t graph_id;   // id and size of the graph after the update
+    uint64_t graph_size;
+    uint32_t n_tensors;
+};
+
 struct rpc_msg_get_device_memory_rsp {
     uint64_t free_mem;
     uint64_t total_mem;
@@ -197,6 +253,12 @@ struct ggml_backend_rpc_buffer_type_context {
 struct ggml_backend_rpc_context {
     std::string endpoint;
     std::string name;
+    std::vector<uint8_t> last_graph; // last serialized graph, the next graph is sent as a diff when possible
+};
+
+struct ggml_backend_rpc_event_context {
+    std::shared_ptr<socket_t> sock;
+    uint64_t seq; // the event is complete when the responses of the first seq commands have been received
 };
 
 struct ggml_backend_rpc_buffer_context {
@@ -379,7 +441,69 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
 
 // RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
 // RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+
+// the functions below must be called with the mutex of the socket locked, except send_rpc_cmd
+
+// receive the responses of the pending commands until the responses of the first seq commands have been received
+static bool recv_pending_rsp(const std::shared_ptr<socket_t> & sock, uint64_t seq) {
+    std::vector<uint8_t> buf;
+    while (sock->n_recv < seq) {
+        GGML_ASSERT(!sock->pending.empty());
+        const rpc_pending_rsp rsp = sock->pending.front();
+        sock->pending.pop_front();
+        sock->pending_size -= sizeof(uint64_t) + rsp.output_size;
+        sock->n_recv++;
+
+        // TODO: currently the output_size is always known, do we need support for commands with variable output size?
+        // even if we do, we can skip sending output_size from the server for commands with known output size
+        uint64_t out_size;
+        if (!recv_data(sock->fd, &out_size, sizeof(out_size))) {
+            return false;
+        }
+        if (out_size != rsp.output_size) {
+            return false;
+        }
+        void * output = rsp.output;
+        if (output == nullptr) {
+            buf.resize(rsp.output_size);
+            output = buf.data();
+        }
+        if (!recv_data(sock->fd, output, rsp.output_size)) {
+            return false;
+        }
+        if (rsp.output != nullptr || rsp.cmd != RPC_CMD_GRAPH_COMPUTE) {
+            continue;
+        }
+
+        // the response of an asynchronous graph computation is only checked, a failure is reported by the next
+        // synchronization or graph_compute
+        const rpc_msg_graph_compute_rsp * response = (const rpc_msg_graph_compute_rsp *) output;
+        const ggml_status result = (ggml_status) (int8_t) response->result;
+        if (result != GGML_STATUS_SUCCESS) {
+            GGML_LOG_ERROR("%s: graph compute failed with status %d\n", __func__, (int) result);
+            if (sock->status == GGML_STATUS_SUCCESS) {
+                sock->status = result;
+            }
+        }
+    }
+    return true;
+}
+
+// the synchronization functions cannot return the failure of an asynchronous graph computation, and the outputs of the
+// graph are not valid - abort like the other asynchronous backends do on a failed computation
+static void check_graph_status(const std::shared_ptr<socket_t> & sock) {
+    if (sock->status != GGML_STATUS_SUCCESS) {
+        GGML_ABORT("RPC graph compute failed with status %d", (int) sock->status);
+    }
+}
+
+// send a command without waiting for its response, output is written when the response is received by recv_pending_rsp
+static bool send_rpc_cmd_async(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    if (sock->pending_size > MAX_PENDING_RSP_SIZE) {
+        if (!recv_pending_rsp(sock, sock->n_sent)) {
+            return false;
+        }
+    }
     uint8_t cmd_byte = cmd;
     if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
         return false;
@@ -390,25 +514,24 @@ static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cm
     if (!send_data(sock->fd, input, input_size)) {
         return false;
     }
-    // TODO: currently the output_size is always known, do we need support for commands with variable output size?
-    // even if we do, we can skip sending output_size from the server for commands with known output size
-    uint64_t out_size;
-    if (!recv_data(sock->fd, &out_size, sizeof(out_size))) {
-        return false;
-    }
-    if (out_size != output_size) {
-        return false;
-    }
-    if (!recv_data(sock->fd, output, output_size)) {
+    // count the size header too, otherwise the responses without data (e.g. SET_TENSOR) would never be drained
+    sock->pending.push_back({cmd_byte, output, output_size});
+    sock->pending_size += sizeof(uint64_t) + output_size;
+    sock->n_sent++;
+    return true;
+}
+
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    if (!send_rpc_cmd_async(sock, cmd, input, input_size, output, output_size)) {
         return false;
     }
-    return true;
+    return recv_pending_rsp(sock, sock->n_sent);
 }
 
 // RPC client-side implementation
 
-static bool check_server_version(const std::shared_ptr<socket_t> & sock) {
-    rpc_msg_hello_rsp response;
+static bool check_server_version(const std::shared_ptr<socket_t> & sock, rpc_msg_hello_rsp & response) {
     bool status = send_rpc_cmd(sock, RPC_CMD_HELLO, nullptr, 0, &response, sizeof(response));
     GGML_ASSERT(status);
     if (response.major != RPC_PROTO_MAJOR_VERSION || response.minor > RPC_PROTO_MINOR_VERSION) {
@@ -421,15 +544,19 @@ static bool check_server_version(const std::shared_ptr<socket_t> & sock) {
     return true;
 }
 
-static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
+static std::shared_ptr<socket_t> get_socket(const std::string & endpoint, rpc_msg_hello_rsp * version = nullptr) {
     static std::mutex mutex;
     std::lock_guard<std::mutex> lock(mutex);
     static std::unordered_map<std::string, std::weak_ptr<socket_t>> sockets;
+    static std::unordered_map<std::string, rpc_msg_hello_rsp> versions;
     static bool initialized = false;
 
     auto it = sockets.find(endpoint);
     if (it != sockets.end()) {
         if (auto sock = it->second.lock()) {
+            if (version) {
+                *version = versions.at(endpoint);
+            }
             return sock;
         }
     }
@@ -454,11 +581,16 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     if (sock == nullptr) {
         return nullptr;
     }
-    if (!check_server_version(sock)) {
+    rpc_msg_hello_rsp response;
+    if (!check_server_version(sock, response)) {
         return nullptr;
     }
     GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
     sockets[endpoint] = sock;
+    versions[endpoint] = response;
+    if (version) {
+        *version = response;
+    }
     return sock;
 }
 
@@ -467,6 +599,9 @@ static void ggml_backend_rpc_buffer_free_buffer(ggml_backend_buffer_t buffer) {
     rpc_msg_free_buffer_req request = {ctx->remote_ptr};
     bool status = send_rpc_cmd(ctx->sock, RPC_CMD_FREE_BUFFER, &request, sizeof(request), nullptr, 0);
     GGML_ASSERT(status);
+    // the server drops its graph cache when a buffer is freed
+    std::lock_guard<std::mutex> lock(ctx->sock->mutex);
+    ctx->sock->graph_cache.clear();
     delete ctx;
 }
 
@@ -555,7 +690,9 @@ static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggm
     memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
     memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
     memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input.data(), input.size(), nullptr, 0);
+    // the data has been sent once this returns, the commands that follow are executed after it by the server
+    std::lock_guard<std::mutex> lock(ctx->sock->mutex);
+    bool status = send_rpc_cmd_async(ctx->sock, RPC_CMD_SET_TENSOR, input.data(), input.size(), nullptr, 0);
     GGML_ASSERT(status);
 }
 
@@ -695,9 +832,34 @@ static void ggml_backend_rpc_free(ggml_backend_t backend) {
     delete backend;
 }
 
-static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
+static void ggml_backend_rpc_set_tensor_async(ggml_backend_t backend, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    ggml_backend_buffer_t buf = tensor->view_src ? tensor->view_src->buffer : tensor->buffer;
+    // set_tensor of the buffer does not wait for the server
+    ggml_backend_rpc_buffer_set_tensor(buf, tensor, data, offset, size);
+    GGML_UNUSED(backend);
+}
+
+static void ggml_backend_rpc_get_tensor_async(ggml_backend_t backend, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_buffer_t buf = tensor->view_src ? tensor->view_src->buffer : tensor->buffer;
+    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buf->context;
+    rpc_msg_get_tensor_req request;
+    request.tensor = serialize_tensor(tensor);
+    request.offset = offset;
+    request.size = size;
+    std::lock_guard<std::mutex> lock(ctx->sock->mutex);
+    bool status = send_rpc_cmd_async(ctx->sock, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
+    GGML_ASSERT(status);
     GGML_UNUSED(backend);
-    // this is no-op because we don't have any async operations
+}
+
+static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    auto sock = get_socket(rpc_ctx->endpoint);
+    GGML_ASSERT(sock != nullptr);
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    bool status = recv_pending_rsp(sock, sock->n_sent);
+    GGML_ASSERT(status);
+    check_graph_status(sock);
 }
 
 static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor*> & visited) {
@@ -737,22 +899,164 @@ static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & o
     memcpy(out_tensors, tensors.data(), n_tensors * sizeof(rpc_tensor));
 }
 
+// serializes the tensors of graph that differ from base, fails if the graphs do not have the same nodes and tensors
+// serialization format: | rpc_msg_graph_update_req | tensors (n_tensors * sizeof(rpc_tensor)) |
+static bool serialize_graph_update(const std::vector<uint8_t> & base, const std::vector<uint8_t> & graph, std::vector<uint8_t> & output) {
+    if (base.size() != graph.size()) {
+        return false;
+    }
+    uint32_t n_nodes;
+    memcpy(&n_nodes, graph.data(), sizeof(n_nodes));
+    const size_t header_size = sizeof(uint32_t) + n_nodes * sizeof(uint64_t) + sizeof(uint32_t);
+    if (memcmp(base.data(), graph.data(), header_size) != 0) {
+        return false;
+    }
+    const uint32_t n_tensors = (graph.size() - header_size) / sizeof(rpc_tensor);
+    const rpc_tensor * base_tensors  = (const rpc_tensor *)(base.data()  + header_size);
+    const rpc_tensor * graph_tensors = (const rpc_tensor *)(graph.data() + header_size);
+
+    std::vector<uint32_t> changed;
+    for (uint32_t i = 0; i < n_tensors; i++) {
+        if (base_tensors[i].id != graph_tensors[i].id) {
+            return false;
+        }
+        if (memcmp(&base_tensors[i], &graph_tensors[i], sizeof(rpc_tensor)) != 0) {
+            changed.push_back(i);
+        }
+    }
+    // not worth it if most of the graph has changed
+    if (changed.size() > n_tensors / 2) {
+        return false;
+    }
+
+    rpc_msg_graph_update_req request;
+    request.base_id    = fnv_hash(base.data(), base.size());
+    request.base_size  = base.size();
+    request.graph_id   = fnv_hash(graph.data(), graph.size());
+    request.graph_size = graph.size();
+    request.n_tensors  = changed.size();
+    output.resize(sizeof(request) + changed.size() * sizeof(rpc_tensor));
+    memcpy(output.data(), &request, sizeof(request));
+    rpc_tensor * out_tensors = (rpc_tensor *)(output.data() + sizeof(request));
+    for (size_t i = 0; i < changed.size(); i++) {
+        memcpy(&out_tensors[i], &graph_tensors[changed[i]], sizeof(rpc_tensor));
+    }
+    return true;
+}
+
 static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
     std::vector<uint8_t> input;
     serialize_graph(cgraph, input);
-    rpc_msg_graph_compute_rsp response;
-    auto sock = get_socket(rpc_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
+    rpc_msg_hello_rsp version;
+    auto sock = get_socket(rpc_ctx->endpoint, &version);
+    GGML_ASSERT(sock != nullptr);
+    std::lock_guard<std::mutex> lock(sock->mutex);
+
+    // a graph sent in full is computed asynchronously and its response is checked later, when the backend is
+    // synchronized or when the responses are drained - return the failure of a previous graph before computing this one
+    if (sock->status != GGML_STATUS_SUCCESS) {
+        const ggml_status status = sock->status;
+        sock->status = GGML_STATUS_SUCCESS;
+        return status;
+    }
+
+    if (version.minor < 1) {
+        // the server does not cache graphs
+        bool status = send_rpc_cmd_async(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), nullptr, sizeof(rpc_msg_graph_compute_rsp));
+        GGML_ASSERT(status);
+        return GGML_STATUS_SUCCESS;
+    }
+
+    // the server keeps the last deserialized graphs: if it has already seen this graph, only send its id, otherwise
+    // try to send only the tensors that changed since the previous graph (e.g. the views of the KV cache that move
+    // with every token)
+    // the client tracks the contents of the graph cache of the server, but the server can still miss a graph (e.g. an
+    // update with tensors it does not know), so the response of a RECOMPUTE or UPDATE is waited for and the graph is
+    // sent in full on a miss
+    auto & graph_cache = sock->graph_cache;
+    auto find_graph = [&](uint64_t id, uint64_t size) {
+        return std::find(graph_cache.begin(), graph_cache.end(), std::make_pair(id, size));
+    };
+
+    const uint64_t graph_id = fnv_hash(input.data(), input.size());
+    auto it = find_graph(graph_id, input.size());
+    rpc_msg_graph_recompute_rsp response = {};
+    bool cached = false;
+    if (it != graph_cache.end()) {
+        rpc_msg_graph_recompute_req request = {graph_id, input.size()};
+        bool status = send_rpc_cmd_async(sock, RPC_CMD_GRAPH_RECOMPUTE, &request, sizeof(request), &response, sizeof(response));
+        GGML_ASSERT(status);
+        graph_cache.splice(graph_cache.begin(), graph_cache, it);
+        cached = true;
+    } else {
+        std::vector<uint8_t> update;
+        auto base = graph_cache.end();
+        if (serialize_graph_update(rpc_ctx->last_graph, input, update)) {
+            base = find_graph(fnv_hash(rpc_ctx->last_graph.data(), rpc_ctx->last_graph.size()), rpc_ctx->last_graph.size());
+        }
+        if (base != graph_cache.end()) {
+            // the server replaces the previous graph with this one
+            bool status = send_rpc_cmd_async(sock, RPC_CMD_GRAPH_UPDATE, update.data(), update.size(), &response, sizeof(response));
+            GGML_ASSERT(status);
+            *base = {graph_id, input.size()};
+            graph_cache.splice(graph_cache.begin(), graph_cache, base);
+            cached = true;
+        }
+    }
+    if (cached) {
+        bool status = recv_pending_rsp(sock, sock->n_sent);
+        GGML_ASSERT(status);
+        if (!response.found) {
+            // start over with an empty graph cache
+            GGML_LOG_DEBUG("%s: graph not found in the graph cache of the server, sending it in full\n", __func__);
+            graph_cache.clear();
+        }
+        if (sock->status != GGML_STATUS_SUCCESS) {
+            // a previous graph failed while waiting
+            const ggml_status result = sock->status;
+            sock->status = GGML_STATUS_SUCCESS;
+            return result;
+        }
+    }
+    if (!cached || !response.found) {
+        bool status = send_rpc_cmd_async(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), nullptr, sizeof(rpc_msg_graph_compute_rsp));
+        GGML_ASSERT(status);
+        if (graph_cache.size() >= GRAPH_CACHE_SIZE) {
+            graph_cache.pop_back();
+        }
+        graph_cache.push_front({graph_id, input.size()});
+    }
+    rpc_ctx->last_graph = std::move(input);
+
+    if (cached && response.found) {
+        return (ggml_status) (int8_t) response.result;
+    }
+    return GGML_STATUS_SUCCESS;
+}
+
+static void ggml_backend_rpc_event_record(ggml_backend_t backend, ggml_backend_event_t event) {
+    ggml_backend_rpc_event_context * event_ctx = (ggml_backend_rpc_event_context *)event->context;
+    std::lock_guard<std::mutex> lock(event_ctx->sock->mutex);
+    event_ctx->seq = event_ctx->sock->n_sent;
+    GGML_UNUSED(backend);
+}
+
+static void ggml_backend_rpc_event_wait(ggml_backend_t backend, ggml_backend_event_t event) {
+    // the servers cannot wait for each other, so the client waits for the event before sending more commands
+    ggml_backend_rpc_event_context * event_ctx = (ggml_backend_rpc_event_context *)event->context;
+    std::lock_guard<std::mutex> lock(event_ctx->sock->mutex);
+    bool status = recv_pending_rsp(event_ctx->sock, event_ctx->seq);
     GGML_ASSERT(status);
-    return (enum ggml_status)response.result;
+    check_graph_status(event_ctx->sock);
+    GGML_UNUSED(backend);
 }
 
 static ggml_backend_i ggml_backend_rpc_interface = {
     /* .get_name                = */ ggml_backend_rpc_name,
     /* .free                    = */ ggml_backend_rpc_free,
-    /* .set_tensor_async        = */ NULL,
-    /* .get_tensor_async        = */ NULL,
+    /* .set_tensor_async        = */ ggml_backend_rpc_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_rpc_get_tensor_async,
     /* .cpy_tensor_async        = */ NULL,
     /* .synchronize             = */ ggml_backend_rpc_synchronize,
     /* .graph_plan_create       = */ NULL,
@@ -760,8 +1064,8 @@ static ggml_backend_i ggml_backend_rpc_interface = {
     /* .graph_plan_update       = */ NULL,
     /* .graph_plan_compute      = */ NULL,
     /* .graph_compute           = */ ggml_backend_rpc_graph_compute,
-    /* .event_record            = */ NULL,
-    /* .event_wait              = */ NULL,
+    /* .event_record            = */ ggml_backend_rpc_event_record,
+    /* .event_wait              = */ ggml_backend_rpc_event_wait,
 };
 
 ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * endpoint) {
@@ -800,6 +1104,7 @@ ggml_backend_t ggml_backend_rpc_init(const char * endpoint) {
     ggml_backend_rpc_context * ctx = new ggml_backend_rpc_context {
         /* .endpoint  = */ endpoint,
         /* .name      = */ "RPC[" + std::string(endpoint) + "]",
+        /* .last_graph = */ {},
     };
 
     ggml_backend_t backend = new ggml_backend {
@@ -854,21 +1159,33 @@ public:
     bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
     bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
     bool graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
+    bool graph_recompute(const rpc_msg_graph_recompute_req & request, rpc_msg_graph_recompute_rsp & response);
+    bool graph_update(const std::vector<uint8_t> & input, rpc_msg_graph_recompute_rsp & response);
     bool init_tensor(const rpc_msg_init_tensor_req & request);
     bool get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response);
 
 private:
     bool get_cached_file(uint64_t hash, std::vector<uint8_t> & data);
     ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
+    bool update_tensor(ggml_tensor * result, const rpc_tensor * tensor);
     ggml_tensor * create_node(uint64_t id,
                               struct ggml_context * ctx,
                               const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
                               std::unordered_map<uint64_t, struct ggml_tensor*> & tensor_map);
 
 
+    struct cached_graph {
+        uint64_t id;
+        uint64_t size;
+        ggml_context_ptr ctx;
+        ggml_cgraph * graph;
+        std::unordered_map<uint64_t, ggml_tensor*> tensor_map;
+    };
+
     ggml_backend_t backend;
     const char * cache_dir;
     std::unordered_set<ggml_backend_buffer_t> buffers;
+    std::list<cached_graph> graph_cache; // most recently used first
 };
 
 void rpc_server::hello(rpc_msg_hello_rsp & response) {
@@ -958,6 +1275,8 @@ bool rpc_server::free_buffer(const rpc_msg_free_buffer_req & request) {
     }
     ggml_backend_buffer_free(buffer);
     buffers.erase(buffer);
+    // the cached graphs may reference tensors in this buffer
+    graph_cache.clear();
     return true;
 }
 
@@ -975,7 +1294,20 @@ bool rpc_server::buffer_clear(const rpc_msg_buffer_clear_req & request) {
 ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor) {
     ggml_tensor * result = ggml_new_tensor_4d(ctx, (ggml_type) tensor->type,
         tensor->ne[0], tensor->ne[1], tensor->ne[2], tensor->ne[3]);
+    if (!update_tensor(result, tensor)) {
+        return nullptr;
+    }
+    return result;
+}
+
+// sets all the fields of result except src, view_src and view_offs
+bool rpc_server::update_tensor(ggml_tensor * result, const rpc_tensor * tensor) {
+    if (tensor->type >= GGML_TYPE_COUNT) {
+        return false;
+    }
+    result->type = (ggml_type) tensor->type;
     for (uint32_t i = 0; i < GGML_MAX_DIMS; i++) {
+        result->ne[i] = tensor->ne[i];
         result->nb[i] = tensor->nb[i];
     }
     result->buffer = reinterpret_cast<ggml_backend_buffer_t>(tensor->buffer);
@@ -999,7 +1331,7 @@ ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rp
     result->flags = tensor->flags;
     result->data = reinterpret_cast<void *>(tensor->data);
     ggml_set_name(result, tensor->name);
-    return result;
+    return true;
 }
 
 
@@ -1291,6 +1623,90 @@ bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph
     }
     ggml_status status = ggml_backend_graph_compute(backend, graph);
     response.result = status;
+
+    const uint64_t graph_id = fnv_hash(input.data(), input.size());
+    graph_cache.remove_if([&](const cached_graph & g) { return g.id == graph_id; });
+    if (graph_cache.size() >= GRAPH_CACHE_SIZE) {
+        graph_cache.pop_back();
+    }
+    graph_cache.push_front({graph_id, input.size(), std::move(ctx_ptr), graph, std::move(tensor_map)});
+    return true;
+}
+
+bool rpc_server::graph_recompute(const rpc_msg_graph_recompute_req & request, rpc_msg_graph_recompute_rsp & response) {
+    for (auto it = graph_cache.begin(); it != graph_cache.end(); ++it) {
+        if (it->id == request.graph_id && it->size == request.graph_size) {
+            GGML_PRINT_DEBUG("[%s] graph_id: %" PRIx64 "\n", __func__, request.graph_id);
+            graph_cache.splice(graph_cache.begin(), graph_cache, it);
+            response.found = 1;
+            response.result = ggml_backend_graph_compute(backend, graph_cache.front().graph);
+            return true;
+        }
+    }
+    response.found = 0;
+    response.result = GGML_STATUS_FAILED;
+    return true;
+}
+
+bool rpc_server::graph_update(const std::vector<uint8_t> & input, rpc_msg_graph_recompute_rsp & response) {
+    // serialization format: | rpc_msg_graph_update_req | tensors (n_tensors * sizeof(rpc_tensor)) |
+    rpc_msg_graph_update_req request;
+    if (input.size() < sizeof(request)) {
+        return false;
+    }
+    memcpy(&request, input.data(), sizeof(request));
+    if (input.size() != sizeof(request) + (uint64_t) request.n_tensors * sizeof(rpc_tensor)) {
+        return false;
+    }
+    const rpc_tensor * tensors = (const rpc_tensor *)(input.data() + sizeof(request));
+    GGML_PRINT_DEBUG("[%s] base_id: %" PRIx64 ", graph_id: %" PRIx64 ", n_tensors: %u\n", __func__, request.base_id, request.graph_id, request.n_tensors);
+
+    response.found = 0;
+    response.result = GGML_STATUS_FAILED;
+
+    auto it = graph_cache.begin();
+    while (it != graph_cache.end() && (it->id != request.base_id || it->size != request.base_size)) {
+        ++it;
+    }
+    if (it == graph_cache.end()) {
+        return true;
+    }
+
+    // the graph is only modified if all the tensors and their sources are known
+    auto & tensor_map = it->tensor_map;
+    auto known = [&](uint64_t id) {
+        return id == 0 || tensor_map.find(id) != tensor_map.end();
+    };
+    for (uint32_t i = 0; i < request.n_tensors; i++) {
+        bool ok = known(tensors[i].id) && tensors[i].id != 0 && known(tensors[i].view_src);
+        for (int j = 0; j < GGML_MAX_SRC && ok; j++) {
+            ok = known(tensors[i].src[j]);
+        }
+        if (!ok) {
+            graph_cache.erase(it);
+            return true;
+        }
+    }
+    for (uint32_t i = 0; i < request.n_tensors; i++) {
+        ggml_tensor * tensor = tensor_map.at(tensors[i].id);
+        if (!update_tensor(tensor, &tensors[i])) {
+            graph_cache.erase(it);
+            return false;
+        }
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            tensor->src[j] = tensors[i].src[j] ? tensor_map.at(tensors[i].src[j]) : nullptr;
+        }
+        tensor->view_src  = tensors[i].view_src ? tensor_map.at(tensors[i].view_src) : nullptr;
+        tensor->view_offs = tensors[i].view_offs;
+    }
+
+    it->id   = request.graph_id;
+    it->size = request.graph_size;
+    graph_cache.splice(graph_cache.begin(), graph_cache, it);
+    graph_cache.remove_if([&](const cached_graph & g) { return g.id == request.graph_id && &g != &graph_cache.front(); });
+
+    response.found = 1;
+    response.result = ggml_backend_graph_compute(backend, graph_cache.front().graph);
     return true;
 }
 
@@ -1502,6 +1918,34 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 }
                 break;
             }
+            case RPC_CMD_GRAPH_RECOMPUTE: {
+                rpc_msg_graph_recompute_req request;
+                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                    return;
+                }
+                rpc_msg_graph_recompute_rsp response;
+                if (!server.graph_recompute(request, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_GRAPH_UPDATE: {
+                std::vector<uint8_t> input;
+                if (!recv_msg(sockfd, input)) {
+                    return;
+                }
+                rpc_msg_graph_recompute_rsp response;
+                if (!server.graph_update(input, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_GET_DEVICE_MEMORY: {
                 if (!recv_msg(sockfd, nullptr, 0)) {
                     return;
@@ -1602,10 +2046,10 @@ static void ggml_backend_rpc_device_get_props(ggml_backend_dev_t dev, struct ggm
     props->type        = ggml_backend_rpc_device_get_type(dev);
     ggml_backend_rpc_device_get_memory(dev, &props->memory_free, &props->memory_total);
     props->caps = {
-        /* .async                 = */ false,
+        /* .async                 = */ true,
         /* .host_buffer           = */ false,
         /* .buffer_from_host_ptr  = */ false,
-        /* .events                = */ false,
+        /* .events                = */ true,
     };
 }
 
@@ -1641,6 +2085,34 @@ static bool ggml_backend_rpc_device_supports_buft(ggml_backend_dev_t dev, ggml_b
     return buft_ctx->endpoint == dev_ctx->endpoint;
 }
 
+static ggml_backend_event_t ggml_backend_rpc_device_event_new(ggml_backend_dev_t dev) {
+    ggml_backend_rpc_device_context * ctx = (ggml_backend_rpc_device_context *)dev->context;
+    auto sock = get_socket(ctx->endpoint);
+    if (sock == nullptr) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    return new ggml_backend_event {
+        /* .device  = */ dev,
+        /* .context = */ new ggml_backend_rpc_event_context { sock, sock->n_sent },
+    };
+}
+
+static void ggml_backend_rpc_device_event_free(ggml_backend_dev_t dev, ggml_backend_event_t event) {
+    delete (ggml_backend_rpc_event_context *)event->context;
+    delete event;
+    GGML_UNUSED(dev);
+}
+
+static void ggml_backend_rpc_device_event_synchronize(ggml_backend_dev_t dev, ggml_backend_event_t event) {
+    ggml_backend_rpc_event_context * event_ctx = (ggml_backend_rpc_event_context *)event->context;
+    std::lock_guard<std::mutex> lock(event_ctx->sock->mutex);
+    bool status = recv_pending_rsp(event_ctx->sock, event_ctx->seq);
+    GGML_ASSERT(status);
+    check_graph_status(event_ctx->sock);
+    GGML_UNUSED(dev);
+}
+
 static const struct ggml_backend_device_i ggml_backend_rpc_device_i = {
     /* .get_name             = */ ggml_backend_rpc_device_get_name,
     /* .get_description      = */ ggml_backend_rpc_device_get_description,
@@ -1654,9 +2126,9 @@ static const struct ggml_backend_device_i ggml_backend_rpc_device_i = {
     /* .supports_op          = */ ggml_backend_rpc_device_supports_op,
     /* .supports_buft        = */ ggml_backend_rpc_device_supports_buft,
     /* .offload_op           = */ NULL,
-    /* .event_new            = */ NULL,
-    /* .event_free           = */ NULL,
-    /* .event_synchronize    = */ NULL,
+    /* .event_new            = */ ggml_backend_rpc_device_event_new,
+    /* .event_free           = */ ggml_backend_rpc_device_event_free,
+    /* .event_synchronize    = */ ggml_backend_rpc_device_event_synchronize,
 };
 
 // backend reg interface
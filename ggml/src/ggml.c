@@ -3490,6 +3490,29 @@ struct ggml_tensor * ggml_soft_max_ext(
     return ggml_soft_max_impl(ctx, a, mask, scale, max_bias, false);
 }
 
+static void ggml_set_mask_blk(
+        struct ggml_tensor * a,
+        struct ggml_tensor * mask,
+        struct ggml_tensor * blk,
+        int                  i_src) {
+    GGML_ASSERT(mask);
+    GGML_ASSERT(blk->type == GGML_TYPE_I8);
+    GGML_ASSERT(ggml_is_contiguous(blk));
+    GGML_ASSERT(ggml_is_matrix(blk));
+    GGML_ASSERT(blk->ne[0] == (mask->ne[0] + GGML_KQ_MASK_BLK - 1)/GGML_KQ_MASK_BLK);
+    GGML_ASSERT(blk->ne[1] == mask->ne[1]);
+
+    a->src[i_src] = blk;
+}
+
+void ggml_soft_max_ext_set_mask_blk(
+        struct ggml_tensor * a,
+        struct ggml_tensor * blk) {
+    GGML_ASSERT(a->op == GGML_OP_SOFT_MAX);
+
+    ggml_set_mask_blk(a, a->src[1], blk, 2);
+}
+
 // ggml_soft_max_ext_back
 
 static struct ggml_tensor * ggml_soft_max_ext_back_impl(
@@ -4404,6 +4427,14 @@ enum ggml_prec ggml_flash_attn_ext_get_prec(
     return (enum ggml_prec) prec_i32;
 }
 
+void ggml_flash_attn_ext_set_mask_blk(
+        struct ggml_tensor * a,
+        struct ggml_tensor * blk) {
+    GGML_ASSERT(a->op == GGML_OP_FLASH_ATTN_EXT);
+
+    ggml_set_mask_blk(a, a->src[3], blk, 4);
+}
+
 // ggml_flash_attn_back
 
 struct ggml_tensor * ggml_flash_attn_back(
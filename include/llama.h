@@ -313,6 +313,15 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // path of a cache file for the tensors repacked by the CPU backend (NULL = disabled)
+        // the cache is written on the first load and used instead of repacking on later loads
+        const char * repack_cache;
+
+        // [EXPERIMENTAL] page the experts of MoE models from the memory mapped file on demand (0 = disabled)
+        // the experts are prefetched from the router outputs and the given number of most frequently
+        // selected experts of each layer are locked in memory
+        int32_t n_expert_resident;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
@@ -343,6 +352,7 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t kv_block_size;    // KV cache block size in cells for paged slot allocation, 0 = contiguous slots (default)
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -357,6 +367,7 @@ extern "C" {
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
+        bool swa_full;    // use full-size KV cache buffers for the sliding-window layers (required for context shift)
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -494,6 +505,7 @@ extern "C" {
     LLAMA_API int32_t llama_model_n_layer    (const struct llama_model * model);
     LLAMA_API int32_t llama_model_n_head     (const struct llama_model * model);
     LLAMA_API int32_t llama_model_n_head_kv  (const struct llama_model * model);
+    LLAMA_API int32_t llama_model_n_swa      (const struct llama_model * model); // sliding window of the SWA layers, 0 - none
 
     // Get the model's RoPE frequency scaling factor
     LLAMA_API float llama_model_rope_freq_scale_train(const struct llama_model * model);
@@ -583,6 +595,28 @@ extern "C" {
     // Remove all LoRA adapters from given context
     LLAMA_API void llama_clear_adapter_lora(struct llama_context * ctx);
 
+    // Add a loaded LoRA adapter to the tokens of a sequence only, in addition to the adapters of the context
+    // The sequences of a batch can use different adapters, each token gathers the adapters of its sequence
+    // The first sequence id of a token selects its adapters
+    // This will not modify model's weight
+    LLAMA_API int32_t llama_set_adapter_lora_seq(
+            struct llama_context * ctx,
+            struct llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale);
+
+    // Remove a specific LoRA adapter from a sequence
+    // Return -1 if the adapter is not present in the sequence
+    LLAMA_API int32_t llama_rm_adapter_lora_seq(
+            struct llama_context * ctx,
+            struct llama_adapter_lora * adapter,
+            llama_seq_id seq_id);
+
+    // Remove all LoRA adapters from a sequence, seq_id < 0 : all sequences
+    LLAMA_API void llama_clear_adapter_lora_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
@@ -724,6 +758,14 @@ extern "C" {
                        llama_pos   p1,
                              int   d);
 
+    // Returns the smallest position present in the KV cache for the specified sequence, -1 if it has no cells
+    // Unless swa_full is set, the sliding-window layers only keep the last n_swa positions of each sequence,
+    // so the result can be larger than the first position that was decoded
+    // Continuing the sequence from position p requires the positions [max(0, p - n_swa + 1), p) to be present
+    LLAMA_API llama_pos llama_kv_self_seq_pos_min(
+            struct llama_context * ctx,
+                     llama_seq_id   seq_id);
+
     // Returns the largest position present in the KV cache for the specified sequence
     LLAMA_API llama_pos llama_kv_self_seq_pos_max(
             struct llama_context * ctx,
@@ -983,6 +1025,29 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Get the k largest logits of the ith token, sorted in descending order.
+    // Writes min(k, n_vocab) candidates to out (p is set to 0.0f) and returns their number, or -1 for invalid ids.
+    // Cheaper than building and partitioning an array with the entire vocabulary when only the top candidates are needed.
+    LLAMA_API int32_t llama_get_logits_top_k_ith(struct llama_context * ctx, int32_t i, int32_t k, llama_token_data * out);
+
+    // Compute the log-probabilities of the outputs in the graph, so that only a few values per output are copied
+    // from the backend instead of the full logits. For each output, the log-probabilities of n_target tokens set with
+    // llama_set_logprobs_targets() and the n_top largest log-probabilities are computed.
+    // While enabled (n_target + n_top > 0), the logits of the outputs are not available.
+    LLAMA_API void llama_set_logprobs(struct llama_context * ctx, int32_t n_target, int32_t n_top);
+
+    // Set the target tokens of the next llama_decode(): n_target tokens for each token of the batch, [n_tokens*n_target]
+    // Only the targets of the tokens for which llama_batch.logits[i] != 0 are used.
+    LLAMA_API void llama_set_logprobs_targets(struct llama_context * ctx, const llama_token * targets, int32_t n_tokens);
+
+    // Log-probabilities of the ith output: the n_target targets, followed by the n_top largest in descending order
+    // Indexed like llama_get_logits_ith(), returns NULL for invalid ids.
+    LLAMA_API float * llama_get_logprobs_ith(struct llama_context * ctx, int32_t i);
+
+    // Tokens of the n_top largest log-probabilities of the ith output, in descending order
+    // Returns NULL for invalid ids.
+    LLAMA_API llama_token * llama_get_logprobs_top_ith(struct llama_context * ctx, int32_t i);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -5,7 +5,9 @@
 #include "llama-model.h"
 
 #include <map>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <stdexcept>
 
 // vec
@@ -380,3 +382,369 @@ llama_adapter_lora * llama_adapter_lora_init(llama_model * model, const char * p
 void llama_adapter_lora_free(llama_adapter_lora * adapter) {
     delete adapter;
 }
+
+// lora per sequence
+
+bool llama_adapter_loras_seq::empty() const {
+    return seq_loras.empty();
+}
+
+void llama_adapter_loras_seq::set(llama_seq_id seq_id, llama_adapter_lora * adapter, float scale) {
+    seq_loras[seq_id][adapter] = scale;
+
+    if (get_slot(adapter) < 0) {
+        need_update = true;
+    }
+}
+
+bool llama_adapter_loras_seq::rm(llama_seq_id seq_id, llama_adapter_lora * adapter) {
+    auto it = seq_loras.find(seq_id);
+    if (it == seq_loras.end() || it->second.erase(adapter) == 0) {
+        return false;
+    }
+
+    if (it->second.empty()) {
+        seq_loras.erase(it);
+    }
+
+    // the slot of the adapter is released at the next update if no other sequence uses it
+
+    return true;
+}
+
+void llama_adapter_loras_seq::clear(llama_seq_id seq_id) {
+    if (seq_id >= 0) {
+        seq_loras.erase(seq_id);
+        return;
+    }
+
+    seq_loras.clear();
+
+    slots.clear();
+    stacks.clear();
+    bufs.clear();
+    ctxs.clear();
+
+    n_slot_alloc = 0;
+    need_update  = false;
+}
+
+const llama_adapter_loras * llama_adapter_loras_seq::get(llama_seq_id seq_id) const {
+    const auto it = seq_loras.find(seq_id);
+    if (it == seq_loras.end()) {
+        return nullptr;
+    }
+
+    return &it->second;
+}
+
+int32_t llama_adapter_loras_seq::get_slot(const llama_adapter_lora * adapter) const {
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (slots[i] == adapter) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+const llama_adapter_loras_seq::stack * llama_adapter_loras_seq::get_stack(const ggml_tensor * w) const {
+    const auto it = stacks.find(w->name);
+    if (it == stacks.end()) {
+        return nullptr;
+    }
+
+    return &it->second;
+}
+
+static bool llama_adapter_lora_can_stack(ggml_type type) {
+    return type == GGML_TYPE_F32 || type == GGML_TYPE_F16 || type == GGML_TYPE_BF16;
+}
+
+static void llama_adapter_lora_to_f32(ggml_type type, const void * src, float * dst, int64_t n) {
+    switch (type) {
+        case GGML_TYPE_F32:  memcpy(dst, src, n*sizeof(float));                         break;
+        case GGML_TYPE_F16:  ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, dst, n); break;
+        case GGML_TYPE_BF16: ggml_bf16_to_fp32_row((const ggml_bf16_t *) src, dst, n); break;
+        default: GGML_ABORT("unsupported type %s", ggml_type_name(type));
+    }
+}
+
+static void llama_adapter_lora_from_f32(ggml_type type, const float * src, void * dst, int64_t n) {
+    switch (type) {
+        case GGML_TYPE_F32:  memcpy(dst, src, n*sizeof(float));                   break;
+        case GGML_TYPE_F16:  ggml_fp32_to_fp16_row(src, (ggml_fp16_t *) dst, n); break;
+        case GGML_TYPE_BF16: ggml_fp32_to_bf16_row(src, (ggml_bf16_t *) dst, n); break;
+        default: GGML_ABORT("unsupported type %s", ggml_type_name(type));
+    }
+}
+
+bool llama_adapter_loras_seq::is_used(llama_adapter_lora * adapter) const {
+    for (const auto & it : seq_loras) {
+        if (it.second.find(adapter) != it.second.end()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void llama_adapter_loras_seq::set_slot(int32_t slot) {
+    const auto * adapter = slots[slot];
+
+    std::vector<uint8_t> data;
+    std::vector<float>   b_f32;
+    std::vector<float>   b_pad;
+
+    for (const auto & it : stacks) {
+        const auto & st = it.second;
+
+        const auto pos = adapter->ab_map.find(it.first);
+        if (pos == adapter->ab_map.end()) {
+            // the previous adapter of the slot may have had this weight
+            data.assign(st.a->nb[2], 0);
+            ggml_backend_tensor_set(st.a, data.data(), slot*st.a->nb[2], data.size());
+            data.assign(st.b->nb[2], 0);
+            ggml_backend_tensor_set(st.b, data.data(), slot*st.b->nb[2], data.size());
+            continue;
+        }
+
+        const auto & lw = pos->second;
+
+        // A: the rows of the adapter, the rows past its rank are zero
+        data.assign(st.a->nb[2], 0);
+        ggml_backend_tensor_get(lw.a, data.data(), 0, ggml_nbytes(lw.a));
+        ggml_backend_tensor_set(st.a, data.data(), slot*st.a->nb[2], data.size());
+
+        // B: the rows padded to the largest rank, with the scale of the adapter
+        const int64_t rank     = lw.b->ne[0];
+        const int64_t rank_max = st.b->ne[0];
+        const int64_t n_out    = lw.b->ne[1];
+
+        const float scale = lw.get_scale(adapter->alpha, 1.0f);
+
+        data.resize(ggml_nbytes(lw.b));
+        ggml_backend_tensor_get(lw.b, data.data(), 0, data.size());
+
+        b_f32.resize(rank*n_out);
+        llama_adapter_lora_to_f32(lw.b->type, data.data(), b_f32.data(), rank*n_out);
+
+        b_pad.assign(rank_max*n_out, 0.0f);
+        for (int64_t i = 0; i < n_out; ++i) {
+            for (int64_t j = 0; j < rank; ++j) {
+                b_pad[i*rank_max + j] = scale*b_f32[i*rank + j];
+            }
+        }
+
+        data.resize(st.b->nb[2]);
+        llama_adapter_lora_from_f32(st.b->type, b_pad.data(), data.data(), rank_max*n_out);
+        ggml_backend_tensor_set(st.b, data.data(), slot*st.b->nb[2], data.size());
+    }
+}
+
+void llama_adapter_loras_seq::update() {
+    // the adapters removed from all the sequences release their slot, its rows of the stacks are overwritten by the next
+    // adapter that takes it
+    for (auto & adapter : slots) {
+        if (adapter && !is_used(adapter)) {
+            adapter = nullptr;
+        }
+    }
+    while (!slots.empty() && slots.back() == nullptr) {
+        slots.pop_back();
+    }
+
+    // the new adapters take the free slots first
+    std::vector<int32_t> added;
+
+    if (need_update) {
+        need_update = false;
+
+        for (const auto & it : seq_loras) {
+            for (const auto & lora : it.second) {
+                if (get_slot(lora.first) >= 0) {
+                    continue;
+                }
+
+                auto free = std::find(slots.begin(), slots.end(), nullptr);
+                if (free == slots.end()) {
+                    free = slots.insert(slots.end(), nullptr);
+                }
+                *free = lora.first;
+
+                added.push_back(free - slots.begin());
+            }
+        }
+    }
+
+    if (slots.empty()) {
+        stacks.clear();
+        bufs.clear();
+        ctxs.clear();
+
+        n_slot_alloc = 0;
+        return;
+    }
+
+    if (added.empty()) {
+        return;
+    }
+
+    // the weights must have the same shapes and types in all the adapters, the ranks can differ
+    struct weight_info {
+        ggml_backend_buffer_type_t buft;
+
+        ggml_type type_a;
+        ggml_type type_b;
+
+        int64_t n_in;
+        int64_t n_out;
+        int64_t rank;
+
+        bool ok;
+    };
+
+    std::map<std::string, weight_info> weights;
+
+    for (const auto * adapter : slots) {
+        if (adapter == nullptr) {
+            continue;
+        }
+
+        for (const auto & it : adapter->ab_map) {
+            const auto & lw = it.second;
+
+            // the token embeddings use flipped A/B matrices and the experts have an expert dimension
+            const bool ok =
+                lw.a->ne[1] == lw.b->ne[0] && ggml_n_dims(lw.a) <= 2 && ggml_n_dims(lw.b) <= 2 &&
+                llama_adapter_lora_can_stack(lw.a->type) && llama_adapter_lora_can_stack(lw.b->type);
+
+            const weight_info info = {
+                ggml_backend_buffer_get_type(lw.a->buffer), lw.a->type, lw.b->type, lw.a->ne[0], lw.b->ne[1], lw.b->ne[0], ok,
+            };
+
+            auto pos = weights.find(it.first);
+            if (pos == weights.end()) {
+                weights.emplace(it.first, info);
+                continue;
+            }
+
+            auto & cur = pos->second;
+
+            cur.ok = cur.ok && info.ok &&
+                cur.buft   == info.buft   &&
+                cur.type_a == info.type_a && cur.type_b == info.type_b &&
+                cur.n_in   == info.n_in   && cur.n_out  == info.n_out;
+
+            cur.rank = std::max(cur.rank, info.rank);
+        }
+    }
+
+    // the stacks are only reallocated if they cannot hold the adapters, otherwise only the rows of the new adapters are
+    // written
+    bool realloc = (int64_t) slots.size() > n_slot_alloc;
+
+    for (const auto & it : weights) {
+        const auto & info = it.second;
+
+        const auto pos = stacks.find(it.first);
+        if (pos == stacks.end()) {
+            realloc = realloc || info.ok;
+            continue;
+        }
+
+        const auto & st = pos->second;
+
+        realloc = realloc || !info.ok ||
+            ggml_backend_buffer_get_type(st.a->buffer) != info.buft ||
+            st.a->type  != info.type_a || st.b->type  != info.type_b ||
+            st.a->ne[0] != info.n_in   || st.b->ne[1] != info.n_out  ||
+            st.b->ne[0] <  info.rank;
+    }
+
+    if (!realloc) {
+        for (int32_t slot : added) {
+            set_slot(slot);
+        }
+
+        return;
+    }
+
+    stacks.clear();
+    bufs.clear();
+    ctxs.clear();
+
+    // leave room for more adapters, so that the next ones do not reallocate the stacks
+    if ((int64_t) slots.size() > n_slot_alloc) {
+        n_slot_alloc = std::max<int64_t>(slots.size(), 2*n_slot_alloc);
+    }
+
+    // create a context for each buffer type
+    std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
+    auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
+        auto it = ctx_map.find(buft);
+        if (it == ctx_map.end()) {
+            ggml_init_params params = {
+                /*.mem_size   =*/ 2*weights.size()*ggml_tensor_overhead(),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+
+            ggml_context * ctx = ggml_init(params);
+            if (!ctx) {
+                throw std::runtime_error("failed to create ggml context");
+            }
+
+            ctx_map[buft] = ctx;
+            ctxs.emplace_back(ctx);
+
+            return ctx;
+        }
+
+        return it->second;
+    };
+
+    for (const auto & it : weights) {
+        const auto & info = it.second;
+        if (!info.ok) {
+            continue;
+        }
+
+        ggml_context * ctx = ctx_for_buft(info.buft);
+
+        stack st;
+        st.a = ggml_new_tensor_3d(ctx, info.type_a, info.n_in, info.rank, n_slot_alloc);
+        st.b = ggml_new_tensor_3d(ctx, info.type_b, info.rank, info.n_out, n_slot_alloc);
+        ggml_format_name(st.a, "%s.lora_a_seq", it.first.c_str());
+        ggml_format_name(st.b, "%s.lora_b_seq", it.first.c_str());
+
+        stacks.emplace(it.first, st);
+    }
+
+    size_t n_bytes = 0;
+
+    for (auto & it : ctx_map) {
+        ggml_backend_buffer_ptr buf { ggml_backend_alloc_ctx_tensors_from_buft(it.second, it.first) };
+        if (!buf) {
+            throw std::runtime_error("failed to allocate buffer for the lora adapters of the sequences\n");
+        }
+
+        // the free slots stay zero
+        ggml_backend_buffer_clear(buf.get(), 0);
+
+        n_bytes += ggml_backend_buffer_get_size(buf.get());
+
+        bufs.emplace_back(std::move(buf));
+    }
+
+    for (size_t s = 0; s < slots.size(); ++s) {
+        if (slots[s] != nullptr) {
+            set_slot(s);
+        }
+    }
+
+    const size_t n_adapters = slots.size() - std::count(slots.begin(), slots.end(), nullptr);
+
+    LLAMA_LOG_INFO("%s: stacked %zu of %zu weights of %zu lora adapters for the sequences, room for %d (%.2f MiB)\n",
+            __func__, stacks.size(), weights.size(), n_adapters, (int) n_slot_alloc, n_bytes/1024.0/1024.0);
+}
@@ -4,6 +4,7 @@
 
 #include "ggml-cpp.h"
 
+#include <map>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -74,3 +75,58 @@ struct llama_adapter_lora {
 };
 
 using llama_adapter_loras = std::unordered_map<llama_adapter_lora *, float>;
+
+//
+// llama_adapter_loras_seq
+//
+
+// LoRA adapters applied only to the tokens of some sequences, so that the sequences of a batch can use different adapters
+// the A/B matrices of the adapters are stacked per weight and each token gathers the ones of its adapters with MUL_MAT_ID
+struct llama_adapter_loras_seq {
+    struct stack {
+        ggml_tensor * a; // [n_in, rank, n_slot]
+        ggml_tensor * b; // [rank, n_out, n_slot], scaled by alpha/rank of the adapters
+    };
+
+    // the adapters of all the sequences, a slot per adapter - nullptr for the slots released by the adapters that are no
+    // longer used, which are reused by the next adapters
+    std::vector<llama_adapter_lora *> slots;
+
+    bool empty() const;
+
+    void set(llama_seq_id seq_id, llama_adapter_lora * adapter, float scale);
+    bool rm (llama_seq_id seq_id, llama_adapter_lora * adapter);
+
+    // seq_id < 0: all sequences
+    void clear(llama_seq_id seq_id);
+
+    // the adapters of a sequence, nullptr if none
+    const llama_adapter_loras * get(llama_seq_id seq_id) const;
+
+    int32_t get_slot(const llama_adapter_lora * adapter) const;
+
+    // nullptr if the adapters of w cannot be stacked, the tokens then use the adapters one by one
+    const stack * get_stack(const ggml_tensor * w) const;
+
+    // update the slots and the stacks after adapters were added to or removed from the sequences
+    void update();
+
+private:
+    bool is_used(llama_adapter_lora * adapter) const;
+
+    // write the rows of the adapter of a slot to the stacks, zero for the weights it does not have
+    void set_slot(int32_t slot);
+
+    std::map<llama_seq_id, llama_adapter_loras> seq_loras;
+
+    // map tensor name to the stacked adapters
+    std::unordered_map<std::string, stack> stacks;
+
+    bool need_update = false;
+
+    // number of slots allocated in the stacks
+    int64_t n_slot_alloc = 0;
+
+    std::vector<ggml_context_ptr> ctxs;
+    std::vector<ggml_backend_buffer_ptr> bufs;
+};
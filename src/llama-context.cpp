@@ -1,11 +1,13 @@
 #include "llama-context.h"
 
 #include "llama-impl.h"
+#include "llama-expert-pager.h"
 #include "llama-io.h"
 #include "llama-mmap.h"
 #include "llama-model.h"
 #include "llama-kv-cache.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
@@ -35,13 +37,18 @@ llama_context::llama_context(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.kv_block_size    = params.kv_block_size;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
+    cparams.swa_full         = params.swa_full;
     cparams.pooling_type     = params.pooling_type;
     cparams.warmup           = false;
 
+    cparams.n_logprobs_target = 0;
+    cparams.n_logprobs_top    = 0;
+
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
     cparams.rope_freq_base   = params.rope_freq_base  == 0.0f ? hparams.rope_freq_base_train  : params.rope_freq_base;
     cparams.rope_freq_scale  = params.rope_freq_scale == 0.0f ? hparams.rope_freq_scale_train : params.rope_freq_scale;
@@ -306,6 +313,9 @@ llama_context::llama_context(
 
         // simulate full KV cache
         kv_self->n = kv_self->size;
+        if (kv_self->swa) {
+            kv_self->swa->n = kv_self->swa->size;
+        }
 
         cross.v_embd.clear();
 
@@ -573,6 +583,11 @@ llm_graph_result_ptr llama_context::build_kv_self_shift(
         const float freq_base_l  = is_swa ? hparams.rope_freq_base_train_swa  : cparams.rope_freq_base;
         const float freq_scale_l = is_swa ? hparams.rope_freq_scale_train_swa : cparams.rope_freq_scale;
 
+        // the sliding-window layers of a separate cache are not shifted (see llama_kv_cache_unified::can_shift)
+        if (kv_self->k_l[il] == nullptr) {
+            continue;
+        }
+
         ggml_tensor * rope_factors = kv_self->cbs.get_rope_factors(n_ctx_per_seq(), il);
 
         ggml_tensor * k =
@@ -686,6 +701,11 @@ llm_graph_result_ptr llama_context::build_kv_self_defrag(
         }
 
         for (uint32_t il = 0; il < hparams.n_layer; ++il) { // NOLINT
+            // the sliding-window layers of a separate cache are not defragmented
+            if (kv_self->k_l[il] == nullptr) {
+                continue;
+            }
+
             const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
             const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
@@ -809,6 +829,9 @@ void llama_context::kv_self_update() {
 
         // simulate full KV cache
         kv_self->n = kv_self->size;
+        if (kv_self->swa) {
+            kv_self->swa->n = kv_self->swa->size;
+        }
 
         llama_token token = model.vocab.token_bos(); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
         llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
@@ -873,6 +896,116 @@ float * llama_context::get_logits_ith(int32_t i) {
     }
 }
 
+int32_t llama_context::get_logits_top_k_ith(int32_t i, int32_t k, llama_token_data * out) {
+    const float * row = get_logits_ith(i);
+    if (row == nullptr) {
+        return -1;
+    }
+
+    const int32_t n_vocab = model.vocab.n_tokens();
+
+    k = std::min(k, n_vocab);
+    if (k <= 0) {
+        return 0;
+    }
+
+    auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    // the candidates are collected in a buffer of 2*k entries - when it fills up, it is partitioned around the
+    // k-th largest logit, which becomes the threshold for the rest of the row
+    // most blocks of the row are rejected by comparing their maximum against the threshold, which vectorizes well
+    constexpr int32_t block_size = 32;
+
+    std::vector<llama_token_data> & buf = logits_top_k_buf;
+    buf.clear();
+    buf.reserve(2*k);
+
+    float thr = -INFINITY;
+
+    for (int32_t i0 = 0; i0 < n_vocab; i0 += block_size) {
+        const int32_t i1 = std::min(i0 + block_size, n_vocab);
+
+        float vmax = -INFINITY;
+        for (int32_t j = i0; j < i1; ++j) {
+            vmax = row[j] > vmax ? row[j] : vmax;
+        }
+
+        if (vmax <= thr && (int32_t) buf.size() >= k) {
+            continue;
+        }
+
+        for (int32_t j = i0; j < i1; ++j) {
+            if (row[j] > thr || (int32_t) buf.size() < k) {
+                buf.push_back({ j, row[j], 0.0f });
+            }
+        }
+
+        if ((int32_t) buf.size() >= 2*k) {
+            std::nth_element(buf.begin(), buf.begin() + (k - 1), buf.end(), comp);
+            buf.resize(k);
+            thr = buf[k - 1].logit;
+        }
+    }
+
+    k = std::min<int32_t>(k, buf.size());
+
+    std::partial_sort(buf.begin(), buf.begin() + k, buf.end(), comp);
+    std::copy(buf.begin(), buf.begin() + k, out);
+
+    return k;
+}
+
+float * llama_context::get_logprobs_ith(int32_t i) {
+    int32_t j = -1;
+
+    try {
+        if (logprobs == nullptr) {
+            throw std::runtime_error("no logprobs");
+        }
+
+        if (i < 0) {
+            j = n_outputs + i;
+            if (j < 0) {
+                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
+            }
+        } else if ((size_t) i >= output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
+        } else {
+            j = output_ids[i];
+        }
+
+        if (j < 0) {
+            throw std::runtime_error(format("batch.logits[%d] != true", i));
+        }
+        if (j >= n_outputs) {
+            // This should not happen
+            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, n_outputs));
+        }
+
+        return logprobs + j*(cparams.n_logprobs_target + cparams.n_logprobs_top);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid logprobs id %d, reason: %s\n", __func__, i, err.what());
+#ifndef NDEBUG
+        GGML_ABORT("fatal error");
+#else
+        return nullptr;
+#endif
+    }
+}
+
+llama_token * llama_context::get_logprobs_top_ith(int32_t i) {
+    const float * row = get_logprobs_ith(i);
+    if (row == nullptr || logprobs_top == nullptr) {
+        return nullptr;
+    }
+
+    const int64_t j = (row - logprobs)/(cparams.n_logprobs_target + cparams.n_logprobs_top);
+
+    return logprobs_top + j*cparams.n_logprobs_top;
+}
+
 float * llama_context::get_embeddings() {
     // reorder embeddings for backward compatibility
     output_reorder();
@@ -983,6 +1116,19 @@ void llama_context::set_warmup(bool value) {
     cparams.warmup = value;
 }
 
+void llama_context::set_logprobs(int32_t n_target, int32_t n_top) {
+    LLAMA_LOG_DEBUG("%s: n_target = %d, n_top = %d\n", __func__, n_target, n_top);
+
+    cparams.n_logprobs_target = std::max(0, n_target);
+    cparams.n_logprobs_top    = std::clamp(n_top, 0, (int32_t) model.vocab.n_tokens());
+
+    logprobs_targets.clear();
+}
+
+void llama_context::set_logprobs_targets(const llama_token * targets, int32_t n_tokens) {
+    logprobs_targets.assign(targets, targets + (size_t) std::max(0, n_tokens)*cparams.n_logprobs_target);
+}
+
 void llama_context::set_adapter_lora(
             llama_adapter_lora * adapter,
             float scale) {
@@ -1010,6 +1156,29 @@ void llama_context::clear_adapter_lora() {
     loras.clear();
 }
 
+void llama_context::set_adapter_lora_seq(
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale) {
+    LLAMA_LOG_DEBUG("%s: adapter = %p, seq_id = %d, scale = %f\n", __func__, (void *) adapter, seq_id, scale);
+
+    loras_seq.set(seq_id, adapter, scale);
+}
+
+bool llama_context::rm_adapter_lora_seq(
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id) {
+    LLAMA_LOG_DEBUG("%s: adapter = %p, seq_id = %d\n", __func__, (void *) adapter, seq_id);
+
+    return loras_seq.rm(seq_id, adapter);
+}
+
+void llama_context::clear_adapter_lora_seq(llama_seq_id seq_id) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d\n", __func__, seq_id);
+
+    loras_seq.clear(seq_id);
+}
+
 bool llama_context::apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -1077,7 +1246,7 @@ int llama_context::encode(llama_batch & inp_batch) {
     //batch_manager->prepare(ubatch);
 
     ggml_backend_sched_reset(sched.get());
-    ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+    graph_set_eval_cb();
 
     const auto causal_attn_org = cparams.causal_attn;
 
@@ -1223,6 +1392,21 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
 
+    const int64_t n_logprobs_target = cparams.embeddings ? 0 : cparams.n_logprobs_target;
+
+    if (n_logprobs_target > 0) {
+        if ((int64_t) logprobs_targets.size() < n_tokens_all*n_logprobs_target) {
+            LLAMA_LOG_ERROR("%s: the logprobs targets of the batch are not set\n", __func__);
+            return -1;
+        }
+        for (int64_t i = 0; i < n_tokens_all*n_logprobs_target; ++i) {
+            if (logprobs_targets[i] < 0 || (uint32_t) logprobs_targets[i] >= model.vocab.n_tokens()) {
+                LLAMA_LOG_ERROR("%s: invalid logprobs target[%" PRId64 "] = %d\n", __func__, i, logprobs_targets[i]);
+                return -1;
+            }
+        }
+    }
+
     if (t_compute_start_us == 0) {
         t_compute_start_us = ggml_time_us();
     }
@@ -1299,6 +1483,18 @@ int llama_context::decode(llama_batch & inp_batch) {
             n_outputs = n_outputs_new;
         }
 
+        // gather the logprobs targets of the outputs of the ubatch, in the order of the output rows
+        if (n_logprobs_target > 0) {
+            logprobs_targets_ubatch.resize(n_outputs*n_logprobs_target);
+
+            for (int32_t r = 0; r < n_outputs; ++r) {
+                const int64_t id = sbatch.out_ids[n_outputs_prev + r];
+
+                std::copy_n(logprobs_targets.begin()        + id*n_logprobs_target, n_logprobs_target,
+                            logprobs_targets_ubatch.begin() +  r*n_logprobs_target);
+            }
+        }
+
         // find KV slot
         {
             if (!kv_self->find_slot(ubatch)) {
@@ -1313,13 +1509,18 @@ int llama_context::decode(llama_batch & inp_batch) {
                 // if we start defragmenting the cache, the benefit from this will be more important
                 const uint32_t pad = kv_self->get_padding(cparams);
                 kv_self->n = std::min(kv_self->size, std::max(pad, GGML_PAD(kv_self->cell_max(), pad)));
+
+                if (kv_self->swa) {
+                    auto & kv_swa = kv_self->swa;
+                    kv_swa->n = std::min(kv_swa->size, std::max(pad, GGML_PAD(kv_swa->cell_max(), pad)));
+                }
             }
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self->n, kv_self->used, kv_self->head);
 
         ggml_backend_sched_reset(sched.get());
-        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+        graph_set_eval_cb();
 
         auto * gf = graph_init();
         auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
@@ -1348,8 +1549,12 @@ int llama_context::decode(llama_batch & inp_batch) {
         //    ggml_graph_dump_dot(gf, NULL, "llama.dot");
         //}
 
-        auto * t_logits = cparams.embeddings ? nullptr         : res->get_logits();
-        auto * t_embd   = cparams.embeddings ? res->get_embd() : nullptr;
+        auto * t_logprobs     = cparams.embeddings ? nullptr : res->get_logprobs();
+        auto * t_logprobs_top = cparams.embeddings ? nullptr : res->get_logprobs_top();
+
+        // the logits are not returned when the log-probabilities are computed in the graph
+        auto * t_logits = cparams.embeddings || t_logprobs ? nullptr         : res->get_logits();
+        auto * t_embd   = cparams.embeddings               ? res->get_embd() : nullptr;
 
         if (t_embd && res->get_embd_pooled()) {
             t_embd = res->get_embd_pooled();
@@ -1370,6 +1575,29 @@ int llama_context::decode(llama_batch & inp_batch) {
             }
         }
 
+        // extract log-probabilities
+        if (t_logprobs && n_outputs > 0) {
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logprobs);
+            GGML_ASSERT(backend_res != nullptr);
+            GGML_ASSERT(logprobs != nullptr);
+
+            const int64_t n_logprobs = t_logprobs->ne[0];
+
+            GGML_ASSERT((n_outputs_prev + n_outputs)*n_logprobs <= (int64_t) logprobs_size);
+            ggml_backend_tensor_get_async(backend_res, t_logprobs, logprobs + n_outputs_prev*n_logprobs, 0, n_outputs*n_logprobs*sizeof(float));
+
+            if (t_logprobs_top) {
+                ggml_backend_t backend_top = ggml_backend_sched_get_tensor_backend(sched.get(), t_logprobs_top);
+                GGML_ASSERT(backend_top != nullptr);
+                GGML_ASSERT(logprobs_top != nullptr);
+
+                const int64_t n_top = t_logprobs_top->ne[0];
+
+                GGML_ASSERT((n_outputs_prev + n_outputs)*n_top <= (int64_t) logprobs_top_size);
+                ggml_backend_tensor_get_async(backend_top, t_logprobs_top, logprobs_top + n_outputs_prev*n_top, 0, n_outputs*n_top*sizeof(llama_token));
+            }
+        }
+
         // extract embeddings
         if (t_embd && n_outputs > 0) {
             ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(sched.get(), t_embd);
@@ -1453,6 +1681,9 @@ int llama_context::decode(llama_batch & inp_batch) {
     // set to total number of outputs in the batch, for use in llama_get_logits_ith
     n_outputs = n_outputs_all;
 
+    // the targets are set for each batch
+    logprobs_targets.clear();
+
     // wait for the computation to finish (automatically done when obtaining the model output)
     //synchronize();
 
@@ -1501,8 +1732,19 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
         has_embd   = true;
     }
 
-    logits_size = has_logits ? n_vocab*n_outputs_max : 0;
-    embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
+    // the log-probabilities computed in the graph are returned instead of the logits
+    const int64_t n_logprobs     = cparams.n_logprobs_target + cparams.n_logprobs_top;
+    const int64_t n_logprobs_top = cparams.n_logprobs_top;
+
+    const bool has_logprobs = has_logits && n_logprobs > 0;
+    if (has_logprobs) {
+        has_logits = false;
+    }
+
+    logits_size       = has_logits   ? n_vocab*n_outputs_max        : 0;
+    embd_size         = has_embd     ?  n_embd*n_outputs_max        : 0;
+    logprobs_size     = has_logprobs ? n_logprobs*n_outputs_max     : 0;
+    logprobs_top_size = has_logprobs ? n_logprobs_top*n_outputs_max : 0;
 
     if (output_ids.empty()) {
         // init, never resized afterwards
@@ -1510,7 +1752,7 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
     }
 
     const size_t prev_size = buf_output ? ggml_backend_buffer_get_size(buf_output.get()) : 0;
-    const size_t new_size  = (logits_size + embd_size) * sizeof(float);
+    const size_t new_size  = (logits_size + embd_size + logprobs_size) * sizeof(float) + logprobs_top_size * sizeof(llama_token);
 
     // alloc only when more than the current capacity is required
     // TODO: also consider shrinking the buffer
@@ -1523,6 +1765,8 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
             buf_output = nullptr;
             logits = nullptr;
             embd = nullptr;
+            logprobs = nullptr;
+            logprobs_top = nullptr;
         }
 
         auto * buft = ggml_backend_cpu_buffer_type();
@@ -1541,8 +1785,11 @@ int32_t llama_context::output_reserve(int32_t n_outputs) {
 
     float * output_base = (float *) ggml_backend_buffer_get_base(buf_output.get());
 
-    logits = has_logits ? output_base               : nullptr;
-    embd   = has_embd   ? output_base + logits_size : nullptr;
+    logits   = has_logits   ? output_base                           : nullptr;
+    embd     = has_embd     ? output_base + logits_size             : nullptr;
+    logprobs = has_logprobs ? output_base + logits_size + embd_size : nullptr;
+
+    logprobs_top = has_logprobs ? (llama_token *) (output_base + logits_size + embd_size + logprobs_size) : nullptr;
 
     // set all ids as invalid (negative)
     std::fill(output_ids.begin(), output_ids.end(), -1);
@@ -1561,6 +1808,9 @@ void llama_context::output_reorder() {
         const uint32_t n_vocab = model.vocab.n_tokens();
         const uint32_t n_embd  = model.hparams.n_embd;
 
+        const uint32_t n_logprobs     = cparams.n_logprobs_target + cparams.n_logprobs_top;
+        const uint32_t n_logprobs_top = cparams.n_logprobs_top;
+
         GGML_ASSERT((size_t) n_outputs == out_ids.size());
 
         // TODO: is there something more efficient which also minimizes swaps?
@@ -1584,6 +1834,14 @@ void llama_context::output_reorder() {
                     std::swap(embd[i*n_embd + k], embd[j_min*n_embd + k]);
                 }
             }
+            if (logprobs_size > 0) {
+                for (uint32_t k = 0; k < n_logprobs; k++) {
+                    std::swap(logprobs[i*n_logprobs + k], logprobs[j_min*n_logprobs + k]);
+                }
+                for (uint32_t k = 0; k < n_logprobs_top; k++) {
+                    std::swap(logprobs_top[i*n_logprobs_top + k], logprobs_top[j_min*n_logprobs_top + k]);
+                }
+            }
         }
         std::fill(output_ids.begin(), output_ids.end(), -1);
         for (int32_t i = 0; i < n_outputs; ++i) {
@@ -1618,6 +1876,9 @@ llm_graph_result_ptr llama_context::graph_build(
              ggml_cgraph * gf,
       const llama_ubatch & ubatch,
             llm_graph_type gtype) {
+    // stack the adapters that were added to the sequences since the last graph
+    loras_seq.update();
+
     return model.build_graph(
             {
                 /*.ctx         =*/ ctx,
@@ -1631,6 +1892,8 @@ llm_graph_result_ptr llama_context::graph_build(
                 /*.loras       =*/ &loras,
                 /*.memory      =*/ kv_self.get(),
                 /*.cross       =*/ &cross,
+                /*.loras_seq   =*/ &loras_seq,
+                /*.logprobs_targets =*/ &logprobs_targets_ubatch,
                 /*.n_outputs   =*/ n_outputs,
                 /*.cb          =*/ graph_get_cb(),
             }, gf, gtype);
@@ -1663,6 +1926,36 @@ ggml_status llama_context::graph_compute(
     return status;
 }
 
+void llama_context::graph_set_eval_cb() {
+    if (model.get_expert_pager()) {
+        ggml_backend_sched_set_eval_callback(sched.get(), graph_eval_cb, this);
+    } else {
+        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+    }
+}
+
+bool llama_context::graph_eval_cb(struct ggml_tensor * t, bool ask, void * user_data) {
+    auto * lctx = (llama_context *) user_data;
+
+    // the router output, the pager prefetches the selected experts before they are multiplied
+    static const char * prefix = "ffn_moe_topk-";
+    const bool routed = strncmp(t->name, prefix, strlen(prefix)) == 0;
+
+    const auto & cb_eval = lctx->cparams.cb_eval;
+    void * cb_eval_user_data = lctx->cparams.cb_eval_user_data;
+
+    if (ask) {
+        lctx->cb_eval_asked = cb_eval && cb_eval(t, true, cb_eval_user_data);
+        return routed || lctx->cb_eval_asked;
+    }
+
+    if (routed) {
+        lctx->model.get_expert_pager()->route(atoi(t->name + strlen(prefix)), t);
+    }
+
+    return lctx->cb_eval_asked ? cb_eval(t, false, cb_eval_user_data) : true;
+}
+
 llm_graph_cb llama_context::graph_get_cb() const {
     return [&](const llama_ubatch & ubatch, ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
@@ -2239,6 +2532,7 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.kv_block_size               =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -2248,6 +2542,7 @@ llama_context_params llama_context_default_params() {
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
+        /*.swa_full                    =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -2391,6 +2686,32 @@ float * llama_get_logits_ith(llama_context * ctx, int32_t i) {
     return ctx->get_logits_ith(i);
 }
 
+int32_t llama_get_logits_top_k_ith(llama_context * ctx, int32_t i, int32_t k, llama_token_data * out) {
+    ctx->synchronize();
+
+    return ctx->get_logits_top_k_ith(i, k, out);
+}
+
+void llama_set_logprobs(llama_context * ctx, int32_t n_target, int32_t n_top) {
+    ctx->set_logprobs(n_target, n_top);
+}
+
+void llama_set_logprobs_targets(llama_context * ctx, const llama_token * targets, int32_t n_tokens) {
+    ctx->set_logprobs_targets(targets, n_tokens);
+}
+
+float * llama_get_logprobs_ith(llama_context * ctx, int32_t i) {
+    ctx->synchronize();
+
+    return ctx->get_logprobs_ith(i);
+}
+
+llama_token * llama_get_logprobs_top_ith(llama_context * ctx, int32_t i) {
+    ctx->synchronize();
+
+    return ctx->get_logprobs_top_ith(i);
+}
+
 float * llama_get_embeddings(llama_context * ctx) {
     ctx->synchronize();
 
@@ -2432,6 +2753,29 @@ void llama_clear_adapter_lora(llama_context * ctx) {
     ctx->clear_adapter_lora();
 }
 
+int32_t llama_set_adapter_lora_seq(
+            llama_context * ctx,
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale) {
+    ctx->set_adapter_lora_seq(adapter, seq_id, scale);
+
+    return 0;
+}
+
+int32_t llama_rm_adapter_lora_seq(
+            llama_context * ctx,
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id) {
+    bool res = ctx->rm_adapter_lora_seq(adapter, seq_id);
+
+    return res ? 0 : -1;
+}
+
+void llama_clear_adapter_lora_seq(llama_context * ctx, llama_seq_id seq_id) {
+    ctx->clear_adapter_lora_seq(seq_id);
+}
+
 int32_t llama_apply_adapter_cvec(
         llama_context * ctx,
                  const float * data,
@@ -2629,6 +2973,15 @@ llama_pos llama_kv_cache_seq_pos_max(llama_context * ctx, llama_seq_id seq_id) {
     return llama_kv_self_seq_pos_max(ctx, seq_id);
 }
 
+llama_pos llama_kv_self_seq_pos_min(llama_context * ctx, llama_seq_id seq_id) {
+    const auto * kv = ctx->get_kv_self();
+    if (!kv) {
+        return -1;
+    }
+
+    return kv->seq_pos_min(seq_id);
+}
+
 llama_pos llama_kv_self_seq_pos_max(llama_context * ctx, llama_seq_id seq_id) {
     const auto * kv = ctx->get_kv_self();
     if (!kv) {
@@ -48,6 +48,12 @@ struct llama_context {
     float * get_logits();
     float * get_logits_ith(int32_t i);
 
+    // the k largest logits of the ith output, sorted in descending order
+    int32_t get_logits_top_k_ith(int32_t i, int32_t k, llama_token_data * out);
+
+    float       * get_logprobs_ith    (int32_t i);
+    llama_token * get_logprobs_top_ith(int32_t i);
+
     float * get_embeddings();
     float * get_embeddings_ith(int32_t i);
     float * get_embeddings_seq(llama_seq_id seq_id);
@@ -66,6 +72,9 @@ struct llama_context {
     void set_causal_attn(bool value);
     void set_warmup(bool value);
 
+    void set_logprobs(int32_t n_target, int32_t n_top);
+    void set_logprobs_targets(const llama_token * targets, int32_t n_tokens);
+
     void set_adapter_lora(
             llama_adapter_lora * adapter,
             float scale);
@@ -75,6 +84,17 @@ struct llama_context {
 
     void clear_adapter_lora();
 
+    void set_adapter_lora_seq(
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id,
+            float scale);
+
+    bool rm_adapter_lora_seq(
+            llama_adapter_lora * adapter,
+            llama_seq_id seq_id);
+
+    void clear_adapter_lora_seq(llama_seq_id seq_id);
+
     bool apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -163,6 +183,11 @@ private:
 
     llm_graph_cb graph_get_cb() const;
 
+    // set the eval callback of the scheduler, chaining the expert pager in front of the user callback
+    void graph_set_eval_cb();
+
+    static bool graph_eval_cb(struct ggml_tensor * t, bool ask, void * user_data);
+
     // used by kv_self_update()
     ggml_tensor * build_rope_shift(
         ggml_context * ctx0,
@@ -197,6 +222,7 @@ private:
     llama_cparams       cparams;
     llama_adapter_cvec  cvec;
     llama_adapter_loras loras;
+    llama_adapter_loras_seq loras_seq;
     llama_sbatch        sbatch;
 
     llama_cross cross; // TODO: tmp for handling cross-attention - need something better probably
@@ -210,6 +236,15 @@ private:
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // log-probabilities computed in the graph (2-dimensional arrays: [n_outputs][n_target + n_top], [n_outputs][n_top])
+    size_t        logprobs_size     = 0; // capacity (of floats) for logprobs
+    float       * logprobs          = nullptr;
+    size_t        logprobs_top_size = 0; // capacity (of tokens) for logprobs_top
+    llama_token * logprobs_top      = nullptr;
+
+    std::vector<llama_token> logprobs_targets;        // [n_tokens][n_target] for the next batch
+    std::vector<llama_token> logprobs_targets_ubatch; // [n_outputs][n_target] for the current ubatch
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -224,8 +259,12 @@ private:
 
     std::vector<int32_t> output_ids; // map batch token positions to ids of the logits and embd buffers
 
+    std::vector<llama_token_data> logits_top_k_buf; // scratch buffer for get_logits_top_k_ith
+
     ggml_backend_sched_ptr sched;
 
+    bool cb_eval_asked = false; // the user eval callback asked for the current tensor
+
     ggml_backend_t backend_cpu = nullptr;
     std::vector<ggml_backend_ptr> backends;
 
@@ -24,11 +24,18 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t kv_block_size;
+
+    // log-probabilities computed in the graph for each output, see llama_set_logprobs()
+    uint32_t n_logprobs_target;
+    uint32_t n_logprobs_top;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
     bool no_perf;
+    bool swa_full;
     bool warmup;
 
     enum llama_pooling_type pooling_type;
@@ -0,0 +1,272 @@
+#include "llama-expert-pager.h"
+
+#include "llama-impl.h"
+#include "llama-model.h"
+
+#include "ggml-backend.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <numeric>
+
+// weight of the latest router output in the selection frequency of the experts
+#define LLAMA_EXPERT_FREQ_ALPHA (1.0f/64)
+
+// number of router outputs of a layer between updates of its resident experts
+#define LLAMA_EXPERT_RESIDENCY_INTERVAL 16
+
+// a resident expert is only replaced by an expert that is selected more often by this factor
+#define LLAMA_EXPERT_RESIDENCY_BIAS 1.25f
+
+std::unique_ptr<llama_expert_pager> llama_expert_pager::init(const llama_model & model, const llama_mmaps & mappings, uint32_t n_resident) {
+    const auto & hparams = model.hparams;
+
+    if (hparams.n_expert == 0 || hparams.n_expert_used == 0 || mappings.empty()) {
+        return nullptr;
+    }
+
+    const uint32_t n_expert = hparams.n_expert;
+
+    std::unique_ptr<llama_expert_pager> pager(new llama_expert_pager(n_expert, hparams.n_expert_used, std::min(n_resident, n_expert)));
+
+    pager->layers.resize(model.layers.size());
+
+    int    n_layer_paged = 0;
+    size_t n_bytes       = 0;
+
+    for (size_t il = 0; il < model.layers.size(); ++il) {
+        const auto & src = model.layers[il];
+        auto & l = pager->layers[il];
+
+        for (const ggml_tensor * t : { src.ffn_up_exps, src.ffn_gate_exps, src.ffn_down_exps }) {
+            if (t == nullptr || t->data == nullptr || t->ne[2] != n_expert) {
+                continue;
+            }
+
+            // only the experts in the CPU buffers created from the mappings can be paged
+            const llama_mmap * mapping = nullptr;
+            size_t offs = 0;
+            for (const auto & m : mappings) {
+                const uint8_t * addr = (const uint8_t *) m->addr();
+                const uint8_t * data = (const uint8_t *) t->data;
+                if (data >= addr && data + ggml_nbytes(t) <= addr + m->size()) {
+                    mapping = m.get();
+                    offs    = data - addr;
+                    break;
+                }
+            }
+
+            if (mapping == nullptr) {
+                continue;
+            }
+
+            l.experts.resize(n_expert);
+            for (uint32_t e = 0; e < n_expert; ++e) {
+                l.experts[e].push_back({ mapping, offs + e*t->nb[2], t->nb[2] });
+            }
+
+            n_bytes += ggml_nbytes(t);
+        }
+
+        if (l.experts.empty()) {
+            continue;
+        }
+
+        l.freq.assign(n_expert, 0.0f);
+        l.resident.assign(n_expert, false);
+        l.prefetched.assign(n_expert, 0);
+
+        if (il > 0 && !pager->layers[il - 1].experts.empty()) {
+            l.follow.assign((size_t) n_expert*n_expert, 0);
+        }
+
+        n_layer_paged++;
+    }
+
+    if (n_layer_paged == 0) {
+        LLAMA_LOG_WARN("%s: no experts in memory mapped files, expert paging disabled\n", __func__);
+        return nullptr;
+    }
+
+    LLAMA_LOG_INFO("%s: paging %u experts of %d layers (%.2f MiB), %u resident experts per layer\n",
+            __func__, n_expert, n_layer_paged, n_bytes/1024.0/1024.0, pager->n_resident);
+
+    return pager;
+}
+
+llama_expert_pager::llama_expert_pager(uint32_t n_expert, uint32_t n_expert_used, uint32_t n_resident) :
+    n_expert(n_expert), n_expert_used(n_expert_used), n_resident(n_resident) {}
+
+llama_expert_pager::~llama_expert_pager() {
+    LLAMA_LOG_INFO("%s: %" PRIu64 " expert prefetches, %" PRIu64 " experts locked, %" PRIu64 " experts unlocked\n",
+            __func__, n_prefetch, n_lock, n_unlock);
+}
+
+void llama_expert_pager::route(int il, const ggml_tensor * selected) {
+    GGML_ASSERT(selected->type == GGML_TYPE_I32);
+
+    if (il < 0 || (size_t) il >= layers.size() || layers[il].experts.empty()) {
+        return;
+    }
+
+    const int64_t n_used   = selected->ne[0];
+    const int64_t n_tokens = selected->ne[1];
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    layer & l = layers[il];
+
+    l.n_route++;
+
+    // the selection is a view of the sorted router probabilities, read it row by row
+    l.selected.resize(n_used*n_tokens);
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        ggml_backend_tensor_get(selected, l.selected.data() + i*n_used, i*selected->nb[1], n_used*sizeof(int32_t));
+    }
+
+    std::vector<uint32_t> count(n_expert, 0);
+    for (const int32_t e : l.selected) {
+        if (e >= 0 && (uint32_t) e < n_expert) {
+            count[e]++;
+        }
+    }
+
+    // the experts of this layer are multiplied next
+    for (uint32_t e = 0; e < n_expert; ++e) {
+        if (count[e] > 0 && !l.resident[e] && l.prefetched[e] != l.n_route) {
+            prefetch(l, e, l.n_route);
+        }
+    }
+
+    // learn which experts follow the experts selected by the previous layer for the same tokens
+    if (!l.follow.empty() && layers[il - 1].selected.size() == l.selected.size()) {
+        const layer & prev = layers[il - 1];
+
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            const int32_t * cur_row  = l.selected.data()    + i*n_used;
+            const int32_t * prev_row = prev.selected.data() + i*n_used;
+            for (int64_t j = 0; j < n_used; ++j) {
+                if (prev_row[j] < 0 || (uint32_t) prev_row[j] >= n_expert) {
+                    continue;
+                }
+                uint32_t * follow = l.follow.data() + (size_t) prev_row[j]*n_expert;
+                for (int64_t k = 0; k < n_used; ++k) {
+                    if (cur_row[k] < 0 || (uint32_t) cur_row[k] >= n_expert) {
+                        continue;
+                    }
+                    if (++follow[cur_row[k]] == (1u << 31)) {
+                        for (uint32_t e = 0; e < n_expert; ++e) {
+                            follow[e] /= 2;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // prefetch the experts that are most likely to be selected by the next layer
+    if ((size_t) il + 1 < layers.size() && !layers[il + 1].follow.empty()) {
+        layer & next = layers[il + 1];
+
+        std::vector<uint64_t> score(n_expert, 0);
+        for (uint32_t p = 0; p < n_expert; ++p) {
+            if (count[p] == 0) {
+                continue;
+            }
+            const uint32_t * follow = next.follow.data() + (size_t) p*n_expert;
+            for (uint32_t e = 0; e < n_expert; ++e) {
+                score[e] += (uint64_t) count[p]*follow[e];
+            }
+        }
+
+        std::vector<int32_t> order(n_expert);
+        std::iota(order.begin(), order.end(), 0);
+
+        const uint32_t n_pred = (uint32_t) std::min<int64_t>(n_expert, n_expert_used*n_tokens);
+        std::partial_sort(order.begin(), order.begin() + n_pred, order.end(), [&](int32_t a, int32_t b) {
+            return score[a] > score[b];
+        });
+
+        for (uint32_t i = 0; i < n_pred && score[order[i]] > 0; ++i) {
+            const int32_t e = order[i];
+            if (!next.resident[e] && next.prefetched[e] != next.n_route + 1) {
+                prefetch(next, e, next.n_route + 1);
+            }
+        }
+    }
+
+    for (uint32_t e = 0; e < n_expert; ++e) {
+        l.freq[e] = (1.0f - LLAMA_EXPERT_FREQ_ALPHA)*l.freq[e] + LLAMA_EXPERT_FREQ_ALPHA*count[e]/n_tokens;
+    }
+
+    if (l.n_route % LLAMA_EXPERT_RESIDENCY_INTERVAL == 0) {
+        update_residency(l);
+    }
+}
+
+void llama_expert_pager::prefetch(layer & l, int32_t e, uint64_t id) {
+    l.prefetched[e] = id;
+
+    for (const auto & r : l.experts[e]) {
+        r.mapping->prefetch(r.offs, r.size);
+    }
+
+    n_prefetch++;
+}
+
+void llama_expert_pager::update_residency(layer & l) {
+    std::vector<int32_t> order(n_expert);
+    std::iota(order.begin(), order.end(), 0);
+
+    auto score = [&](int32_t e) {
+        return l.freq[e]*(l.resident[e] ? LLAMA_EXPERT_RESIDENCY_BIAS : 1.0f);
+    };
+
+    std::partial_sort(order.begin(), order.begin() + n_resident, order.end(), [&](int32_t a, int32_t b) {
+        return score(a) > score(b);
+    });
+
+    std::vector<bool> keep(n_expert, false);
+    for (uint32_t i = 0; i < n_resident && l.freq[order[i]] > 0.0f; ++i) {
+        keep[order[i]] = true;
+    }
+
+    for (uint32_t e = 0; e < n_expert; ++e) {
+        if (l.resident[e] && !keep[e]) {
+            for (const auto & r : l.experts[e]) {
+                r.mapping->unlock (r.offs, r.size);
+                r.mapping->release(r.offs, r.size);
+            }
+            l.resident[e] = false;
+            n_unlock++;
+        }
+    }
+
+    for (uint32_t e = 0; e < n_expert && !lock_failed; ++e) {
+        if (l.resident[e] || !keep[e]) {
+            continue;
+        }
+
+        size_t n_locked = 0;
+        for (const auto & r : l.experts[e]) {
+            if (!r.mapping->lock(r.offs, r.size)) {
+                break;
+            }
+            n_locked++;
+        }
+
+        if (n_locked < l.experts[e].size()) {
+            for (size_t i = 0; i < n_locked; ++i) {
+                l.experts[e][i].mapping->unlock(l.experts[e][i].offs, l.experts[e][i].size);
+            }
+
+            LLAMA_LOG_WARN("%s: failed to lock an expert in memory after locking %" PRIu64 " experts, "
+                    "the experts will only be prefetched (try increasing RLIMIT_MEMLOCK)\n", __func__, n_lock - n_unlock);
+            lock_failed = true;
+            break;
+        }
+
+        l.resident[e] = true;
+        n_lock++;
+    }
+}
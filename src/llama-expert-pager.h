@@ -0,0 +1,79 @@
+#pragma once
+
+#include "llama-mmap.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct llama_model;
+struct ggml_tensor;
+
+//
+// llama_expert_pager
+//
+
+// pages the experts of MoE models from the memory mapped model files on demand:
+//  - the experts selected by the router of a layer are prefetched before their matrix multiplications
+//  - the experts of the next layer are prefetched from the experts that followed the current selection in the past
+//  - the most frequently selected experts of each layer are locked in memory, the others can be reclaimed by the OS
+struct llama_expert_pager {
+    // returns nullptr if no expert of the model is in a memory mapped file
+    static std::unique_ptr<llama_expert_pager> init(const llama_model & model, const llama_mmaps & mappings, uint32_t n_resident);
+
+    ~llama_expert_pager();
+
+    // selected: the router output of layer il, [n_expert_used, n_tokens]
+    void route(int il, const ggml_tensor * selected);
+
+private:
+    struct range {
+        const llama_mmap * mapping;
+
+        size_t offs;
+        size_t size;
+    };
+
+    struct layer {
+        // the ranges of the up/gate/down matrices of each expert
+        std::vector<std::vector<range>> experts;
+
+        // decayed selection frequency of each expert
+        std::vector<float> freq;
+
+        // how often each expert of this layer was selected after each expert of the previous layer
+        // [n_expert (prev), n_expert], empty if the previous layer has no experts
+        std::vector<uint32_t> follow;
+
+        std::vector<bool>     resident;
+        std::vector<uint64_t> prefetched; // last route() call that prefetched each expert
+
+        // the last router output
+        std::vector<int32_t> selected;
+
+        uint64_t n_route = 0;
+    };
+
+    llama_expert_pager(uint32_t n_expert, uint32_t n_expert_used, uint32_t n_resident);
+
+    void prefetch(layer & l, int32_t e, uint64_t id);
+
+    void update_residency(layer & l);
+
+    const uint32_t n_expert;
+    const uint32_t n_expert_used;
+    const uint32_t n_resident;
+
+    std::vector<layer> layers; // empty experts for the layers without pageable experts
+
+    bool lock_failed = false;
+
+    // stats
+    uint64_t n_prefetch = 0;
+    uint64_t n_lock     = 0;
+    uint64_t n_unlock   = 0;
+
+    // the contexts of a model can decode concurrently
+    std::mutex mutex;
+};
@@ -6,6 +6,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <list>
 #include <stdexcept>
 
 //
@@ -903,6 +904,283 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+//
+// token trie and mask cache
+//
+
+// max number of grammar states with cached masks, per grammar
+#define LLAMA_GRAMMAR_MASK_CACHE_SIZE 64
+
+// EOG tokens, empty pieces and invalid UTF-8 sequences are not part of the trie - they are handled separately
+// note: the pieces are decoded without a previous partial UTF-8 sequence, so the trie cannot be used while
+//       the grammar is in the middle of a code point
+struct llama_grammar_trie {
+    struct node {
+        uint32_t code_point;  // label of the edge from the parent
+        uint32_t child_begin; // the children are stored contiguously in nodes
+        uint32_t child_end;
+        uint32_t tok_begin;   // tokens that end at this node, in tokens
+        uint32_t tok_end;
+        uint32_t part_begin;  // tokens that end at this node with an incomplete UTF-8 sequence, in partials
+        uint32_t part_end;
+    };
+
+    struct entry {
+        std::vector<uint32_t> code_points; // without the terminating 0
+        llama_partial_utf8    partial;
+        llama_token           id;
+    };
+
+    std::vector<node> nodes; // nodes[0] is the root
+
+    std::vector<llama_token> tokens;
+    std::vector<std::pair<llama_token, llama_partial_utf8>> partials;
+
+    std::vector<uint64_t> eog; // 1 bit per token
+
+    uint32_t n_vocab = 0;
+
+    explicit llama_grammar_trie(const llama_vocab & vocab) {
+        n_vocab = vocab.n_tokens();
+
+        eog.resize((n_vocab + 63) / 64, 0);
+
+        std::vector<entry> entries;
+        entries.reserve(n_vocab);
+
+        for (llama_token id = 0; id < (llama_token) n_vocab; ++id) {
+            if (vocab.is_eog(id)) {
+                eog[id / 64] |= uint64_t(1) << (id % 64);
+                continue;
+            }
+
+            const std::string & piece = vocab.token_to_piece(id);
+            if (piece.empty() || piece[0] == 0) {
+                continue;
+            }
+
+            auto decoded = decode_utf8(piece, {});
+            if (decoded.second.n_remain < 0) {
+                continue; // can never be accepted
+            }
+
+            decoded.first.pop_back(); // terminating 0
+
+            entries.push_back({ std::move(decoded.first), decoded.second, id });
+        }
+
+        // shorter sequences first, so the tokens that end at a node come before the ones that continue
+        std::sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) {
+            return a.code_points < b.code_points;
+        });
+
+        nodes.push_back({ 0, 0, 0, 0, 0, 0, 0 });
+
+        build(entries, 0, 0, entries.size(), 0);
+    }
+
+    // entries [i0, i1) share the first depth code points, which lead to node inode
+    void build(const std::vector<entry> & entries, uint32_t inode, size_t i0, size_t i1, size_t depth) {
+        nodes[inode].tok_begin  = tokens.size();
+        nodes[inode].part_begin = partials.size();
+
+        while (i0 < i1 && entries[i0].code_points.size() == depth) {
+            if (entries[i0].partial.n_remain == 0) {
+                tokens.push_back(entries[i0].id);
+            } else {
+                partials.emplace_back(entries[i0].id, entries[i0].partial);
+            }
+            ++i0;
+        }
+
+        nodes[inode].tok_end  = tokens.size();
+        nodes[inode].part_end = partials.size();
+
+        // allocate the children first, so they are contiguous
+        std::vector<std::pair<size_t, size_t>> ranges;
+        for (size_t i = i0; i < i1; ) {
+            const uint32_t cp = entries[i].code_points[depth];
+
+            size_t j = i + 1;
+            while (j < i1 && entries[j].code_points[depth] == cp) {
+                ++j;
+            }
+
+            ranges.emplace_back(i, j);
+            i = j;
+        }
+
+        const uint32_t child_begin = nodes.size();
+
+        for (const auto & range : ranges) {
+            nodes.push_back({ entries[range.first].code_points[depth], 0, 0, 0, 0, 0, 0 });
+        }
+
+        nodes[inode].child_begin = child_begin;
+        nodes[inode].child_end   = nodes.size();
+
+        for (size_t ic = 0; ic < ranges.size(); ++ic) {
+            build(entries, child_begin + ic, ranges[ic].first, ranges[ic].second, depth + 1);
+        }
+    }
+};
+
+std::shared_ptr<const llama_grammar_trie> llama_grammar_trie_init(const struct llama_vocab & vocab) {
+    const int64_t t_start_us = ggml_time_us();
+
+    auto trie = std::make_shared<const llama_grammar_trie>(vocab);
+
+    LLAMA_LOG_DEBUG("%s: built token trie with %zu nodes in %.2f ms\n", __func__, trie->nodes.size(), (ggml_time_us() - t_start_us) / 1000.0);
+
+    return trie;
+}
+
+struct llama_grammar_mask_cache {
+    std::shared_ptr<const llama_grammar_trie> trie; // shared by all grammars of the vocab
+
+    // allowed tokens (1 bit per token) for the most recently used states, front is the most recent
+    // a state is the sorted list of stacks
+    std::list<std::pair<llama_grammar_stacks, std::vector<uint64_t>>> entries;
+};
+
+// marks the tokens of the trie that are accepted by a grammar state
+// whole subtrees are skipped as soon as no stack can match their prefix
+struct llama_grammar_trie_walker {
+    const llama_grammar_rules & rules;
+    const llama_grammar_trie  & trie;
+
+    std::vector<uint64_t> & mask;
+
+    // the stacks obtained after matching the char range at the top of a stack
+    // this does not depend on the matched char, so it is computed once per stack and reused for all children
+    std::map<llama_grammar_stack, llama_grammar_stacks> advanced;
+
+    const llama_grammar_stacks & advance(const llama_grammar_stack & stack) {
+        auto it = advanced.find(stack);
+        if (it != advanced.end()) {
+            return it->second;
+        }
+
+        const auto * pos_after = llama_grammar_match_char(stack.back(), 0).second;
+
+        // update top of stack to next element, if any
+        llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+        if (!llama_grammar_is_end_of_sequence(pos_after)) {
+            stack_after.push_back(pos_after);
+        }
+
+        llama_grammar_stacks next_stacks;
+        llama_grammar_advance_stack(rules, stack_after, next_stacks);
+
+        return advanced.emplace(stack, std::move(next_stacks)).first->second;
+    }
+
+    // stacks are the possible stacks after matching the code points leading to inode
+    void walk(uint32_t inode, const llama_grammar_stacks & stacks) {
+        const auto & node = trie.nodes[inode];
+
+        // complete tokens are accepted by any stack, including the empty stack (end of grammar)
+        for (uint32_t i = node.tok_begin; i < node.tok_end; ++i) {
+            const llama_token id = trie.tokens[i];
+            mask[id / 64] |= uint64_t(1) << (id % 64);
+        }
+
+        for (uint32_t i = node.part_begin; i < node.part_end; ++i) {
+            for (const auto & stack : stacks) {
+                if (!stack.empty() && llama_grammar_match_partial_char(stack.back(), trie.partials[i].second)) {
+                    const llama_token id = trie.partials[i].first;
+                    mask[id / 64] |= uint64_t(1) << (id % 64);
+                    break;
+                }
+            }
+        }
+
+        if (node.child_begin == node.child_end) {
+            return;
+        }
+
+        std::vector<const llama_grammar_stacks *> afters(stacks.size(), nullptr);
+
+        llama_grammar_stacks next_stacks;
+
+        for (uint32_t ic = node.child_begin; ic < node.child_end; ++ic) {
+            const uint32_t chr = trie.nodes[ic].code_point;
+
+            const llama_grammar_stacks * next = nullptr;
+
+            next_stacks.clear();
+
+            for (size_t is = 0; is < stacks.size(); ++is) {
+                if (stacks[is].empty() || !llama_grammar_match_char(stacks[is].back(), chr).first) {
+                    continue;
+                }
+
+                if (!afters[is]) {
+                    afters[is] = &advance(stacks[is]);
+                }
+
+                if (!next) {
+                    // common case: a single stack matches
+                    next = afters[is];
+                    continue;
+                }
+
+                if (next != &next_stacks) {
+                    next_stacks = *next;
+                    next = &next_stacks;
+                }
+
+                for (const auto & stack : *afters[is]) {
+                    if (std::find(next_stacks.begin(), next_stacks.end(), stack) == next_stacks.end()) {
+                        next_stacks.push_back(stack);
+                    }
+                }
+            }
+
+            if (next && !next->empty()) {
+                walk(ic, *next);
+            }
+        }
+    }
+};
+
+// returns the mask of the tokens in the trie that are allowed by the current grammar state, from the cache if possible
+// if the state is not cached and compute is false, returns nullptr
+static const std::vector<uint64_t> * llama_grammar_get_mask(const struct llama_grammar & grammar, bool compute) {
+    auto & cache = *grammar.masks;
+
+    llama_grammar_stacks state = grammar.stacks;
+    std::sort(state.begin(), state.end());
+
+    for (auto it = cache.entries.begin(); it != cache.entries.end(); ++it) {
+        if (it->first == state) {
+            cache.entries.splice(cache.entries.begin(), cache.entries, it);
+            return &cache.entries.front().second;
+        }
+    }
+
+    if (!compute) {
+        return nullptr;
+    }
+
+    if (!cache.trie) {
+        cache.trie = grammar.vocab->get_grammar_trie();
+    }
+
+    std::vector<uint64_t> mask((cache.trie->n_vocab + 63) / 64, 0);
+
+    llama_grammar_trie_walker walker = { grammar.rules, *cache.trie, mask, {} };
+    walker.walk(0, grammar.stacks);
+
+    if (cache.entries.size() >= LLAMA_GRAMMAR_MASK_CACHE_SIZE) {
+        cache.entries.pop_back();
+    }
+
+    cache.entries.emplace_front(std::move(state), std::move(mask));
+
+    return &cache.entries.front().second;
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -970,6 +1248,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         /* .trigger_tokens   = */ {},
         /* .trigger_patterns    = */ {},
+        /* .masks = */            std::make_shared<llama_grammar_mask_cache>(),
     };
 }
 
@@ -1075,6 +1354,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        /* .masks = */            std::make_shared<llama_grammar_mask_cache>(),
     };
 }
 
@@ -1097,8 +1377,12 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        std::make_shared<llama_grammar_mask_cache>(),
     };
 
+    // the trie does not depend on the grammar
+    result->masks->trie = grammar.masks->trie;
+
     // redirect elements in stacks to point to new rules
     for (size_t is = 0; is < result->stacks.size(); is++) {
         for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
@@ -1130,6 +1414,29 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    // use the allowed tokens of the whole vocab when this grammar state has been seen before, or when many
+    // candidates have to be checked - the trie shares the matching of common prefixes between the tokens
+    // not possible when the previous token ended in the middle of a UTF-8 sequence
+    if (grammar.masks && grammar.partial_utf8.n_remain == 0) {
+        const bool compute = cur_p->size >= grammar.vocab->n_tokens() / 8;
+
+        const auto * mask = llama_grammar_get_mask(grammar, compute);
+        if (mask) {
+            const auto & eog = grammar.masks->trie->eog;
+
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                const llama_token id = cur_p->data[i].id;
+
+                const bool allowed = (*mask)[id / 64] >> (id % 64) & 1;
+                if (!allowed && !(allow_eog && (eog[id / 64] >> (id % 64) & 1))) {
+                    cur_p->data[i].logit = -INFINITY;
+                }
+            }
+
+            return;
+        }
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
 
@@ -3,6 +3,7 @@
 #include "llama.h"
 
 #include <map>
+#include <memory>
 #include <regex>
 #include <string>
 #include <vector>
@@ -106,6 +107,12 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// prefix trie over the code points of the token pieces of a vocab
+struct llama_grammar_trie;
+
+// allowed tokens of recently seen grammar states, computed with the trie (see llama_grammar_apply_impl)
+struct llama_grammar_mask_cache;
+
 struct llama_grammar_trigger_pattern {
     std::string pattern;
     std::regex  regex;
@@ -132,6 +139,8 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    // note: the cached states point into rules, so each grammar (and clone) has its own cache
+    std::shared_ptr<llama_grammar_mask_cache> masks;
 };
 
 //
@@ -157,6 +166,9 @@ struct llama_grammar * llama_grammar_init_impl(
 
 void llama_grammar_free_impl(struct llama_grammar * grammar);
 
+// build the token trie of a vocab - use llama_vocab::get_grammar_trie() to get the shared instance
+std::shared_ptr<const llama_grammar_trie> llama_grammar_trie_init(const struct llama_vocab & vocab);
+
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar);
 
 // TODO: move the API below as member functions of llama_grammar
@@ -5,7 +5,9 @@
 #include "llama-cparams.h"
 #include "llama-kv-cache.h"
 
+#include <atomic>
 #include <cassert>
+#include <cinttypes>
 #include <cmath>
 #include <cstring>
 
@@ -150,6 +152,102 @@ void llm_graph_input_out_ids::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+void llm_graph_input_lora_seq::set_input(const llama_ubatch * ubatch) {
+    const int64_t n_tokens = ubatch->n_tokens;
+    const int64_t n_slot   = loras_seq->slots.size();
+
+    // the output rows are in the order of llm_graph_input_out_ids
+    std::vector<int32_t> rows[2];
+    for (int i = 0; i < n_tokens; ++i) {
+        rows[0].push_back(i);
+    }
+    if (n_outputs == n_tokens) {
+        rows[1] = rows[0];
+    } else if (ubatch->output) {
+        for (int i = 0; i < n_tokens; ++i) {
+            if (ubatch->output[i]) {
+                rows[1].push_back(i);
+            }
+        }
+    } else if (n_outputs == 1) {
+        rows[1].push_back(n_tokens - 1);
+    }
+
+    std::vector<int32_t> ids_data;
+    std::vector<float>   scale_data;
+    std::vector<float>   mask_data;
+
+    for (int k = 0; k < 2; ++k) {
+        if (!ids[k] && !scale[k] && !mask[k]) {
+            continue;
+        }
+
+        const int64_t n_rows = rows[k].size();
+
+        // the unused adapter slots of a row point to slot 0 with a zero scale
+        ids_data  .assign(n_used*n_rows, 0);
+        scale_data.assign(n_used*n_rows, 0.0f);
+        mask_data .assign(n_rows*n_slot, 0.0f);
+
+        for (int64_t r = 0; r < n_rows; ++r) {
+            const llama_seq_id seq_id = ubatch->seq_id[rows[k][r] / ubatch->n_seq_tokens][0];
+
+            const llama_adapter_loras * loras = loras_seq->get(seq_id);
+            if (loras == nullptr) {
+                continue;
+            }
+
+            int64_t j = 0;
+            for (const auto & lora : *loras) {
+                const int32_t slot = loras_seq->get_slot(lora.first);
+                GGML_ASSERT(slot >= 0 && j < n_used);
+
+                ids_data  [r*n_used + j] = slot;
+                scale_data[r*n_used + j] = lora.second;
+                mask_data [slot*n_rows + r] = lora.second;
+                j++;
+            }
+        }
+
+        if (ids[k]) {
+            ggml_backend_tensor_set(ids[k], ids_data.data(), 0, ggml_nbytes(ids[k]));
+        }
+        if (scale[k]) {
+            ggml_backend_tensor_set(scale[k], scale_data.data(), 0, ggml_nbytes(scale[k]));
+        }
+        if (mask[k]) {
+            ggml_backend_tensor_set(mask[k], mask_data.data(), 0, ggml_nbytes(mask[k]));
+        }
+    }
+}
+
+ggml_tensor * llm_graph_input_lora_seq::get_ids(ggml_context * ctx, int k, int64_t n_rows) {
+    if (!ids[k]) {
+        ids[k] = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, n_used, n_rows);
+        ggml_set_input(ids[k]);
+    }
+
+    return ids[k];
+}
+
+ggml_tensor * llm_graph_input_lora_seq::get_scale(ggml_context * ctx, int k, int64_t n_rows) {
+    if (!scale[k]) {
+        scale[k] = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 1, n_used, n_rows);
+        ggml_set_input(scale[k]);
+    }
+
+    return scale[k];
+}
+
+ggml_tensor * llm_graph_input_lora_seq::get_mask(ggml_context * ctx, int k, int64_t n_rows) {
+    if (!mask[k]) {
+        mask[k] = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_rows, loras_seq->slots.size());
+        ggml_set_input(mask[k]);
+    }
+
+    return mask[k];
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -191,6 +289,28 @@ void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+void llm_graph_input_logprobs::set_input(const llama_ubatch * ubatch) {
+    GGML_UNUSED(ubatch);
+
+    GGML_ASSERT(ids && targets);
+    GGML_ASSERT(targets->size() == (size_t) ggml_nelements(ids));
+
+    ggml_backend_tensor_set(ids, targets->data(), 0, ggml_nbytes(ids));
+}
+
+void llm_graph_input_vocab_ids::set_input(const llama_ubatch * ubatch) {
+    GGML_UNUSED(ubatch);
+
+    GGML_ASSERT(ids);
+
+    std::vector<int32_t> data(ggml_nelements(ids));
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = i;
+    }
+
+    ggml_backend_tensor_set(ids, data.data(), 0, ggml_nbytes(ids));
+}
+
 void llm_graph_input_cls::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && (
                 cparams.pooling_type == LLAMA_POOLING_TYPE_CLS ||
@@ -417,37 +537,29 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
 }
 
 void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
-    if (self_kq_mask || self_kq_mask_swa) {
-        const int64_t n_kv         = kv_self->n;
-        const int64_t n_tokens     = ubatch->n_tokens;
-        const int64_t n_seq_tokens = ubatch->n_seq_tokens;
-        const int64_t n_seqs       = ubatch->n_seqs;
+    const int64_t n_tokens     = ubatch->n_tokens;
+    const int64_t n_seq_tokens = ubatch->n_seq_tokens;
+    const int64_t n_seqs       = ubatch->n_seqs;
+
+    // Use only the previous KV cells of the correct sequence for each token of the ubatch.
+    // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+    // Example with a cache of 10 tokens, 2 tokens populated in cache and 3 tokens in batch:
+    //   Causal mask:
+    //      xxx-------
+    //      xxxx------
+    //      xxxxx-----
+    //   Non-causal mask:
+    //      xxxxx-----
+    //      xxxxx-----
+    //      xxxxx-----
+    // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
+    auto fill_mask = [&](ggml_tensor * mask, ggml_tensor * blk, const llama_kv_cache_unified * kv, bool swa) {
+        GGML_ASSERT(ggml_backend_buffer_is_host(mask->buffer));
+
+        float * data = (float *) mask->data;
+
+        const int64_t n_kv = kv->n;
 
-        float * data     = nullptr;
-        float * data_swa = nullptr;
-
-        if (self_kq_mask) {
-            GGML_ASSERT(ggml_backend_buffer_is_host(self_kq_mask->buffer));
-            data = (float *) self_kq_mask->data;
-        }
-
-        if (self_kq_mask_swa) {
-            GGML_ASSERT(ggml_backend_buffer_is_host(self_kq_mask_swa->buffer));
-            data_swa = (float *) self_kq_mask_swa->data;
-        }
-
-        // Use only the previous KV cells of the correct sequence for each token of the ubatch.
-        // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
-        // Example with a cache of 10 tokens, 2 tokens populated in cache and 3 tokens in batch:
-        //   Causal mask:
-        //      xxx-------
-        //      xxxx------
-        //      xxxxx-----
-        //   Non-causal mask:
-        //      xxxxx-----
-        //      xxxxx-----
-        //      xxxxx-----
-        // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
         for (int h = 0; h < 1; ++h) {
             for (int s = 0; s < n_seqs; ++s) {
                 const llama_seq_id seq_id = ubatch->seq_id[s][0];
@@ -455,61 +567,87 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
                 for (int j = 0; j < n_seq_tokens; ++j) {
                     const llama_pos pos = ubatch->pos[s*n_seq_tokens + j];
                     for (int i = 0; i < n_kv; ++i) {
+                        const llama_kv_cell & cell = kv->cells[i];
+
                         float f;
                         // mask the token if:
-                        if (!kv_self->cells[i].has_seq_id(seq_id) // not the correct sequence
-                            || (cparams.causal_attn && kv_self->cells[i].pos > pos) // for causal, mask future tokens
+                        if (!cell.has_seq_id(seq_id) // not the correct sequence
+                            || (cparams.causal_attn && cell.pos > pos) // for causal, mask future tokens
                         ) {
                             f = -INFINITY;
                         } else {
                             if (hparams.use_alibi) {
-                                f = -std::abs(kv_self->cells[i].pos - pos);
+                                f = -std::abs(cell.pos - pos);
                             } else {
                                 f = 0.0f;
                             }
                         }
 
-                        if (data) {
-                            data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                        }
-
                         // may need to cut off old tokens for sliding window
                         // TODO @ngxson : we are currently re-using the swa logic to store the chunked mask, we should rename SWA to something more generic like "aux mask"
-                        if (data_swa) {
+                        if (swa) {
                             if (hparams.n_attn_chunk) {
                                 llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
-                                if (kv_self->cells[i].pos < pos_chunk_start || pos < pos_chunk_start) {
+                                if (cell.pos < pos_chunk_start || pos < pos_chunk_start) {
                                     f = -INFINITY;
                                 }
                             } else {
-                                if (pos - kv_self->cells[i].pos >= (int32_t)hparams.n_swa) {
+                                if (pos - cell.pos >= (int32_t)hparams.n_swa) {
                                     f = -INFINITY;
                                 }
                             }
-                            data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
                         }
+
+                        data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
                     }
                 }
             }
 
             // mask padded tokens
-            if (data) {
-                for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                    for (int j = 0; j < n_kv; ++j) {
-                        data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                    }
+            for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
+                for (int j = 0; j < n_kv; ++j) {
+                    data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
                 }
             }
+        }
 
-            // mask padded tokens
-            if (data_swa) {
-                for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                    for (int j = 0; j < n_kv; ++j) {
-                        data_swa[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
+        // summarize each block of GGML_KQ_MASK_BLK cells of a row as fully masked, all zero or mixed
+        // with many sequences in the cache, most blocks of a row belong to other sequences and are masked
+        if (blk) {
+            GGML_ASSERT(ggml_backend_buffer_is_host(blk->buffer));
+
+            int8_t * data_blk = (int8_t *) blk->data;
+
+            const int64_t n_blk = blk->ne[0];
+
+            for (int64_t j = 0; j < blk->ne[1]; ++j) {
+                const float * row = data + j*n_kv;
+
+                for (int64_t ib = 0; ib < n_blk; ++ib) {
+                    const int64_t i0 = ib*GGML_KQ_MASK_BLK;
+                    const int64_t i1 = std::min<int64_t>(i0 + GGML_KQ_MASK_BLK, n_kv);
+
+                    bool masked = true;
+                    bool zero   = true;
+
+                    for (int64_t i = i0; i < i1; ++i) {
+                        masked = masked && row[i] == -INFINITY;
+                        zero   = zero   && row[i] == 0.0f;
                     }
+
+                    data_blk[j*n_blk + ib] = masked ? GGML_KQ_MASK_BLK_MASKED : zero ? GGML_KQ_MASK_BLK_ZERO : GGML_KQ_MASK_BLK_MIXED;
                 }
             }
         }
+    };
+
+    if (self_kq_mask) {
+        fill_mask(self_kq_mask, self_kq_mask_blk, kv_self, false);
+    }
+
+    // the sliding-window layers can have a separate cache
+    if (self_kq_mask_swa) {
+        fill_mask(self_kq_mask_swa, self_kq_mask_swa_blk, kv_self->swa ? kv_self->swa.get() : kv_self, true);
     }
 }
 
@@ -588,8 +726,35 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     loras            (params.loras),
     memory           (params.memory),
     cross            (params.cross),
+    loras_seq        (params.loras_seq),
+    logprobs_targets (params.logprobs_targets),
     cb_func          (params.cb),
     res              (std::make_unique<llm_graph_result>()) {
+        if (loras_seq && !loras_seq->empty() && ubatch.seq_id) {
+            std::vector<bool> used(loras_seq->slots.size(), false);
+
+            int32_t n_used = 0;
+            for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+                const llama_adapter_loras * seq_loras = loras_seq->get(ubatch.seq_id[s][0]);
+                if (seq_loras == nullptr) {
+                    continue;
+                }
+
+                for (const auto & lora : *seq_loras) {
+                    used[loras_seq->get_slot(lora.first)] = true;
+                }
+
+                n_used = std::max(n_used, (int32_t) seq_loras->size());
+            }
+
+            if (n_used > 0) {
+                auto inp = std::make_unique<llm_graph_input_lora_seq>(loras_seq, n_outputs, n_used);
+                inp->used = std::move(used);
+
+                inp_lora_seq = inp.get();
+                res->add_input(std::move(inp));
+            }
+        }
     }
 
 int64_t llm_graph_context::n_pos_per_token() const {
@@ -631,6 +796,113 @@ ggml_tensor * llm_graph_context::build_lora_mm(
         res = ggml_add(ctx0, res, ab_cur);
     }
 
+    if (inp_lora_seq) {
+        res = build_lora_seq_mm(w, cur, res);
+    }
+
+    return res;
+}
+
+ggml_tensor * llm_graph_context::build_lora_seq_mm(
+          ggml_tensor * w,
+          ggml_tensor * cur,
+          ggml_tensor * res) const {
+    bool has_weight = false;
+    for (size_t s = 0; s < loras_seq->slots.size() && !has_weight; ++s) {
+        has_weight = inp_lora_seq->used[s] && loras_seq->slots[s]->get_weight(w) != nullptr;
+    }
+
+    if (!has_weight) {
+        return res;
+    }
+
+    // the rows of cur are either the tokens or the outputs of the ubatch, possibly over several dimensions (e.g.
+    // [n_embd, n_seq_tokens, n_seqs]), or its last dimension is the tokens and each token has several rows (e.g.
+    // [n_embd_head, n_head, n_tokens])
+    int64_t n_rows  = ggml_nrows(cur);
+    int     dim_tok = 1;
+    if (n_rows != n_tokens && n_rows != n_outputs) {
+        dim_tok = ggml_n_dims(cur) - 1;
+        n_rows  = cur->ne[dim_tok];
+        if (dim_tok < 2 || (n_rows != n_tokens && n_rows != n_outputs)) {
+            // e.g. the outputs of the encoder used by the cross-attention, which do not belong to the sequences of the
+            // ubatch
+            static std::atomic<bool> warned { false };
+            if (!warned.exchange(true)) {
+                LLAMA_LOG_WARN("%s: the rows of the input of %s [%" PRId64 ", %" PRId64 ", %" PRId64 ", %" PRId64 "] are not the tokens of the ubatch, "
+                        "the lora adapters of the sequences are not applied to it\n",
+                        __func__, w->name, cur->ne[0], cur->ne[1], cur->ne[2], cur->ne[3]);
+            }
+            return res;
+        }
+    }
+
+    const int k = n_rows == n_tokens ? 0 : 1;
+
+    if (dim_tok == 1 && ggml_n_dims(cur) > 2) {
+        // apply the adapters to the rows of cur as a 2D tensor, then restore the shape of the result
+        ggml_tensor * x = ggml_is_contiguous(cur) ? cur : ggml_cont(ctx0, cur);
+        x = ggml_reshape_2d(ctx0, x, x->ne[0], n_rows);
+
+        ggml_tensor * res_2d = build_lora_seq_mm(w, x, ggml_reshape_2d(ctx0, res, res->ne[0], n_rows));
+
+        return ggml_reshape_4d(ctx0, res_2d, res->ne[0], res->ne[1], res->ne[2], res->ne[3]);
+    }
+
+    const auto * st = dim_tok == 1 ? loras_seq->get_stack(w) : nullptr;
+    if (st) {
+        // gather the A/B matrices of the adapters of each row
+        ggml_tensor * ids = inp_lora_seq->get_ids(ctx0, k, n_rows);
+
+        ggml_tensor * x = ggml_is_contiguous(cur) ? cur : ggml_cont(ctx0, cur);
+        x = ggml_reshape_3d(ctx0, x, x->ne[0], 1, n_rows);
+
+        ggml_tensor * ab_cur = ggml_mul_mat_id(ctx0, st->b, ggml_mul_mat_id(ctx0, st->a, x, ids), ids); // [n_out, n_used, n_rows]
+        ab_cur = ggml_mul(ctx0, ab_cur, inp_lora_seq->get_scale(ctx0, k, n_rows));
+
+        for (int64_t j = 0; j < ab_cur->ne[1]; ++j) {
+            res = ggml_add(ctx0, res, ggml_view_2d(ctx0, ab_cur, ab_cur->ne[0], n_rows, ab_cur->nb[2], j*ab_cur->nb[1]));
+        }
+
+        return res;
+    }
+
+    // the adapters that could not be stacked, or the ones of tokens with several rows, are applied one by one, masked to
+    // the rows of their sequences
+    ggml_tensor * mask = nullptr;
+
+    for (size_t s = 0; s < loras_seq->slots.size(); ++s) {
+        if (!inp_lora_seq->used[s]) {
+            continue;
+        }
+
+        llama_adapter_lora * adapter = loras_seq->slots[s];
+
+        llama_adapter_lora_weight * lw = adapter->get_weight(w);
+        if (lw == nullptr) {
+            continue;
+        }
+
+        if (mask == nullptr) {
+            mask = inp_lora_seq->get_mask(ctx0, k, n_rows);
+        }
+
+        ggml_tensor * ab_cur = ggml_mul_mat(
+                ctx0, lw->b,
+                ggml_mul_mat(ctx0, lw->a, cur)
+                );
+
+        // the mask of the slot along the dimension of the tokens, broadcast to the rows of each token
+        int64_t ne[4] = { 1, 1, 1, 1 };
+        ne[dim_tok] = n_rows;
+
+        ggml_tensor * mask_s = ggml_view_4d(ctx0, mask, ne[0], ne[1], ne[2], ne[3], mask->nb[0], mask->nb[0], mask->nb[0], s*mask->nb[1]);
+
+        ab_cur = ggml_scale(ctx0, ab_cur, lw->get_scale(adapter->alpha, 1.0f));
+        ab_cur = ggml_mul(ctx0, ab_cur, mask_s);
+        res = ggml_add(ctx0, res, ab_cur);
+    }
+
     return res;
 }
 
@@ -659,6 +931,45 @@ ggml_tensor * llm_graph_context::build_lora_mm_id(
         res = ggml_add(ctx0, res, ab_cur);
     }
 
+    // the per-sequence adapters of the experts are applied one by one, masked to the rows of their sequences
+    const int64_t n_rows = cur->ne[2];
+    if (inp_lora_seq && (n_rows == n_tokens || n_rows == n_outputs)) {
+        const int k = n_rows == n_tokens ? 0 : 1;
+
+        ggml_tensor * mask = nullptr;
+
+        for (size_t s = 0; s < loras_seq->slots.size(); ++s) {
+            if (!inp_lora_seq->used[s]) {
+                continue;
+            }
+
+            llama_adapter_lora * adapter = loras_seq->slots[s];
+
+            llama_adapter_lora_weight * lw = adapter->get_weight(w);
+            if (lw == nullptr) {
+                continue;
+            }
+
+            if (mask == nullptr) {
+                mask = inp_lora_seq->get_mask(ctx0, k, n_rows);
+            }
+
+            const float alpha = adapter->alpha;
+            const float rank  = (float) lw->b->ne[0];
+            const float scale = alpha ? alpha / rank : 1.0f;
+
+            ggml_tensor * ab_cur = ggml_mul_mat_id(
+                    ctx0, lw->b,
+                    ggml_mul_mat_id(ctx0, lw->a, cur, ids),
+                    ids
+                    );
+
+            ab_cur = ggml_scale(ctx0, ab_cur, scale);
+            ab_cur = ggml_mul(ctx0, ab_cur, ggml_view_3d(ctx0, mask, 1, 1, n_rows, mask->nb[0], mask->nb[0], s*mask->nb[1]));
+            res = ggml_add(ctx0, res, ab_cur);
+        }
+    }
+
     return res;
 }
 
@@ -994,6 +1305,31 @@ ggml_tensor * llm_graph_context::build_inp_embd(ggml_tensor * tok_embd) const {
 
             cur = ggml_add(ctx0, cur, inpL_delta);
         }
+
+        // apply the lora of the sequences, masked to their tokens
+        for (size_t s = 0; inp_lora_seq && s < loras_seq->slots.size(); ++s) {
+            if (!inp_lora_seq->used[s]) {
+                continue;
+            }
+
+            llama_adapter_lora * adapter = loras_seq->slots[s];
+
+            llama_adapter_lora_weight * lw = adapter->get_weight(tok_embd);
+            if (lw == nullptr) {
+                continue;
+            }
+
+            ggml_tensor * mask = inp_lora_seq->get_mask(ctx0, 0, ubatch.n_tokens);
+
+            ggml_tensor * inpL_delta = ggml_scale(ctx0, ggml_mul_mat(
+                        ctx0, lw->b, // non-transposed lora_b
+                        ggml_get_rows(ctx0, lw->a, inp->tokens)
+                        ), lw->get_scale(adapter->alpha, 1.0f));
+
+            inpL_delta = ggml_mul(ctx0, inpL_delta, ggml_view_2d(ctx0, mask, 1, ubatch.n_tokens, mask->nb[0], s*mask->nb[1]));
+
+            cur = ggml_add(ctx0, cur, inpL_delta);
+        }
     } else {
         inp->embd = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, ubatch.n_tokens);
         ggml_set_input(inp->embd);
@@ -1188,6 +1524,7 @@ ggml_tensor * llm_graph_context::build_attn_mha(
          ggml_tensor * v,
          ggml_tensor * kq_b,
          ggml_tensor * kq_mask,
+         ggml_tensor * kq_mask_blk,
          ggml_tensor * v_mla,
              bool      v_trans,
              float     kq_scale) const {
@@ -1228,6 +1565,10 @@ ggml_tensor * llm_graph_context::build_attn_mha(
 
         ggml_flash_attn_ext_set_prec(cur, GGML_PREC_F32);
 
+        if (kq_mask_blk) {
+            ggml_flash_attn_ext_set_mask_blk(cur, kq_mask_blk);
+        }
+
         if (v_mla) {
             cur = ggml_reshape_4d(ctx0, cur, v_mla->ne[0], 1, n_head, n_tokens);
             cur = ggml_mul_mat(ctx0, v_mla, cur);
@@ -1264,6 +1605,10 @@ ggml_tensor * llm_graph_context::build_attn_mha(
 
         kq = ggml_soft_max_ext(ctx0, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
 
+        if (kq_mask_blk) {
+            ggml_soft_max_ext_set_mask_blk(kq, kq_mask_blk);
+        }
+
         if (!v_trans) {
             // note: avoid this branch
             v = ggml_cont(ctx0, ggml_transpose(ctx0, v));
@@ -1335,7 +1680,7 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * v = ggml_permute(ctx0, v_cur, 0, 2, 1, 3);
     //cb(k, "v", il);
 
-    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, false, kq_scale);
+    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, nullptr, v_mla, false, kq_scale);
 
     cb(cur, "kqv_out", il);
 
@@ -1367,14 +1712,22 @@ llm_graph_input_attn_kv_unified * llm_graph_context::build_attn_inp_kv_unified()
 
     inp->self_kq_mask_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask, GGML_TYPE_F16) : inp->self_kq_mask;
 
+    inp->self_kq_mask_blk = ggml_new_tensor_2d(ctx0, GGML_TYPE_I8, (n_kv + GGML_KQ_MASK_BLK - 1)/GGML_KQ_MASK_BLK, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+    ggml_set_input(inp->self_kq_mask_blk);
+
     if (hparams.n_swa_pattern > 1) {
         GGML_ASSERT(hparams.n_swa > 0);
 
-        inp->self_kq_mask_swa = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+        const auto n_kv_swa = kv_self->swa ? kv_self->swa->n : n_kv;
+
+        inp->self_kq_mask_swa = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv_swa, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         //cb(inp->self_kq_mask_swa, "KQ_mask_swa", -1);
         ggml_set_input(inp->self_kq_mask_swa);
 
         inp->self_kq_mask_swa_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->self_kq_mask_swa, GGML_TYPE_F16) : inp->self_kq_mask_swa;
+
+        inp->self_kq_mask_swa_blk = ggml_new_tensor_2d(ctx0, GGML_TYPE_I8, (n_kv_swa + GGML_KQ_MASK_BLK - 1)/GGML_KQ_MASK_BLK, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+        ggml_set_input(inp->self_kq_mask_swa_blk);
     }
 
     return (llm_graph_input_attn_kv_unified *) res->add_input(std::move(inp));
@@ -1401,6 +1754,9 @@ ggml_tensor * llm_graph_context::build_attn(
     const llama_kv_cache_unified * kv_self = static_cast<const llama_kv_cache_unified *>(memory);
     const auto & n_ctx = cparams.n_ctx;
 
+    // the cache that holds this layer - the sliding-window layers can have a smaller, separate cache
+    const llama_kv_cache_unified * kv = kv_self->layer_cache(il);
+
     const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
     const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
@@ -1412,40 +1768,69 @@ ggml_tensor * llm_graph_context::build_attn(
     {
         GGML_ASSERT(!kv_self->recurrent);
 
-        const auto kv_head = kv_self->head;
-
         GGML_ASSERT(kv_self->size == n_ctx);
 
-        ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*kv_head);
-        //cb(k_cache_view, "k_cache_view", il);
+        // the cells of the ubatch - a single range, unless the cache is paged or the layer uses a sliding window
+        // (when reserving, find_slot has not been called and the tokens go to [head, head + n_tokens))
+        std::vector<llama_kv_cache_unified::slot_range> ranges = kv->ubatch_ranges;
+        if (ranges.empty()) {
+            const uint32_t head = std::min(kv->head, kv->size - (uint32_t) n_tokens);
 
-        // note: storing RoPE-ed version of K in the KV cache
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_cur, k_cache_view));
+            ranges.push_back({ head, head + (uint32_t) n_tokens });
+        }
 
         v_cur = ggml_reshape_2d(ctx0, v_cur, n_embd_v_gqa, n_tokens);
 
-        ggml_tensor * v_cache_view = nullptr;
+        int64_t i0 = 0; // first token of the range
 
-        if (!v_trans) {
-            v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], n_tokens*n_embd_v_gqa, ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa)*kv_head);
-        } else {
-            // note: the V cache is transposed when not using flash attention
-            v_cache_view = ggml_view_2d(ctx0, kv_self->v_l[il], n_tokens, n_embd_v_gqa,
-                    (  n_ctx)*ggml_element_size(kv_self->v_l[il]),
-                    (kv_head)*ggml_element_size(kv_self->v_l[il]));
+        for (const auto & range : ranges) {
+            const auto kv_head = range.c0;
+            const auto n_range = (int64_t) (range.c1 - range.c0);
 
-            v_cur = ggml_transpose(ctx0, v_cur);
+            ggml_tensor * k_src = k_cur;
+            ggml_tensor * v_src = v_cur;
+
+            if (n_range != n_tokens) {
+                k_src = k_cur->ne[2] == n_tokens ?
+                    ggml_view_3d(ctx0, k_cur, k_cur->ne[0], k_cur->ne[1], n_range, k_cur->nb[1], k_cur->nb[2], i0*k_cur->nb[2]) :
+                    ggml_view_2d(ctx0, k_cur, k_cur->ne[0], n_range, k_cur->nb[1], i0*k_cur->nb[1]);
+                v_src = ggml_view_2d(ctx0, v_cur, n_embd_v_gqa, n_range, v_cur->nb[1], i0*v_cur->nb[1]);
+            }
+
+            ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv->k_l[il], n_range*n_embd_k_gqa, ggml_row_size(kv->k_l[il]->type, n_embd_k_gqa)*kv_head);
+            //cb(k_cache_view, "k_cache_view", il);
+
+            // note: storing RoPE-ed version of K in the KV cache
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_src, k_cache_view));
+
+            ggml_tensor * v_cache_view = nullptr;
+
+            if (!v_trans) {
+                v_cache_view = ggml_view_1d(ctx0, kv->v_l[il], n_range*n_embd_v_gqa, ggml_row_size(kv->v_l[il]->type, n_embd_v_gqa)*kv_head);
+            } else {
+                // note: the V cache is transposed when not using flash attention
+                v_cache_view = ggml_view_2d(ctx0, kv->v_l[il], n_range, n_embd_v_gqa,
+                        (kv->size)*ggml_element_size(kv->v_l[il]),
+                        ( kv_head)*ggml_element_size(kv->v_l[il]));
+
+                v_src = ggml_transpose(ctx0, v_src);
+            }
+            //cb(v_cache_view, "v_cache_view", il);
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_src, v_cache_view));
+
+            i0 += n_range;
         }
-        //cb(v_cache_view, "v_cache_view", il);
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_cur, v_cache_view));
+        GGML_ASSERT(i0 == n_tokens);
     }
 
     const bool is_swa = hparams.is_swa(il);
 
-    const auto & kq_mask = is_swa ? inp->get_kq_mask_swa() : inp->get_kq_mask();
+    const auto & kq_mask     = is_swa ? inp->get_kq_mask_swa()     : inp->get_kq_mask();
+    const auto & kq_mask_blk = is_swa ? inp->get_kq_mask_swa_blk() : inp->get_kq_mask_blk();
 
-    const auto n_kv = kv_self->n;
+    const auto n_kv = kv->n;
 
     const int64_t n_head_kv = hparams.n_head_kv(il);
 
@@ -1456,26 +1841,26 @@ ggml_tensor * llm_graph_context::build_attn(
     //cb(q, "q", il);
 
     ggml_tensor * k =
-        ggml_view_3d(ctx0, kv_self->k_l[il],
+        ggml_view_3d(ctx0, kv->k_l[il],
                 n_embd_head_k, n_kv, n_head_kv,
-                ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
-                ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
+                ggml_row_size(kv->k_l[il]->type, n_embd_k_gqa),
+                ggml_row_size(kv->k_l[il]->type, n_embd_head_k),
                 0);
     //cb(k, "k", il);
 
     ggml_tensor * v = !v_trans ?
-        ggml_view_3d(ctx0, kv_self->v_l[il],
+        ggml_view_3d(ctx0, kv->v_l[il],
                 n_embd_head_v, n_kv, n_head_kv,
-                ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
-                ggml_row_size(kv_self->v_l[il]->type, n_embd_head_v),
+                ggml_row_size(kv->v_l[il]->type, n_embd_v_gqa),
+                ggml_row_size(kv->v_l[il]->type, n_embd_head_v),
                 0) :
-        ggml_view_3d(ctx0, kv_self->v_l[il],
+        ggml_view_3d(ctx0, kv->v_l[il],
                 n_kv, n_embd_head_v, n_head_kv,
-                ggml_element_size(kv_self->v_l[il])*n_ctx,
-                ggml_element_size(kv_self->v_l[il])*n_ctx*n_embd_head_v,
+                ggml_element_size(kv->v_l[il])*kv->size,
+                ggml_element_size(kv->v_l[il])*kv->size*n_embd_head_v,
                 0);
 
-    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, v_trans, kq_scale);
+    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, kq_mask_blk, v_mla, v_trans, kq_scale);
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1535,7 +1920,7 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * v = ggml_permute(ctx0, v_cur, 0, 2, 1, 3);
     //cb(k, "v", il);
 
-    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, false, kq_scale);
+    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, nullptr, v_mla, false, kq_scale);
 
     cb(cur, "kqv_out", il);
 
@@ -1704,3 +2089,160 @@ void llm_graph_context::build_pooling(
 
     ggml_build_forward_expand(gf, cur);
 }
+
+ggml_tensor * llm_graph_context::build_top_k(ggml_tensor * logits, int64_t k) const {
+    const int64_t n_vocab   = logits->ne[0];
+    const int64_t n_outputs = logits->ne[1];
+
+    // an argsort of an entire row of the vocab does not fit in the shared memory of the GPUs for large vocabs - the
+    // rows are split in chunks, and the top-k of the chunks are the candidates of a second top-k
+    // the chunks are sized so that there are about as many candidates as values in a chunk
+    int64_t n_chunk_size = 1024;
+    while (n_chunk_size*n_chunk_size < n_vocab*k) {
+        n_chunk_size *= 2;
+    }
+
+    if (n_vocab < 2*n_chunk_size) {
+        return ggml_cont(ctx0, ggml_top_k(ctx0, logits, k));
+    }
+
+    const int64_t n_chunk = n_vocab/n_chunk_size;
+    const int64_t n_main  = n_chunk*n_chunk_size;
+    const int64_t n_tail  = n_vocab - n_main;
+
+    auto inp = std::make_unique<llm_graph_input_vocab_ids>();
+
+    inp->ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_vocab);
+    ggml_set_input(inp->ids);
+
+    ggml_tensor * ids = inp->ids;
+
+    res->add_input(std::move(inp));
+
+    const size_t esize = ggml_element_size(logits);
+
+    // top-k of the chunks: the chunk-local ids [k, n_chunk, n_outputs]
+    ggml_tensor * main = n_tail == 0 ? logits : ggml_cont(ctx0, ggml_view_2d(ctx0, logits, n_main, n_outputs, logits->nb[1], 0));
+    main = ggml_reshape_3d(ctx0, main, n_chunk_size, n_chunk, n_outputs);
+
+    ggml_tensor * top_main = ggml_cont(ctx0, ggml_top_k(ctx0, main, k));
+
+    ggml_tensor * cand_logits = ggml_get_rows(ctx0,
+            ggml_reshape_3d(ctx0, main, 1, n_chunk_size, n_chunk*n_outputs),
+            ggml_reshape_2d(ctx0, top_main, k, n_chunk*n_outputs));
+    cand_logits = ggml_reshape_2d(ctx0, cand_logits, k*n_chunk, n_outputs);
+
+    // the token ids of the candidates, gathered from the ids of their chunk: [k, n_outputs, n_chunk] for ggml_get_rows
+    ggml_tensor * cand_ids = ggml_cont(ctx0, ggml_permute(ctx0, top_main, 0, 2, 1, 3));
+    cand_ids = ggml_get_rows(ctx0,
+            ggml_view_3d(ctx0, ids, 1, n_chunk_size, n_chunk, ids->nb[0], n_chunk_size*ids->nb[0], 0),
+            ggml_reshape_2d(ctx0, cand_ids, k*n_outputs, n_chunk));
+    cand_ids = ggml_reshape_3d(ctx0, cand_ids, k, n_outputs, n_chunk);
+    cand_ids = ggml_cont(ctx0, ggml_permute(ctx0, cand_ids, 0, 2, 1, 3));
+    cand_ids = ggml_reshape_2d(ctx0, cand_ids, k*n_chunk, n_outputs);
+
+    // the values past the last full chunk
+    if (n_tail > 0) {
+        const int64_t k_tail = std::min(k, n_tail);
+
+        ggml_tensor * tail = ggml_cont(ctx0, ggml_view_2d(ctx0, logits, n_tail, n_outputs, logits->nb[1], n_main*esize));
+
+        ggml_tensor * top_tail = ggml_cont(ctx0, ggml_top_k(ctx0, tail, k_tail));
+
+        ggml_tensor * tail_logits = ggml_get_rows(ctx0, ggml_reshape_3d(ctx0, tail, 1, n_tail, n_outputs), top_tail);
+        tail_logits = ggml_reshape_2d(ctx0, tail_logits, k_tail, n_outputs);
+
+        ggml_tensor * tail_ids = ggml_get_rows(ctx0,
+                ggml_view_3d(ctx0, ids, 1, n_tail, 1, ids->nb[0], n_tail*ids->nb[0], n_main*ids->nb[0]),
+                ggml_reshape_2d(ctx0, top_tail, k_tail*n_outputs, 1));
+        tail_ids = ggml_reshape_2d(ctx0, tail_ids, k_tail, n_outputs);
+
+        cand_logits = ggml_concat(ctx0, cand_logits, tail_logits, 0);
+        cand_ids    = ggml_concat(ctx0, cand_ids,    tail_ids,    0);
+    }
+
+    const int64_t n_cand = cand_logits->ne[0];
+
+    // top-k of the candidates
+    ggml_tensor * top = ggml_cont(ctx0, ggml_top_k(ctx0, cand_logits, k));
+
+    return ggml_get_rows(ctx0, ggml_reshape_3d(ctx0, cand_ids, 1, n_cand, n_outputs), top);
+}
+
+void llm_graph_context::build_logprobs(ggml_cgraph * gf) const {
+    const int64_t n_target = cparams.n_logprobs_target;
+    const int64_t n_top    = cparams.n_logprobs_top;
+
+    if (cparams.embeddings || res->t_logits == nullptr || n_target + n_top == 0 || n_outputs == 0) {
+        return;
+    }
+
+    ggml_tensor * logits = res->t_logits;
+    if (!ggml_is_contiguous(logits)) {
+        logits = ggml_cont(ctx0, logits);
+    }
+
+    const int64_t n_vocab = logits->ne[0];
+
+    GGML_ASSERT(logits->ne[1] == n_outputs);
+    GGML_ASSERT(n_top <= n_vocab);
+
+    // the logits of each output as rows of a single value, so that the tokens gathered with ggml_get_rows
+    // are relative to their output: [1, n_vocab, n_outputs]
+    ggml_tensor * rows = ggml_reshape_3d(ctx0, logits, 1, n_vocab, n_outputs);
+
+    ggml_tensor * top = nullptr;
+    if (n_top == 1) {
+        top = ggml_argmax(ctx0, logits);
+    } else if (n_top > 1) {
+        top = build_top_k(logits, n_top);
+    }
+
+    if (top) {
+        // read back after the graph is computed, while it is also an input of other nodes
+        ggml_set_output(top);
+
+        top = ggml_reshape_2d(ctx0, top, n_top, n_outputs);
+    }
+
+    // the max logit of each output, for a stable log-sum-exp
+    ggml_tensor * top_logits = ggml_get_rows(ctx0, rows, top ? top : ggml_reshape_2d(ctx0, ggml_argmax(ctx0, logits), 1, n_outputs));
+    top_logits = ggml_reshape_2d(ctx0, top_logits, top ? n_top : 1, n_outputs);
+
+    ggml_tensor * max = ggml_view_2d(ctx0, top_logits, 1, n_outputs, top_logits->nb[1], 0);
+
+    // log(sum(exp(logits))) = max + log(sum(exp(logits - max)))
+    ggml_tensor * lse = ggml_sub(ctx0, logits, max);
+    lse = ggml_exp     (ctx0, lse);
+    lse = ggml_sum_rows(ctx0, lse);
+    lse = ggml_log     (ctx0, lse);
+    lse = ggml_add     (ctx0, lse, max);
+    cb(lse, "result_logsumexp", -1);
+
+    ggml_tensor * cur = nullptr;
+
+    if (n_target > 0) {
+        auto inp = std::make_unique<llm_graph_input_logprobs>(logprobs_targets);
+
+        inp->ids = ggml_new_tensor_2d(ctx0, GGML_TYPE_I32, n_target, n_outputs);
+        ggml_set_input(inp->ids);
+
+        cur = ggml_reshape_2d(ctx0, ggml_get_rows(ctx0, rows, inp->ids), n_target, n_outputs);
+
+        res->add_input(std::move(inp));
+    }
+
+    if (top) {
+        cur = cur ? ggml_concat(ctx0, cur, top_logits, 0) : top_logits;
+
+        res->t_logprobs_top = top;
+        ggml_build_forward_expand(gf, top);
+    }
+
+    cur = ggml_sub(ctx0, cur, lse);
+    cb(cur, "result_logprobs", -1);
+
+    res->t_logprobs = cur;
+
+    ggml_build_forward_expand(gf, cur);
+}
@@ -162,6 +162,33 @@ public:
     const int32_t n_outputs;
 };
 
+class llm_graph_input_lora_seq : public llm_graph_input_i {
+public:
+    llm_graph_input_lora_seq(
+            const llama_adapter_loras_seq * loras_seq,
+            int32_t n_outputs,
+            int32_t n_used) : loras_seq(loras_seq), n_outputs(n_outputs), n_used(n_used) {}
+    virtual ~llm_graph_input_lora_seq() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    // created on first use, the rows are the tokens (0) or the outputs (1) of the ubatch
+    ggml_tensor * get_ids  (ggml_context * ctx, int k, int64_t n_rows);
+    ggml_tensor * get_scale(ggml_context * ctx, int k, int64_t n_rows);
+    ggml_tensor * get_mask (ggml_context * ctx, int k, int64_t n_rows);
+
+    ggml_tensor * ids  [2] = {}; // I32 [n_used, n_rows], the slots of the adapters of the sequence of each row
+    ggml_tensor * scale[2] = {}; // F32 [1, n_used, n_rows]
+    ggml_tensor * mask [2] = {}; // F32 [n_rows, n_slot], the scale of each slot for each row
+
+    std::vector<bool> used; // the slots used by the sequences of the ubatch
+
+    const llama_adapter_loras_seq * loras_seq;
+
+    const int32_t n_outputs;
+    const int32_t n_used; // max number of adapters of a sequence of the ubatch
+};
+
 class llm_graph_input_mean : public llm_graph_input_i {
 public:
     llm_graph_input_mean(const llama_cparams & cparams) : cparams(cparams) {}
@@ -186,6 +213,28 @@ public:
     const llama_cparams & cparams;
 };
 
+class llm_graph_input_logprobs : public llm_graph_input_i {
+public:
+    llm_graph_input_logprobs(const std::vector<llama_token> * targets) : targets(targets) {}
+    virtual ~llm_graph_input_logprobs() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    ggml_tensor * ids = nullptr; // I32 [n_target, n_outputs]
+
+    const std::vector<llama_token> * targets; // [n_outputs][n_target] for the outputs of the ubatch
+};
+
+class llm_graph_input_vocab_ids : public llm_graph_input_i {
+public:
+    llm_graph_input_vocab_ids() = default;
+    virtual ~llm_graph_input_vocab_ids() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    ggml_tensor * ids = nullptr; // I32 [n_vocab], the token ids in order
+};
+
 class llm_graph_input_s_copy : public llm_graph_input_i {
 public:
     llm_graph_input_s_copy(const llama_kv_cache_unified * kv_self) : kv_self(kv_self) {}
@@ -256,14 +305,20 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
-    ggml_tensor * get_kq_mask()     const { return self_kq_mask_cnv; }
-    ggml_tensor * get_kq_mask_swa() const { return self_kq_mask_swa_cnv; }
+    ggml_tensor * get_kq_mask()         const { return self_kq_mask_cnv; }
+    ggml_tensor * get_kq_mask_swa()     const { return self_kq_mask_swa_cnv; }
+    ggml_tensor * get_kq_mask_blk()     const { return self_kq_mask_blk; }
+    ggml_tensor * get_kq_mask_swa_blk() const { return self_kq_mask_swa_blk; }
 
     ggml_tensor * self_kq_mask         = nullptr; // F32 [n_kv, n_batch]
     ggml_tensor * self_kq_mask_cnv     = nullptr; //     [n_kv, n_batch]
     ggml_tensor * self_kq_mask_swa     = nullptr; // F32 [n_kv, n_batch]
     ggml_tensor * self_kq_mask_swa_cnv = nullptr; //     [n_kv, n_batch]
 
+    // summary of the masks in blocks of GGML_KQ_MASK_BLK cells, used by the attention kernels to skip masked blocks
+    ggml_tensor * self_kq_mask_blk     = nullptr; // I8  [n_kv/GGML_KQ_MASK_BLK, n_batch]
+    ggml_tensor * self_kq_mask_swa_blk = nullptr; // I8  [n_kv/GGML_KQ_MASK_BLK, n_batch]
+
     const llama_hparams & hparams;
     const llama_cparams & cparams;
 
@@ -299,9 +354,11 @@ class llm_graph_result_i {
 public:
     virtual ~llm_graph_result_i() = default;
 
-    virtual ggml_tensor * get_logits()      = 0;
-    virtual ggml_tensor * get_embd()        = 0;
-    virtual ggml_tensor * get_embd_pooled() = 0;
+    virtual ggml_tensor * get_logits()       = 0;
+    virtual ggml_tensor * get_logprobs()     = 0;
+    virtual ggml_tensor * get_logprobs_top() = 0;
+    virtual ggml_tensor * get_embd()         = 0;
+    virtual ggml_tensor * get_embd_pooled()  = 0;
 
     virtual void set_inputs(const llama_ubatch * ubatch) = 0;
 };
@@ -313,9 +370,11 @@ class llm_graph_result : public llm_graph_result_i {
 public:
     virtual ~llm_graph_result() = default;
 
-    ggml_tensor * get_logits()      override { return t_logits; }
-    ggml_tensor * get_embd()        override { return t_embd; }
-    ggml_tensor * get_embd_pooled() override { return t_embd_pooled; }
+    ggml_tensor * get_logits()       override { return t_logits; }
+    ggml_tensor * get_logprobs()     override { return t_logprobs; }
+    ggml_tensor * get_logprobs_top() override { return t_logprobs_top; }
+    ggml_tensor * get_embd()         override { return t_embd; }
+    ggml_tensor * get_embd_pooled()  override { return t_embd_pooled; }
 
     void set_inputs(const llama_ubatch * ubatch) override {
         for (auto & input : inputs) {
@@ -329,9 +388,11 @@ public:
     }
 
     // important graph nodes
-    ggml_tensor * t_logits      = nullptr;
-    ggml_tensor * t_embd        = nullptr;
-    ggml_tensor * t_embd_pooled = nullptr;
+    ggml_tensor * t_logits       = nullptr;
+    ggml_tensor * t_logprobs     = nullptr; // F32 [n_target + n_top, n_outputs]
+    ggml_tensor * t_logprobs_top = nullptr; // I32 [n_top, n_outputs]
+    ggml_tensor * t_embd         = nullptr;
+    ggml_tensor * t_embd_pooled  = nullptr;
 
     std::vector<llm_graph_input_ptr> inputs;
 };
@@ -360,6 +421,10 @@ struct llm_graph_params {
     const llama_memory_i      * memory;
     const llama_cross         * cross;
 
+    const llama_adapter_loras_seq * loras_seq;
+
+    const std::vector<llama_token> * logprobs_targets;
+
     int32_t n_outputs;
 
     const llm_graph_cb & cb;
@@ -413,6 +478,13 @@ struct llm_graph_context {
     const llama_memory_i      * memory;
     const llama_cross         * cross;
 
+    const llama_adapter_loras_seq * loras_seq;
+
+    // nullptr if no sequence of the ubatch has adapters
+    llm_graph_input_lora_seq * inp_lora_seq = nullptr;
+
+    const std::vector<llama_token> * logprobs_targets;
+
     const llm_graph_cb & cb_func;
 
     std::unique_ptr<llm_graph_result> res;
@@ -436,6 +508,12 @@ struct llm_graph_context {
               ggml_tensor * w,
               ggml_tensor * cur) const;
 
+    // add the per-sequence adapters of w to res = w*cur
+    ggml_tensor * build_lora_seq_mm(
+              ggml_tensor * w,
+              ggml_tensor * cur,
+              ggml_tensor * res) const;
+
     // do mat_mul_id, while optionally apply lora
     ggml_tensor * build_lora_mm_id(
               ggml_tensor * w,   // ggml_tensor * as
@@ -510,6 +588,7 @@ struct llm_graph_context {
              ggml_tensor * v,     // [n_embd_head_v, n_tokens, n_head_v] (v_trans == false)
              ggml_tensor * kq_b,
              ggml_tensor * kq_mask,
+             ggml_tensor * kq_mask_blk, // optional block summary of kq_mask
              ggml_tensor * v_mla, // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
                     bool   v_trans,
                    float   kq_scale) const;
@@ -593,4 +672,14 @@ struct llm_graph_context {
             ggml_tensor * cls_b,
             ggml_tensor * cls_out,
             ggml_tensor * cls_out_b) const;
+
+    //
+    // logprobs
+    //
+
+    // the ids of the k largest values of each row of logits [n_vocab, n_outputs], I32 with k ids per output
+    ggml_tensor * build_top_k(ggml_tensor * logits, int64_t k) const;
+
+    // log-probabilities of the targets and the top tokens of the outputs, see llama_set_logprobs()
+    void build_logprobs(ggml_cgraph * gf) const;
 };
@@ -20,17 +20,43 @@ bool llama_kv_cache_unified::init(
                 ggml_type   type_k,
                 ggml_type   type_v,
                  uint32_t   kv_size,
-                     bool   offload) {
+                     bool   offload,
+     std::function<bool(int32_t il)> filter) {
     const int32_t n_layer = hparams.n_layer;
 
     has_shift = false;
 
     recurrent = llama_model_is_recurrent(&model);
     v_trans   = !recurrent && !cparams.flash_attn;
-    can_shift = !recurrent;
 
-    LLAMA_LOG_INFO("%s: kv_size = %d, offload = %d, type_k = '%s', type_v = '%s', n_layer = %d, can_shift = %d\n",
-            __func__, kv_size, offload, ggml_type_name(type_k), ggml_type_name(type_v), n_layer, can_shift);
+    // the sliding-window layers only attend to the last n_swa positions of each sequence
+    // give them a separate cache with room for the window of every sequence and one ubatch
+    if (!filter && !recurrent && !cparams.swa_full && hparams.n_swa > 0 && hparams.n_swa_pattern > 1 && hparams.n_attn_chunk == 0) {
+        const uint32_t size_swa = std::min(kv_size, GGML_PAD(cparams.n_seq_max*hparams.n_swa + cparams.n_ubatch, get_padding(cparams)));
+
+        if (size_swa < kv_size) {
+            swa = std::make_unique<llama_kv_cache_unified>(hparams, cbs);
+            swa->n_swa = hparams.n_swa;
+
+            if (!swa->init(model, cparams, type_k, type_v, size_swa, offload, [this](int32_t il) { return hparams.is_swa(il); })) {
+                return false;
+            }
+
+            filter = [this](int32_t il) { return !hparams.is_swa(il); };
+        }
+    }
+
+    // the SWA cache does not keep the positions that a shifted sequence would move into the window
+    can_shift = !recurrent && !swa && n_swa == 0;
+
+    block_size = recurrent || n_swa > 0 ? 0 : std::min(cparams.kv_block_size, kv_size);
+
+    if (recurrent && cparams.kv_block_size > 0) {
+        LLAMA_LOG_WARN("%s: paged KV cache is not supported for recurrent models - ignoring kv_block_size\n", __func__);
+    }
+
+    LLAMA_LOG_INFO("%s: kv_size = %d, offload = %d, type_k = '%s', type_v = '%s', n_layer = %d, can_shift = %d, block_size = %d, n_swa = %d\n",
+            __func__, kv_size, offload, ggml_type_name(type_k), ggml_type_name(type_v), n_layer, can_shift, block_size, n_swa);
 
     head = 0;
     size = kv_size;
@@ -71,6 +97,12 @@ bool llama_kv_cache_unified::init(
     v_l.reserve(n_layer);
 
     for (int i = 0; i < n_layer; i++) {
+        if (filter && !filter(i)) {
+            k_l.push_back(nullptr);
+            v_l.push_back(nullptr);
+            continue;
+        }
+
         const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(i) + hparams.n_embd_k_s();
         const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(i) + hparams.n_embd_v_s();
 
@@ -136,7 +168,7 @@ int32_t llama_kv_cache_unified::get_used_cells() const {
 }
 
 size_t llama_kv_cache_unified::total_size() const {
-    size_t size = 0;
+    size_t size = swa ? swa->total_size() : 0;
     for (const auto & buf : bufs) {
         size += ggml_backend_buffer_get_size(buf.get());
     }
@@ -154,6 +186,10 @@ llama_pos llama_kv_cache_unified::pos_max() const {
 }
 
 void llama_kv_cache_unified::clear() {
+    if (swa) {
+        swa->clear();
+    }
+
     for (int32_t i = 0; i < (int32_t) size; ++i) {
         cells[i].pos = -1;
         cells[i].seq_id.clear();
@@ -163,6 +199,8 @@ void llama_kv_cache_unified::clear() {
     head = 0;
     used = 0;
 
+    ubatch_ranges.clear();
+
     for (auto & buf : bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -238,6 +276,10 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         head = new_head;
     }
 
+    if (swa) {
+        swa->seq_rm(seq_id, p0, p1);
+    }
+
     return true;
 }
 
@@ -290,6 +332,10 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
             cells[i].seq_id.insert(seq_id_dst);
         }
     }
+
+    if (swa) {
+        swa->seq_cp(seq_id_src, seq_id_dst, p0, p1);
+    }
 }
 
 void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
@@ -322,6 +368,10 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     if (new_head != size && new_head < head) {
         head = new_head;
     }
+
+    if (swa) {
+        swa->seq_keep(seq_id);
+    }
 }
 
 void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
@@ -380,6 +430,10 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     head = new_head != size ? new_head : 0;
+
+    if (swa) {
+        swa->seq_add(seq_id, p0, p1, delta);
+    }
 }
 
 void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
@@ -426,6 +480,29 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
             }
         }
     }
+
+    if (swa) {
+        swa->seq_div(seq_id, p0, p1, d);
+    }
+}
+
+llama_pos llama_kv_cache_unified::seq_pos_min(llama_seq_id seq_id) const {
+    llama_pos result = -1;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        if (cells[i].has_seq_id(seq_id) && (result < 0 || cells[i].pos < result)) {
+            result = cells[i].pos;
+        }
+    }
+
+    // the positions before the window are only held by this cache
+    if (swa && result >= 0) {
+        const llama_pos result_swa = swa->seq_pos_min(seq_id);
+
+        result = result_swa < 0 ? -1 : std::max(result, result_swa);
+    }
+
+    return result;
 }
 
 llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
@@ -447,6 +524,12 @@ void llama_kv_cache_unified::defrag() {
 }
 
 void llama_kv_cache_unified::restore() {
+    if (swa) {
+        swa->restore();
+    }
+
+    ubatch_ranges.clear();
+
     if (pending.ranges.empty()) {
         return;
     }
@@ -481,6 +564,13 @@ void llama_kv_cache_unified::restore() {
 }
 
 void llama_kv_cache_unified::commit() {
+    // note: a single sequence state is read into each cache separately
+    if (swa && !swa->pending.ranges.empty()) {
+        swa->commit();
+    }
+
+    ubatch_ranges.clear();
+
     // TODO: tmp - move to llama_kv_cache_recurrent
     if (recurrent) {
         return;
@@ -501,10 +591,18 @@ bool llama_kv_cache_unified::get_can_shift() const {
 
 bool llama_kv_cache_unified::find_slot(
        const llama_ubatch & ubatch) {
-    const uint32_t n_tokens = ubatch.n_tokens;
-    const uint32_t n_seqs   = ubatch.n_seqs;
+    const uint32_t n_seqs       = ubatch.n_seqs;
     const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
 
+    if (n_swa > 0) {
+        return find_slot_swa(ubatch, false);
+    }
+
+    // if the cells of the sliding-window layers are placed but this cache is full, restore() releases them
+    if (swa && !swa->find_slot(ubatch)) {
+        return false;
+    }
+
     // if we have enough unused cells before the current head ->
     //   better to start searching from the beginning of the cache, hoping to fill it
     if (head > used + 2*ubatch.n_tokens) {
@@ -676,6 +774,18 @@ bool llama_kv_cache_unified::find_slot(
 
     // otherwise, one cell per token.
 
+    if (block_size > 0) {
+        return find_slot_paged(ubatch);
+    }
+
+    return find_slot_cont(ubatch);
+}
+
+bool llama_kv_cache_unified::find_slot_cont(const llama_ubatch & ubatch) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
     if (n_tokens > size) {
         LLAMA_LOG_ERROR("%s: n_tokens = %d > size = %d\n", __func__, n_tokens, size);
         return false;
@@ -725,14 +835,324 @@ bool llama_kv_cache_unified::find_slot(
 
     pending.ranges.push_back({head, head + n_tokens});
 
+    ubatch_ranges.clear();
+    ubatch_ranges.push_back({head, head + n_tokens});
+
+    return true;
+}
+
+bool llama_kv_cache_unified::find_slot_paged(const llama_ubatch & ubatch) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    // any free cell can be used, so the only failure is a full cache
+    if (n_tokens > size - used) {
+        return false;
+    }
+
+    const uint32_t n_blocks = (size + block_size - 1)/block_size;
+
+    // number of used cells in each block
+    std::vector<uint32_t> blk_used(n_blocks, 0);
+
+    // the cell holding the last position of each sequence in the ubatch (size - none)
+    std::map<llama_seq_id, uint32_t> seq_tail;
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        seq_tail[ubatch.seq_id[s][0]] = size;
+    }
+
+    std::vector<bool> is_free(size);
+
+    for (uint32_t i = 0; i < size; ++i) {
+        const llama_kv_cell & cell = cells[i];
+
+        is_free[i] = cell.pos < 0;
+
+        if (cell.pos < 0) {
+            continue;
+        }
+
+        blk_used[i/block_size]++;
+
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            auto it = seq_tail.find(seq_id);
+            if (it != seq_tail.end() && (it->second == size || cells[it->second].pos < cell.pos)) {
+                it->second = i;
+            }
+        }
+    }
+
+    // the cells that are free and not yet taken by a token of the ubatch
+    std::vector<bool> avail = is_free;
+
+    // search cursors - the blocks and cells before them are known to be in use
+    uint32_t next_blk  = 0;
+    uint32_t next_cell = 0;
+
+    // the cells that receive the tokens, in token order
+    std::vector<uint32_t> idxs;
+    idxs.reserve(n_tokens);
+
+    for (uint32_t s = 0; s < n_seqs; s++) {
+        uint32_t & tail = seq_tail[ubatch.seq_id[s][0]];
+
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            uint32_t idx = size;
+
+            // append to the block of the sequence while it has room
+            if (tail != size && (tail + 1) % block_size != 0 && tail + 1 < size && avail[tail + 1]) {
+                idx = tail + 1;
+            }
+
+            // start a new block
+            if (idx == size) {
+                for (; next_blk < n_blocks; ++next_blk) {
+                    if (blk_used[next_blk] == 0) {
+                        idx = next_blk*block_size;
+                        break;
+                    }
+                }
+            }
+
+            // no empty blocks left - take any free cell
+            if (idx == size) {
+                for (; next_cell < size; ++next_cell) {
+                    if (avail[next_cell]) {
+                        idx = next_cell;
+                        break;
+                    }
+                }
+            }
+
+            GGML_ASSERT(idx < size && "KV paged find_slot bug: no free cell");
+
+            avail[idx] = false;
+            blk_used[idx/block_size]++;
+            tail = idx;
+
+            idxs.push_back(idx);
+        }
+    }
+
+    // with a fragmented cache the placement above can split the ubatch in many ranges - use the longest free runs instead
+    if (!find_slot_runs(is_free, n_tokens, idxs)) {
+        LLAMA_LOG_WARN("%s: the free cells are too fragmented for a ubatch of %d tokens - requesting defrag\n", __func__, n_tokens);
+
+        do_defrag = true;
+
+        return false;
+    }
+
+    apply_slot(ubatch, idxs);
+
     return true;
 }
 
+bool llama_kv_cache_unified::find_slot_swa(const llama_ubatch & ubatch, bool cont) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    if (n_tokens > size) {
+        LLAMA_LOG_ERROR("%s: n_tokens = %d > size = %d\n", __func__, n_tokens, size);
+        return false;
+    }
+
+    // the next position of each sequence - the cells that are n_swa or more positions before it are masked for all the new tokens
+    std::map<llama_seq_id, llama_pos> seq_next;
+
+    for (const auto & cell : cells) {
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            auto it = seq_next.emplace(seq_id, cell.pos + 1).first;
+            it->second = std::max(it->second, cell.pos + 1);
+        }
+    }
+
+    // a ubatch that goes back in a sequence needs the window before its first token
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            auto it = seq_next.find(ubatch.seq_id[s][j]);
+            if (it != seq_next.end()) {
+                it->second = std::min(it->second, ubatch.pos[s*n_seq_tokens]);
+            }
+        }
+    }
+
+    std::vector<bool> is_free(size);
+    for (uint32_t i = 0; i < size; ++i) {
+        const llama_kv_cell & cell = cells[i];
+
+        is_free[i] = true;
+        for (const llama_seq_id seq_id : cell.seq_id) {
+            if (seq_next.at(seq_id) - cell.pos < (llama_pos) n_swa) {
+                is_free[i] = false;
+                break;
+            }
+        }
+    }
+
+    // the cells that receive the tokens, in token order
+    std::vector<uint32_t> idxs;
+    idxs.reserve(n_tokens);
+
+    if (cont) {
+        for (uint32_t c0 = 0; c0 + n_tokens <= size && idxs.empty(); ++c0) {
+            uint32_t n = 0;
+            while (n < n_tokens && is_free[c0 + n]) {
+                n++;
+            }
+
+            if (n == n_tokens) {
+                for (uint32_t i = 0; i < n_tokens; ++i) {
+                    idxs.push_back(c0 + i);
+                }
+            } else {
+                c0 += n;
+            }
+        }
+    } else {
+        // go around the cache from the head, so that the oldest cells are reused first
+        for (uint32_t i = 0; i < size && idxs.size() < n_tokens; ++i) {
+            const uint32_t idx = (head + i) % size;
+            if (is_free[idx]) {
+                idxs.push_back(idx);
+            }
+        }
+    }
+
+    if (idxs.size() < n_tokens) {
+        return false;
+    }
+
+    if (!find_slot_runs(is_free, n_tokens, idxs)) {
+        LLAMA_LOG_WARN("%s: the reusable cells are too fragmented for a ubatch of %d tokens\n", __func__, n_tokens);
+        return false;
+    }
+
+    apply_slot(ubatch, idxs);
+
+    return true;
+}
+
+bool llama_kv_cache_unified::find_slot_runs(const std::vector<bool> & is_free, uint32_t n, std::vector<uint32_t> & idxs) const {
+    uint32_t n_ranges = idxs.empty() ? 0 : 1;
+    for (size_t i = 1; i < idxs.size(); ++i) {
+        n_ranges += idxs[i] != idxs[i - 1] + 1;
+    }
+
+    if (idxs.size() == n && n_ranges <= n_ubatch_ranges_max) {
+        return true;
+    }
+
+    // the runs of free cells, longest first
+    std::vector<slot_range> runs;
+    for (uint32_t i = 0; i < size; ++i) {
+        if (!is_free[i]) {
+            continue;
+        }
+
+        if (!runs.empty() && runs.back().c1 == i) {
+            runs.back().c1++;
+        } else {
+            runs.push_back({ i, i + 1 });
+        }
+    }
+
+    std::stable_sort(runs.begin(), runs.end(), [](const slot_range & a, const slot_range & b) {
+        return a.c1 - a.c0 > b.c1 - b.c0;
+    });
+
+    idxs.clear();
+
+    for (uint32_t r = 0; r < runs.size() && r < n_ubatch_ranges_max && idxs.size() < n; ++r) {
+        for (uint32_t i = runs[r].c0; i < runs[r].c1 && idxs.size() < n; ++i) {
+            idxs.push_back(i);
+        }
+    }
+
+    return idxs.size() == n;
+}
+
+void llama_kv_cache_unified::apply_slot(const llama_ubatch & ubatch, const std::vector<uint32_t> & idxs) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    GGML_ASSERT(idxs.size() == n_tokens);
+
+    // the last reused position of each sequence - its earlier positions are dropped too, so that the positions
+    // of a sequence from seq_pos_min() onwards are all present
+    std::map<llama_seq_id, llama_pos> seq_drop;
+
+    ubatch_ranges.clear();
+
+    for (uint32_t s = 0; s < n_seqs; s++) {
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k   = s*n_seq_tokens + i;
+            const uint32_t idx = idxs[k];
+
+            llama_kv_cell & cell = cells[idx];
+
+            if (cell.pos >= 0) {
+                GGML_ASSERT(n_swa > 0 && "KV find_slot bug: the cell is in use");
+
+                for (const llama_seq_id seq_id : cell.seq_id) {
+                    auto it = seq_drop.emplace(seq_id, cell.pos).first;
+                    it->second = std::max(it->second, cell.pos);
+                }
+
+                cell.seq_id.clear();
+                used--;
+            }
+
+            cell.pos = ubatch.pos[k];
+
+            for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
+                cell.seq_id.insert(ubatch.seq_id[s][j]);
+            }
+
+            if (!ubatch_ranges.empty() && ubatch_ranges.back().c1 == idx) {
+                ubatch_ranges.back().c1++;
+            } else {
+                ubatch_ranges.push_back({idx, idx + 1});
+            }
+        }
+    }
+
+    used += n_tokens;
+
+    if (!seq_drop.empty()) {
+        for (uint32_t i = 0; i < size; ++i) {
+            llama_kv_cell & cell = cells[i];
+
+            for (const auto & [seq_id, pos] : seq_drop) {
+                if (cell.pos <= pos && cell.has_seq_id(seq_id)) {
+                    cell.seq_id.erase(seq_id);
+                }
+            }
+
+            if (cell.pos >= 0 && cell.is_empty()) {
+                cell.pos = -1;
+                used--;
+            }
+        }
+    }
+
+    pending.ranges.insert(pending.ranges.end(), ubatch_ranges.begin(), ubatch_ranges.end());
+
+    head = ubatch_ranges.front().c0;
+}
+
 uint32_t llama_kv_cache_unified::get_padding(const llama_cparams & cparams) const {
     // the FA kernels require padding to avoid extra runtime boundary checks
     return cparams.flash_attn ? 256u : 32u;
 }
 
+const llama_kv_cache_unified * llama_kv_cache_unified::layer_cache(int32_t il) const {
+    return swa && k_l[il] == nullptr ? swa.get() : this;
+}
+
 uint32_t llama_kv_cache_unified::cell_max() const {
     for (uint32_t i = size; i > 0; --i) {
         const llama_kv_cell & cell = cells[i - 1];
@@ -746,20 +1166,20 @@ uint32_t llama_kv_cache_unified::cell_max() const {
 }
 
 size_t llama_kv_cache_unified::size_k_bytes() const {
-    size_t size_k_bytes = 0;
+    size_t size_k_bytes = swa ? swa->size_k_bytes() : 0;
 
     for (const auto & k : k_l) {
-        size_k_bytes += ggml_nbytes(k);
+        size_k_bytes += k ? ggml_nbytes(k) : 0;
     }
 
     return size_k_bytes;
 }
 
 size_t llama_kv_cache_unified::size_v_bytes() const {
-    size_t size_v_bytes = 0;
+    size_t size_v_bytes = swa ? swa->size_v_bytes() : 0;
 
     for (const auto & v : v_l) {
-        size_v_bytes += ggml_nbytes(v);
+        size_v_bytes += v ? ggml_nbytes(v) : 0;
     }
 
     return size_v_bytes;
@@ -938,6 +1358,10 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
 
     state_write_meta(io, cell_ranges, seq_id);
     state_write_data(io, cell_ranges);
+
+    if (swa) {
+        swa->state_write(io, seq_id);
+    }
 }
 
 void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
@@ -948,6 +1372,14 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
     res = res && state_read_meta(io, cell_count, seq_id);
     res = res && state_read_data(io, cell_count);
 
+    if (res && swa) {
+        uint32_t cell_count_swa;
+        io.read_to(&cell_count_swa, sizeof(cell_count_swa));
+
+        res = res && swa->state_read_meta(io, cell_count_swa, seq_id);
+        res = res && swa->state_read_data(io, cell_count_swa);
+    }
+
     if (!res) {
         if (seq_id == -1) {
             clear();
@@ -981,14 +1413,21 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
     const uint32_t v_trans = this->v_trans ? 1 : 0;
     const uint32_t n_layer = hparams.n_layer;
 
-    io.write(&v_trans, sizeof(v_trans));
-    io.write(&n_layer, sizeof(n_layer));
+    // the layers stored in this cache
+    const uint32_t n_layer_kv = std::count_if(k_l.begin(), k_l.end(), [](const ggml_tensor * k) { return k != nullptr; });
+
+    io.write(&v_trans,    sizeof(v_trans));
+    io.write(&n_layer_kv, sizeof(n_layer_kv));
 
     std::vector<uint8_t> tmp_buf;
 
     // Iterate and write all the keys first, each row is a cell
     // Get whole range at a time
     for (uint32_t il = 0; il < n_layer; ++il) {
+        if (k_l[il] == nullptr) {
+            continue;
+        }
+
         const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
 
         // Write key type
@@ -1009,6 +1448,10 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
 
     if (!v_trans) {
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (v_l[il] == nullptr) {
+                continue;
+            }
+
             const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
             // Write value type
@@ -1030,6 +1473,10 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
         // When v is transposed, we also need the element size and get the element ranges from each row
         const uint32_t kv_size = size;
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (v_l[il] == nullptr) {
+                continue;
+            }
+
             const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
             // Write value type
@@ -1086,7 +1533,9 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
         }
         batch.n_seq_id[0] = 1;
         batch.seq_id[0] = &dest_seq_id;
-        if (!find_slot(batch)) {
+
+        // the restored cells are read as one contiguous block, so do not use paged placement here
+        if (!(recurrent ? find_slot(batch) : n_swa > 0 ? find_slot_swa(batch, true) : find_slot_cont(batch))) {
             LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
             return false;
         }
@@ -1161,13 +1610,16 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
 }
 
 bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell_count) {
+    const uint32_t n_layer    = hparams.n_layer;
+    const uint32_t n_layer_kv = std::count_if(k_l.begin(), k_l.end(), [](const ggml_tensor * k) { return k != nullptr; });
+
     uint32_t v_trans;
-    uint32_t n_layer;
-    io.read_to(&v_trans, sizeof(v_trans));
-    io.read_to(&n_layer, sizeof(n_layer));
+    uint32_t n_layer_ref;
+    io.read_to(&v_trans,     sizeof(v_trans));
+    io.read_to(&n_layer_ref, sizeof(n_layer_ref));
 
-    if (n_layer != hparams.n_layer) {
-        LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer, hparams.n_layer);
+    if (n_layer_ref != n_layer_kv) {
+        LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer_ref, n_layer_kv);
         return false;
     }
     if (cell_count > size) {
@@ -1181,6 +1633,10 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
 
     // For each layer, read the keys for each cell, one row is one cell, read as one contiguous block
     for (uint32_t il = 0; il < n_layer; ++il) {
+        if (k_l[il] == nullptr) {
+            continue;
+        }
+
         const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
 
         // Read type of key
@@ -1209,6 +1665,10 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
 
     if (!v_trans) {
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (v_l[il] == nullptr) {
+                continue;
+            }
+
             const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
             // Read type of value
@@ -1237,6 +1697,10 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
     } else {
         // For each layer, read the values for each cell (transposed)
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (v_l[il] == nullptr) {
+                continue;
+            }
+
             const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
             // Read type of value
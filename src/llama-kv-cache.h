@@ -7,6 +7,7 @@
 #include "ggml-cpp.h"
 
 #include <functional>
+#include <memory>
 #include <set>
 #include <vector>
 
@@ -81,13 +82,15 @@ public:
     virtual ~llama_kv_cache_unified() = default;
 
     // TODO: become constructor
+    // filter - the layers that are stored in this cache (nullptr - all the layers)
     bool init(
             const llama_model & model,   // TODO: do not reference the model
           const llama_cparams & cparams,
                     ggml_type   type_k,
                     ggml_type   type_v,
                      uint32_t   kv_size,
-                         bool   offload);
+                         bool   offload,
+         std::function<bool(int32_t il)> filter = nullptr);
 
     int32_t get_n_tokens()   const override;
     int32_t get_used_cells() const override;
@@ -109,6 +112,7 @@ public:
     void seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos delta) override;
     void seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
 
+    llama_pos seq_pos_min(llama_seq_id seq_id) const override;
     llama_pos seq_pos_max(llama_seq_id seq_id) const override;
 
     bool get_can_shift() const override;
@@ -117,11 +121,15 @@ public:
     // updates the cache head
     // Note: On success, it's important that cache.head points
     // to the first cell of the slot.
+    // In paged mode the slot can be split into several ranges of cells (see ubatch_ranges)
     bool find_slot(const llama_ubatch & batch);
 
     // TODO: maybe not needed
     uint32_t get_padding(const llama_cparams & cparams) const;
 
+    // the cache that holds the KV of layer il
+    const llama_kv_cache_unified * layer_cache(int32_t il) const;
+
     // find how many cells are currently in use
     uint32_t cell_max() const;
 
@@ -149,6 +157,13 @@ public:
         std::vector<slot_range> ranges;
     } pending;
 
+    // the cells that receive the tokens of the last ubatch passed to find_slot, in token order
+    // with contiguous slots this is a single range starting at head
+    std::vector<slot_range> ubatch_ranges;
+
+    // max number of ranges in ubatch_ranges - the K/V store of each range adds a few nodes per layer to the graph
+    static constexpr uint32_t n_ubatch_ranges_max = 32;
+
     // state write/load
 
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const;
@@ -169,6 +184,21 @@ public:
     bool v_trans   = true;  // the value tensor is transposed
     bool can_shift = false;
 
+    // sliding window of the layers in this cache: the cells that are out of the window of all their sequences
+    // are reused by find_slot, the positions before a reused cell are dropped from its sequences as well
+    // 0 - no sliding window, the cells are only reused after they are removed
+    uint32_t n_swa = 0;
+
+    // the sliding-window layers are stored in this cache, sized for the window of each sequence
+    // the K/V tensors of these layers are nullptr in k_l/v_l of the parent cache
+    std::unique_ptr<llama_kv_cache_unified> swa;
+
+    // paged mode: the cells are grouped in blocks of block_size cells and the new tokens of a sequence
+    // are appended to the block holding its last cell, or to a fresh block when that one is full
+    // the slot of a ubatch does not need to be contiguous, so holes in the cache do not block find_slot
+    // 0 - disabled, the slot of a ubatch is a contiguous range of cells
+    uint32_t block_size = 0;
+
     // Note: The value of head isn't only used to optimize searching
     // for a free KV slot. llama_decode_impl also uses it, so it
     // cannot be freely changed after a slot has been allocated.
@@ -191,6 +221,20 @@ private:
     std::vector<ggml_context_ptr>        ctxs;
     std::vector<ggml_backend_buffer_ptr> bufs;
 
+    bool find_slot_cont (const llama_ubatch & ubatch);
+    bool find_slot_paged(const llama_ubatch & ubatch);
+
+    // cont - the slot must be a single range of cells
+    bool find_slot_swa(const llama_ubatch & ubatch, bool cont);
+
+    // pick n of the free cells, from the longest runs of free cells first, to keep the number of ranges low
+    // returns false if more than n_ubatch_ranges_max ranges are needed
+    bool find_slot_runs(const std::vector<bool> & is_free, uint32_t n, std::vector<uint32_t> & idxs) const;
+
+    // assign the cells idxs to the tokens of the ubatch and set ubatch_ranges
+    // the cells must be free, or out of the window of their sequences with n_swa > 0
+    void apply_slot(const llama_ubatch & ubatch, const std::vector<uint32_t> & idxs);
+
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
@@ -9,6 +9,8 @@
 #include <stdexcept>
 #include <cerrno>
 #include <algorithm>
+#include <mutex>
+#include <unordered_map>
 
 #ifdef __has_include
     #if __has_include(<unistd.h>)
@@ -126,6 +128,26 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            DWORD chunk_read = 0;
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) ((offset + bytes_read) >> 32);
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &ov);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -209,6 +231,31 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+#if defined(_POSIX_MAPPED_FILES)
+        const int fd = fileno(fp);
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            bytes_read += ret;
+        }
+#else
+        // no positional reads, serialize on the FILE lock
+        std::lock_guard<std::mutex> lock(read_at_mutex);
+        seek(offset, SEEK_SET);
+        read_raw(ptr, len);
+#endif
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -239,6 +286,9 @@ struct llama_file::impl {
 
     FILE * fp;
     size_t size;
+#if !defined(_WIN32) && !defined(_POSIX_MAPPED_FILES)
+    mutable std::mutex read_at_mutex;
+#endif
 };
 
 llama_file::llama_file(const char * fname, const char * mode) : pimpl(std::make_unique<impl>(fname, mode)) {}
@@ -261,6 +311,7 @@ int llama_file::file_id() const {
 
 void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
 void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, len); }
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
 
 uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
@@ -273,6 +324,10 @@ struct llama_mmap::impl {
 #ifdef _POSIX_MAPPED_FILES
     std::vector<std::pair<size_t, size_t>> mapped_fragments;
 
+    // number of locked ranges that partially cover each page, see lock()
+    mutable std::unordered_map<size_t, int> page_locks;
+    mutable std::mutex page_locks_mutex;
+
     impl(struct llama_file * file, size_t prefetch, bool numa) {
         size = file->size();
         int fd = file->file_id();
@@ -354,6 +409,120 @@ struct llama_mmap::impl {
         mapped_fragments = std::move(new_mapped_fragments);
     }
 
+    // page aligned part of [offset, offset + len), outer also includes the partial pages at the ends
+    void * page_range(size_t offset, size_t len, bool outer, size_t * n_bytes) const {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t first = std::min(offset, size);
+        size_t last  = std::min(offset + len, size);
+        if (outer) {
+            first = first & ~(page_size - 1);
+            last  = (last + page_size - 1) & ~(page_size - 1);
+        } else {
+            align_range(&first, &last, page_size);
+        }
+        *n_bytes = last - first;
+        return (uint8_t *) addr + first;
+    }
+
+    void prefetch(size_t offset, size_t len) const {
+        size_t n_bytes;
+        void * ptr = page_range(offset, len, true, &n_bytes);
+        if (n_bytes > 0 && posix_madvise(ptr, n_bytes, POSIX_MADV_WILLNEED)) {
+            LLAMA_LOG_WARN("warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n",
+                    strerror(errno));
+        }
+    }
+
+    void release(size_t offset, size_t len) const {
+        size_t n_bytes;
+        void * ptr = page_range(offset, len, false, &n_bytes);
+        if (n_bytes == 0) {
+            return;
+        }
+#ifdef MADV_COLD
+        // not supported before Linux 5.4, the hint is optional
+        madvise(ptr, n_bytes, MADV_COLD);
+#else
+        posix_madvise(ptr, n_bytes, POSIX_MADV_DONTNEED);
+#endif
+    }
+
+    // the pages at the ends of [offset, offset + len) that are only partially covered by the range
+    std::vector<size_t> partial_pages(size_t offset, size_t len) const {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t first = std::min(offset, size);
+        size_t last  = std::min(offset + len, size);
+
+        std::vector<size_t> res;
+        if (first % page_size != 0) {
+            res.push_back(first / page_size);
+        }
+        if (last % page_size != 0 && (res.empty() || res[0] != last / page_size)) {
+            res.push_back(last / page_size);
+        }
+        return res;
+    }
+
+    // mlock works on whole pages and the locked ranges can be adjacent, e.g. the experts of a tensor: the page at the end
+    // of a range can hold the start of the next one. the outer pages of a range are locked, and the partially covered
+    // pages are reference counted so that unlocking a range keeps the pages shared with the other locked ranges
+    bool lock(size_t offset, size_t len) const {
+#ifdef _POSIX_MEMLOCK_RANGE
+        size_t n_bytes;
+        void * ptr = page_range(offset, len, true, &n_bytes);
+        if (n_bytes == 0) {
+            return true;
+        }
+        if (mlock(ptr, n_bytes)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(page_locks_mutex);
+        for (size_t page : partial_pages(offset, len)) {
+            page_locks[page]++;
+        }
+        return true;
+#else
+        GGML_UNUSED(offset);
+        GGML_UNUSED(len);
+        return false;
+#endif
+    }
+
+    void unlock(size_t offset, size_t len) const {
+#ifdef _POSIX_MEMLOCK_RANGE
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t n_bytes;
+        uint8_t * first = (uint8_t *) page_range(offset, len, true, &n_bytes);
+        uint8_t * last  = first + n_bytes;
+        if (n_bytes == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(page_locks_mutex);
+        for (size_t page : partial_pages(offset, len)) {
+            auto it = page_locks.find(page);
+            GGML_ASSERT(it != page_locks.end() && "unlocking a range that is not locked");
+            if (--it->second == 0) {
+                page_locks.erase(it);
+                continue;
+            }
+            // still locked by another range
+            uint8_t * page_ptr = (uint8_t *) addr + page*page_size;
+            if (page_ptr == first) {
+                first += page_size;
+            }
+            if (page_ptr + page_size == last) {
+                last -= page_size;
+            }
+        }
+        if (last > first && munlock(first, last - first)) {
+            LLAMA_LOG_WARN("warning: failed to munlock buffer: %s\n", strerror(errno));
+        }
+#else
+        GGML_UNUSED(offset);
+        GGML_UNUSED(len);
+#endif
+    }
+
     ~impl() {
         for (const auto & frag : mapped_fragments) {
             if (munmap((char *) addr + frag.first, frag.second - frag.first)) {
@@ -386,31 +555,59 @@ struct llama_mmap::impl {
 
         if (prefetch > 0) {
 #if _WIN32_WINNT >= 0x602
-            BOOL (WINAPI *pPrefetchVirtualMemory) (HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
-            HMODULE hKernel32 = GetModuleHandleW(L"kernel32.dll");
-
-            pPrefetchVirtualMemory = (decltype(pPrefetchVirtualMemory))(void *) GetProcAddress(hKernel32, "PrefetchVirtualMemory");
-
-            if (pPrefetchVirtualMemory) {
-                WIN32_MEMORY_RANGE_ENTRY range;
-                range.VirtualAddress = addr;
-                range.NumberOfBytes = (SIZE_T) std::min(size, prefetch);
-                if (!pPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
-                    LLAMA_LOG_WARN("warning: PrefetchVirtualMemory failed: %s\n",
-                            llama_format_win_err(GetLastError()).c_str());
-                }
-            }
+            prefetch_range(addr, std::min(size, prefetch));
 #else
             throw std::runtime_error("PrefetchVirtualMemory unavailable");
 #endif
         }
     }
 
+#if _WIN32_WINNT >= 0x602
+    static void prefetch_range(void * ptr, size_t len) {
+        BOOL (WINAPI *pPrefetchVirtualMemory) (HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+        HMODULE hKernel32 = GetModuleHandleW(L"kernel32.dll");
+
+        pPrefetchVirtualMemory = (decltype(pPrefetchVirtualMemory))(void *) GetProcAddress(hKernel32, "PrefetchVirtualMemory");
+
+        if (pPrefetchVirtualMemory) {
+            WIN32_MEMORY_RANGE_ENTRY range;
+            range.VirtualAddress = ptr;
+            range.NumberOfBytes = (SIZE_T) len;
+            if (!pPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+                LLAMA_LOG_WARN("warning: PrefetchVirtualMemory failed: %s\n",
+                        llama_format_win_err(GetLastError()).c_str());
+            }
+        }
+    }
+#endif
+
     void unmap_fragment(size_t first, size_t last) {
         GGML_UNUSED(first);
         GGML_UNUSED(last);
     }
 
+    void prefetch(size_t offset, size_t len) const {
+#if _WIN32_WINNT >= 0x602
+        prefetch_range((uint8_t *) addr + offset, std::min(len, size - offset));
+#else
+        GGML_UNUSED(offset);
+        GGML_UNUSED(len);
+#endif
+    }
+
+    void release(size_t offset, size_t len) const {
+        GGML_UNUSED(offset);
+        GGML_UNUSED(len);
+    }
+
+    bool lock(size_t offset, size_t len) const {
+        return VirtualLock((uint8_t *) addr + offset, std::min(len, size - offset));
+    }
+
+    void unlock(size_t offset, size_t len) const {
+        VirtualUnlock((uint8_t *) addr + offset, std::min(len, size - offset));
+    }
+
     ~impl() {
         if (!UnmapViewOfFile(addr)) {
             LLAMA_LOG_WARN("warning: UnmapViewOfFile failed: %s\n",
@@ -432,6 +629,27 @@ struct llama_mmap::impl {
 
         throw std::runtime_error("mmap not supported");
     }
+
+    void prefetch(size_t offset, size_t len) const {
+        GGML_UNUSED(offset);
+        GGML_UNUSED(len);
+    }
+
+    void release(size_t offset, size_t len) const {
+        GGML_UNUSED(offset);
+        GGML_UNUSED(len);
+    }
+
+    bool lock(size_t offset, size_t len) const {
+        GGML_UNUSED(offset);
+        GGML_UNUSED(len);
+        return false;
+    }
+
+    void unlock(size_t offset, size_t len) const {
+        GGML_UNUSED(offset);
+        GGML_UNUSED(len);
+    }
 #endif
 
     void * addr;
@@ -446,6 +664,11 @@ void * llama_mmap::addr() const { return pimpl->addr; }
 
 void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
 
+void llama_mmap::prefetch(size_t offset, size_t len) const { pimpl->prefetch(offset, len); }
+void llama_mmap::release (size_t offset, size_t len) const { pimpl->release (offset, len); }
+bool llama_mmap::lock    (size_t offset, size_t len) const { return pimpl->lock(offset, len); }
+void llama_mmap::unlock  (size_t offset, size_t len) const { pimpl->unlock  (offset, len); }
+
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
 #else
@@ -26,6 +26,9 @@ struct llama_file {
     void read_raw(void * ptr, size_t len) const;
     uint32_t read_u32() const;
 
+    // read len bytes at offset without moving the file position, can be called from multiple threads
+    void read_raw_at(void * ptr, size_t len, size_t offset) const;
+
     void write_raw(const void * ptr, size_t len) const;
     void write_u32(uint32_t val) const;
 
@@ -44,6 +47,12 @@ struct llama_mmap {
 
     void unmap_fragment(size_t first, size_t last);
 
+    // hints for a range of the mapping, used to page parts of the model on demand
+    void prefetch(size_t offset, size_t len) const; // start reading the range in the background
+    void release (size_t offset, size_t len) const; // the range is not needed soon, its pages can be reclaimed first
+    bool lock    (size_t offset, size_t len) const; // keep the range in memory
+    void unlock  (size_t offset, size_t len) const;
+
     static const bool SUPPORTED;
 
 private:
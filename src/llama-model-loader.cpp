@@ -2,10 +2,18 @@
 
 #include "ggml.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
 #include <future>
+#include <mutex>
+#include <random>
+#include <thread>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
@@ -64,6 +72,18 @@ static std::string llama_model_ftype_name(llama_ftype ftype) {
     }
 }
 
+// tensors in the extra buffer types of the CPU backend are converted to a different layout by set_tensor
+// the converted data is stored in host memory and can be copied as is to and from the repack cache
+static bool llama_tensor_is_repacked(const struct ggml_tensor * t) {
+    if (t->buffer == nullptr) {
+        return false;
+    }
+    ggml_backend_buffer_type_t buft = ggml_backend_buffer_get_type(t->buffer);
+    ggml_backend_dev_t dev = ggml_backend_buft_get_device(buft);
+    return dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU &&
+        buft != ggml_backend_dev_buffer_type(dev) && !ggml_backend_buft_is_host(buft);
+}
+
 // return a list of splits for a given path
 // for example, given "<name>-00002-of-00004.gguf", returns list of all 4 splits
 static std::vector<std::string> llama_get_list_splits(const std::string & path, const int idx, const int n_split) {
@@ -891,6 +911,7 @@ bool llama_model_loader::load_all_data(
 
     std::vector<no_init<uint8_t>> read_buf;
     std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
+    std::vector<ggml_tensor *> parallel_tensors;
 
     // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
     // NVMe raid configurations might require more / larger buffers.
@@ -996,6 +1017,15 @@ bool llama_model_loader::load_all_data(
 
         size_t n_size = ggml_nbytes(cur);
 
+        if (!repack_cache_path.empty() && llama_tensor_is_repacked(cur)) {
+            repack_cache_tensors.push_back(cur);
+            if (load_repacked(cur)) {
+                size_done += n_size;
+                continue;
+            }
+            repack_cache_dirty = true;
+        }
+
         if (use_mmap) {
             const auto & mapping = mappings.at(weight->idx);
             ggml_backend_buffer_t buf_mmap = nullptr;
@@ -1026,14 +1056,10 @@ bool llama_model_loader::load_all_data(
             }
         } else {
             const auto & file = files.at(weight->idx);
-            if (ggml_backend_buffer_is_host(cur->buffer)) {
-                file->seek(weight->offs, SEEK_SET);
-                file->read_raw(cur->data, n_size);
-                if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                        return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                    }));
-                }
+            if (ggml_backend_buffer_is_host(cur->buffer) || llama_tensor_is_repacked(cur)) {
+                // read later with multiple threads, see load_data_parallel
+                parallel_tensors.push_back(cur);
+                continue;
             } else {
                 // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
                 if (upload_backend) {
@@ -1078,6 +1104,10 @@ bool llama_model_loader::load_all_data(
     }
     ggml_backend_free(upload_backend);
 
+    if (!parallel_tensors.empty() && !load_data_parallel(parallel_tensors, progress_callback, progress_callback_user_data)) {
+        return false;
+    }
+
     // check validation results
     bool validation_failed = false;
     for (auto & future : validation_result) {
@@ -1114,6 +1144,366 @@ bool llama_model_loader::load_all_data(
     return true;
 }
 
+bool llama_model_loader::load_data_parallel(
+        const std::vector<ggml_tensor *> & tensors,
+        llama_progress_callback progress_callback,
+        void * progress_callback_user_data) {
+    // the tensors are split in chunks that are read with positional reads by a pool of threads, so that a single
+    // synchronous reader does not limit the load throughput on fast storage
+    // the tensors of the extra buffer types are staged in memory and repacked by the thread that reads their last chunk
+    // the reads are mostly waiting on the storage, so a few threads are used even on machines with fewer cores
+    constexpr size_t chunk_size  = 16 * 1024 * 1024; // 16MB
+    constexpr size_t min_threads = 4;
+    constexpr size_t max_threads = 8;
+
+    struct pending_tensor {
+        ggml_tensor * tensor;
+        const llama_tensor_weight * weight;
+        size_t n_size;
+        std::vector<no_init<uint8_t>> staging; // only used if the buffer is not host memory
+        std::atomic<size_t> n_chunks_left;
+    };
+
+    std::vector<pending_tensor> pending(tensors.size());
+    size_t n_chunks = 0;
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        auto & p = pending[i];
+        p.tensor = tensors[i];
+        p.weight = &require_weight(ggml_get_name(p.tensor));
+        p.n_size = ggml_nbytes(p.tensor);
+        p.n_chunks_left = std::max<size_t>(1, (p.n_size + chunk_size - 1) / chunk_size);
+        n_chunks += p.n_chunks_left;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t next_tensor = 0;
+    size_t next_offs   = 0;
+    size_t n_chunks_done = 0;
+    std::atomic<size_t> n_bytes_done = 0;
+    std::atomic<bool> stop = false;
+    std::exception_ptr error;
+    std::vector<ggml_tensor *> invalid_tensors;
+
+    // returns the tensor and the offset of the next chunk to read, or false if there are no more chunks
+    auto next_chunk = [&](pending_tensor ** p, size_t * offs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (next_tensor == pending.size()) {
+            return false;
+        }
+        *p    = &pending[next_tensor];
+        *offs = next_offs;
+        if (next_offs == 0 && !ggml_backend_buffer_is_host((*p)->tensor->buffer)) {
+            (*p)->staging.resize((*p)->n_size);
+        }
+        next_offs += chunk_size;
+        if (next_offs >= (*p)->n_size) {
+            next_tensor++;
+            next_offs = 0;
+        }
+        return true;
+    };
+
+    auto worker = [&]() {
+        try {
+            pending_tensor * p;
+            size_t offs;
+            while (!stop && next_chunk(&p, &offs)) {
+                const size_t n_read = std::min(chunk_size, p->n_size - offs);
+                uint8_t * data = p->staging.empty() ? (uint8_t *) p->tensor->data : (uint8_t *) p->staging.data();
+
+                files.at(p->weight->idx)->read_raw_at(data + offs, n_read, p->weight->offs + offs);
+                n_bytes_done += n_read;
+
+                if (p->n_chunks_left.fetch_sub(1) == 1) {
+                    // last chunk of this tensor
+                    if (check_tensors && !ggml_validate_row_data(p->tensor->type, data, p->n_size)) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        invalid_tensors.push_back(p->tensor);
+                    }
+                    if (!p->staging.empty()) {
+                        ggml_backend_tensor_set(p->tensor, data, 0, p->n_size);
+                        p->staging.clear();
+                        p->staging.shrink_to_fit();
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    n_chunks_done++;
+                }
+                cv.notify_one();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            stop = true;
+            cv.notify_one();
+        }
+    };
+
+    const int n_threads = (int) std::min(n_chunks, std::clamp<size_t>(std::thread::hardware_concurrency(), min_threads, max_threads));
+
+    LLAMA_LOG_DEBUG("%s: reading %zu tensors in %zu chunks with %d threads\n", __func__, pending.size(), n_chunks, n_threads);
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads);
+    for (int i = 0; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    // report the progress from the calling thread
+    bool cancelled = false;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (n_chunks_done < n_chunks && !stop) {
+            cv.wait_for(lock, std::chrono::milliseconds(100));
+            if (progress_callback) {
+                lock.unlock();
+                if (!progress_callback((float) (size_done + n_bytes_done) / size_data, progress_callback_user_data)) {
+                    cancelled = true;
+                    stop = true;
+                }
+                lock.lock();
+            }
+        }
+    }
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (cancelled) {
+        return false;
+    }
+
+    for (auto * t : invalid_tensors) {
+        LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(t));
+    }
+    if (!invalid_tensors.empty()) {
+        throw std::runtime_error("found tensors with invalid data");
+    }
+
+    size_done += n_bytes_done;
+
+    return true;
+}
+
+#define LLAMA_REPACK_CACHE_KEY  "repack_cache.key"
+#define LLAMA_REPACK_CACHE_BUFT "repack_cache.buft" // buffer type of each tensor, in the order of the tensors
+
+void llama_model_loader::init_repack_cache(const std::string & path) {
+    repack_cache_path = path;
+
+    // the layout of the repacked tensors depends on the model tensors and on the CPU features used by the backend
+    // the model files are not hashed in full to keep the cold start fast: the key covers the GGUF metadata, the
+    // tensor metadata and a few samples of the data of each tensor, so that a model re-converted with the same
+    // shapes does not load stale tensors
+    uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+    auto hash_add = [&hash](const void * data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= ((const uint8_t *) data)[i];
+            hash *= 0x100000001b3ULL;
+        }
+    };
+    auto hash_str = [&hash_add](const char * str) {
+        hash_add(str, strlen(str) + 1);
+    };
+
+    for (const auto & file : files) {
+        const size_t size = file->size();
+        hash_add(&size, sizeof(size));
+    }
+    {
+        std::vector<uint8_t> meta_data(gguf_get_meta_size(meta.get()));
+        gguf_get_meta_data(meta.get(), meta_data.data());
+        hash_add(meta_data.data(), meta_data.size());
+    }
+
+    const size_t n_sample = 256;
+    std::vector<uint8_t> sample(n_sample);
+
+    for (const auto & it : weights_map) {
+        const llama_tensor_weight & w = it.second;
+        hash_str(it.first.c_str());
+        hash_add(&w.idx,  sizeof(w.idx));
+        hash_add(&w.offs, sizeof(w.offs));
+        hash_add(&w.tensor->type, sizeof(w.tensor->type));
+        hash_add(w.tensor->ne, sizeof(w.tensor->ne));
+
+        // the start, the middle and the end of the data
+        const size_t n_size = ggml_nbytes(w.tensor);
+        const size_t n_read = std::min(n_sample, n_size);
+        for (size_t offs : { (size_t) 0, (n_size - n_read)/2, n_size - n_read }) {
+            files[w.idx]->seek(w.offs + offs, SEEK_SET);
+            files[w.idx]->read_raw(sample.data(), n_read);
+            hash_add(sample.data(), n_read);
+        }
+    }
+
+    ggml_backend_dev_t cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (cpu_dev) {
+        ggml_backend_reg_t cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
+        auto get_features_fn = (ggml_backend_get_features_t) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_get_features");
+        if (get_features_fn) {
+            for (ggml_backend_feature * f = get_features_fn(cpu_reg); f->name; f++) {
+                hash_str(f->name);
+                hash_str(f->value);
+            }
+        }
+    }
+
+    repack_cache_key = format("%016" PRIx64, hash);
+
+    FILE * f = ggml_fopen(path.c_str(), "rb");
+    if (!f) {
+        LLAMA_LOG_INFO("%s: repack cache '%s' not found, it will be created\n", __func__, path.c_str());
+        return;
+    }
+    fclose(f);
+
+    ggml_context * ctx = nullptr;
+    gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx,
+    };
+
+    gguf_context_ptr meta(gguf_init_from_file(path.c_str(), params));
+    if (!meta) {
+        LLAMA_LOG_WARN("%s: failed to read repack cache '%s', it will be recreated\n", __func__, path.c_str());
+        return;
+    }
+    repack_cache_ctx.reset(ctx);
+
+    const int64_t key_id = gguf_find_key(meta.get(), LLAMA_REPACK_CACHE_KEY);
+    if (key_id < 0 || gguf_get_kv_type(meta.get(), key_id) != GGUF_TYPE_STRING ||
+        repack_cache_key != gguf_get_val_str(meta.get(), key_id)) {
+        LLAMA_LOG_INFO("%s: repack cache '%s' was created for a different model or CPU, it will be recreated\n", __func__, path.c_str());
+        repack_cache_ctx.reset();
+        return;
+    }
+
+    const int64_t buft_id = gguf_find_key(meta.get(), LLAMA_REPACK_CACHE_BUFT);
+    if (buft_id < 0 || gguf_get_kv_type(meta.get(), buft_id) != GGUF_TYPE_ARRAY || gguf_get_arr_type(meta.get(), buft_id) != GGUF_TYPE_STRING ||
+        gguf_get_arr_n(meta.get(), buft_id) != (size_t) gguf_get_n_tensors(meta.get())) {
+        LLAMA_LOG_INFO("%s: repack cache '%s' has an old format, it will be recreated\n", __func__, path.c_str());
+        repack_cache_ctx.reset();
+        return;
+    }
+
+    try {
+        repack_cache_file = std::make_unique<llama_file>(path.c_str(), "rb");
+        if (llama_mmap::SUPPORTED) {
+            repack_cache_mapping = std::make_unique<llama_mmap>(repack_cache_file.get());
+        }
+    } catch (const std::exception & e) {
+        LLAMA_LOG_WARN("%s: failed to open repack cache '%s': %s\n", __func__, path.c_str(), e.what());
+        repack_cache_mapping.reset();
+        repack_cache_file.reset();
+        repack_cache_ctx.reset();
+        return;
+    }
+
+    repack_cache_meta = std::move(meta);
+
+    LLAMA_LOG_INFO("%s: using repack cache '%s' with %" PRId64 " tensors\n", __func__, path.c_str(), gguf_get_n_tensors(repack_cache_meta.get()));
+}
+
+bool llama_model_loader::load_repacked(struct ggml_tensor * cur) const {
+    if (!repack_cache_meta) {
+        return false;
+    }
+
+    const int64_t tensor_id = gguf_find_tensor(repack_cache_meta.get(), ggml_get_name(cur));
+    if (tensor_id < 0) {
+        return false;
+    }
+
+    // the repacked layout fills the whole allocation of the tensor, which can be larger than the tensor (e.g. AMX)
+    ggml_backend_buffer_type_t buft = ggml_backend_buffer_get_type(cur->buffer);
+
+    const size_t n_size = ggml_backend_buft_get_alloc_size(buft, cur);
+
+    const ggml_tensor * meta = ggml_get_tensor(repack_cache_ctx.get(), ggml_get_name(cur));
+    if (meta == nullptr || meta->type != GGML_TYPE_I8 || (size_t) ggml_nelements(meta) != n_size ||
+        strcmp(gguf_get_arr_str(repack_cache_meta.get(), gguf_find_key(repack_cache_meta.get(), LLAMA_REPACK_CACHE_BUFT), tensor_id), ggml_backend_buft_name(buft)) != 0) {
+        return false;
+    }
+
+    const size_t offs   = gguf_get_data_offset(repack_cache_meta.get()) + gguf_get_tensor_offset(repack_cache_meta.get(), tensor_id);
+    if (offs + n_size > repack_cache_file->size()) {
+        return false;
+    }
+
+    if (repack_cache_mapping) {
+        memcpy(cur->data, (const uint8_t *) repack_cache_mapping->addr() + offs, n_size);
+    } else {
+        repack_cache_file->seek(offs, SEEK_SET);
+        repack_cache_file->read_raw(cur->data, n_size);
+    }
+
+    return true;
+}
+
+void llama_model_loader::save_repack_cache() {
+    repack_cache_mapping.reset();
+    repack_cache_file.reset();
+    repack_cache_meta.reset();
+    repack_cache_ctx.reset();
+
+    if (repack_cache_path.empty() || !repack_cache_dirty || repack_cache_tensors.empty()) {
+        return;
+    }
+
+    gguf_context_ptr ctx(gguf_init_empty());
+    gguf_set_val_str(ctx.get(), LLAMA_REPACK_CACHE_KEY, repack_cache_key.c_str());
+
+    // the repacked data is stored as bytes, with the size of the allocation of the tensor in its buffer type
+    ggml_init_params params = {
+        /*.mem_size   =*/ repack_cache_tensors.size()*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context_ptr ctx_data(ggml_init(params));
+
+    std::vector<const char *> bufts;
+    for (auto * t : repack_cache_tensors) {
+        ggml_backend_buffer_type_t buft = ggml_backend_buffer_get_type(t->buffer);
+
+        // the extra buffer types do not implement get_tensor, write the repacked data directly from host memory
+        ggml_tensor * t_data = ggml_new_tensor_1d(ctx_data.get(), GGML_TYPE_I8, ggml_backend_buft_get_alloc_size(buft, t));
+        ggml_set_name(t_data, ggml_get_name(t));
+        t_data->data = t->data;
+        gguf_add_tensor(ctx.get(), t_data);
+
+        bufts.push_back(ggml_backend_buft_name(buft));
+    }
+    gguf_set_arr_str(ctx.get(), LLAMA_REPACK_CACHE_BUFT, bufts.data(), bufts.size());
+
+    // write to a temporary file and rename it, so that other processes loading the same model never see a partial cache
+    const std::string path_tmp = format("%s.%08x.tmp", repack_cache_path.c_str(), (uint32_t) std::random_device{}());
+    if (!gguf_write_to_file(ctx.get(), path_tmp.c_str(), false)) {
+        LLAMA_LOG_WARN("%s: failed to write repack cache '%s'\n", __func__, path_tmp.c_str());
+        std::remove(path_tmp.c_str());
+        return;
+    }
+#ifdef _WIN32
+    std::remove(repack_cache_path.c_str());
+#endif
+    if (std::rename(path_tmp.c_str(), repack_cache_path.c_str()) != 0) {
+        LLAMA_LOG_WARN("%s: failed to rename '%s' to '%s'\n", __func__, path_tmp.c_str(), repack_cache_path.c_str());
+        std::remove(path_tmp.c_str());
+        return;
+    }
+
+    LLAMA_LOG_INFO("%s: saved %zu repacked tensors to '%s'\n", __func__, repack_cache_tensors.size(), repack_cache_path.c_str());
+}
+
 std::string llama_model_loader::ftype_name() const {
     return llama_model_ftype_name(ftype);
 }
@@ -91,6 +91,16 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
+    // cache of the tensors repacked by the CPU extra buffer types
+    std::string                 repack_cache_path;
+    std::string                 repack_cache_key;
+    gguf_context_ptr            repack_cache_meta;
+    ggml_context_ptr            repack_cache_ctx;
+    std::unique_ptr<llama_file> repack_cache_file;
+    std::unique_ptr<llama_mmap> repack_cache_mapping;
+    std::vector<ggml_tensor *>  repack_cache_tensors; // all repacked tensors loaded so far
+    bool                        repack_cache_dirty = false; // some tensors were repacked instead of loaded from the cache
+
     llama_model_loader(
         const std::string & fname,
         std::vector<std::string> & splits, // optional, only need if the split does not follow naming scheme
@@ -163,6 +173,23 @@ struct llama_model_loader {
             llama_progress_callback progress_callback,
             void * progress_callback_user_data);
 
+    // read the tensors from the model files with multiple threads, used by load_all_data without mmap
+    // the tensors must be in host buffers or in the extra buffer types of the CPU backend
+    // returns false if cancelled by progress_callback
+    bool load_data_parallel(
+            const std::vector<ggml_tensor *> & tensors,
+            llama_progress_callback progress_callback,
+            void * progress_callback_user_data);
+
+    // open the repack cache at path if it was created for this model and the current CPU features
+    void init_repack_cache(const std::string & path);
+
+    // copy the repacked data of cur from the repack cache, returns false if it is not in the cache
+    bool load_repacked(struct ggml_tensor * cur) const;
+
+    // write the repack cache if some of the repacked tensors were not found in it
+    void save_repack_cache();
+
     std::string ftype_name() const;
 
     void print_info() const;
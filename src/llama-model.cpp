@@ -2,6 +2,7 @@
 
 #include "llama-impl.h"
 #include "llama-mmap.h"
+#include "llama-expert-pager.h"
 #include "llama-batch.h"
 #include "llama-cparams.h"
 #include "llama-model-loader.h"
@@ -360,6 +361,9 @@ struct llama_model::impl {
     // model memory mapped files
     llama_mmaps mappings;
 
+    // pages the experts from the mappings
+    std::unique_ptr<llama_expert_pager> expert_pager;
+
     // objects representing data potentially being locked in memory
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
@@ -1426,6 +1430,13 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     const bool use_mmap_buffer = true;
 
+    // the experts are kept in the mapped files and paged on demand
+    bool use_expert_paging = params.n_expert_resident > 0 && hparams.n_expert > 0;
+    if (use_expert_paging && (!ml.use_mmap || use_mlock)) {
+        LLAMA_LOG_WARN("%s: expert paging requires mmap without mlock, disabling\n", __func__);
+        use_expert_paging = false;
+    }
+
     LLAMA_LOG_INFO("%s: loading model tensors, this can take a while... (mmap = %s)\n", __func__, ml.use_mmap ? "true" : "false");
 
     // build a list of buffer types for the CPU and GPU devices
@@ -1643,6 +1654,12 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                 if (!buft) {
                     throw std::runtime_error(format("failed to find a compatible buffer type for tensor %s", tn.str().c_str()));
                 }
+
+                // the experts in the extra CPU buffer types (repacked) would be copied out of the mapped file
+                auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+                if (use_expert_paging && op == GGML_OP_MUL_MAT_ID && ggml_backend_buft_get_device(buft) == cpu_dev) {
+                    buft = ggml_backend_dev_buffer_type(cpu_dev);
+                }
             }
 
             // avoid using a host buffer when using mmap
@@ -4051,7 +4068,8 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr);
+    // with expert paging, the experts are read when they are routed to instead of prefetching the whole file
+    ml.init_mappings(!use_expert_paging, use_mlock ? &pimpl->mlock_mmaps : nullptr);
     pimpl->mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -4161,6 +4179,10 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    if (params.repack_cache) {
+        ml.init_repack_cache(params.repack_cache);
+    }
+
     // load tensor data
     for (auto & it : ctx_bufs) {
         ggml_context * ctx = it.first;
@@ -4170,12 +4192,18 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    ml.save_repack_cache();
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             pimpl->mappings.emplace_back(std::move(mapping));
         }
     }
 
+    if (use_expert_paging) {
+        pimpl->expert_pager = llama_expert_pager::init(*this, pimpl->mappings, params.n_expert_resident);
+    }
+
     return true;
 }
 
@@ -4404,6 +4432,10 @@ bool llama_model::has_tensor_overrides() const {
     return pimpl->has_tensor_overrides;
 }
 
+llama_expert_pager * llama_model::get_expert_pager() const {
+    return pimpl->expert_pager.get();
+}
+
 const ggml_tensor * llama_model::get_tensor(const char * name) const {
     auto it = std::find_if(tensors_by_name.begin(), tensors_by_name.end(),
             [name](const std::pair<std::string, ggml_tensor *> & it) {
@@ -13064,6 +13096,9 @@ llm_graph_result_ptr llama_model::build_graph(
     // add on pooling layer
     llm->build_pooling(gf, cls, cls_b, cls_out, cls_out_b);
 
+    // add on the log-probabilities of the outputs
+    llm->build_logprobs(gf);
+
     return std::move(llm->res);
 }
 
@@ -13082,6 +13117,8 @@ llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.repack_cache                =*/ nullptr,
+        /*.n_expert_resident           =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
@@ -13128,6 +13165,10 @@ int32_t llama_model_n_head_kv(const llama_model * model) {
     return model->hparams.n_head_kv();
 }
 
+int32_t llama_model_n_swa(const llama_model * model) {
+    return model->hparams.n_swa_pattern > 1 && model->hparams.n_attn_chunk == 0 ? model->hparams.n_swa : 0;
+}
+
 // deprecated
 int32_t llama_n_ctx_train(const llama_model * model) {
     return llama_model_n_ctx_train(model);
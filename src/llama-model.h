@@ -15,6 +15,7 @@
 struct llama_cparams;
 struct llama_ubatch;
 struct llama_model_loader;
+struct llama_expert_pager;
 
 // available models
 enum llm_type {
@@ -390,6 +391,9 @@ struct llama_model {
 
     const struct ggml_tensor * get_tensor(const char * name) const;
 
+    // nullptr if the experts are not paged
+    llama_expert_pager * get_expert_pager() const;
+
     // TODO: move this to new llm_arch_model_i interface
     llama_memory_i * create_memory() const; // TODO: params
 
@@ -1,6 +1,7 @@
 #include "llama-vocab.h"
 
 #include "llama-impl.h"
+#include "llama-grammar.h"
 #include "llama-model-loader.h"
 
 #include "unicode.h"
@@ -13,6 +14,7 @@
 #include <cstring>
 #include <forward_list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
 #include <unordered_map>
@@ -1268,6 +1270,9 @@ struct llama_vocab::impl {
 
     std::vector<llama_token> cache_special_tokens;
     std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    std::mutex                                grammar_trie_mutex;
+    std::shared_ptr<const llama_grammar_trie> grammar_trie;
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -3030,6 +3035,16 @@ const std::string & llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
 
+std::shared_ptr<const llama_grammar_trie> llama_vocab::get_grammar_trie() const {
+    std::lock_guard<std::mutex> lock(pimpl->grammar_trie_mutex);
+
+    if (!pimpl->grammar_trie) {
+        pimpl->grammar_trie = llama_grammar_trie_init(*this);
+    }
+
+    return pimpl->grammar_trie;
+}
+
 int32_t llama_vocab::token_to_piece(llama_token token, char * buf, int32_t length, int32_t lstrip, bool special) const {
     return pimpl->token_to_piece(token, buf, length, lstrip, special);
 }
@@ -8,6 +8,7 @@
 
 struct LLM_KV;
 struct llama_model_loader;
+struct llama_grammar_trie;
 
 struct llama_vocab {
     struct token_data {
@@ -105,6 +106,9 @@ struct llama_vocab {
     // use cached data
     const std::string & token_to_piece(llama_token token) const;
 
+    // prefix trie of the token pieces used by grammar sampling, built on first use
+    std::shared_ptr<const llama_grammar_trie> get_grammar_trie() const;
+
     int32_t detokenize(
             const llama_token * tokens,
                       int32_t   n_tokens,
@@ -1,9 +1,14 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <random>
+#include <string>
+#include <vector>
 
 #include "get-model.h"
 
+#include "gguf.h"
+
 char * get_model_or_exit(int argc, char *argv[]) {
     char * model_path;
     if (argc > 1) {
@@ -19,3 +24,146 @@ char * get_model_or_exit(int argc, char *argv[]) {
 
     return model_path;
 }
+
+bool make_tiny_model(const char * fname, const char * fname_vocab, const tiny_model_params & params) {
+    gguf_init_params vparams = {
+        /* .no_alloc = */ true,
+        /* .ctx      = */ nullptr,
+    };
+
+    gguf_context * vocab = gguf_init_from_file(fname_vocab, vparams);
+    if (!vocab) {
+        fprintf(stderr, "%s: failed to read the vocab from %s\n", __func__, fname_vocab);
+        return false;
+    }
+
+    const int64_t id_tokens = gguf_find_key(vocab, "tokenizer.ggml.tokens");
+    if (id_tokens < 0) {
+        gguf_free(vocab);
+        return false;
+    }
+
+    const int n_vocab = gguf_get_arr_n(vocab, id_tokens);
+    const bool gemma3 = strcmp(params.arch, "gemma3") == 0;
+
+    gguf_context * gguf = gguf_init_empty();
+
+    // keep only the tokenizer of the vocab file
+    gguf_set_kv(gguf, vocab);
+    for (int64_t i = gguf_get_n_kv(gguf) - 1; i >= 0; i--) {
+        const std::string key = gguf_get_key(gguf, i);
+        if (key.rfind("tokenizer.", 0) != 0) {
+            gguf_remove_key(gguf, key.c_str());
+        }
+    }
+    gguf_free(vocab);
+
+    const std::string arch = params.arch;
+
+    const int n_embd_head = params.n_embd/params.n_head;
+
+    gguf_set_val_str(gguf, "general.architecture", params.arch);
+    gguf_set_val_str(gguf, "general.name",         "tiny");
+    gguf_set_val_u32(gguf, (arch + ".context_length").c_str(),                   4096);
+    gguf_set_val_u32(gguf, (arch + ".embedding_length").c_str(),                 params.n_embd);
+    gguf_set_val_u32(gguf, (arch + ".block_count").c_str(),                      params.n_layer);
+    gguf_set_val_u32(gguf, (arch + ".feed_forward_length").c_str(),              params.n_ff);
+    gguf_set_val_u32(gguf, (arch + ".attention.head_count").c_str(),             params.n_head);
+    gguf_set_val_u32(gguf, (arch + ".attention.head_count_kv").c_str(),          params.n_head_kv);
+    gguf_set_val_f32(gguf, (arch + ".attention.layer_norm_rms_epsilon").c_str(), 1e-5f);
+    gguf_set_val_u32(gguf, (arch + ".rope.dimension_count").c_str(),             n_embd_head);
+    if (gemma3) {
+        gguf_set_val_u32(gguf, (arch + ".attention.sliding_window").c_str(), params.n_swa);
+    }
+    if (params.n_expert > 0) {
+        gguf_set_val_u32(gguf, (arch + ".expert_count").c_str(),      params.n_expert);
+        gguf_set_val_u32(gguf, (arch + ".expert_used_count").c_str(), 2);
+    }
+
+    std::mt19937 rng(params.seed);
+    std::normal_distribution<float> dist(0.0f, gemma3 ? 0.08f : 0.02f);
+
+    std::vector<ggml_context *> ctxs;
+
+    auto add = [&](const std::string & name, ggml_type type, std::vector<int64_t> ne, bool ones = false) {
+        if (ne[0] % ggml_blck_size(type) != 0) {
+            type = GGML_TYPE_F32;
+        }
+
+        int64_t n = 1;
+        for (int64_t x : ne) {
+            n *= x;
+        }
+
+        ggml_init_params ip = {
+            /* .mem_size   = */ ggml_tensor_overhead() + ggml_row_size(type, ne[0])*(n/ne[0]),
+            /* .mem_buffer = */ nullptr,
+            /* .no_alloc   = */ false,
+        };
+
+        ggml_context * ctx = ggml_init(ip);
+        ctxs.push_back(ctx);
+
+        ggml_tensor * t = ggml_new_tensor(ctx, type, ne.size(), ne.data());
+        ggml_set_name(t, name.c_str());
+
+        std::vector<float> data(n);
+        for (float & x : data) {
+            x = ones ? 1.0f : dist(rng);
+        }
+
+        if (type == GGML_TYPE_F32) {
+            memcpy(t->data, data.data(), n*sizeof(float));
+        } else {
+            ggml_quantize_chunk(type, data.data(), t->data, 0, n/ne[0], ne[0], nullptr);
+        }
+
+        gguf_add_tensor(gguf, t);
+    };
+
+    const ggml_type wtype = params.wtype;
+
+    add("token_embd.weight",  wtype,         { params.n_embd, n_vocab });
+    add("output_norm.weight", GGML_TYPE_F32, { params.n_embd }, true);
+    if (!gemma3) {
+        add("output.weight", wtype, { params.n_embd, n_vocab });
+    }
+
+    for (int il = 0; il < params.n_layer; il++) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+
+        add(blk + "attn_norm.weight",   GGML_TYPE_F32, { params.n_embd }, true);
+        add(blk + "attn_q.weight",      wtype,         { params.n_embd, params.n_embd });
+        add(blk + "attn_k.weight",      wtype,         { params.n_embd, n_embd_head*params.n_head_kv });
+        add(blk + "attn_v.weight",      wtype,         { params.n_embd, n_embd_head*params.n_head_kv });
+        add(blk + "attn_output.weight", wtype,         { params.n_embd, params.n_embd });
+        add(blk + "ffn_norm.weight",    GGML_TYPE_F32, { params.n_embd }, true);
+
+        if (gemma3) {
+            add(blk + "post_attention_norm.weight", GGML_TYPE_F32, { params.n_embd }, true);
+            add(blk + "attn_q_norm.weight",         GGML_TYPE_F32, { n_embd_head },   true);
+            add(blk + "attn_k_norm.weight",         GGML_TYPE_F32, { n_embd_head },   true);
+            add(blk + "post_ffw_norm.weight",       GGML_TYPE_F32, { params.n_embd }, true);
+        }
+
+        if (params.n_expert > 0) {
+            add(blk + "ffn_gate_inp.weight",  GGML_TYPE_F32, { params.n_embd, params.n_expert });
+            add(blk + "ffn_gate_exps.weight", wtype,         { params.n_embd, params.n_ff,   params.n_expert });
+            add(blk + "ffn_up_exps.weight",   wtype,         { params.n_embd, params.n_ff,   params.n_expert });
+            add(blk + "ffn_down_exps.weight", wtype,         { params.n_ff,   params.n_embd, params.n_expert });
+        } else {
+            add(blk + "ffn_gate.weight", wtype, { params.n_embd, params.n_ff });
+            add(blk + "ffn_up.weight",   wtype, { params.n_embd, params.n_ff });
+            add(blk + "ffn_down.weight", wtype, { params.n_ff,   params.n_embd });
+        }
+    }
+
+    const bool ok = gguf_write_to_file(gguf, fname, false);
+
+    gguf_free(gguf);
+    for (ggml_context * ctx : ctxs) {
+        ggml_free(ctx);
+    }
+
+    return ok;
+}
@@ -1,2 +1,25 @@
 #pragma once
+
+#include "ggml.h"
+
 char * get_model_or_exit(int, char*[]);
+
+struct tiny_model_params {
+    const char * arch = "llama"; // "llama" or "gemma3"
+
+    int n_layer   = 2;
+    int n_embd    = 64;
+    int n_head    = 4;
+    int n_head_kv = 2;
+    int n_ff      = 128;
+    int n_expert  = 0; // > 0 for a MoE feed-forward (llama only)
+    int n_swa     = 0; // sliding window of the gemma3 SWA layers
+
+    ggml_type wtype = GGML_TYPE_F32;
+
+    unsigned seed = 42;
+};
+
+// write a small model with random weights and the tokenizer of fname_vocab (e.g. models/ggml-vocab-llama-spm.gguf)
+// for the tests that need to run a model
+bool make_tiny_model(const char * fname, const char * fname_vocab, const tiny_model_params & params);
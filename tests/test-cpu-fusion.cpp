@@ -0,0 +1,127 @@
+// the CPU backend fuses sequences of nodes (add -> rms_norm -> mul, silu -> mul) into single kernels
+// check that the fusions are planned, and that the results are identical to computing the nodes one by one
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const int n_embd = 64;
+static const int n_ff   = 96;
+static const int n_tok  = 7;
+
+struct layer_graph {
+    ggml_context * ctx;
+    ggml_cgraph  * gf;
+    ggml_tensor  * norm;
+    ggml_tensor  * gate;
+    ggml_tensor  * out;
+};
+
+static void fill(ggml_tensor * t, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    float * data = ggml_get_data_f32(t);
+    for (int64_t i = 0; i < ggml_nelements(t); i++) {
+        data[i] = dist(rng);
+    }
+}
+
+// a llama-like layer: residual add, rms norm, SwiGLU feed-forward, final norm
+static layer_graph build_layer() {
+    ggml_init_params params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+
+    ggml_tensor * x      = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tok);
+    ggml_tensor * h      = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tok);
+    ggml_tensor * w_norm = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    ggml_tensor * w_gate = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_ff);
+    ggml_tensor * w_up   = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_ff);
+    ggml_tensor * w_down = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_ff, n_embd);
+
+    for (ggml_tensor * t : { x, h, w_norm, w_gate, w_up, w_down }) {
+        fill(t, rng);
+    }
+
+    ggml_tensor * inp  = ggml_add(ctx, h, x);
+    ggml_tensor * norm = ggml_rms_norm(ctx, inp, 1e-5f);
+    ggml_tensor * cur  = ggml_mul(ctx, norm, w_norm);
+
+    ggml_tensor * gate = ggml_silu(ctx, ggml_mul_mat(ctx, w_gate, cur));
+    ggml_tensor * up   = ggml_mul_mat(ctx, w_up, cur);
+
+    cur = ggml_mul(ctx, gate, up);
+    cur = ggml_mul_mat(ctx, w_down, cur);
+
+    ggml_tensor * out = ggml_rms_norm(ctx, ggml_add(ctx, cur, inp), 1e-5f);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    return { ctx, gf, norm, gate, out };
+}
+
+int main(void) {
+    int n_failed = 0;
+
+    // the add and the rms_norm of add -> rms_norm -> mul, the silu of silu -> mul and the add of the final add -> rms_norm
+    // an intermediate result that is a graph output or is read by another split of the scheduler must be stored
+    for (int flag : { 0, (int) GGML_TENSOR_FLAG_OUTPUT, (int) GGML_TENSOR_FLAG_SPLIT_INPUT }) {
+        layer_graph layer = build_layer();
+
+        int n_expected = 4;
+        if (flag == GGML_TENSOR_FLAG_OUTPUT) {
+            layer.norm->flags |= flag;
+            n_expected--;
+        } else if (flag == GGML_TENSOR_FLAG_SPLIT_INPUT) {
+            layer.gate->flags |= flag;
+            n_expected--;
+        }
+
+        const int  n_fused = ggml_graph_n_fused_nodes(layer.gf);
+        const bool ok      = n_fused == n_expected;
+
+        printf("flag = %2d: %d fused nodes, expected %d: %s\n", flag, n_fused, n_expected, ok ? "OK" : "FAIL");
+
+        n_failed += !ok;
+
+        ggml_free(layer.ctx);
+    }
+
+    for (int n_threads : { 1, 2, 4 }) {
+        layer_graph fused   = build_layer();
+        layer_graph unfused = build_layer();
+
+        ggml_graph_compute_with_ctx(fused.ctx, fused.gf, n_threads);
+
+        // reference: one node at a time, nothing can be fused
+        ggml_cgraph * gf_node = ggml_new_graph(unfused.ctx);
+        for (int i = 0; i < ggml_graph_n_nodes(unfused.gf); i++) {
+            ggml_graph_clear(gf_node);
+            ggml_graph_add_node(gf_node, ggml_graph_node(unfused.gf, i));
+            ggml_graph_compute_with_ctx(unfused.ctx, gf_node, n_threads);
+        }
+
+        const bool ok = memcmp(fused.out->data, unfused.out->data, ggml_nbytes(fused.out)) == 0;
+
+        printf("n_threads = %d: %s\n", n_threads, ok ? "OK" : "FAIL");
+
+        n_failed += !ok;
+
+        ggml_free(fused.ctx);
+        ggml_free(unfused.ctx);
+    }
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+// weights in the CPU_AARCH64 extra buffer type are repacked in interleaved blocks of 8 rows and multiplied with
+// dedicated GEMV/GEMM kernels - check them against the vec_dot path of the same weights in a regular CPU buffer
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const int n_in  = 512;
+static const int n_out = 64;
+
+static ggml_backend_buffer_type_t get_repack_buft() {
+    ggml_backend_reg_t reg = ggml_backend_cpu_reg();
+    ggml_backend_dev_t dev = ggml_backend_reg_dev_get(reg, 0);
+
+    auto get_extra_bufts = (ggml_backend_dev_get_extra_bufts_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_dev_get_extra_bufts");
+    if (!get_extra_bufts) {
+        return nullptr;
+    }
+
+    for (ggml_backend_buffer_type_t * buft = get_extra_bufts(dev); buft && *buft; buft++) {
+        if (strcmp(ggml_backend_buft_name(*buft), "CPU_AARCH64") == 0) {
+            return *buft;
+        }
+    }
+
+    return nullptr;
+}
+
+// w*x with the weights in a buffer of type buft
+static std::vector<float> mul_mat(ggml_backend_t backend, ggml_backend_buffer_type_t buft, ggml_type type,
+        const std::vector<float> & w_data, const std::vector<float> & x_data, int n_tokens, bool * repacked) {
+    ggml_init_params params = {
+        /* .mem_size   = */ 8*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+
+    ggml_context * ctx_w = ggml_init(params);
+    ggml_context * ctx   = ggml_init(params);
+
+    ggml_tensor * w = ggml_new_tensor_2d(ctx_w, type, n_in, n_out);
+    ggml_backend_buffer_t buf_w = ggml_backend_alloc_ctx_tensors_from_buft(ctx_w, buft);
+
+    // a tensor without a repacked layout has no traits and would fail in set_tensor
+    *repacked = w->extra != nullptr || buft == ggml_backend_cpu_buffer_type();
+
+    std::vector<float> res;
+
+    if (*repacked) {
+        std::vector<uint8_t> w_q(ggml_nbytes(w));
+        ggml_quantize_chunk(type, w_data.data(), w_q.data(), 0, n_out, n_in, nullptr);
+        ggml_backend_tensor_set(w, w_q.data(), 0, w_q.size());
+
+        ggml_tensor * x   = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_in, n_tokens);
+        ggml_tensor * out = ggml_mul_mat(ctx, w, x);
+
+        ggml_cgraph * gf = ggml_new_graph(ctx);
+        ggml_build_forward_expand(gf, out);
+
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+
+        ggml_backend_tensor_set(x, x_data.data(), 0, n_in*n_tokens*sizeof(float));
+        ggml_backend_graph_compute(backend, gf);
+
+        res.resize(ggml_nelements(out));
+        ggml_backend_tensor_get(out, res.data(), 0, ggml_nbytes(out));
+
+        ggml_backend_buffer_free(buf);
+    }
+
+    ggml_backend_buffer_free(buf_w);
+    ggml_free(ctx_w);
+    ggml_free(ctx);
+
+    return res;
+}
+
+static double nmse(const std::vector<float> & a, const std::vector<float> & b) {
+    double err = 0.0;
+    double sum = 0.0;
+    for (size_t i = 0; i < a.size(); i++) {
+        err += (a[i] - b[i])*(a[i] - b[i]);
+        sum += b[i]*b[i];
+    }
+    return err/sum;
+}
+
+int main(void) {
+    ggml_backend_buffer_type_t buft = get_repack_buft();
+    if (!buft) {
+        printf("no CPU_AARCH64 buffer type, skipping\n");
+        return 0;
+    }
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    std::vector<float> w_data(n_in*n_out);
+    for (auto & f : w_data) {
+        f = dist(rng);
+    }
+
+    int n_failed = 0;
+
+    for (ggml_type type : { GGML_TYPE_Q8_0, GGML_TYPE_Q5_K, GGML_TYPE_Q6_K }) {
+        bool supported = true;
+
+        // a single token uses the GEMV kernel, the others the GEMM kernel with a tail of rows that is not a multiple of 4
+        for (int n_tokens : { 1, 4, 7, 16 }) {
+            std::vector<float> x_data(n_in*n_tokens);
+            for (auto & f : x_data) {
+                f = dist(rng);
+            }
+
+            for (int n_threads : { 1, 4 }) {
+                ggml_backend_cpu_set_n_threads(backend, n_threads);
+
+                bool repacked = false;
+
+                const std::vector<float> ref = mul_mat(backend, ggml_backend_cpu_buffer_type(), type, w_data, x_data, n_tokens, &repacked);
+                const std::vector<float> res = mul_mat(backend, buft, type, w_data, x_data, n_tokens, &repacked);
+
+                if (!repacked) {
+                    printf("%s: not repacked on this CPU, skipping\n", ggml_type_name(type));
+                    supported = false;
+                    break;
+                }
+
+                const double err = nmse(res, ref);
+                const bool   ok  = err < 1e-6;
+
+                printf("%s, n_tokens = %2d, n_threads = %d: nmse = %e %s\n", ggml_type_name(type), n_tokens, n_threads, err, ok ? "OK" : "FAIL");
+
+                n_failed += !ok;
+            }
+
+            if (!supported) {
+                break;
+            }
+        }
+    }
+
+    ggml_backend_free(backend);
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,240 @@
+// check the embedding index against a brute-force search, with and without IVF lists,
+// and that an index survives a save/load round trip and can be extended after loading
+// and that a truncated or corrupted index file is rejected when it is loaded
+
+#include "embd-index.h"
+
+#include "gguf.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static const int n_embd  = 64;
+static const int n_rows  = 500;
+static const int n_query = 20;
+static const int top_k   = 5;
+
+static std::vector<float> random_unit(std::mt19937 & rng) {
+    std::normal_distribution<float> dist;
+
+    std::vector<float> v(n_embd);
+    double sum = 0.0;
+    for (auto & x : v) {
+        x = dist(rng);
+        sum += x*x;
+    }
+    for (auto & x : v) {
+        x /= std::sqrt(sum);
+    }
+    return v;
+}
+
+static float dot(const std::vector<float> & a, const std::vector<float> & b) {
+    float sum = 0.0f;
+    for (int i = 0; i < n_embd; i++) {
+        sum += a[i]*b[i];
+    }
+    return sum;
+}
+
+static common_embd_index_chunk make_chunk(int i) {
+    return { "file" + std::to_string(i % 3), (int64_t) i*100, "chunk " + std::to_string(i) };
+}
+
+static void add_rows(common_embd_index * idx, const std::vector<std::vector<float>> & rows, int i0, int i1) {
+    for (int i = i0; i < i1; i++) {
+        common_embd_index_add(idx, make_chunk(i), rows[i].data());
+    }
+    common_embd_index_build(idx);
+}
+
+// the rows of the index are reordered by list, identify them by their text
+static int row_of(const common_embd_index * idx, int64_t id) {
+    const auto chunk = common_embd_index_get_chunk(idx, id);
+    const int  i     = std::stoi(chunk.text.substr(6));
+    const auto ref   = make_chunk(i);
+    assert(chunk.filename == ref.filename);
+    assert(chunk.filepos  == ref.filepos);
+    return i;
+}
+
+static int check(common_embd_index * idx, const std::vector<std::vector<float>> & rows, const std::vector<std::vector<float>> & queries,
+        int n_probe, float eps) {
+    int n_fail = 0;
+    for (const auto & q : queries) {
+        const auto res = common_embd_index_search(idx, q.data(), top_k, n_probe);
+        assert((int) res.size() == top_k);
+
+        // the best exact score, ties within eps are accepted
+        float best = -2.0f;
+        for (const auto & r : rows) {
+            best = std::max(best, dot(r, q));
+        }
+
+        for (int i = 0; i < top_k; i++) {
+            const int row = row_of(idx, res[i].id);
+            if (std::fabs(res[i].score - dot(rows[row], q)) > eps) {
+                fprintf(stderr, "%s: score %f of row %d, expected %f\n", __func__, res[i].score, row, dot(rows[row], q));
+                n_fail++;
+            }
+            if (i > 0) {
+                assert(res[i].score <= res[i - 1].score);
+            }
+        }
+        if (res[0].score < best - 2*eps) {
+            fprintf(stderr, "%s: best score %f, expected %f\n", __func__, res[0].score, best);
+            n_fail++;
+        }
+    }
+    return n_fail;
+}
+
+static std::vector<char> read_file(const std::string & fname) {
+    std::ifstream f(fname, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+static void write_file(const std::string & fname, const std::vector<char> & data) {
+    std::ofstream f(fname, std::ios::binary);
+    f.write(data.data(), data.size());
+}
+
+// position of element i of a tensor of the index file
+static size_t tensor_pos(const std::string & fname, const char * name, size_t i, size_t elsize) {
+    gguf_init_params params = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ nullptr,
+    };
+    gguf_context * gctx = gguf_init_from_file(fname.c_str(), params);
+    assert(gctx);
+    const int64_t tid = gguf_find_tensor(gctx, name);
+    assert(tid >= 0);
+    const size_t pos = gguf_get_data_offset(gctx) + gguf_get_tensor_offset(gctx, tid) + i*elsize;
+    gguf_free(gctx);
+    return pos;
+}
+
+int main() {
+    std::mt19937 rng(1234);
+
+    std::vector<std::vector<float>> rows;
+    std::vector<std::vector<float>> queries;
+    for (int i = 0; i < n_rows; i++) {
+        rows.push_back(random_unit(rng));
+    }
+    for (int i = 0; i < n_query; i++) {
+        queries.push_back(random_unit(rng));
+    }
+
+    const std::string fname = "test-embd-index.gguf";
+
+    int n_fail = 0;
+
+    for (ggml_type type : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0 }) {
+        const float eps = type == GGML_TYPE_F32 ? 1e-5f : type == GGML_TYPE_F16 ? 2e-3f : 2e-2f;
+
+        for (int n_list : { 0, 16 }) {
+            printf("%s: type = %s, n_list = %d\n", __func__, ggml_type_name(type), n_list);
+
+            // build half of the rows, save, load and add the other half
+            common_embd_index_ptr idx = common_embd_index_init(n_embd, type, n_list, 2);
+            add_rows(idx.get(), rows, 0, n_rows/2);
+            assert(common_embd_index_n_list(idx.get()) == n_list);
+            assert(common_embd_index_save(idx.get(), fname));
+
+            idx = common_embd_index_load(fname, 2);
+            assert(idx);
+            assert(common_embd_index_n_rows(idx.get()) == n_rows/2);
+            assert(common_embd_index_has_file(idx.get(), "file1"));
+            assert(!common_embd_index_has_file(idx.get(), "file3"));
+
+            add_rows(idx.get(), rows, n_rows/2, n_rows);
+            assert(common_embd_index_n_rows(idx.get()) == n_rows);
+            assert(common_embd_index_save(idx.get(), fname));
+
+            idx = common_embd_index_load(fname, 2);
+            assert(idx);
+            assert(common_embd_index_n_rows(idx.get()) == n_rows);
+
+            // scanning all the lists is an exhaustive search
+            n_fail += check(idx.get(), rows, queries, n_list, eps);
+
+            if (n_list > 0) {
+                // a stored vector is found in the list of its nearest centroid
+                for (int i = 0; i < n_query; i++) {
+                    const auto res = common_embd_index_search(idx.get(), rows[i].data(), 1, 1);
+                    assert(res.size() == 1);
+                    if (row_of(idx.get(), res[0].id) != i) {
+                        fprintf(stderr, "%s: stored vector %d not found with n_probe = 1\n", __func__, i);
+                        n_fail++;
+                    }
+                }
+            }
+        }
+    }
+
+    // a truncated index and indexes with a file id or a text offset out of range
+    {
+        printf("%s: invalid index files\n", __func__);
+
+        common_embd_index_ptr idx = common_embd_index_init(n_embd, GGML_TYPE_F32, 0, 2);
+        add_rows(idx.get(), rows, 0, 10);
+        assert(common_embd_index_save(idx.get(), fname));
+
+        const std::vector<char> data = read_file(fname);
+
+        const std::string fname_bad = "test-embd-index-bad.gguf";
+
+        auto load_bad = [&](const std::vector<char> & bad) {
+            write_file(fname_bad, bad);
+            return common_embd_index_load(fname_bad, 2) != nullptr;
+        };
+
+        assert(load_bad(data));
+
+        std::vector<char> bad(data.begin(), data.begin() + data.size()/2);
+        if (load_bad(bad)) {
+            fprintf(stderr, "%s: truncated index loaded\n", __func__);
+            n_fail++;
+        }
+
+        // there are 3 files
+        const int32_t file_id = 3;
+        bad = data;
+        memcpy(bad.data() + tensor_pos(fname, "embd_index.file_id", 5, sizeof(int32_t)), &file_id, sizeof(file_id));
+        if (load_bad(bad)) {
+            fprintf(stderr, "%s: index with an invalid file id loaded\n", __func__);
+            n_fail++;
+        }
+
+        const int64_t text_offs = 1 << 20;
+        bad = data;
+        memcpy(bad.data() + tensor_pos(fname, "embd_index.text_offs", 10, sizeof(int64_t)), &text_offs, sizeof(text_offs));
+        if (load_bad(bad)) {
+            fprintf(stderr, "%s: index with an invalid text offset loaded\n", __func__);
+            n_fail++;
+        }
+
+        std::remove(fname_bad.c_str());
+    }
+
+    std::remove(fname.c_str());
+
+    if (n_fail > 0) {
+        fprintf(stderr, "%s: %d failures\n", __func__, n_fail);
+        return 1;
+    }
+
+    printf("%s: OK\n", __func__);
+    return 0;
+}
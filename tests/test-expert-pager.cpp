@@ -0,0 +1,180 @@
+// the expert pager locks the most frequently selected experts of a layer in memory and unlocks the experts that are
+// replaced - check the locked memory of the process after routing tokens to a fixed set of experts, including
+// experts that are adjacent in the model file and share a page at their boundary
+
+#include "llama.h"
+#include "get-model.h"
+
+#include "../src/llama-model.h"
+#include "../src/llama-expert-pager.h"
+
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+static const int n_expert = 8;
+
+// total locked memory of the process
+static size_t locked_bytes() {
+    size_t res = 0;
+
+    FILE * f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return 0;
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        size_t kb;
+        if (sscanf(line, "Locked: %zu kB", &kb) == 1) {
+            res += kb*1024;
+        }
+    }
+
+    fclose(f);
+
+    return res;
+}
+
+// the pages of the up/gate/down matrices of the experts of layer 0
+static size_t expected_bytes(const llama_model * model, const std::vector<int> & experts) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    const auto & layer = model->layers[0];
+
+    std::set<uintptr_t> pages;
+    for (const ggml_tensor * t : { layer.ffn_up_exps, layer.ffn_gate_exps, layer.ffn_down_exps }) {
+        for (int e : experts) {
+            const uintptr_t first = (uintptr_t) t->data + e*t->nb[2];
+            const uintptr_t last  = first + t->nb[2];
+            for (uintptr_t p = first & ~(page_size - 1); p < last; p += page_size) {
+                pages.insert(p);
+            }
+        }
+    }
+
+    return pages.size()*page_size;
+}
+
+struct router {
+    ggml_context          * ctx;
+    ggml_backend_buffer_t   buf;
+    ggml_tensor           * selected;
+
+    router() {
+        ggml_init_params params = {
+            /* .mem_size   = */ ggml_tensor_overhead(),
+            /* .mem_buffer = */ NULL,
+            /* .no_alloc   = */ true,
+        };
+        ctx      = ggml_init(params);
+        selected = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, 2, 1);
+        buf      = ggml_backend_alloc_ctx_tensors_from_buft(ctx, ggml_backend_cpu_buffer_type());
+    }
+
+    ~router() {
+        ggml_backend_buffer_free(buf);
+        ggml_free(ctx);
+    }
+
+    // route a single token of layer 0 to experts e0 and e1, n times
+    void route(llama_expert_pager * pager, int32_t e0, int32_t e1, int n) {
+        const int32_t data[2] = { e0, e1 };
+        ggml_backend_tensor_set(selected, data, 0, sizeof(data));
+
+        for (int i = 0; i < n; i++) {
+            pager->route(0, selected);
+        }
+    }
+};
+
+static bool check(const llama_model * model, size_t locked0, const std::vector<int> & experts, const char * name) {
+    const size_t locked   = locked_bytes() - locked0;
+    const size_t expected = expected_bytes(model, experts);
+
+    const bool ok = locked == expected;
+
+    printf("%s: locked %zu bytes, expected %zu: %s\n", name, locked, expected, ok ? "OK" : "FAIL");
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+#ifndef __linux__
+    printf("the locked memory is read from /proc/self/smaps, skipping\n");
+    return 0;
+#endif
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab.gguf>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = "test-expert-pager.gguf";
+
+    // the experts are not page aligned: a page is shared by the end of an expert and the start of the next one
+    tiny_model_params mparams;
+    mparams.n_ff     = 120;
+    mparams.n_expert = n_expert;
+
+    if (!make_tiny_model(fname.c_str(), argv[1], mparams)) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    const size_t locked0 = locked_bytes();
+
+    llama_model_params params = llama_model_default_params();
+    params.use_mmap          = true;
+    params.n_expert_resident = 2;
+
+    llama_model * model = llama_model_load_from_file(fname.c_str(), params);
+    GGML_ASSERT(model);
+
+    llama_expert_pager * pager = model->get_expert_pager();
+    GGML_ASSERT(pager);
+
+    bool ok = true;
+
+    {
+        router r;
+
+        // the residency is updated every 16 routes
+        r.route(pager, 1, 2, 16);
+
+        if (locked_bytes() == locked0) {
+            printf("the experts could not be locked (RLIMIT_MEMLOCK?), skipping\n");
+        } else {
+            ok = check(model, locked0, { 1, 2 }, "experts 1, 2") && ok;
+
+            // expert 3 replaces expert 1, the page shared by experts 1 and 2 stays locked
+            r.route(pager, 2, 3, 48);
+            ok = check(model, locked0, { 2, 3 }, "experts 2, 3") && ok;
+
+            // experts 1 and 4 are adjacent to experts 2 and 3
+            r.route(pager, 1, 4, 64);
+            ok = check(model, locked0, { 1, 4 }, "experts 1, 4") && ok;
+        }
+    }
+
+    llama_model_free(model);
+
+    ok = locked_bytes() == locked0 && ok;
+
+    llama_backend_free();
+
+    std::remove(fname.c_str());
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+// with fewer q rows than threads, the CPU flash attention splits the KV cells of each row across threads and merges
+// the partial results - check it against a naive reference and the row-parallel path (a single thread), including
+// a chunk of KV cells that is entirely masked
+// with an F16 V the chunks are accumulated in FP16 and rounded differently than a whole row, so only an F32 V is
+// expected to match the single thread result closely
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static const int n_embd_head = 64;
+static const int n_head      = 4;
+static const int n_head_kv   = 2;
+static const int n_kv        = 1024;
+
+struct fa_graph {
+    ggml_context * ctx;
+    ggml_cgraph  * gf;
+    ggml_tensor  * q;
+    ggml_tensor  * k;
+    ggml_tensor  * v;
+    ggml_tensor  * mask;
+    ggml_tensor  * out;
+};
+
+static fa_graph build_fa(ggml_type type_v, int n_tokens, int n_masked, float softcap) {
+    ggml_init_params params = {
+        /* .mem_size   = */ 64*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    ggml_tensor * q    = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd_head, n_tokens, n_head);
+    ggml_tensor * k    = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_embd_head, n_kv,     n_head_kv);
+    ggml_tensor * v    = ggml_new_tensor_3d(ctx, type_v,        n_embd_head, n_kv,     n_head_kv);
+    ggml_tensor * mask = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+
+    for (int64_t i = 0; i < ggml_nelements(q); i++) {
+        ((float *) q->data)[i] = dist(rng);
+    }
+    for (int64_t i = 0; i < ggml_nelements(k); i++) {
+        ((ggml_fp16_t *) k->data)[i] = ggml_fp32_to_fp16(dist(rng));
+    }
+    for (int64_t i = 0; i < ggml_nelements(v); i++) {
+        ggml_set_f32_1d(v, i, dist(rng));
+    }
+    for (int64_t j = 0; j < mask->ne[1]; j++) {
+        for (int64_t i = 0; i < n_kv; i++) {
+            ((ggml_fp16_t *) mask->data)[j*n_kv + i] = ggml_fp32_to_fp16(i < n_masked ? -INFINITY : 0.0f);
+        }
+    }
+
+    ggml_tensor * out = ggml_flash_attn_ext(ctx, q, k, v, mask, 1.0f/sqrtf(n_embd_head), 0.0f, softcap);
+    ggml_flash_attn_ext_set_prec(out, GGML_PREC_F32);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    return { ctx, gf, q, k, v, mask, out };
+}
+
+// softmax(softcap(scale*KQ) + mask)*V in double precision, from the same K/V and the F16-rounded Q
+static std::vector<float> reference(const fa_graph & g, int n_tokens, float softcap) {
+    const float scale = 1.0f/sqrtf(n_embd_head);
+
+    std::vector<float> res(n_embd_head*n_head*n_tokens);
+
+    for (int t = 0; t < n_tokens; t++) {
+        for (int h = 0; h < n_head; h++) {
+            const int hk = h/(n_head/n_head_kv);
+
+            const float * q = (const float *) g.q->data + (h*n_tokens + t)*n_embd_head;
+
+            std::vector<double> s(n_kv, -INFINITY);
+            double s_max = -INFINITY;
+
+            for (int i = 0; i < n_kv; i++) {
+                const float m = ggml_fp16_to_fp32(((const ggml_fp16_t *) g.mask->data)[t*n_kv + i]);
+                if (m == -INFINITY) {
+                    continue;
+                }
+
+                const ggml_fp16_t * k = (const ggml_fp16_t *) g.k->data + (hk*n_kv + i)*n_embd_head;
+
+                double dot = 0.0;
+                for (int d = 0; d < n_embd_head; d++) {
+                    dot += ggml_fp16_to_fp32(ggml_fp32_to_fp16(q[d]))*ggml_fp16_to_fp32(k[d]);
+                }
+
+                dot *= scale;
+                if (softcap != 0.0f) {
+                    dot = softcap*tanh(dot/softcap);
+                }
+
+                s[i]  = dot + m;
+                s_max = std::max(s_max, s[i]);
+            }
+
+            double sum = 0.0;
+            std::vector<double> acc(n_embd_head, 0.0);
+
+            for (int i = 0; i < n_kv; i++) {
+                if (s[i] == -INFINITY) {
+                    continue;
+                }
+
+                const double p = exp(s[i] - s_max);
+                sum += p;
+
+                for (int d = 0; d < n_embd_head; d++) {
+                    acc[d] += p*ggml_get_f32_1d(g.v, (hk*n_kv + i)*n_embd_head + d);
+                }
+            }
+
+            // the result is permuted: [n_embd_head, n_head, n_tokens]
+            for (int d = 0; d < n_embd_head; d++) {
+                res[(t*n_head + h)*n_embd_head + d] = acc[d]/sum;
+            }
+        }
+    }
+
+    return res;
+}
+
+static float max_err(const float * a, const float * b, size_t n) {
+    float err = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        err = std::max(err, std::fabs(a[i] - b[i]));
+    }
+    return err;
+}
+
+int main(void) {
+    int n_failed = 0;
+
+    for (ggml_type type_v : { GGML_TYPE_F16, GGML_TYPE_F32 }) {
+        const float tol_ref = type_v == GGML_TYPE_F16 ? 2e-3f : 1e-4f;
+
+        for (int n_tokens : { 1, 2 }) {
+            // a single token with 8 threads splits the rows in 2 chunks of 512 cells, the first one entirely masked with n_masked = 600
+            for (int n_masked : { 0, 300, 600 }) {
+                for (float softcap : { 0.0f, 20.0f }) {
+                    fa_graph g1 = build_fa(type_v, n_tokens, n_masked, softcap);
+                    ggml_graph_compute_with_ctx(g1.ctx, g1.gf, 1);
+
+                    const std::vector<float> ref = reference(g1, n_tokens, softcap);
+
+                    bool ok = true;
+
+                    for (int n_threads : { 1, 2, 4, 8, 16 }) {
+                        fa_graph gn = build_fa(type_v, n_tokens, n_masked, softcap);
+                        ggml_graph_compute_with_ctx(gn.ctx, gn.gf, n_threads);
+
+                        const float err_ref = max_err((const float *) gn.out->data, ref.data(), ref.size());
+                        const float err_1   = max_err((const float *) gn.out->data, (const float *) g1.out->data, ref.size());
+
+                        printf("%s, n_tokens = %d, n_masked = %3d, softcap = %4.1f, n_threads = %2d: err = %e, err vs 1 thread = %e\n",
+                                ggml_type_name(type_v), n_tokens, n_masked, softcap, n_threads, err_ref, err_1);
+
+                        ok = ok && err_ref < tol_ref;
+                        if (type_v == GGML_TYPE_F32) {
+                            ok = ok && err_1 < 1e-5f;
+                        }
+
+                        ggml_free(gn.ctx);
+                    }
+
+                    printf("%s\n", ok ? "OK" : "FAIL");
+
+                    n_failed += !ok;
+
+                    ggml_free(g1.ctx);
+                }
+            }
+        }
+    }
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "llama-grammar.h"
+#include "json-schema-to-grammar.h"
+
+#include <cassert>
+#include <cmath>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+static const llama_vocab * vocab;
+
+// the allowed tokens computed for the entire vocab (token trie + mask cache) must match the ones computed
+// by checking the tokens one at a time
+static void check_state(const llama_grammar & grammar) {
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    std::vector<llama_token_data> cur;
+    cur.reserve(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        cur.push_back(llama_token_data{ id, 0.0f, 0.0f });
+    }
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+
+    llama_grammar_apply_impl(grammar, &cur_p);
+
+    // the clone has an empty mask cache, so single candidates are checked without the trie
+    llama_grammar * ref = llama_grammar_clone_impl(grammar);
+
+    int n_allowed = 0;
+    for (llama_token id = 0; id < n_vocab; id++) {
+        llama_token_data       single   = { id, 0.0f, 0.0f };
+        llama_token_data_array single_p = { &single, 1, -1, false };
+
+        llama_grammar_apply_impl(*ref, &single_p);
+
+        const bool allowed     = single.logit   != -INFINITY;
+        const bool allowed_all = cur[id].logit  != -INFINITY;
+
+        if (allowed != allowed_all) {
+            fprintf(stderr, "  token %d ('%s'): allowed = %d, allowed with the full vocab = %d\n",
+                    id, llama_vocab_get_text(vocab, id), allowed, allowed_all);
+        }
+        assert(allowed == allowed_all);
+
+        n_allowed += allowed;
+    }
+
+    llama_grammar_free_impl(ref);
+
+    fprintf(stderr, "  %d allowed tokens\n", n_allowed);
+}
+
+static void test(const std::string & name, const std::string & grammar_str, const std::vector<std::string> & pieces) {
+    fprintf(stderr, "⚫ Testing token trie: %s\n", name.c_str());
+
+    llama_grammar * grammar = llama_grammar_init_impl(vocab, grammar_str.c_str(), "root", false, nullptr, 0, nullptr, 0);
+    assert(grammar != nullptr);
+
+    check_state(*grammar);
+
+    for (const auto & piece : pieces) {
+        llama_grammar_accept_str(*grammar, piece);
+
+        check_state(*grammar);
+        // second time with the cached mask
+        check_state(*grammar);
+    }
+
+    llama_grammar_free_impl(grammar);
+
+    fprintf(stderr, "  ✅︎ passed\n");
+}
+
+int main(int argc, const char ** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const char * vocab_file = argv[1];
+
+    fprintf(stderr, "reading vocab from: '%s'\n", vocab_file);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(vocab_file, mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, vocab_file);
+        return 1;
+    }
+
+    vocab = llama_model_get_vocab(model);
+
+    test("simple", R"""(
+        root ::= "hello" " "+ ("world" | "there") "!"?
+    )""", { "hel", "lo ", " ", "wor", "ld", "!" });
+
+    test("json", R"""(
+        root   ::= object
+        value  ::= object | array | string | number | ("true" | "false" | "null") ws
+
+        object ::=
+          "{" ws (
+                    string ":" ws value
+            ("," ws string ":" ws value)*
+          )? "}" ws
+
+        array  ::=
+          "[" ws (
+                    value
+            ("," ws value)*
+          )? "]" ws
+
+        string ::=
+          "\"" (
+            [^"\\\x7F\x00-\x1F] |
+            "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4})
+          )* "\"" ws
+
+        number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [1-9] [0-9]{0,15})? ws
+
+        ws ::= | " " | "\n" [ \t]{0,20}
+    )""", { "{", "\"na", "me\": ", "\"abc", "\\", "n", "\", \"n\": [1", ".5, ", "tr" });
+
+    test("utf-8", R"""(
+        root ::= "こんにちは" [ぁ-ゟ]+ "、" ("世界" | "皆さん")
+    )""", { "こん", "\xE3\x81", "\xAB", "ちはあい", "\xE3", "\x80\x81", "皆" });
+
+    test("json schema", json_schema_to_grammar(json::parse(R"""({
+        "type": "object",
+        "properties": {
+            "name":  { "type": "string", "maxLength": 8 },
+            "age":   { "type": "integer", "minimum": 0 },
+            "email": { "type": "string", "pattern": "^[a-z]+@[a-z]+\\.com$" }
+        },
+        "required": ["name", "age"]
+    })""")), { "{", "\"name\"", ": \"Jo", "hn\", ", "\"age\": 4", "2, \"email\": \"jo" });
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stdout, "All tests passed.\n");
+    return 0;
+}
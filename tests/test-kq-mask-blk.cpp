@@ -0,0 +1,155 @@
+// the attention kernels of the CPU backend can skip KV blocks using a block summary of the KQ mask
+// check that soft_max_ext and flash_attn_ext give the same results with and without the summary
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+static const int n_embd_head = 64;
+static const int n_head      = 4;
+static const int n_kv        = 512;
+static const int n_seq       = 8;
+
+struct attn_graph {
+    ggml_context * ctx;
+    ggml_cgraph  * gf;
+    ggml_tensor  * out;
+};
+
+static void fill(ggml_tensor * t, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    float * data = ggml_get_data_f32(t);
+    for (int64_t i = 0; i < ggml_nelements(t); i++) {
+        data[i] = dist(rng);
+    }
+}
+
+// n_seq sequences share the cache in interleaved runs of cells, with a causal mask within each sequence
+// the first sequence uses ALiBi-like values, so that its blocks are mixed instead of zero
+static void fill_mask(ggml_tensor * mask, int n_tokens) {
+    float * data = ggml_get_data_f32(mask);
+
+    const int n_run = 48;
+
+    for (int j = 0; j < mask->ne[1]; j++) {
+        const int s   = j % n_seq;
+        const int pos = n_kv/n_seq + j/n_seq;
+
+        for (int i = 0; i < n_kv; i++) {
+            const int s_cell   = (i/n_run) % n_seq;
+            const int pos_cell = (i/(n_run*n_seq))*n_run + i % n_run;
+
+            float f = -INFINITY;
+            if (j < n_tokens && s_cell == s && pos_cell <= pos) {
+                f = s == 0 ? -0.01f*(pos - pos_cell) : 0.0f;
+            }
+            data[j*n_kv + i] = f;
+        }
+    }
+}
+
+static void fill_blk(ggml_tensor * blk, const ggml_tensor * mask) {
+    const float * data     = (const float *) mask->data;
+    int8_t      * data_blk = (int8_t *) blk->data;
+
+    for (int64_t j = 0; j < blk->ne[1]; j++) {
+        for (int64_t ib = 0; ib < blk->ne[0]; ib++) {
+            bool masked = true;
+            bool zero   = true;
+            for (int64_t i = ib*GGML_KQ_MASK_BLK; i < std::min<int64_t>((ib + 1)*GGML_KQ_MASK_BLK, mask->ne[0]); i++) {
+                masked = masked && data[j*mask->ne[0] + i] == -INFINITY;
+                zero   = zero   && data[j*mask->ne[0] + i] == 0.0f;
+            }
+            data_blk[j*blk->ne[0] + ib] = masked ? GGML_KQ_MASK_BLK_MASKED : zero ? GGML_KQ_MASK_BLK_ZERO : GGML_KQ_MASK_BLK_MIXED;
+        }
+    }
+}
+
+static attn_graph build_attn(bool flash_attn, bool use_blk, int n_tokens) {
+    ggml_init_params params = {
+        /* .mem_size   = */ 64*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+
+    ggml_tensor * q    = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd_head, n_tokens, n_head);
+    ggml_tensor * k    = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd_head, n_kv,     n_head);
+    ggml_tensor * v    = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd_head, n_kv,     n_head);
+    ggml_tensor * mask = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+    ggml_tensor * blk  = ggml_new_tensor_2d(ctx, GGML_TYPE_I8,  n_kv/GGML_KQ_MASK_BLK, mask->ne[1]);
+
+    for (ggml_tensor * t : { q, k, v }) {
+        fill(t, rng);
+    }
+    fill_mask(mask, n_tokens);
+    fill_blk(blk, mask);
+
+    const float scale = 1.0f/sqrtf(n_embd_head);
+
+    ggml_tensor * out;
+
+    if (flash_attn) {
+        out = ggml_flash_attn_ext(ctx, q, ggml_cast(ctx, k, GGML_TYPE_F16), ggml_cast(ctx, v, GGML_TYPE_F16),
+                ggml_cast(ctx, mask, GGML_TYPE_F16), scale, 0.0f, 0.0f);
+        ggml_flash_attn_ext_set_prec(out, GGML_PREC_F32);
+        if (use_blk) {
+            ggml_flash_attn_ext_set_mask_blk(out, blk);
+        }
+    } else {
+        out = ggml_soft_max_ext(ctx, ggml_mul_mat(ctx, k, q), mask, scale, 0.0f);
+        if (use_blk) {
+            ggml_soft_max_ext_set_mask_blk(out, blk);
+        }
+    }
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    return { ctx, gf, out };
+}
+
+int main(void) {
+    int n_failed = 0;
+
+    for (bool flash_attn : { false, true }) {
+        // with a single token and more threads than q rows, flash attention splits the KV cells across threads
+        for (int n_tokens : { 1, n_seq, 4*n_seq }) {
+            for (int n_threads : { 1, 8 }) {
+                attn_graph ref = build_attn(flash_attn, false, n_tokens);
+                attn_graph blk = build_attn(flash_attn, true,  n_tokens);
+
+                ggml_graph_compute_with_ctx(ref.ctx, ref.gf, n_threads);
+                ggml_graph_compute_with_ctx(blk.ctx, blk.gf, n_threads);
+
+                const float * a = ggml_get_data_f32(ref.out);
+                const float * b = ggml_get_data_f32(blk.out);
+
+                double err = 0.0;
+                for (int64_t i = 0; i < ggml_nelements(ref.out); i++) {
+                    err = std::max(err, (double) std::fabs(a[i] - b[i]));
+                }
+
+                const bool ok = err < 1e-6;
+
+                printf("%s, n_tokens = %2d, n_threads = %d: max err = %e %s\n",
+                        flash_attn ? "flash_attn_ext" : "soft_max_ext  ", n_tokens, n_threads, err, ok ? "OK" : "FAIL");
+
+                n_failed += !ok;
+
+                ggml_free(ref.ctx);
+                ggml_free(blk.ctx);
+            }
+        }
+    }
+
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+// decode into a fragmented paged KV cache and check the logits against a context that holds a single sequence:
+// - a ubatch that would be scattered over many single-cell holes is placed in the longest runs of free cells
+// - when only single-cell holes are left, find_slot fails and requests a defrag, and the retried decode succeeds
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int n_vocab_used = 1000;
+
+static std::vector<llama_token> random_tokens(std::mt19937 & rng, int n) {
+    std::uniform_int_distribution<llama_token> dist(100, n_vocab_used);
+
+    std::vector<llama_token> res(n);
+    for (auto & t : res) {
+        t = dist(rng);
+    }
+    return res;
+}
+
+// decode the tokens of one sequence, retrying once if the cache asked for a defrag
+static int decode_seq(llama_context * ctx, const std::vector<llama_token> & tokens, llama_seq_id seq_id, llama_pos pos0, bool * retried = nullptr) {
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+
+    for (size_t i = 0; i < tokens.size(); i++) {
+        common_batch_add(batch, tokens[i], pos0 + i, { seq_id }, i == tokens.size() - 1);
+    }
+
+    int ret = llama_decode(ctx, batch);
+    if (ret == 1) {
+        if (retried) {
+            *retried = true;
+        }
+        ret = llama_decode(ctx, batch);
+    }
+
+    llama_batch_free(batch);
+
+    return ret;
+}
+
+// the logits of the last token of a sequence decoded alone in a fresh context
+static std::vector<float> ref_logits(llama_model * model, const std::vector<llama_token> & tokens) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx   = 512;
+    cparams.n_batch = 512;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    GGML_ASSERT(decode_seq(ctx, tokens, 0, 0) == 0);
+
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    std::vector<float> res(logits, logits + llama_vocab_n_tokens(llama_model_get_vocab(model)));
+
+    llama_free(ctx);
+
+    return res;
+}
+
+static bool check(llama_context * ctx, llama_model * model, const std::vector<llama_token> & tokens, const char * name) {
+    const std::vector<float> ref = ref_logits(model, tokens);
+
+    const float * logits = llama_get_logits_ith(ctx, -1);
+
+    float err = 0.0f;
+    for (size_t i = 0; i < ref.size(); i++) {
+        err = std::max(err, std::fabs(logits[i] - ref[i]));
+    }
+
+    const bool ok = err < 1e-3f;
+
+    printf("%s: max err = %e %s\n", name, err, ok ? "OK" : "FAIL");
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab.gguf>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = "test-kv-cache-paged.gguf";
+
+    if (!make_tiny_model(fname.c_str(), argv[1], tiny_model_params())) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(fname.c_str(), llama_model_default_params());
+    GGML_ASSERT(model);
+
+    // with blocks of a single cell, the tokens of two sequences decoded in lockstep alternate in the cache
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx         = 512;
+    cparams.n_batch       = 512;
+    cparams.n_seq_max     = 8;
+    cparams.kv_block_size = 1;
+    cparams.defrag_thold  = -1.0f;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    GGML_ASSERT(llama_n_ctx(ctx) == 512);
+
+    std::mt19937 rng(1234);
+
+    std::vector<llama_token> seq0 = random_tokens(rng, 129);
+    std::vector<llama_token> seq1 = random_tokens(rng, 128);
+
+    llama_batch batch = llama_batch_init(2, 0, 1);
+    for (int i = 0; i < 128; i++) {
+        common_batch_clear(batch);
+        common_batch_add(batch, seq0[i], i, { 0 }, false);
+        common_batch_add(batch, seq1[i], i, { 1 }, false);
+        GGML_ASSERT(llama_decode(ctx, batch) == 0);
+    }
+    llama_batch_free(batch);
+
+    // leave 128 single-cell holes in [0, 256)
+    llama_kv_self_seq_rm(ctx, 1, -1, -1);
+
+    bool ok = true;
+
+    // the holes would need 64 ranges - the free run [256, 512) is used instead
+    {
+        const auto tokens = random_tokens(rng, 64);
+
+        bool retried = false;
+        GGML_ASSERT(decode_seq(ctx, tokens, 2, 0, &retried) == 0);
+        GGML_ASSERT(!retried);
+
+        ok = check(ctx, model, tokens, "free run") && ok;
+    }
+
+    // fill the rest of the free run
+    {
+        const auto tokens = random_tokens(rng, 192);
+
+        GGML_ASSERT(decode_seq(ctx, tokens, 3, 0) == 0);
+    }
+
+    // only the single-cell holes are left - the first decode fails and requests a defrag
+    {
+        const auto tokens = random_tokens(rng, 64);
+
+        bool retried = false;
+        GGML_ASSERT(decode_seq(ctx, tokens, 4, 0, &retried) == 0);
+        GGML_ASSERT(retried);
+
+        ok = check(ctx, model, tokens, "defrag") && ok;
+    }
+
+    // the cells of seq 0 moved during the defrag
+    {
+        GGML_ASSERT(decode_seq(ctx, { seq0[128] }, 0, 128) == 0);
+
+        ok = check(ctx, model, seq0, "after defrag") && ok;
+    }
+
+    llama_free(ctx);
+    llama_model_free(model);
+
+    llama_backend_free();
+
+    std::remove(fname.c_str());
+
+    return ok ? 0 : 1;
+}
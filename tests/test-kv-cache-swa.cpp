@@ -0,0 +1,217 @@
+// the sliding-window layers keep only the last n_swa positions of each sequence in a smaller cache, unless swa_full is
+// set - decode the same batches in both modes and check the logits:
+// - the prompts of several sequences, then tokens of all the sequences until they are well past n_swa
+// - a sequence is cleared and a new prompt takes the cells that are out of the window of the other sequences
+// - the state of a sequence is saved and restored in a new context, which continues it
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int n_swa = 16;
+static const int n_seq = 3;
+static const int n_vocab_used = 1000;
+
+static std::vector<llama_token> random_tokens(std::mt19937 & rng, int n) {
+    std::uniform_int_distribution<llama_token> dist(100, n_vocab_used);
+
+    std::vector<llama_token> res(n);
+    for (auto & t : res) {
+        t = dist(rng);
+    }
+    return res;
+}
+
+static llama_context * make_ctx(llama_model * model, bool swa_full) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 512;
+    cparams.n_batch   = 512;
+    cparams.n_ubatch  = 16;
+    cparams.n_seq_max = n_seq;
+    cparams.swa_full  = swa_full;
+
+    return llama_init_from_model(model, cparams);
+}
+
+// decode the batch in both contexts, returns the max difference of the logits of the outputs
+static float decode_cmp(llama_context * ctx, llama_context * ctx_full, const llama_batch & batch) {
+    GGML_ASSERT(llama_decode(ctx,      batch) == 0);
+    GGML_ASSERT(llama_decode(ctx_full, batch) == 0);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+    float err = 0.0f;
+    for (int i = 0; i < batch.n_tokens; i++) {
+        if (!batch.logits[i]) {
+            continue;
+        }
+
+        const float * logits      = llama_get_logits_ith(ctx,      i);
+        const float * logits_full = llama_get_logits_ith(ctx_full, i);
+
+        for (int j = 0; j < n_vocab; j++) {
+            err = std::max(err, std::fabs(logits[j] - logits_full[j]));
+        }
+    }
+
+    return err;
+}
+
+// the cells of the SWA cache are not in the same order, so the sums of the attention are rounded differently - with the
+// random weights of the tiny model this is about 1e-3, a window that is off by one position gives errors above 0.1
+static bool check(float err, const char * name) {
+    const bool ok = err < 1e-2f;
+
+    printf("%s: max err = %e %s\n", name, err, ok ? "OK" : "FAIL");
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab.gguf>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = "test-kv-cache-swa.gguf";
+
+    // the 6th layer of gemma3 attends to the whole context, the other ones to the last n_swa positions
+    tiny_model_params mparams;
+    mparams.arch    = "gemma3";
+    mparams.n_layer = 6;
+    mparams.n_swa   = n_swa;
+
+    if (!make_tiny_model(fname.c_str(), argv[1], mparams)) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(fname.c_str(), llama_model_default_params());
+    GGML_ASSERT(model);
+    GGML_ASSERT(llama_model_n_swa(model) == n_swa);
+
+    llama_context * ctx      = make_ctx(model, false);
+    llama_context * ctx_full = make_ctx(model, true);
+
+    std::mt19937 rng(1234);
+
+    std::vector<llama_pos> n_past(n_seq, 0);
+
+    llama_batch batch = llama_batch_init(512, 0, 1);
+
+    // add n tokens of each sequence in seq_ids to the batch, with an output for the last one
+    auto add = [&](const std::vector<llama_seq_id> & seq_ids, int n) {
+        for (llama_seq_id s : seq_ids) {
+            for (llama_token t : random_tokens(rng, n)) {
+                common_batch_add(batch, t, n_past[s], { s }, false);
+                n_past[s]++;
+            }
+            batch.logits[batch.n_tokens - 1] = true;
+        }
+    };
+
+    bool ok = true;
+
+    // prompts of different lengths, longer than the window, in ubatches of n_swa tokens
+    {
+        common_batch_clear(batch);
+        for (int s = 0; s < n_seq; s++) {
+            add({ s }, n_swa + 8 + 4*s);
+        }
+
+        ok = check(decode_cmp(ctx, ctx_full, batch), "prompts") && ok;
+    }
+
+    // a token of each sequence per batch
+    {
+        float err = 0.0f;
+        for (int i = 0; i < 3*n_swa; i++) {
+            common_batch_clear(batch);
+            add({ 0, 1, 2 }, 1);
+
+            err = std::max(err, decode_cmp(ctx, ctx_full, batch));
+        }
+
+        ok = check(err, "generation") && ok;
+
+        // the positions out of the window are only kept with swa_full
+        bool ok_pos = true;
+        for (int s = 0; s < n_seq; s++) {
+            ok_pos = ok_pos && llama_kv_self_seq_pos_min(ctx_full, s) == 0;
+            ok_pos = ok_pos && llama_kv_self_seq_pos_min(ctx, s) > 0 && llama_kv_self_seq_pos_min(ctx, s) <= n_past[s] - n_swa;
+            ok_pos = ok_pos && llama_kv_self_seq_pos_max(ctx, s) == n_past[s] - 1;
+        }
+
+        printf("positions of the sequences: %s\n", ok_pos ? "OK" : "FAIL");
+
+        ok = ok && ok_pos;
+    }
+
+    // seq 1 starts over with a new prompt, in the same batches as the tokens of the other sequences
+    {
+        llama_kv_self_seq_rm(ctx,      1, -1, -1);
+        llama_kv_self_seq_rm(ctx_full, 1, -1, -1);
+        n_past[1] = 0;
+
+        common_batch_clear(batch);
+        add({ 0, 2 }, 1);
+        add({ 1 }, 2*n_swa + 8);
+
+        float err = decode_cmp(ctx, ctx_full, batch);
+        for (int i = 0; i < n_swa; i++) {
+            common_batch_clear(batch);
+            add({ 0, 1, 2 }, 1);
+
+            err = std::max(err, decode_cmp(ctx, ctx_full, batch));
+        }
+
+        ok = check(err, "new prompt of seq 1") && ok;
+    }
+
+    // seq 0 is saved and restored in a new context, which continues it past another window
+    {
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, 0));
+        GGML_ASSERT(llama_state_seq_get_data(ctx, state.data(), state.size(), 0) == state.size());
+
+        llama_context * ctx_dst = make_ctx(model, false);
+
+        bool ok_state = llama_state_seq_set_data(ctx_dst, state.data(), state.size(), 0) == state.size();
+        ok_state = ok_state && llama_kv_self_seq_pos_min(ctx_dst, 0) == llama_kv_self_seq_pos_min(ctx, 0);
+        ok_state = ok_state && llama_kv_self_seq_pos_max(ctx_dst, 0) == llama_kv_self_seq_pos_max(ctx, 0);
+
+        printf("restored state of seq 0: %s\n", ok_state ? "OK" : "FAIL");
+
+        ok = ok && ok_state;
+
+        float err = 0.0f;
+        for (int i = 0; i < n_swa + 4 && ok_state; i++) {
+            common_batch_clear(batch);
+            add({ 0 }, 1);
+
+            err = std::max(err, decode_cmp(ctx_dst, ctx_full, batch));
+        }
+
+        ok = check(err, "continuation of the restored seq 0") && ok;
+
+        llama_free(ctx_dst);
+    }
+
+    llama_batch_free(batch);
+
+    llama_free(ctx);
+    llama_free(ctx_full);
+    llama_model_free(model);
+
+    llama_backend_free();
+
+    std::remove(fname.c_str());
+
+    return ok ? 0 : 1;
+}
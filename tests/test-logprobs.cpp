@@ -0,0 +1,117 @@
+// the log-probabilities of the top tokens are computed in the graph, with a top-k of the vocab split in chunks
+// - check the tokens and their log-probabilities against the full logits of the same batch, for values of k that
+//   give different chunk sizes, with and without a single chunk
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static bool check(llama_context * ctx, const std::vector<std::vector<float>> & logits, int k) {
+    const int n_vocab = logits[0].size();
+
+    bool ok = true;
+
+    for (size_t idx = 0; idx < logits.size() && ok; idx++) {
+        const std::vector<float> & ref = logits[idx];
+
+        double sum = 0.0;
+        const float max = *std::max_element(ref.begin(), ref.end());
+        for (float l : ref) {
+            sum += exp(l - max);
+        }
+        const double lse = max + log(sum);
+
+        std::vector<float> sorted = ref;
+        std::sort(sorted.begin(), sorted.end(), std::greater<float>());
+
+        const float       * logprobs = llama_get_logprobs_ith(ctx, idx);
+        const llama_token * top      = llama_get_logprobs_top_ith(ctx, idx);
+
+        for (int i = 0; i < k && ok; i++) {
+            // ties can be returned in any order
+            ok = top[i] >= 0 && top[i] < n_vocab && ref[top[i]] == sorted[i] &&
+                std::fabs(logprobs[i] - (ref[top[i]] - lse)) < 1e-4;
+
+            if (!ok) {
+                printf("output %zu, top %d: token %d, logprob %f, expected logit %f, logprob %f\n",
+                        idx, i, top[i], logprobs[i], sorted[i], sorted[i] - lse);
+            }
+        }
+    }
+
+    printf("top-%d log-probabilities: %s\n", k, ok ? "OK" : "FAIL");
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab.gguf>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = "test-logprobs.gguf";
+
+    if (!make_tiny_model(fname.c_str(), argv[1], tiny_model_params())) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(fname.c_str(), llama_model_default_params());
+    GGML_ASSERT(model);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx   = 256;
+    cparams.n_batch = 256;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    const std::vector<llama_token> prompt = common_tokenize(ctx, "The quick brown fox jumps over the lazy dog", true);
+
+    llama_batch batch = llama_batch_init(prompt.size(), 0, 1);
+    for (size_t i = 0; i < prompt.size(); i++) {
+        common_batch_add(batch, prompt[i], i, { 0 }, true);
+    }
+
+    // the full logits of all the outputs
+    std::vector<std::vector<float>> logits;
+
+    GGML_ASSERT(llama_decode(ctx, batch) == 0);
+    for (size_t i = 0; i < prompt.size(); i++) {
+        const float * l = llama_get_logits_ith(ctx, i);
+        logits.emplace_back(l, l + n_vocab);
+    }
+
+    bool ok = true;
+
+    // k = 2 and 40 split the vocab in chunks of 1024 and 2048, k = 1000 in chunks of 8192, and k = 10000 uses a
+    // single top-k of the vocab
+    for (int k : { 2, 40, 1000, 10000 }) {
+        llama_kv_self_clear(ctx);
+        llama_set_logprobs(ctx, 0, k);
+
+        GGML_ASSERT(llama_decode(ctx, batch) == 0);
+
+        ok = check(ctx, logits, k) && ok;
+    }
+
+    llama_batch_free(batch);
+
+    llama_free(ctx);
+    llama_model_free(model);
+
+    llama_backend_free();
+
+    std::remove(fname.c_str());
+
+    return ok ? 0 : 1;
+}
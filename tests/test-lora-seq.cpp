@@ -0,0 +1,557 @@
+// the sequences of a batch can use different LoRA adapters, each token gathering the adapters of its sequence
+// - decode sequences with no adapter, one of two adapters of different ranks and both adapters in a single batch,
+//   and check their logits against each sequence decoded alone with the adapters applied to the whole context
+// - replace an adapter of a sequence by a third adapter, which reuses the slot of the stacked matrices it frees
+// - apply the adapters of the sequences to 3D activations with the graph context and check them against the host
+// - check that the slots of the adapters are released when no sequence uses them anymore and reused without
+//   reallocating the stacked matrices
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#include "../src/llama-adapter.h"
+#include "../src/llama-batch.h"
+#include "../src/llama-cparams.h"
+#include "../src/llama-graph.h"
+#include "../src/llama-model.h"
+
+#include "ggml-alloc.h"
+#include "ggml-cpu.h"
+#include "gguf.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+static const int n_embd  = 64;
+static const int n_layer = 2;
+static const int n_vocab_used = 1000;
+
+using lora_list = std::vector<std::pair<llama_adapter_lora *, float>>;
+
+// write a LoRA adapter of the given rank for some weights of the tiny model
+static bool make_tiny_lora(const char * fname, const std::vector<std::string> & names, int rank, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 0.1f);
+
+    gguf_context * gguf = gguf_init_empty();
+
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_str(gguf, "general.type",         "adapter");
+    gguf_set_val_str(gguf, "adapter.type",         "lora");
+    gguf_set_val_f32(gguf, "adapter.lora.alpha",   rank);
+
+    std::vector<ggml_context *> ctxs;
+
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        ggml_init_params ip = {
+            /* .mem_size   = */ ggml_tensor_overhead() + ne0*ne1*sizeof(float),
+            /* .mem_buffer = */ nullptr,
+            /* .no_alloc   = */ false,
+        };
+
+        ggml_context * ctx = ggml_init(ip);
+        ctxs.push_back(ctx);
+
+        ggml_tensor * t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+        ggml_set_name(t, name.c_str());
+
+        for (int64_t i = 0; i < ne0*ne1; i++) {
+            ((float *) t->data)[i] = dist(rng);
+        }
+
+        gguf_add_tensor(gguf, t);
+    };
+
+    for (const auto & name : names) {
+        if (name == "token_embd.weight") {
+            // A and B are flipped for the token embeddings
+            add(name + ".lora_a", rank, 32000);
+            add(name + ".lora_b", rank, n_embd);
+            continue;
+        }
+
+        for (int il = 0; il < n_layer; il++) {
+            const std::string blk = "blk." + std::to_string(il) + ".";
+
+            const int64_t n_in  = name == "ffn_down.weight" ? 128 : n_embd;
+            const int64_t n_out = name == "ffn_up.weight"   ? 128 : name == "attn_v.weight" ? n_embd/2 : n_embd;
+
+            add(blk + name + ".lora_a", n_in, rank);
+            add(blk + name + ".lora_b", rank, n_out);
+        }
+    }
+
+    const bool ok = gguf_write_to_file(gguf, fname, false);
+
+    gguf_free(gguf);
+    for (ggml_context * ctx : ctxs) {
+        ggml_free(ctx);
+    }
+
+    return ok;
+}
+
+static std::vector<llama_token> random_tokens(std::mt19937 & rng, int n) {
+    std::uniform_int_distribution<llama_token> dist(100, n_vocab_used);
+
+    std::vector<llama_token> res(n);
+    for (auto & t : res) {
+        t = dist(rng);
+    }
+    return res;
+}
+
+static std::vector<float> get_logits(llama_context * ctx, int idx) {
+    const float * logits = llama_get_logits_ith(ctx, idx);
+
+    return std::vector<float>(logits, logits + llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx))));
+}
+
+// the logits of the last token of a sequence decoded alone, with the adapters applied to the whole context
+static std::vector<float> ref_logits(llama_model * model, const std::vector<llama_token> & tokens, const lora_list & loras) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx   = 256;
+    cparams.n_batch = 256;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    for (const auto & lora : loras) {
+        llama_set_adapter_lora(ctx, lora.first, lora.second);
+    }
+
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        common_batch_add(batch, tokens[i], i, { 0 }, i == tokens.size() - 1);
+    }
+    GGML_ASSERT(llama_decode(ctx, batch) == 0);
+    llama_batch_free(batch);
+
+    std::vector<float> res = get_logits(ctx, -1);
+
+    llama_free(ctx);
+
+    return res;
+}
+
+static float max_err(const std::vector<float> & a, const std::vector<float> & b) {
+    float err = 0.0f;
+    for (size_t i = 0; i < a.size(); i++) {
+        err = std::max(err, std::fabs(a[i] - b[i]));
+    }
+    return err;
+}
+
+static bool check(const std::vector<float> & res, const std::vector<float> & ref, const std::vector<float> & base, bool has_loras, const char * name) {
+    const float err      = max_err(res, ref);
+    const float err_base = max_err(ref, base);
+
+    // the adapters must change the logits much more than the error
+    const bool ok = err < 1e-3f && (!has_loras || err_base > 100*err);
+
+    printf("%s: max err = %e, adapters vs base = %e %s\n", name, err, err_base, ok ? "OK" : "FAIL");
+
+    return ok;
+}
+
+// the adapters of the sequences applied by build_lora_mm to the 3D activations of a ubatch with 2 tokens of each of 3
+// sequences: heads = true for [n_embd, 2, n_tokens] (several rows per token), heads = false for
+// [n_embd, n_seq_tokens, n_seqs] (the tokens over 2 dimensions)
+static bool test_3d_input(llama_model * model, const std::vector<lora_list> & seq_loras, bool heads, const char * name) {
+    const int n_seq_tokens = 2;
+    const int n_seqs       = 3;
+    const int n_tokens     = n_seq_tokens*n_seqs;
+
+    llama_adapter_loras_seq loras_seq;
+    for (int s = 0; s < n_seqs; s++) {
+        for (const auto & lora : seq_loras[s]) {
+            loras_seq.set(s, lora.first, lora.second);
+        }
+    }
+    loras_seq.update();
+
+    std::vector<llama_seq_id>   seq_ids(n_seqs);
+    std::vector<llama_seq_id *> seq_id (n_seqs);
+    std::vector<int32_t>        n_seq_id(n_seqs, 1);
+    for (int s = 0; s < n_seqs; s++) {
+        seq_ids[s] = s;
+        seq_id[s]  = &seq_ids[s];
+    }
+
+    llama_ubatch ubatch = {};
+    ubatch.equal_seqs   = true;
+    ubatch.n_tokens     = n_tokens;
+    ubatch.n_seq_tokens = n_seq_tokens;
+    ubatch.n_seqs       = n_seqs;
+    ubatch.n_seq_id     = n_seq_id.data();
+    ubatch.seq_id       = seq_id.data();
+
+    llama_cparams cparams = {};
+    cparams.n_ctx     = 256;
+    cparams.n_seq_max = 1;
+
+    const llama_adapter_loras loras;
+    const llm_graph_cb cb;
+
+    ggml_init_params ip = {
+        /* .mem_size   = */ 256*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /* .mem_buffer = */ nullptr,
+        /* .no_alloc   = */ true,
+    };
+    ggml_context * ctx = ggml_init(ip);
+
+    const llm_graph_params params = {
+        /*.ctx              =*/ ctx,
+        /*.arch             =*/ model->arch,
+        /*.hparams          =*/ model->hparams,
+        /*.cparams          =*/ cparams,
+        /*.ubatch           =*/ ubatch,
+        /*.sched            =*/ nullptr,
+        /*.backend_cpu      =*/ nullptr,
+        /*.cvec             =*/ nullptr,
+        /*.loras            =*/ &loras,
+        /*.memory           =*/ nullptr,
+        /*.cross            =*/ nullptr,
+        /*.loras_seq        =*/ &loras_seq,
+        /*.logprobs_targets =*/ nullptr,
+        /*.n_outputs        =*/ n_tokens,
+        /*.cb               =*/ cb,
+    };
+
+    llm_graph_context gctx(params);
+
+    ggml_tensor * w = const_cast<ggml_tensor *>(model->get_tensor("blk.0.attn_q.weight"));
+
+    ggml_tensor * x = heads ?
+        ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd, 2, n_tokens) :
+        ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd, n_seq_tokens, n_seqs);
+    ggml_set_input(x);
+
+    // the difference with the matmul without adapters
+    ggml_tensor * delta = ggml_sub(ctx, gctx.build_lora_mm(w, x), ggml_mul_mat(ctx, w, x));
+    ggml_set_output(delta);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, delta);
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    ggml_gallocr_t galloc  = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+    GGML_ASSERT(ggml_gallocr_alloc_graph(galloc, gf));
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    std::vector<float> x_data(ggml_nelements(x));
+    for (auto & v : x_data) {
+        v = dist(rng);
+    }
+    ggml_backend_tensor_set(x, x_data.data(), 0, ggml_nbytes(x));
+
+    gctx.res->set_inputs(&ubatch);
+
+    GGML_ASSERT(ggml_backend_graph_compute(backend, gf) == GGML_STATUS_SUCCESS);
+
+    std::vector<float> res(ggml_nelements(delta));
+    ggml_backend_tensor_get(delta, res.data(), 0, ggml_nbytes(delta));
+
+    // the adapters of the sequence of each row, on the host
+    const int64_t n_out = delta->ne[0];
+
+    float err     = 0.0f;
+    float max_ref = 0.0f;
+
+    for (int64_t i2 = 0; i2 < x->ne[2]; i2++) {
+        for (int64_t i1 = 0; i1 < x->ne[1]; i1++) {
+            const int64_t token = heads ? i2 : i2*n_seq_tokens + i1;
+            const int64_t row   = i2*x->ne[1] + i1;
+
+            const float * xr = x_data.data() + row*n_embd;
+
+            std::vector<float> ref(n_out, 0.0f);
+
+            for (const auto & lora : seq_loras[token / n_seq_tokens]) {
+                const llama_adapter_lora_weight * lw = lora.first->get_weight(w);
+                if (lw == nullptr) {
+                    continue;
+                }
+
+                const int64_t rank = lw->b->ne[0];
+
+                std::vector<float> a(ggml_nelements(lw->a));
+                std::vector<float> b(ggml_nelements(lw->b));
+                ggml_backend_tensor_get(lw->a, a.data(), 0, ggml_nbytes(lw->a));
+                ggml_backend_tensor_get(lw->b, b.data(), 0, ggml_nbytes(lw->b));
+
+                std::vector<float> ax(rank, 0.0f);
+                for (int64_t r = 0; r < rank; r++) {
+                    for (int64_t i = 0; i < n_embd; i++) {
+                        ax[r] += a[r*n_embd + i]*xr[i];
+                    }
+                }
+
+                const float scale = lw->get_scale(lora.first->alpha, lora.second);
+                for (int64_t o = 0; o < n_out; o++) {
+                    float sum = 0.0f;
+                    for (int64_t r = 0; r < rank; r++) {
+                        sum += b[o*rank + r]*ax[r];
+                    }
+                    ref[o] += scale*sum;
+                }
+            }
+
+            for (int64_t o = 0; o < n_out; o++) {
+                err     = std::max(err, std::fabs(res[row*n_out + o] - ref[o]));
+                max_ref = std::max(max_ref, std::fabs(ref[o]));
+            }
+        }
+    }
+
+    ggml_gallocr_free(galloc);
+    ggml_backend_free(backend);
+    ggml_free(ctx);
+
+    const bool ok = err < 1e-4f && max_ref > 1e-2f;
+
+    printf("%s: max err = %e, max delta = %e %s\n", name, err, max_ref, ok ? "OK" : "FAIL");
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab.gguf>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname   = "test-lora-seq.gguf";
+    const std::string fname_a = "test-lora-seq-a.gguf";
+    const std::string fname_b = "test-lora-seq-b.gguf";
+    const std::string fname_c = "test-lora-seq-c.gguf";
+
+    if (!make_tiny_model(fname.c_str(), argv[1], tiny_model_params())) {
+        return 1;
+    }
+
+    // the weights of the adapters partly overlap, the token embeddings cannot be stacked and use one matmul per adapter
+    if (!make_tiny_lora(fname_a.c_str(), { "attn_q.weight", "attn_v.weight", "ffn_down.weight" }, 4, 1) ||
+        !make_tiny_lora(fname_b.c_str(), { "attn_q.weight", "ffn_up.weight", "token_embd.weight" }, 8, 2) ||
+        !make_tiny_lora(fname_c.c_str(), { "attn_q.weight", "ffn_up.weight" }, 4, 3)) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(fname.c_str(), llama_model_default_params());
+    GGML_ASSERT(model);
+
+    llama_adapter_lora * lora_a = llama_adapter_lora_init(model, fname_a.c_str());
+    llama_adapter_lora * lora_b = llama_adapter_lora_init(model, fname_b.c_str());
+    llama_adapter_lora * lora_c = llama_adapter_lora_init(model, fname_c.c_str());
+    GGML_ASSERT(lora_a && lora_b && lora_c);
+
+    const int n_seq = 4;
+
+    const std::vector<lora_list> seq_loras = {
+        { },
+        { { lora_a, 1.0f } },
+        { { lora_b, 0.5f } },
+        { { lora_a, 0.5f }, { lora_b, 1.0f } },
+    };
+
+    std::mt19937 rng(1234);
+
+    std::vector<std::vector<llama_token>> tokens(n_seq);
+    for (int s = 0; s < n_seq; s++) {
+        tokens[s] = random_tokens(rng, 16 + 3*s);
+    }
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 256;
+    cparams.n_seq_max = n_seq;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    for (int s = 0; s < n_seq; s++) {
+        for (const auto & lora : seq_loras[s]) {
+            GGML_ASSERT(llama_set_adapter_lora_seq(ctx, lora.first, s, lora.second) == 0);
+        }
+    }
+
+    bool ok = true;
+
+    // the prompts of all the sequences in one batch
+    {
+        std::vector<int> idx(n_seq);
+
+        llama_batch batch = llama_batch_init(256, 0, 1);
+        for (int s = 0; s < n_seq; s++) {
+            for (size_t i = 0; i < tokens[s].size(); i++) {
+                common_batch_add(batch, tokens[s][i], i, { s }, i == tokens[s].size() - 1);
+            }
+            idx[s] = batch.n_tokens - 1;
+        }
+        GGML_ASSERT(llama_decode(ctx, batch) == 0);
+        llama_batch_free(batch);
+
+        const std::vector<float> base = ref_logits(model, tokens[0], {});
+
+        for (int s = 0; s < n_seq; s++) {
+            const std::string name = "prompt, seq " + std::to_string(s);
+            ok = check(get_logits(ctx, idx[s]), ref_logits(model, tokens[s], seq_loras[s]), base, !seq_loras[s].empty(), name.c_str()) && ok;
+        }
+    }
+
+    // a token of each sequence
+    {
+        llama_batch batch = llama_batch_init(n_seq, 0, 1);
+        for (int s = 0; s < n_seq; s++) {
+            tokens[s].push_back(random_tokens(rng, 1)[0]);
+            common_batch_add(batch, tokens[s].back(), tokens[s].size() - 1, { s }, true);
+        }
+        GGML_ASSERT(llama_decode(ctx, batch) == 0);
+        llama_batch_free(batch);
+
+        const std::vector<float> base = ref_logits(model, tokens[0], {});
+
+        for (int s = 0; s < n_seq; s++) {
+            const std::string name = "generation, seq " + std::to_string(s);
+            ok = check(get_logits(ctx, s), ref_logits(model, tokens[s], seq_loras[s]), base, !seq_loras[s].empty(), name.c_str()) && ok;
+        }
+    }
+
+    // seq 2 no longer uses adapter b and is decoded again, seq 3 still uses it
+    {
+        GGML_ASSERT(llama_rm_adapter_lora_seq(ctx, lora_b, 2) == 0);
+        GGML_ASSERT(llama_rm_adapter_lora_seq(ctx, lora_b, 2) == -1);
+        llama_kv_self_seq_rm(ctx, 2, -1, -1);
+
+        llama_batch batch = llama_batch_init(256, 0, 1);
+        for (size_t i = 0; i < tokens[2].size(); i++) {
+            common_batch_add(batch, tokens[2][i], i, { 2 }, i == tokens[2].size() - 1);
+        }
+        tokens[3].push_back(random_tokens(rng, 1)[0]);
+        common_batch_add(batch, tokens[3].back(), tokens[3].size() - 1, { 3 }, true);
+        GGML_ASSERT(llama_decode(ctx, batch) == 0);
+        llama_batch_free(batch);
+
+        const std::vector<float> base = ref_logits(model, tokens[2], {});
+
+        ok = check(get_logits(ctx, tokens[2].size() - 1), base, base, false, "seq 2 without adapter b") && ok;
+        ok = check(get_logits(ctx, tokens[2].size()), ref_logits(model, tokens[3], seq_loras[3]), ref_logits(model, tokens[3], {}), true, "seq 3") && ok;
+    }
+
+    // adapter a is replaced by adapter c in seq 1 and removed from seq 3, adapter c takes its slot - the weights of
+    // adapter a that c does not have must not be applied anymore
+    {
+        GGML_ASSERT(llama_rm_adapter_lora_seq(ctx, lora_a, 1) == 0);
+        GGML_ASSERT(llama_rm_adapter_lora_seq(ctx, lora_a, 3) == 0);
+        GGML_ASSERT(llama_set_adapter_lora_seq(ctx, lora_c, 1, 1.0f) == 0);
+        llama_kv_self_seq_rm(ctx, 1, -1, -1);
+        llama_kv_self_seq_rm(ctx, 3, -1, -1);
+
+        llama_batch batch = llama_batch_init(256, 0, 1);
+        for (size_t i = 0; i < tokens[1].size(); i++) {
+            common_batch_add(batch, tokens[1][i], i, { 1 }, i == tokens[1].size() - 1);
+        }
+        for (size_t i = 0; i < tokens[3].size(); i++) {
+            common_batch_add(batch, tokens[3][i], i, { 3 }, i == tokens[3].size() - 1);
+        }
+        GGML_ASSERT(llama_decode(ctx, batch) == 0);
+        llama_batch_free(batch);
+
+        const std::vector<float> base = ref_logits(model, tokens[1], {});
+
+        ok = check(get_logits(ctx, tokens[1].size() - 1), ref_logits(model, tokens[1], { { lora_c, 1.0f } }), base, true, "seq 1 with adapter c") && ok;
+        ok = check(get_logits(ctx, -1), ref_logits(model, tokens[3], { { lora_b, 1.0f } }), ref_logits(model, tokens[3], {}), true, "seq 3 without adapter a") && ok;
+    }
+
+    llama_free(ctx);
+
+    // 3D activations, with the tokens in the last dimension or over the last two
+    {
+        const std::vector<lora_list> loras_3d = {
+            { { lora_a, 1.0f } },
+            { },
+            { { lora_a, 0.5f }, { lora_b, 1.0f } },
+        };
+
+        ok = test_3d_input(model, loras_3d, true,  "3D input, several rows per token") && ok;
+        ok = test_3d_input(model, loras_3d, false, "3D input, tokens over 2 dimensions") && ok;
+    }
+
+    // the slots and the stacks follow the adapters used by the sequences
+    {
+        const ggml_tensor * wq    = model->get_tensor("blk.0.attn_q.weight");
+        const ggml_tensor * wdown = model->get_tensor("blk.0.ffn_down.weight");
+
+        llama_adapter_loras_seq loras;
+
+        loras.set(0, lora_a, 1.0f);
+        loras.set(1, lora_a, 1.0f);
+        loras.set(1, lora_b, 1.0f);
+        loras.update();
+
+        const ggml_tensor * st_a = loras.get_stack(wq) ? loras.get_stack(wq)->a : nullptr;
+
+        bool ok_slots = loras.slots.size() == 2 && st_a && st_a->ne[2] == 2;
+
+        // adapter a is still used by seq 0
+        loras.rm(1, lora_a);
+        loras.update();
+        ok_slots = ok_slots && loras.slots.size() == 2 && loras.get_slot(lora_a) == 0;
+
+        // adapter a releases its slot, adapter c takes it without reallocating the stacks and clears the rows of the
+        // weights of a that it does not have
+        loras.clear(0);
+        loras.update();
+        ok_slots = ok_slots && loras.get_slot(lora_a) < 0 && loras.get_slot(lora_b) == 1;
+
+        loras.set(2, lora_c, 1.0f);
+        loras.update();
+        ok_slots = ok_slots && loras.slots.size() == 2 && loras.get_slot(lora_c) == 0 && loras.get_stack(wq)->a == st_a;
+
+        if (ok_slots && loras.get_stack(wdown)) {
+            const ggml_tensor * st_b = loras.get_stack(wdown)->b;
+
+            std::vector<float> rows(ggml_nelements(st_b));
+            ggml_backend_tensor_get(st_b, rows.data(), 0, ggml_nbytes(st_b));
+            for (int64_t i = 0; i < st_b->ne[0]*st_b->ne[1]; i++) {
+                ok_slots = ok_slots && rows[i] == 0.0f;
+            }
+        }
+
+        // a third adapter needs more slots
+        loras.set(3, lora_a, 1.0f);
+        loras.update();
+        ok_slots = ok_slots && loras.slots.size() == 3 && loras.get_slot(lora_a) == 2 && loras.get_stack(wq)->a->ne[2] >= 3;
+
+        loras.clear(1);
+        loras.clear(2);
+        loras.clear(3);
+        loras.update();
+        ok_slots = ok_slots && loras.empty() && loras.slots.empty() && loras.get_stack(wq) == nullptr;
+
+        printf("release and reuse of the slots of the adapters: %s\n", ok_slots ? "OK" : "FAIL");
+
+        ok = ok && ok_slots;
+    }
+
+    llama_adapter_lora_free(lora_a);
+    llama_adapter_lora_free(lora_b);
+    llama_adapter_lora_free(lora_c);
+    llama_model_free(model);
+
+    llama_backend_free();
+
+    std::remove(fname.c_str());
+    std::remove(fname_a.c_str());
+    std::remove(fname_b.c_str());
+    std::remove(fname_c.c_str());
+
+    return ok ? 0 : 1;
+}
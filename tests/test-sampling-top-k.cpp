@@ -0,0 +1,163 @@
+// when the sampling chain starts with top-k, common_sampler only builds candidates from the top-k logits
+// - check llama_get_logits_top_k_ith against a full sort of the logits
+// - check that the sampled tokens are the same as with the entire vocabulary (grammar_first uses the full path)
+
+#include "llama.h"
+#include "common.h"
+#include "sampling.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static bool check_top_k(llama_context * ctx, int idx, int k) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+    const float * logits = llama_get_logits_ith(ctx, idx);
+
+    std::vector<llama_token_data> ref(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        ref[id] = { id, logits[id], 0.0f };
+    }
+    std::sort(ref.begin(), ref.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    std::vector<llama_token_data> res(k);
+    const int n = llama_get_logits_top_k_ith(ctx, idx, k, res.data());
+
+    bool ok = n == std::min(k, n_vocab);
+    for (int i = 0; ok && i < n; i++) {
+        // ties can be returned in any order
+        ok = res[i].logit == ref[i].logit && logits[res[i].id] == res[i].logit;
+    }
+
+    printf("top-k of output %d, k = %5d: %s\n", idx, k, ok ? "OK" : "FAIL");
+
+    return ok;
+}
+
+// sample 64 tokens with two samplers of the same parameters, one using the top-k path and one the full vocabulary
+static bool check_sampling(llama_context * ctx, const std::vector<llama_token> & prompt, const common_params_sampling & params, const char * name) {
+    const llama_model * model = llama_get_model(ctx);
+
+    common_sampler * smpl_top_k = common_sampler_init(model, params);
+    common_sampler * smpl_full  = common_sampler_init(model, params);
+
+    llama_kv_self_clear(ctx);
+
+    llama_batch batch = llama_batch_init(prompt.size(), 0, 1);
+    for (size_t i = 0; i < prompt.size(); i++) {
+        common_batch_add(batch, prompt[i], i, { 0 }, i == prompt.size() - 1);
+    }
+    GGML_ASSERT(llama_decode(ctx, batch) == 0);
+
+    bool ok = true;
+
+    llama_pos n_past = prompt.size();
+    for (int i = 0; i < 64; i++) {
+        const llama_token id_top_k = common_sampler_sample(smpl_top_k, ctx, -1, false);
+        const llama_token id_full  = common_sampler_sample(smpl_full,  ctx, -1, true);
+
+        if (id_top_k != id_full) {
+            printf("%s: token %d: %d != %d\n", name, i, id_top_k, id_full);
+            ok = false;
+            break;
+        }
+
+        common_sampler_accept(smpl_top_k, id_top_k, true);
+        common_sampler_accept(smpl_full,  id_full,  true);
+
+        // decode the same token again instead of the sampled one: the logits change little between the steps, so
+        // that the penalized tokens are still among the largest logits
+        common_batch_clear(batch);
+        common_batch_add(batch, prompt.back(), n_past++, { 0 }, true);
+        GGML_ASSERT(llama_decode(ctx, batch) == 0);
+    }
+
+    printf("%s: %s\n", name, ok ? "OK" : "FAIL");
+
+    llama_batch_free(batch);
+
+    common_sampler_free(smpl_top_k);
+    common_sampler_free(smpl_full);
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <vocab.gguf>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = "test-sampling-top-k.gguf";
+
+    if (!make_tiny_model(fname.c_str(), argv[1], tiny_model_params())) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(fname.c_str(), llama_model_default_params());
+    GGML_ASSERT(model);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx   = 256;
+    cparams.n_batch = 256;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+
+    const std::vector<llama_token> prompt = common_tokenize(ctx, "The quick brown fox jumps over the lazy dog", true);
+
+    bool ok = true;
+
+    // top-k of every output of the prompt
+    {
+        llama_batch batch = llama_batch_init(prompt.size(), 0, 1);
+        for (size_t i = 0; i < prompt.size(); i++) {
+            common_batch_add(batch, prompt[i], i, { 0 }, true);
+        }
+        GGML_ASSERT(llama_decode(ctx, batch) == 0);
+        llama_batch_free(batch);
+
+        for (int idx = 0; idx < (int) prompt.size(); idx++) {
+            for (int k : { 1, 40, 1000, 40000 }) {
+                ok = check_top_k(ctx, idx, k) && ok;
+            }
+        }
+    }
+
+    common_params_sampling params;
+    params.seed  = 1234;
+    params.top_k = 40;
+    params.temp  = 1.5f;
+
+    ok = check_sampling(ctx, prompt, params, "top-k") && ok;
+
+    // the penalized tokens are kept as candidates, and the tokens that move into the top-k when they are penalized
+    params.top_k           = 4;
+    params.penalty_last_n  = 16;
+    params.penalty_repeat  = 1.5f;
+    params.penalty_present = 5.0f;
+
+    ok = check_sampling(ctx, prompt, params, "top-k + penalties") && ok;
+
+    // the biased tokens are kept as candidates, a token from outside the top-k can become the most likely one
+    params.logit_bias.push_back({ 500, 100.0f });
+    params.logit_bias.push_back({ prompt.back(), -INFINITY });
+
+    ok = check_sampling(ctx, prompt, params, "top-k + penalties + logit bias") && ok;
+
+    llama_free(ctx);
+    llama_model_free(model);
+
+    llama_backend_free();
+
+    std::remove(fname.c_str());
+
+    return ok ? 0 : 1;
+}